@@ -0,0 +1,66 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: createbench.cpp
+ *
+ * Creates HDF5 files with synthetic input datasets for the benchmarks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <hdf5.h>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv)
+{
+    if (argc < 5)
+    {
+        fprintf(stdout, "Syntax: %s <file.h5> <dim0> <dim1> <number_of_datasets>\n", argv[0]);
+        return 1;
+    }
+
+    std::string hdf5_file = argv[1];
+    hsize_t dims[2] = {strtoull(argv[2], NULL, 10), strtoull(argv[3], NULL, 10)};
+    int dataset_count = atoi(argv[4]);
+    hid_t file_id = H5Fcreate(hdf5_file.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        fprintf(stderr, "Failed to create file %s\n", hdf5_file.c_str());
+        return 1;
+    }
+
+    std::vector<int> data(dims[0] * dims[1]);
+    for (int count=1; count<=dataset_count; ++count)
+    {
+        for (size_t i=0; i<data.size(); ++i)
+            data[i] = (int) ((count * i) % 1000);
+
+        char name[64];
+        snprintf(name, sizeof(name)-1, "Input%d", count);
+        hid_t space_id = H5Screate_simple(2, dims, NULL);
+        if (space_id < 0)
+        {
+            fprintf(stderr, "Failed to create dataspace\n");
+            return 1;
+        }
+        hid_t dset_id = H5Dcreate(file_id, name, H5T_STD_I32LE, space_id,
+            H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if (dset_id < 0)
+        {
+            fprintf(stderr, "Failed to create dataset\n");
+            return 1;
+        }
+        herr_t ret = H5Dwrite(dset_id, H5T_NATIVE_INT,
+            H5S_ALL, H5S_ALL, H5P_DEFAULT, data.data());
+        if (ret < 0)
+        {
+            fprintf(stderr, "Error writing data to file\n");
+            return 1;
+        }
+        H5Dclose(dset_id);
+        H5Sclose(space_id);
+    }
+
+    H5Fclose(file_id);
+    return 0;
+}
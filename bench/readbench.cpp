@@ -0,0 +1,85 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: readbench.cpp
+ *
+ * Reads a dataset over and over and reports how long that takes. The first
+ * read of the process is reported on its own (cold), as it also pays for the
+ * initialization of the UDF backend; the median of the others is reported
+ * as the warm latency.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <hdf5.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stdout, "Syntax: %s <file.h5> <dataset> [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    std::string hdf5_file = argv[1];
+    std::string hdf5_dataset = argv[2];
+    int iterations = argc == 4 ? std::max(atoi(argv[3]), 2) : 10;
+    hid_t file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        fprintf(stderr, "Failed to open file %s\n", hdf5_file.c_str());
+        return 1;
+    }
+
+    // Disable the chunk cache so that every read goes through the filter
+    hid_t dapl_id = H5Pcreate(H5P_DATASET_ACCESS);
+    H5Pset_chunk_cache(dapl_id, 0, 0, 1.0);
+
+    std::vector<double> latencies;
+    std::vector<char> rdata;
+    size_t size = 0;
+    for (int i=0; i<iterations; ++i)
+    {
+        double start = now();
+        hid_t dataset_id = H5Dopen(file_id, hdf5_dataset.c_str(), dapl_id);
+        if (dataset_id < 0)
+        {
+            fprintf(stderr, "Failed to open dataset %s\n", hdf5_dataset.c_str());
+            return 1;
+        }
+        hid_t type_id = H5Dget_type(dataset_id);
+        hid_t space_id = H5Dget_space(dataset_id);
+        size = H5Sget_simple_extent_npoints(space_id) * H5Tget_size(type_id);
+        rdata.resize(size);
+        herr_t ret = H5Dread(dataset_id, type_id, H5S_ALL, H5S_ALL, H5P_DEFAULT, rdata.data());
+        H5Sclose(space_id);
+        H5Tclose(type_id);
+        H5Dclose(dataset_id);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to read dataset %s\n", hdf5_dataset.c_str());
+            return 1;
+        }
+        latencies.push_back(now() - start);
+    }
+    H5Pclose(dapl_id);
+    H5Fclose(file_id);
+
+    // Output: cold latency (ms), warm latency (ms), warm throughput (MB/s)
+    double cold = latencies[0];
+    std::vector<double> warm(latencies.begin() + 1, latencies.end());
+    std::sort(warm.begin(), warm.end());
+    double median = warm[warm.size() / 2];
+    printf("%.3f %.3f %.1f\n", cold, median, median > 0 ? size / (median * 1e3) : 0.0);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#!/bin/bash
+#
+# HDF5-UDF: User-Defined Functions for HDF5
+#
+# File: run-bench.sh
+#
+# Attaches equivalent Lua, Python, and C++ UDFs to synthetic HDF5 files and
+# measures how long reading the resulting virtual datasets takes, for several
+# dataset sizes and numbers of input datasets.
+#
+# Settings (environment variables):
+#   HDF5_UDF          path to the hdf5-udf tool (default: hdf5-udf)
+#   BENCH_BACKENDS    backends to measure (default: "lua python cpp")
+#   BENCH_SIZES       dataset dimensions (default: "256x256 1024x1024 2048x2048")
+#   BENCH_INPUTS      numbers of input datasets (default: "1 2 4")
+#   BENCH_ITERATIONS  reads per measurement, the first being the cold one (default: 10)
+#
+
+HDF5_UDF=${HDF5_UDF:-hdf5-udf}
+BACKENDS=${BENCH_BACKENDS:-"lua python cpp"}
+SIZES=${BENCH_SIZES:-"256x256 1024x1024 2048x2048"}
+INPUTS=${BENCH_INPUTS:-"1 2 4"}
+ITERATIONS=${BENCH_ITERATIONS:-10}
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+# Write a UDF that adds up 'count' input datasets into the "Output" dataset
+function generate_udf() {
+    local backend=$1 count=$2 file=$3 i
+    local sum=""
+    case $backend in
+        lua)
+            echo "function dynamic_dataset()" > $file
+            echo "    local out = lib.getData(\"Output\")" >> $file
+            for i in $(seq 1 $count); do
+                echo "    local in$i = lib.getData(\"Input$i\")" >> $file
+                sum="$sum${sum:+ + }in$i[i]"
+            done
+            echo "    local n = lib.getDims(\"Output\")[1] * lib.getDims(\"Output\")[2]" >> $file
+            echo "    for i=0, n-1 do" >> $file
+            echo "        out[i] = $sum" >> $file
+            echo "    end" >> $file
+            echo "end" >> $file
+            ;;
+        python)
+            echo "def dynamic_dataset():" > $file
+            echo "    out = lib.getData(\"Output\")" >> $file
+            for i in $(seq 1 $count); do
+                echo "    in$i = lib.getData(\"Input$i\")" >> $file
+                sum="$sum${sum:+ + }in$i[i]"
+            done
+            echo "    n = lib.getDims(\"Output\")[0] * lib.getDims(\"Output\")[1]" >> $file
+            echo "    for i in range(n):" >> $file
+            echo "        out[i] = $sum" >> $file
+            ;;
+        cpp)
+            echo "extern \"C\" void dynamic_dataset()" > $file
+            echo "{" >> $file
+            echo "    auto out = lib.getData<int>(\"Output\");" >> $file
+            for i in $(seq 1 $count); do
+                echo "    auto in$i = lib.getData<int>(\"Input$i\");" >> $file
+                sum="$sum${sum:+ + }in$i[i]"
+            done
+            echo "    auto dims = lib.getDims(\"Output\");" >> $file
+            echo "    for (size_t i=0; i<dims[0]*dims[1]; ++i)" >> $file
+            echo "        out[i] = $sum;" >> $file
+            echo "}" >> $file
+            ;;
+    esac
+}
+
+printf "%-8s %-12s %-7s %12s %12s %14s\n" \
+    "backend" "dimensions" "inputs" "cold (ms)" "warm (ms)" "warm (MB/s)"
+
+for backend in $BACKENDS; do
+    case $backend in
+        lua) extension=lua ;;
+        python) extension=py ;;
+        cpp) extension=cpp ;;
+        *) echo "Unknown backend $backend" >&2; exit 1 ;;
+    esac
+    for size in $SIZES; do
+        dim0=${size%x*}
+        dim1=${size#*x}
+        for count in $INPUTS; do
+            h5file=$WORKDIR/bench.h5
+            udffile=$WORKDIR/bench.$extension
+            generate_udf $backend $count $udffile
+            result="failed"
+            if "$BENCHDIR/createbench" $h5file $dim0 $dim1 $count &&
+                "$HDF5_UDF" $h5file $udffile Output:${size}:int32 > $WORKDIR/attach.log 2>&1; then
+                result=$("$BENCHDIR/readbench" $h5file Output $ITERATIONS 2> $WORKDIR/read.log) || result="failed"
+            fi
+            if [ "$result" = "failed" ]; then
+                printf "%-8s %-12s %-7s %12s\n" $backend $size $count "failed"
+            else
+                printf "%-8s %-12s %-7s %12s %12s %14s\n" $backend $size $count $result
+            fi
+        done
+    done
+done
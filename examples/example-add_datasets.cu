@@ -0,0 +1,25 @@
+/*
+ * Simple example: combines data from two existing datasets on the GPU
+ *
+ * To embed it in an existing HDF5 file, run:
+ * $ make files
+ * $ hdf5-udf example-add_datasets.h5 example-add_datasets.cu
+ *
+ * Note the absence of an output Dataset name in the call to
+ * hdf5-udf: the tool determines it based on the calls to
+ * lib.getData() made by this code. The resolution and
+ * data types are determined to be the same as that of the
+ * input datasets, Dataset1 and Dataset2.
+ *
+ * The function is called once for each element 'i' of the
+ * output grid, each call running on a thread of its own.
+ */
+
+__device__ void dynamic_dataset(size_t i)
+{
+    auto ds1_data = lib.getData<int>("Dataset1");
+    auto ds2_data = lib.getData<int>("Dataset2");
+    auto udf_data = lib.getData<int>("VirtualDataset");
+
+    udf_data[i] = ds1_data[i] + ds2_data[i];
+}
@@ -0,0 +1,233 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: payloadtest.cpp
+ *
+ * Feeds malformed chunk payloads to the HDF5-UDF filter and checks that it
+ * rejects them without reading past the end of the chunk: every payload is
+ * placed right before an inaccessible page, so out-of-bounds reads crash the
+ * program. Legacy JSON payloads are checked to be sized and parsed as before.
+ *
+ * The filter is loaded from the path given on the command line, e.g.:
+ * $ ./payloadtest ../src/libhdf5-udf.so
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <hdf5.h>
+#include <initializer_list>
+#include <string>
+#include "payload.h"
+
+static H5Z_func_t filter = NULL;
+static int failures = 0;
+
+/* Copy a payload to the end of a page that is followed by an inaccessible one */
+static void *guard(const std::string &data)
+{
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t size = (data.size() + pagesize - 1) / pagesize * pagesize + pagesize;
+    char *base = (char *) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED || mprotect(base + size - pagesize, pagesize, PROT_NONE) != 0)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    char *buf = base + size - pagesize - data.size();
+    memcpy(buf, data.data(), data.size());
+    return buf;
+}
+
+/* Run the filter on a payload, collecting what it prints to stderr */
+static size_t runFilter(unsigned int flags, const std::string &payload, std::string &messages)
+{
+    fflush(stderr);
+    FILE *tmp = tmpfile();
+    int saved_stderr = dup(STDERR_FILENO);
+    dup2(fileno(tmp), STDERR_FILENO);
+
+    void *buf = guard(payload);
+    size_t buf_size = payload.size();
+    size_t ret = filter(flags, 0, NULL, payload.size(), &buf_size, &buf);
+
+    fflush(stderr);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    char line[1024];
+    rewind(tmp);
+    messages.clear();
+    while (fgets(line, sizeof(line), tmp))
+        messages += line;
+    fclose(tmp);
+    return ret;
+}
+
+static void check(const char *name, bool ok)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", name);
+    if (! ok)
+        failures++;
+}
+
+/* Reading a payload must fail; 'parsed' tells whether it must get past the parser */
+static void checkRead(const char *name, const std::string &payload, bool parsed = false)
+{
+    std::string messages;
+    size_t ret = runFilter(H5Z_FLAG_REVERSE, payload, messages);
+    bool rejected = messages.find("Failed to parse UDF payload") != std::string::npos;
+    check(name, ret == 0 && rejected != parsed);
+}
+
+/* Writing a payload must store 'expected' bytes of it */
+static void checkWrite(const char *name, const std::string &payload, size_t expected)
+{
+    std::string messages;
+    check(name, runFilter(0, payload, messages) == expected);
+}
+
+/* Binary payload of a 100x50 int32 dataset computed from two inputs */
+static std::string binaryPayload()
+{
+    PayloadWriter writer;
+    writer.header.backend_id = payloadId(payload_backends, "C++");
+    writer.header.datatype_id = payloadId(payload_datatypes, "int32");
+    writer.header.rank = 2;
+    writer.header.num_inputs = 2;
+    writer.header.blob_size = 16;
+    writer.header.blob_hash = 0x1234;
+    for (auto dim: { 100, 50, 10, 50 })
+        writer.u64(dim);
+    writer.str("Output");
+    writer.str("/nonexistent/payloadtest.h5");
+    writer.str("Input1");
+    writer.str("Input2");
+    return writer.finish();
+}
+
+/* Overwrite a 32-bit field of the header of a payload */
+static std::string patch32(std::string payload, size_t offset, uint32_t value)
+{
+    value = htole32(value);
+    memcpy(&payload[offset], &value, sizeof(value));
+    return payload;
+}
+
+static std::string patch64(std::string payload, size_t offset, uint64_t value)
+{
+    value = htole64(value);
+    memcpy(&payload[offset], &value, sizeof(value));
+    return payload;
+}
+
+static void testBinaryPayloads()
+{
+    auto payload = binaryPayload();
+    checkRead("binary: well-formed payload gets past the parser", payload, true);
+    checkWrite("binary: well-formed payload is stored whole", payload, payload.size());
+    checkRead("binary: empty payload", "");
+    checkRead("binary: truncated fixed-size header", payload.substr(0, sizeof(PayloadHeader) - 1));
+    checkRead("binary: fixed-size header only", payload.substr(0, sizeof(PayloadHeader)));
+    checkRead("binary: truncated tables", payload.substr(0, payload.size() - 1));
+    checkWrite("binary: truncated payload is not stored", payload.substr(0, payload.size() - 1), 0);
+
+    std::string bad_magic = payload;
+    bad_magic[0] = 'X';
+    checkRead("binary: bad magic", bad_magic);
+    checkRead("binary: unknown version", patch32(payload, offsetof(PayloadHeader, version), 99));
+    checkRead("binary: header larger than the payload",
+        patch32(payload, offsetof(PayloadHeader, header_size), payload.size() + 1));
+    checkRead("binary: header smaller than its tables",
+        patch32(payload, offsetof(PayloadHeader, header_size), sizeof(PayloadHeader)));
+    checkRead("binary: oversized rank", patch32(payload, offsetof(PayloadHeader, rank), 0xffffffff));
+    checkRead("binary: oversized number of inputs",
+        patch32(payload, offsetof(PayloadHeader, num_inputs), 0xffffffff));
+    checkRead("binary: oversized number of siblings",
+        patch32(payload, offsetof(PayloadHeader, num_siblings), 0xffffffff));
+    checkRead("binary: followed input out of range",
+        patch32(payload, offsetof(PayloadHeader, follow_input), 3));
+    checkRead("binary: unknown backend", patch32(payload, offsetof(PayloadHeader, backend_id), 99));
+    checkRead("binary: unknown datatype", patch32(payload, offsetof(PayloadHeader, datatype_id), 99));
+    checkRead("binary: bytecode past the end",
+        patch64(payload, offsetof(PayloadHeader, blob_offset), payload.size() - 8));
+    checkRead("binary: oversized bytecode",
+        patch64(patch64(payload, offsetof(PayloadHeader, blob_offset), payload.size()),
+            offsetof(PayloadHeader, blob_size), 0xffffffffffffffffULL));
+
+    /* The length of the output name, the first string after the dimensions */
+    size_t strings = sizeof(PayloadHeader) + 4 * sizeof(uint64_t);
+    checkRead("binary: oversized string", patch32(payload, strings, 0xffffffff));
+    checkRead("binary: string past the tables", patch32(payload, strings, payload.size() - strings));
+
+    /* A sibling output whose datatype is not known */
+    PayloadWriter writer;
+    writer.header.num_siblings = 1;
+    writer.u64(100);
+    writer.u64(50);
+    writer.u64(10);
+    writer.u64(50);
+    writer.u32(99);
+    writer.header.backend_id = payloadId(payload_backends, "C++");
+    writer.header.datatype_id = payloadId(payload_datatypes, "int32");
+    writer.header.rank = 2;
+    writer.str("Output");
+    writer.str("");
+    writer.str("Sibling");
+    checkRead("binary: unknown datatype of a sibling", writer.finish());
+}
+
+static void testJsonPayloads()
+{
+    /* Payloads written by older versions: JSON, a NUL byte, and the bytecode */
+    std::string json = "{\"output_dataset\": \"Output\", \"output_datatype\": \"int32\", "
+        "\"output_resolution\": [100, 50], \"input_datasets\": [\"Input1\", \"Input2\"], "
+        "\"backend\": \"C++\", \"bytecode_size\": 16, \"output_file\": \"/nonexistent/payloadtest.h5\"}";
+    std::string payload = json + std::string(1, '\0') + std::string(16, 'B');
+    checkWrite("json: payload is stored whole", payload, payload.size());
+    checkRead("json: payload gets past the parser", payload, true);
+
+    std::string shared = "{\"output_dataset\": \"Output\", \"output_datatype\": \"int32\", "
+        "\"output_resolution\": [100, 50], \"input_datasets\": [], \"backend\": \"C++\", "
+        "\"bytecode_size\": 16, \"bytecode_dataset\": \"/.hdf5-udf/0000000000001234\"}";
+    checkWrite("json: payload with shared bytecode is stored without it",
+        shared + std::string(1, '\0'), shared.size() + 1);
+    checkRead("json: payload with shared bytecode gets past the parser", shared + std::string(1, '\0'), true);
+
+    checkWrite("json: truncated bytecode is not stored", payload.substr(0, payload.size() - 1), 0);
+    checkWrite("json: missing terminator is not stored", json, 0);
+    checkWrite("json: malformed JSON is not stored", "{\"output_dataset\": ", 0);
+    checkRead("json: malformed JSON", "{\"output_dataset\": ");
+    checkRead("json: missing keys", std::string("{}") + std::string(1, '\0'));
+    checkRead("json: bytecode larger than the payload",
+        "{\"output_dataset\": \"Output\", \"output_datatype\": \"int32\", \"output_resolution\": [1], "
+        "\"input_datasets\": [], \"backend\": \"C++\", \"bytecode_size\": 4096}");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stdout, "Syntax: %s <libhdf5-udf.so>\n", argv[0]);
+        exit(1);
+    }
+
+    void *handle = dlopen(argv[1], RTLD_NOW);
+    auto plugin_info = handle ? (const void *(*)(void)) dlsym(handle, "H5PLget_plugin_info") : NULL;
+    if (! plugin_info)
+    {
+        fprintf(stderr, "Failed to load the HDF5-UDF filter from %s: %s\n", argv[1], dlerror());
+        exit(1);
+    }
+    filter = ((const H5Z_class2_t *) plugin_info())->filter;
+
+    H5open();
+    H5Eset_auto(H5E_DEFAULT, NULL, NULL);
+    testBinaryPayloads();
+    testJsonPayloads();
+
+    printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
@@ -9,31 +9,104 @@
 #define __anon_mmap_h
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <algorithm>
 
+/*
+ * Mappings created with createShareable() are backed by a memfd, so that
+ * they can be handed over to other processes (see WorkerPool). moveTo()
+ * releases their pages as it copies them out, so that the mapping and the
+ * buffer it is moved to never hold the whole contents twice.
+ */
 class AnonymousMemoryMap {
 public:
     AnonymousMemoryMap(size_t size) :
-        mm_size(size)
+        mm((void *) -1),
+        mm_size(size),
+        fd(-1),
+        base((void *) -1),
+        base_size(0)
     {
     }
 
     ~AnonymousMemoryMap()
     {
-        munmap(mm, mm_size);
+        if (base != (void *) -1)
+            munmap(base, base_size);
+        if (fd >= 0)
+            close(fd);
     }
 
     bool create()
     {
-        mm = mmap(NULL, mm_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
-        if (mm == (void *) -1)
+        base_size = mm_size;
+        base = mmap(NULL, base_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if (base == (void *) -1)
             fprintf(stderr, "Failed to create anonymous mapping: %s\n", strerror(errno));
+        mm = base;
         return mm != (void *) -1;
     }
 
+    // Create a mapping backed by a memfd. Sandboxed processes cannot create
+    // memfds of a given size.
+    bool createShareable()
+    {
+        size_t pagesize = sysconf(_SC_PAGESIZE);
+        base_size = std::max((mm_size + pagesize - 1) & ~(pagesize - 1), pagesize);
+        fd = memfd_create("hdf5-udf-shm", MFD_CLOEXEC);
+        if (fd < 0 || ftruncate(fd, base_size) < 0)
+        {
+            fprintf(stderr, "Failed to create shared memory: %s\n", strerror(errno));
+            return false;
+        }
+        base = mmap(NULL, base_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == (void *) -1)
+        {
+            fprintf(stderr, "Failed to map shared memory: %s\n", strerror(errno));
+            return false;
+        }
+        mm = base;
+        return true;
+    }
+
+    // Copy the contents of a mapping created with createShareable() to
+    // 'dest', a few megabytes at a time. The memfd pages of each block are
+    // released once copied, also from other processes that map them, so
+    // the mapping reads back as zeroes afterwards.
+    void moveTo(void *dest)
+    {
+        const size_t block_size = 4 * 1024 * 1024;
+        for (size_t pos = 0; pos < mm_size; pos += block_size)
+        {
+            size_t n = std::min(block_size, mm_size - pos);
+            memcpy((char *) dest + pos, (char *) mm + pos, n);
+            if (fd >= 0)
+                fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, pos, n);
+        }
+    }
+
+    // Give up the ownership of the mapping. The caller is responsible for
+    // releasing it with munmap().
+    void *release()
+    {
+        void *ptr = mm;
+        base = (void *) -1;
+        mm = (void *) -1;
+        return ptr;
+    }
+
     void *mm;
     size_t mm_size;
+    int fd;                          /* memfd backing the mapping, or -1 */
+
+private:
+    void *base;
+    size_t base_size;
 };
 
-#endif /* __anon_mmap_h */
\ No newline at end of file
+#endif /* __anon_mmap_h */
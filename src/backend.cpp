@@ -5,9 +5,20 @@
  *
  * Interfaces with supported code parsers and generators.
  */
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
 #include "backend.h"
+#include "stats.h"
+#include "hash.h"
+#include "resource_limits.h"
+#include "miniz.h"
 #ifdef ENABLE_CPP
 #include "cpp_backend.h"
 #endif
@@ -17,9 +28,12 @@
 #ifdef ENABLE_PYTHON
 #include "python_backend.h"
 #endif
+#ifdef ENABLE_CUDA
+#include "cuda_backend.h"
+#endif
 
-std::string Backend::assembleUDF(
-    std::string udf_file, std::string template_file, std::string placeholder, std::string extension)
+std::string Backend::assembleSource(
+    std::string udf_file, std::string template_file, std::string placeholder)
 {
     std::ifstream ifs(udf_file);
     if (! ifs.is_open())
@@ -52,7 +66,15 @@ std::string Backend::assembleUDF(
     }
 
     /* Embed UDF string in the template */
-    auto completeCode = udf.replace(start, placeholder.length(), inputFileBuffer);
+    return udf.replace(start, placeholder.length(), inputFileBuffer);
+}
+
+std::string Backend::assembleUDF(
+    std::string udf_file, std::string template_file, std::string placeholder, std::string extension)
+{
+    auto completeCode = assembleSource(udf_file, template_file, placeholder);
+    if (completeCode.size() == 0)
+        return "";
 
     /* Compile the code */
     auto out_file = writeToDisk(completeCode.data(), completeCode.size(), extension);
@@ -82,21 +104,264 @@ std::string Backend::writeToDisk(const char *data, size_t size, std::string exte
     return std::string(path);
 }
 
-// Get a backend by their name (e.g., "LuaJIT")
-Backend *getBackendByName(std::string name)
+/* Processes forked by forkUDF() and the index of the calling one among them */
+static int parallel_workers = 1;
+static int parallel_rank = 0;
+
+void Backend::setParallelWorkers(int num_workers)
+{
+    parallel_workers = std::max(num_workers, 1);
+}
+
+void Backend::parallelRange(size_t n, size_t *begin, size_t *end)
+{
+    /* Split the range into contiguous blocks, one per process */
+    *begin = (size_t) (((unsigned __int128) n * parallel_rank) / parallel_workers);
+    *end = (size_t) (((unsigned __int128) n * (parallel_rank + 1)) / parallel_workers);
+}
+
+/* Blob whose hash is known, as stored on the dataset payload */
+static const char *known_blob = NULL;
+static size_t known_blob_size = 0;
+static uint64_t known_blob_hash = 0;
+
+void Backend::setBlobHash(const char *udf_blob, size_t udf_blob_size, uint64_t hash)
+{
+    known_blob = udf_blob;
+    known_blob_size = udf_blob_size;
+    known_blob_hash = hash;
+}
+
+uint64_t Backend::blobHash(const char *udf_blob, size_t udf_blob_size)
+{
+    if (udf_blob == known_blob && udf_blob_size == known_blob_size)
+        return known_blob_hash;
+    return hash64(udf_blob, udf_blob_size);
+}
+
+bool Backend::forkUDF(std::function<bool()> child)
+{
+    StatsTimer timer(STATS_FORK_WAIT);
+    std::vector<pid_t> pids;
+    for (int rank=0; rank<parallel_workers; ++rank)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            parallel_rank = rank;
+            bool ready = limitResources(0, true, 0) && child();
+
+            // Exit the process without invoking any callbacks registered with atexit()
+            _exit(ready ? 0 : 1);
+        }
+        else if (pid < 0)
+        {
+            fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+            for (auto other: pids)
+                kill(other, SIGKILL);
+            break;
+        }
+        pids.push_back(pid);
+    }
+
+    bool ret = pids.size() == (size_t) parallel_workers;
+    for (auto pid: pids)
+    {
+        int status;
+        waitpid(pid, &status, 0);
+        if (WIFSIGNALED(status))
+            fprintf(stderr, "UDF process killed by signal %d (%s)\n", WTERMSIG(status), strsignal(WTERMSIG(status)));
+        ret = ret && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return ret;
+}
+
+/* Compress a data buffer; the original size is appended to the compressed stream */
+std::string Backend::compressBuffer(const char *data, size_t usize)
+{
+    uint64_t csize = mz_compressBound(usize);
+    std::string compressed;
+    compressed.resize(csize);
+
+    auto status = mz_compress(
+        (uint8_t *) compressed.data(), &csize,
+        (const uint8_t *) data, usize);
+    if (status != Z_OK)
+    {
+        fprintf(stderr, "Failed to compress input buffer\n");
+        return "";
+    }
+    memcpy(&compressed[csize], &usize, sizeof(uint64_t));
+    compressed.resize(csize + sizeof(uint64_t));
+    return compressed;
+}
+
+/* Decompress a data buffer produced by compressBuffer() */
+std::string Backend::decompressBuffer(const char *data, size_t csize)
+{
+    /* Get original size */
+    uint64_t usize;
+    if (csize < sizeof(uint64_t))
+        return "";
+    memcpy(&usize, &data[csize-sizeof(uint64_t)], sizeof(uint64_t));
+    csize -= sizeof(uint64_t);
+
+    std::string uncompressed;
+    uncompressed.resize(usize);
+
+    auto status = mz_uncompress(
+        (uint8_t *) uncompressed.data(), &usize,
+        (const uint8_t *) data, csize);
+    if (status != Z_OK)
+    {
+        fprintf(stderr, "Failed to uncompress buffer: %d\n", status);
+        return "";
+    }
+    return uncompressed;
+}
+
+/* Tag of blobs compressed by compressPayload() */
+#define PAYLOAD_MAGIC "HUDF-ZIP"
+#define PAYLOAD_MAGIC_SIZE 8
+
+std::string Backend::compressPayload(const std::string &data)
+{
+    auto compressed = compressBuffer(data.data(), data.size());
+    if (compressed.size() == 0)
+        return "";
+    return std::string(PAYLOAD_MAGIC, PAYLOAD_MAGIC_SIZE) + compressed;
+}
+
+bool Backend::isCompressedPayload(const char *data, size_t size)
+{
+    return size > PAYLOAD_MAGIC_SIZE + sizeof(uint64_t) &&
+        memcmp(data, PAYLOAD_MAGIC, PAYLOAD_MAGIC_SIZE) == 0;
+}
+
+std::string Backend::decompressPayload(const char *data, size_t size)
+{
+    if (! isCompressedPayload(data, size))
+        return std::string(data, size);
+    return decompressBuffer(data + PAYLOAD_MAGIC_SIZE, size - PAYLOAD_MAGIC_SIZE);
+}
+
+std::string Backend::stripCppComments(std::string udf_file)
+{
+    std::string input;
+
+    // Invoke the GCC preprocessor to get rid of comments. The source is
+    // taken as C++ whatever its extension.
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+    {
+        fprintf(stderr, "Failed to create pipe\n");
+        return input;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Child: runs proprocessor, outputs to pipe
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        char *cmd[] = {
+            (char *) "g++",
+            (char *) "-x",
+            (char *) "c++",
+            (char *) "-fpreprocessed",
+            (char *) "-dD",
+            (char *) "-E",
+            (char *) udf_file.c_str(),
+            (char *) NULL
+        };
+        execvp(cmd[0], cmd);
+        _exit(1);
+    }
+    else if (pid > 0)
+    {
+        // Parent: reads from pipe until the preprocessor closes it,
+        // concatenating to 'input' string
+        close(pipefd[1]);
+        while (true)
+        {
+            char buf[8192];
+            ssize_t n = read(pipefd[0], buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            else if (n <= 0)
+                break;
+            input.append(buf, n);
+        }
+        close(pipefd[0]);
+        waitpid(pid, NULL, 0);
+    }
+    else
+    {
+        fprintf(stderr, "Failed to execute g++\n");
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    return input;
+}
+
+bool Backend::udfCallsDataSlice(std::string udf_file)
+{
+    std::ifstream data(udf_file, std::ifstream::binary);
+    std::string input(std::istreambuf_iterator<char>(data), {});
+    return input.find("getDataSlice") != std::string::npos;
+}
+
+std::vector<std::string> Backend::scanCppDatasetNames(std::string udf_file)
 {
+    std::vector<std::string> output;
+
+    // Go through the source one line at a time, identifying calls to our API
+    std::string line;
+    std::istringstream iss(stripCppComments(udf_file));
+    while (std::getline(iss, line))
+    {
+        size_t n = line.find("lib.getData");
+        if (n == std::string::npos)
+            n = line.find("lib.getBlock");
+        if (n != std::string::npos)
+        {
+            auto start = line.substr(n).find_first_of("\"");
+            auto end = line.substr(n+start+1).find_first_of("\"");
+            auto name = line.substr(n).substr(start+1, end);
+            output.push_back(name);
+        }
+    }
+    return output;
+}
+
+// Backends live for the lifetime of the process so that they can keep
+// interpreter states and UDF code around between filter invocations
+static std::vector<Backend *> &backendRegistry()
+{
+    static std::vector<Backend *> backends = {
 #ifdef ENABLE_LUA
-    if (name.compare("LuaJIT") == 0)
-        return static_cast<Backend *>(new LuaBackend());
+        static_cast<Backend *>(new LuaBackend()),
 #endif
 #ifdef ENABLE_PYTHON
-    if (name.compare("Python") == 0)
-        return static_cast<Backend *>(new PythonBackend());
+        static_cast<Backend *>(new PythonBackend()),
 #endif
 #ifdef ENABLE_CPP
-    if (name.compare("C++") == 0)
-        return static_cast<Backend *>(new CppBackend());
+        static_cast<Backend *>(new CppBackend()),
+#endif
+#ifdef ENABLE_CUDA
+        static_cast<Backend *>(new CudaBackend()),
 #endif
+    };
+    return backends;
+}
+
+// Get a backend by their name (e.g., "LuaJIT")
+Backend *getBackendByName(std::string name)
+{
+    for (auto backend: backendRegistry())
+        if (name.compare(backend->name()) == 0)
+            return backend;
     return NULL;
 }
 
@@ -116,17 +381,14 @@ Backend *getBackendByFileExtension(std::string name)
     };
 
     auto ext = name.substr(sep);
-#ifdef ENABLE_LUA
-    if (sameString(ext, ".lua"))
-        return static_cast<Backend *>(new LuaBackend());
-#endif
-#ifdef ENABLE_PYTHON
-    if (sameString(ext, ".py"))
-        return static_cast<Backend *>(new PythonBackend());
-#endif
-#ifdef ENABLE_CPP
-    if (sameString(ext, ".cpp"))
-        return static_cast<Backend *>(new CppBackend());
-#endif
+    for (auto backend: backendRegistry())
+        if (sameString(ext, backend->extension()))
+            return backend;
     return NULL;
-}
\ No newline at end of file
+}
+
+// Get all backends enabled in this build
+std::vector<Backend *> getBackends()
+{
+    return backendRegistry();
+}
@@ -9,12 +9,16 @@
 #define __backend_h
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <functional>
 #include <vector>
 #include <string>
 #include "dataset.h"
 
 class Backend {
 public:
+    virtual ~Backend() {}
+
     // Backend name (e.g., "LuaJIT")
     virtual std::string name() {
         return "";
@@ -30,7 +34,16 @@ public:
         return "";
     }
 
-    // Execute a user-defined-function
+    // Compiler and options used by compile(), so that cached builds are not
+    // reused once they change. If the first word names an executable on $PATH,
+    // the compilation cache also takes the identity of that file into account.
+    virtual std::string compilerSignature() {
+        return "";
+    }
+
+    // Execute a user-defined-function. Other outputs of UDFs that produce
+    // several datasets are given among the inputs (see DatasetInfo::isOutput);
+    // their 'data' must be writeable by forked processes.
     virtual bool run(
         const std::string filterpath,
         const std::vector<DatasetInfo> input_datasets,
@@ -42,14 +55,84 @@ public:
         return false;
     }
 
+    // Execute a user-defined-function in the calling process. Unlike run(), no
+    // child process is created and no sandbox is set up: this is meant to be
+    // called from a process that has already been isolated (see WorkerPool).
+    // The UDF writes straight into output_dataset.data.
+    virtual bool execute(
+        const std::string filterpath,
+        const std::vector<DatasetInfo> input_datasets,
+        const DatasetInfo output_dataset,
+        const char *output_cast_datatype,
+        const char *udf_blob,
+        size_t udf_blob_size)
+    {
+        return false;
+    }
+
+    // Load resources that execute() needs and which cannot be retrieved once
+    // the sandbox is in place (e.g., modules the interpreter loads from disk).
+    virtual void warmup(const std::string filterpath) {}
+
+    // Whether run() executes UDFs in the calling process (e.g., on a GPU whose
+    // context cannot be used by forked processes). Such UDFs are never handed
+    // to the worker pool.
+    virtual bool runsInProcess() {
+        return false;
+    }
+
+    // Whether the backend still holds a copy of an input dataset from previous
+    // calls (see DatasetInfo::content_key), so that it need not be read again
+    virtual bool holdsInput(const DatasetInfo &info) {
+        return false;
+    }
+
     // Scan the UDF file for references to HDF5 dataset names.
     // We use this to store the UDF dependencies in the JSON payload.
     virtual std::vector<std::string> udfDatasetNames(std::string udf_file) {
         return std::vector<std::string>();
     }
 
+    // Scan the UDF file for calls to lib.parallel_for(), which only the
+    // templates of some backends provide. Comments are skipped.
+    virtual bool udfCallsParallelFor(std::string udf_file) {
+        return false;
+    }
+
+    // Scan the UDF file for calls to lib.getDataSlice(), which every template
+    // provides. Comments are not skipped, so a mention there counts as a call.
+    virtual bool udfCallsDataSlice(std::string udf_file);
+
+    // Number of processes run() forks to execute UDFs that call lib.parallel_for().
+    // Each process executes the whole UDF but only its share of the parallel ranges.
+    static void setParallelWorkers(int num_workers);
+
+    // Share of the range [0, n) that lib.parallel_for() hands to the calling process
+    static void parallelRange(size_t n, size_t *begin, size_t *end);
+
+    // Hash of the blob given to the next calls to run() or execute(), as stored
+    // on the dataset payload, so that backends look up the state they keep for
+    // that blob without hashing it again
+    static void setBlobHash(const char *udf_blob, size_t udf_blob_size, uint64_t hash);
+
+    // Hash of a blob: the one set with setBlobHash() for that buffer, or else hash64() of its contents
+    static uint64_t blobHash(const char *udf_blob, size_t udf_blob_size);
+
+    // Helper function: run 'child' under the number of processes set with
+    // setParallelWorkers(), each of which exits with the value it returns.
+    // Returns true if all processes exited successfully.
+    bool forkUDF(std::function<bool()> child);
+
     // Helper function: combine the UDF template file and the user-defined-function
-    // file into one, saving the result to a temporary file on disk that ends on the
+    // file into one string. The user-defined-function is injected in the template
+    // file right where the placeholder string is found. Returns an empty string on
+    // errors.
+    std::string assembleSource(
+        std::string udf_file,
+        std::string template_file,
+        std::string placeholder);
+
+    // Helper function: same as assembleSource(), saving the result to a temporary file on disk that ends on the
     // on the provided extension. The user-defined-function is injected in the template
     // file right where the placeholder string is found.
     std::string assembleUDF(
@@ -58,15 +141,39 @@ public:
         std::string placeholder,
         std::string extension);
 
+    // Helper function: scan C/C++ source (such as that of the C++ and CUDA
+    // backends) for calls to lib.getData() and lib.getBlock(), returning the
+    // dataset names they are given. Comments are skipped.
+    std::vector<std::string> scanCppDatasetNames(std::string udf_file);
+
+    // Helper function: get C/C++ source with the comments stripped off by the
+    // GCC preprocessor. Returns an empty string on errors.
+    std::string stripCppComments(std::string udf_file);
+
     // Helper function: save a data blob to a temporary file on disk whose name ends
     // on the given extension.
     std::string writeToDisk(const char *data, size_t size, std::string extension);
+
+    // Helper functions: compress and decompress a data buffer
+    static std::string compressBuffer(const char *data, size_t usize);
+    static std::string decompressBuffer(const char *data, size_t csize);
+
+    // Helper functions: compress a blob produced by compile() and get the original
+    // contents back. Compressed blobs are tagged so that those stored by older
+    // versions, which are not compressed, are recognized and used as they are.
+    static std::string compressPayload(const std::string &data);
+    static bool isCompressedPayload(const char *data, size_t size);
+    static std::string decompressPayload(const char *data, size_t size);
 };
 
-// Get a backend by their name (e.g., "LuaJIT")
+// Get a backend by their name (e.g., "LuaJIT"). Backends are owned by a
+// process-wide registry and must not be deleted by the caller.
 Backend *getBackendByName(std::string name);
 
 // Get a backend by file extension (e.g., ".lua")
 Backend *getBackendByFileExtension(std::string name);
 
+// Get all backends enabled in this build
+std::vector<Backend *> getBackends();
+
 #endif /* __backend_h */
\ No newline at end of file
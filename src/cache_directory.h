@@ -0,0 +1,66 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: cache_directory.h
+ *
+ * Location of the on-disk caches kept by HDF5-UDF.
+ */
+#ifndef __cache_directory_h
+#define __cache_directory_h
+
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string>
+
+/* Create a directory and its parents */
+static inline bool makeDirectory(const std::string &dir)
+{
+    for (size_t pos = 1; pos <= dir.size(); ++pos)
+    {
+        if (pos < dir.size() && dir[pos] != '/')
+            continue;
+        auto parent = dir.substr(0, pos);
+        if (mkdir(parent.c_str(), 0700) != 0 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Directory of a cache: the value of the environment variable 'env_name' if
+ * set (an empty value disables the cache), or else 'subdir' under
+ * $XDG_CACHE_HOME/hdf5-udf (or ~/.cache/hdf5-udf). Returns an empty string
+ * if the cache is disabled or no directory can be determined.
+ */
+static inline std::string cacheDirectory(const char *env_name, const std::string &subdir)
+{
+    const char *env = getenv(env_name);
+    if (env)
+        return env;
+    std::string suffix = subdir.size() ? "/" + subdir : "";
+    env = getenv("XDG_CACHE_HOME");
+    if (env && env[0] == '/')
+        return std::string(env) + "/hdf5-udf" + suffix;
+    env = getenv("HOME");
+    if (env && env[0] == '/')
+        return std::string(env) + "/.cache/hdf5-udf" + suffix;
+    return "";
+}
+
+/*
+ * Name under which an entry for 'path' is written before being moved into
+ * place. It holds the host name next to the process id, as cache directories
+ * on shared file systems are written by processes of many nodes at once.
+ */
+static inline std::string temporaryPath(const std::string &path)
+{
+    char host[HOST_NAME_MAX + 1] = "";
+    gethostname(host, sizeof(host) - 1);
+    return path + "." + host + "." + std::to_string(getpid()) + ".tmp";
+}
+
+#endif /* __cache_directory_h */
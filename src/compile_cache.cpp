@@ -0,0 +1,183 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: compile_cache.cpp
+ *
+ * Persistent cache of compiled UDFs.
+ *
+ * Attaching the same UDF to many files compiles it once: the bytecode (or
+ * shared library) produced by the backend and the dataset names found on
+ * the UDF file are stored on the cache directory and served to later runs
+ * without compiling the UDF again. The compiler is identified by the
+ * signature given by the backend (its version or the options passed to it)
+ * and, for external compilers, by the path, size, and modification time of
+ * the executable, so upgrades invalidate the entries.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fstream>
+#include <sstream>
+#include "compile_cache.h"
+#include "cache_directory.h"
+#include "hash.h"
+
+#define COMPILE_CACHE_MAGIC "HUDFCMP1"
+#define COMPILE_CACHE_MAGIC_SIZE 8
+
+static bool readWholeFile(const std::string &path, std::string &out)
+{
+    std::ifstream stream(path, std::ifstream::binary);
+    if (! stream.is_open())
+        return false;
+    std::ostringstream contents;
+    contents << stream.rdbuf();
+    out = contents.str();
+    return ! stream.bad();
+}
+
+/* Path, size, and modification time of the executable a signature starts with, if any */
+static std::string executableStamp(const std::string &signature)
+{
+    auto executable = signature.substr(0, signature.find(' '));
+    std::string path;
+    if (executable.find('/') != std::string::npos)
+        path = executable;
+    else
+    {
+        const char *env = getenv("PATH");
+        std::istringstream iss(env ? env : "/usr/local/bin:/usr/bin:/bin");
+        std::string entry;
+        while (std::getline(iss, entry, ':'))
+        {
+            auto candidate = (entry.size() ? entry : ".") + "/" + executable;
+            if (access(candidate.c_str(), X_OK) == 0)
+            {
+                path = candidate;
+                break;
+            }
+        }
+    }
+
+    char resolved[PATH_MAX];
+    struct stat statbuf;
+    if (path.empty() || ! realpath(path.c_str(), resolved) || stat(resolved, &statbuf) != 0)
+        return "";
+    std::ostringstream stamp;
+    stamp << resolved << ":" << statbuf.st_size << ":" <<
+        statbuf.st_mtim.tv_sec << "." << statbuf.st_mtim.tv_nsec;
+    return stamp.str();
+}
+
+CompileCache::CompileCache(Backend *backend, const std::string &udf_file, const std::string &template_file)
+{
+    std::string udf_source, template_source;
+    if (! readWholeFile(udf_file, udf_source))
+        return;
+    if (template_file.size() && ! readWholeFile(template_file, template_source))
+        return;
+
+    /* Without a signature, there is no telling when builds get stale */
+    auto signature = backend->compilerSignature();
+    if (signature.empty())
+        return;
+    auto stamp = executableStamp(signature);
+
+    auto key = backend->name() + '\0' + signature + '\0' + stamp + '\0' + udf_source;
+    names_key = "names" + ('\0' + key);
+    bytecode_key = "bytecode" + ('\0' + key) + '\0' + template_source;
+
+    dir = cacheDirectory("HDF5_UDF_COMPILE_CACHE_DIR", "compile");
+    if (dir.size() && ! makeDirectory(dir))
+        dir.clear();
+}
+
+bool CompileCache::lookup(const std::string &key, const std::string &suffix, std::string &value)
+{
+    if (! enabled())
+        return false;
+    std::string entry;
+    auto path = dir + "/" + hashToString(hash64(key.data(), key.size())) + suffix;
+    if (! readWholeFile(path, entry))
+        return false;
+
+    /* Layout: magic, key size, value size, key, and value */
+    const size_t header_size = COMPILE_CACHE_MAGIC_SIZE + 2 * sizeof(uint64_t);
+    if (entry.size() < header_size || memcmp(entry.data(), COMPILE_CACHE_MAGIC, COMPILE_CACHE_MAGIC_SIZE) != 0)
+        return false;
+    uint64_t key_size, value_size;
+    memcpy(&key_size, &entry[COMPILE_CACHE_MAGIC_SIZE], sizeof(key_size));
+    memcpy(&value_size, &entry[COMPILE_CACHE_MAGIC_SIZE + sizeof(key_size)], sizeof(value_size));
+    if (key_size != key.size() || entry.size() != header_size + key_size + value_size ||
+        entry.compare(header_size, key_size, key) != 0)
+        return false;
+    value = entry.substr(header_size + key_size);
+    return true;
+}
+
+bool CompileCache::store(const std::string &key, const std::string &suffix, const std::string &value)
+{
+    if (! enabled())
+        return false;
+    std::string entry(COMPILE_CACHE_MAGIC, COMPILE_CACHE_MAGIC_SIZE);
+    uint64_t key_size = key.size(), value_size = value.size();
+    entry.append((const char *) &key_size, sizeof(key_size));
+    entry.append((const char *) &value_size, sizeof(value_size));
+    entry.append(key);
+    entry.append(value);
+
+    /* The entry is written aside and moved into place, so readers never see partial entries */
+    auto path = dir + "/" + hashToString(hash64(key.data(), key.size())) + suffix;
+    auto tmp_path = temporaryPath(path);
+    std::ofstream stream(tmp_path, std::ofstream::binary | std::ofstream::trunc);
+    stream.write(entry.data(), entry.size());
+    stream.close();
+    if (stream.fail() || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to write compilation cache entry %s\n", path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool CompileCache::lookupBytecode(std::string &bytecode)
+{
+    return lookup(bytecode_key, ".bytecode", bytecode) && bytecode.size() > 0;
+}
+
+bool CompileCache::storeBytecode(const std::string &bytecode)
+{
+    return store(bytecode_key, ".bytecode", bytecode);
+}
+
+bool CompileCache::lookupDatasetNames(std::vector<std::string> &names)
+{
+    std::string value;
+    if (! lookup(names_key, ".names", value))
+        return false;
+    names.clear();
+    for (size_t start = 0; start < value.size(); )
+    {
+        auto end = value.find('\0', start);
+        if (end == std::string::npos)
+            return false;
+        names.push_back(value.substr(start, end - start));
+        start = end + 1;
+    }
+    return true;
+}
+
+bool CompileCache::storeDatasetNames(const std::vector<std::string> &names)
+{
+    std::string value;
+    for (auto &name: names)
+        value.append(name).push_back('\0');
+    return store(names_key, ".names", value);
+}
@@ -0,0 +1,45 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: compile_cache.h
+ *
+ * Persistent cache of compiled UDFs.
+ */
+#ifndef __compile_cache_h
+#define __compile_cache_h
+
+#include <string>
+#include <vector>
+#include "backend.h"
+
+class CompileCache {
+public:
+    // Prepare the lookup of the builds of a UDF file. Entries are keyed by the
+    // contents of the UDF and template files, by the backend, and by the
+    // compiler (its version, or its executable and options). They are kept
+    // under the directory given by $HDF5_UDF_COMPILE_CACHE_DIR, which defaults
+    // to $XDG_CACHE_HOME/hdf5-udf/compile (or ~/.cache/hdf5-udf/compile).
+    CompileCache(Backend *backend, const std::string &udf_file, const std::string &template_file);
+
+    // Whether a cache directory is available
+    bool enabled() const { return dir.size() > 0; }
+
+    // Output of Backend::compile()
+    bool lookupBytecode(std::string &bytecode);
+    bool storeBytecode(const std::string &bytecode);
+
+    // Output of Backend::udfDatasetNames()
+    bool lookupDatasetNames(std::vector<std::string> &names);
+    bool storeDatasetNames(const std::vector<std::string> &names);
+
+private:
+    // Cache entries hold their whole key, so that hash collisions are told apart
+    bool lookup(const std::string &key, const std::string &suffix, std::string &value);
+    bool store(const std::string &key, const std::string &suffix, const std::string &value);
+
+    std::string dir;
+    std::string bytecode_key;
+    std::string names_key;
+};
+
+#endif /* __compile_cache_h */
@@ -26,11 +26,60 @@
 #include "cpp_backend.h"
 #include "anon_mmap.h"
 #include "dataset.h"
-#include "miniz.h"
+#include "hash.h"
+#include "ops.h"
+#include "stats.h"
 #ifdef ENABLE_SANDBOX
 #include "sandbox.h"
 #endif
 
+/* Datasets made available to the UDF */
+static std::vector<DatasetInfo> dataset_info;
+
+/* Functions made available to the C++ template library (udf_template.cpp) */
+static void *cppGetData(const char *element)
+{
+    for (auto &info: dataset_info)
+        if (info.name.compare(element) == 0)
+            return info.data ? info.data : info.load();
+    fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
+    return NULL;
+}
+
+static void *cppGetDataSlice(const char *element, const hsize_t *offset, const hsize_t *count)
+{
+    for (auto &info: dataset_info)
+        if (info.name.compare(element) == 0)
+        {
+            std::vector<hsize_t> slice_offset(offset, offset + info.dimensions.size());
+            std::vector<hsize_t> slice_count(count, count + info.dimensions.size());
+            return info.getSlice(slice_offset, slice_count);
+        }
+    fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
+    return NULL;
+}
+
+static void cppGetBlockRange(size_t *rows, size_t *step)
+{
+    hsize_t block_step;
+    *rows = DatasetInfo::blockRows(dataset_info, &block_step);
+    *step = block_step;
+}
+
+static void cppSetBlock(size_t first, size_t last)
+{
+    DatasetInfo::setBlock(first, last);
+}
+
+static void *cppGetBlock(const char *element)
+{
+    for (auto &info: dataset_info)
+        if (info.name.compare(element) == 0)
+            return info.getBlock(dataset_info[0]);
+    fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
+    return NULL;
+}
+
 /* This backend's name */
 std::string CppBackend::name()
 {
@@ -43,36 +92,79 @@ std::string CppBackend::extension()
     return ".cpp";
 }
 
-/* Compile C to a shared object using GCC. Returns the shared object as a string. */
-std::string CppBackend::compile(std::string udf_file, std::string template_file)
+std::string CppBackend::compilerSignature()
 {
-    std::string placeholder = "// user_callback_placeholder";
-    auto cpp_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
-    if (cpp_file.size() == 0)
-    {
-        fprintf(stderr, "Will not be able to compile the UDF code\n");
-        return "";
-    }
+    /* Extra builds requested through the environment are part of the output */
+    const char *targets = getenv("HDF5_UDF_CPP_TARGETS");
+    return std::string("g++ -rdynamic -shared -fPIC -O3 -C targets=") + (targets ? targets : "");
+}
 
-    std::string output = udf_file + ".so";
+/* Tag of blobs that hold one shared library per ISA level */
+#define MULTI_TARGET_MAGIC "HUDF-ISA"
+#define MULTI_TARGET_MAGIC_SIZE 8
+#define TARGET_NAME_SIZE 16
+
+/*
+ * ISA level of a target given to -march: 1 for the baseline "x86-64" and
+ * N for "x86-64-vN". Returns 0 for targets we don't know how to detect.
+ */
+static int targetLevel(const std::string &target)
+{
+    if (target == "x86-64")
+        return 1;
+    if (target.size() == 9 && target.compare(0, 8, "x86-64-v") == 0 &&
+        target[8] >= '2' && target[8] <= '4')
+        return target[8] - '0';
+    return 0;
+}
+
+/* Highest x86-64 ISA level supported by this CPU, according to CPUID */
+static int hostLevel()
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (! (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("sse3") &&
+           __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1") &&
+           __builtin_cpu_supports("sse4.2")))
+        return 1;
+    if (! (__builtin_cpu_supports("avx") && __builtin_cpu_supports("avx2") &&
+           __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2") &&
+           __builtin_cpu_supports("fma")))
+        return 2;
+    if (! (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512cd") && __builtin_cpu_supports("avx512dq") &&
+           __builtin_cpu_supports("avx512vl")))
+        return 3;
+    return 4;
+#else
+    return 1;
+#endif
+}
+
+/* Build the shared library for the given -march target (or the compiler's default) */
+static std::string buildLibrary(const std::string &cpp_file, const std::string &output, const std::string &target)
+{
+    std::string march = "-march=" + target;
     pid_t pid = fork();
     if (pid == 0)
     {
         // Child process
-        char *cmd[] = {
+        std::vector<char *> cmd = {
             (char *) "g++",
             (char *) "-rdynamic",
             (char *) "-shared",
             (char *) "-fPIC",
-            (char *) "-flto",
-            (char *) "-Os",
+            (char *) "-O3",
             (char *) "-C",
             (char *) "-o",
             (char *) output.c_str(),
-            (char *) cpp_file.c_str(),
-            NULL
         };
-        execvp(cmd[0], cmd);
+        if (target.size())
+            cmd.push_back((char *) march.c_str());
+        cmd.push_back((char *) cpp_file.c_str());
+        cmd.push_back(NULL);
+        execvp(cmd[0], cmd.data());
+        _exit(1);
     }
     else if (pid > 0)
     {
@@ -82,240 +174,537 @@ std::string CppBackend::compile(std::string udf_file, std::string template_file)
 
         // Read generated shared library
         struct stat statbuf;
-        std::string bytecode;
+        std::string shlib;
         if (stat(output.c_str(), &statbuf) == 0) {
             std::ifstream data(output, std::ifstream::binary);
             std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(data), {});
-            bytecode.assign(buffer.begin(), buffer.end());
+            shlib.assign(buffer.begin(), buffer.end());
             unlink(output.c_str());
         }
-        unlink(cpp_file.c_str());
-
-        // Compress the data
-        return compressBuffer(bytecode.data(), bytecode.size());
+        return shlib;
     }
     fprintf(stderr, "Failed to execute g++\n");
     return "";
 }
 
-/* Compress the shared library object and return the result as a string */
-std::string CppBackend::compressBuffer(const char *data, size_t usize)
+/*
+ * Compile C to a shared object using GCC. Returns the shared object as a string.
+ * $HDF5_UDF_CPP_TARGETS may list x86-64 ISA levels (e.g., "x86-64-v3,x86-64-v4")
+ * to build the UDF for in addition to the compiler's default target. All builds
+ * are then stored in the blob and the best match for the CPU is picked at load
+ * time.
+ */
+std::string CppBackend::compile(std::string udf_file, std::string template_file)
 {
-    uint64_t csize = mz_compressBound(usize);
-    std::string compressed;
-    compressed.resize(csize);
+    std::vector<std::string> targets;
+    const char *env = getenv("HDF5_UDF_CPP_TARGETS");
+    if (env)
+    {
+        std::string target;
+        std::istringstream iss(env);
+        while (std::getline(iss, target, ','))
+        {
+            if (target.empty())
+                continue;
+            if (targetLevel(target) < 2)
+            {
+                fprintf(stderr, "Unsupported target '%s' given to $HDF5_UDF_CPP_TARGETS\n", target.c_str());
+                return "";
+            }
+            targets.push_back(target);
+        }
+    }
 
-    auto status = mz_compress(
-        (uint8_t *) compressed.data(), &csize,
-        (const uint8_t *) data, usize);
-    if (status != Z_OK)
+    std::string placeholder = "// user_callback_placeholder";
+    auto cpp_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
+    if (cpp_file.size() == 0)
     {
-        fprintf(stderr, "Failed to compress input buffer\n");
+        fprintf(stderr, "Will not be able to compile the UDF code\n");
         return "";
     }
-    memcpy(&compressed[csize], &usize, sizeof(uint64_t));
-    compressed.resize(csize + sizeof(uint64_t));
-    return compressed;
+
+    std::string output = udf_file + ".so";
+    std::string shlib = buildLibrary(cpp_file, output, "");
+    if (shlib.size() == 0 || targets.size() == 0)
+    {
+        unlink(cpp_file.c_str());
+        return shlib.size() ? compressBuffer(shlib.data(), shlib.size()) : "";
+    }
+
+    /*
+     * Layout: magic, number of libraries, and one record per library with the
+     * target name and the size of the compressed library, followed by the
+     * compressed libraries themselves. The default build comes first.
+     */
+    std::vector<std::pair<std::string, std::string>> builds;
+    builds.push_back(std::make_pair("x86-64", compressBuffer(shlib.data(), shlib.size())));
+    for (auto &target: targets)
+    {
+        printf("Building for %s\n", target.c_str());
+        shlib = buildLibrary(cpp_file, output, target);
+        if (shlib.size() == 0)
+        {
+            fprintf(stderr, "Failed to build the UDF for %s\n", target.c_str());
+            unlink(cpp_file.c_str());
+            return "";
+        }
+        builds.push_back(std::make_pair(target, compressBuffer(shlib.data(), shlib.size())));
+    }
+    unlink(cpp_file.c_str());
+
+    std::string blob(MULTI_TARGET_MAGIC, MULTI_TARGET_MAGIC_SIZE);
+    uint32_t count = builds.size();
+    blob.append((const char *) &count, sizeof(count));
+    for (auto &build: builds)
+    {
+        char name[TARGET_NAME_SIZE] = {0};
+        strncpy(name, build.first.c_str(), sizeof(name) - 1);
+        uint64_t size = build.second.size();
+        blob.append(name, sizeof(name));
+        blob.append((const char *) &size, sizeof(size));
+    }
+    for (auto &build: builds)
+        blob.append(build.second);
+    return blob;
 }
 
-/* Decompress the shared library object and return the result as a string */
-std::string CppBackend::decompressBuffer(const char *data, size_t csize)
+/* Decompress the shared library held in a blob, picking the best build for this CPU */
+std::string CppBackend::extractLibrary(const char *blob, size_t blob_size)
 {
-    /* Get original file size */
-    uint64_t usize;
-    memcpy(&usize, &data[csize-sizeof(uint64_t)], sizeof(uint64_t));
-    csize -= sizeof(uint64_t);
+    size_t header_size = MULTI_TARGET_MAGIC_SIZE + sizeof(uint32_t);
+    if (blob_size < header_size || memcmp(blob, MULTI_TARGET_MAGIC, MULTI_TARGET_MAGIC_SIZE) != 0)
+        return decompressBuffer(blob, blob_size);
 
-    std::string uncompressed;
-    uncompressed.resize(usize);
+    uint32_t count;
+    memcpy(&count, &blob[MULTI_TARGET_MAGIC_SIZE], sizeof(count));
+    size_t record_size = TARGET_NAME_SIZE + sizeof(uint64_t);
+    if (count == 0 || count > (blob_size - header_size) / record_size)
+    {
+        fprintf(stderr, "Invalid shared library blob\n");
+        return "";
+    }
 
-    auto status = mz_uncompress(
-        (uint8_t *) uncompressed.data(), &usize,
-        (const uint8_t *) data, csize);
-    if (status != Z_OK)
+    int host_level = hostLevel();
+    int best_level = 0;
+    size_t best_offset = 0, best_size = 0;
+    size_t offset = header_size + count * record_size;
+    for (uint32_t i=0; i<count; ++i)
+    {
+        const char *record = &blob[header_size + i * record_size];
+        std::string name(record, strnlen(record, TARGET_NAME_SIZE));
+        uint64_t size;
+        memcpy(&size, &record[TARGET_NAME_SIZE], sizeof(size));
+        if (size > blob_size || offset > blob_size - size)
+        {
+            fprintf(stderr, "Invalid shared library blob\n");
+            return "";
+        }
+        int level = targetLevel(name);
+        if (level > best_level && level <= host_level)
+        {
+            best_level = level;
+            best_offset = offset;
+            best_size = size;
+        }
+        offset += size;
+    }
+    if (best_level == 0)
     {
-        fprintf(stderr, "Failed to uncompress shared library object: %d\n", status);
+        fprintf(stderr, "No build of the UDF runs on this CPU\n");
         return "";
     }
-    return uncompressed;
+    return decompressBuffer(&blob[best_offset], best_size);
 }
 
-/* Execute the user-defined-function embedded in the given buffer */
-bool CppBackend::run(
+/*
+ * Resolve the UDF and the APIs defined in our C++ template file, populate the
+ * dataset vectors, and run the UDF, optionally setting up the sandbox first.
+ */
+bool CppBackend::callUDF(
+    SharedLibraryManager &shlib,
     const std::string filterpath,
-    const std::vector<DatasetInfo> input_datasets,
-    const DatasetInfo output_dataset,
-    const char *output_cast_datatype,
+    const std::vector<DatasetInfo> &input_datasets,
+    const DatasetInfo &output_dataset,
+    bool use_sandbox)
+{
+    /* Get references to the UDF and the APIs defined in our C++ template file */
+    void (*udf)(void) = (void (*)()) shlib.loadsym("dynamic_dataset");
+    auto hdf5_udf_data =
+        static_cast<std::vector<void *>*>(shlib.loadsym("hdf5_udf_data"));
+    auto hdf5_udf_names =
+        static_cast<std::vector<const char *>*>(shlib.loadsym("hdf5_udf_names"));
+    auto hdf5_udf_types =
+        static_cast<std::vector<const char *>*>(shlib.loadsym("hdf5_udf_types"));
+    auto hdf5_udf_dims =
+        static_cast<std::vector<std::vector<hsize_t>>*>(shlib.loadsym("hdf5_udf_dims"));
+    auto hdf5_udf_chunk_offset =
+        static_cast<std::vector<hsize_t>*>(shlib.loadsym("hdf5_udf_chunk_offset"));
+    auto hdf5_udf_chunk_dims =
+        static_cast<std::vector<hsize_t>*>(shlib.loadsym("hdf5_udf_chunk_dims"));
+    if (! udf || ! hdf5_udf_data || ! hdf5_udf_names || ! hdf5_udf_types || ! hdf5_udf_dims ||
+        ! hdf5_udf_chunk_offset || ! hdf5_udf_chunk_dims)
+        return false;
+
+    auto hdf5_udf_parallel_range =
+        static_cast<void (**)(size_t, size_t *, size_t *)>(
+            shlib.loadsym("hdf5_udf_parallel_range", false));
+    if (hdf5_udf_parallel_range)
+        *hdf5_udf_parallel_range = Backend::parallelRange;
+    auto hdf5_udf_loader =
+        static_cast<void *(**)(const char *)>(shlib.loadsym("hdf5_udf_loader", false));
+    auto hdf5_udf_slicer =
+        static_cast<void *(**)(const char *, const hsize_t *, const hsize_t *)>(
+            shlib.loadsym("hdf5_udf_slicer", false));
+    auto hdf5_udf_block_range =
+        static_cast<void (**)(size_t *, size_t *)>(shlib.loadsym("hdf5_udf_block_range", false));
+    auto hdf5_udf_set_block =
+        static_cast<void (**)(size_t, size_t)>(shlib.loadsym("hdf5_udf_set_block", false));
+    auto hdf5_udf_block =
+        static_cast<void *(**)(const char *)>(shlib.loadsym("hdf5_udf_block", false));
+    if (hdf5_udf_block_range && hdf5_udf_set_block && hdf5_udf_block)
+    {
+        *hdf5_udf_block_range = cppGetBlockRange;
+        *hdf5_udf_set_block = cppSetBlock;
+        *hdf5_udf_block = cppGetBlock;
+    }
+
+    /* Vectorized kernels (lib.ops). Libraries built before they existed lack the hooks. */
+    auto hdf5_udf_ops_binary =
+        static_cast<decltype(&udfOpsBinary) *>(shlib.loadsym("hdf5_udf_ops_binary", false));
+    auto hdf5_udf_ops_scale =
+        static_cast<decltype(&udfOpsScale) *>(shlib.loadsym("hdf5_udf_ops_scale", false));
+    auto hdf5_udf_ops_clamp =
+        static_cast<decltype(&udfOpsClamp) *>(shlib.loadsym("hdf5_udf_ops_clamp", false));
+    auto hdf5_udf_ops_convert =
+        static_cast<decltype(&udfOpsConvert) *>(shlib.loadsym("hdf5_udf_ops_convert", false));
+    auto hdf5_udf_ops_reduce =
+        static_cast<decltype(&udfOpsReduce) *>(shlib.loadsym("hdf5_udf_ops_reduce", false));
+    if (hdf5_udf_ops_binary && hdf5_udf_ops_scale && hdf5_udf_ops_clamp &&
+        hdf5_udf_ops_convert && hdf5_udf_ops_reduce)
+    {
+        *hdf5_udf_ops_binary = udfOpsBinary;
+        *hdf5_udf_ops_scale = udfOpsScale;
+        *hdf5_udf_ops_clamp = udfOpsClamp;
+        *hdf5_udf_ops_convert = udfOpsConvert;
+        *hdf5_udf_ops_reduce = udfOpsReduce;
+    }
+
+    /* Populate vector of dataset names, sizes, and types */
+    dataset_info.clear();
+    dataset_info.push_back(output_dataset);
+    dataset_info.insert(
+        dataset_info.end(), input_datasets.begin(), input_datasets.end());
+
+    if (hdf5_udf_loader && hdf5_udf_slicer)
+    {
+        *hdf5_udf_loader = cppGetData;
+        *hdf5_udf_slicer = cppGetDataSlice;
+    }
+    else
+    {
+        /* UDFs built before datasets could be read on demand need them upfront */
+        for (auto &info: dataset_info)
+            if (! info.data && ! info.load())
+                return false;
+    }
+
+    /*
+     * Grids are handed to the UDF aligned to DATA_ALIGNMENT bytes, which the
+     * template tells the compiler about. Only input datasets mapped straight
+     * from the file may not be, in which case the UDF gets an aligned copy.
+     */
+    std::vector<void *> copies;
+    for (size_t i=1; i<dataset_info.size(); ++i)
+    {
+        auto &info = dataset_info[i];
+        if (! info.data || ((uintptr_t) info.data % DATA_ALIGNMENT) == 0)
+            continue;
+        size_t size = info.getGridSize() * info.getStorageSize();
+        void *copy = NULL;
+        if (posix_memalign(&copy, DATA_ALIGNMENT, size) != 0)
+        {
+            fprintf(stderr, "Not enough memory to align dataset %s\n", info.name.c_str());
+            for (auto ptr: copies)
+                free(ptr);
+            return false;
+        }
+        memcpy(copy, info.data, size);
+        info.data = copy;
+        copies.push_back(copy);
+    }
+
+    /* The library may have been used by a previous call */
+    hdf5_udf_data->clear();
+    hdf5_udf_names->clear();
+    hdf5_udf_types->clear();
+    hdf5_udf_dims->clear();
+    for (size_t i=0; i<dataset_info.size(); ++i)
+    {
+        hdf5_udf_data->push_back(dataset_info[i].data);
+        hdf5_udf_names->push_back(dataset_info[i].name.c_str());
+        hdf5_udf_types->push_back(dataset_info[i].getDatatype());
+        hdf5_udf_dims->push_back(dataset_info[i].dimensions);
+    }
+    *hdf5_udf_chunk_offset = output_dataset.chunk_offset;
+    *hdf5_udf_chunk_dims = output_dataset.chunk_dimensions;
+
+    /* Prepare the sandbox if needed and run the UDF */
+    bool ready = true;
+#ifdef ENABLE_SANDBOX
+    if (use_sandbox)
+    {
+        Sandbox sandbox;
+        ready = sandbox.init(filterpath);
+    }
+#endif
+    if (ready)
+    {
+        StatsTimer timer(STATS_UDF);
+        udf();
+    }
+    for (auto ptr: copies)
+        free(ptr);
+    return ready;
+}
+
+/* Maximum number of decompressed shared libraries kept around between calls */
+#define MAX_CACHED_LIBRARIES 16
+
+CppBackend::CachedLibrary *CppBackend::getLibrary(
     const char *sharedlib_data,
     size_t sharedlib_data_size)
 {
+    uint64_t key = blobHash(sharedlib_data, sharedlib_data_size);
+    auto it = libraries.find(key);
+    if (it != libraries.end() &&
+        it->second.blob.size() == sharedlib_data_size &&
+        memcmp(it->second.blob.data(), sharedlib_data, sharedlib_data_size) == 0)
+    {
+        it->second.last_used = ++use_counter;
+        return &it->second;
+    }
+
+    auto release = [](CachedLibrary &entry)
+    {
+        delete entry.shlib;
+        if (entry.fd >= 0)
+            close(entry.fd);
+    };
+
+    if (it != libraries.end())
+    {
+        /* Hash collision: evict the previous entry */
+        release(it->second);
+        libraries.erase(it);
+    }
+
+    /* Evict the least recently used library if the cache is full */
+    if (libraries.size() >= MAX_CACHED_LIBRARIES)
+    {
+        auto lru = std::min_element(libraries.begin(), libraries.end(),
+            [](const std::pair<const uint64_t, CachedLibrary> &a,
+               const std::pair<const uint64_t, CachedLibrary> &b)
+            { return a.second.last_used < b.second.last_used; });
+        release(lru->second);
+        libraries.erase(lru);
+    }
+
     /* Decompress the shared library */
-    std::string decompressed_shlib = decompressBuffer(sharedlib_data, sharedlib_data_size);
+    std::string decompressed_shlib = extractLibrary(sharedlib_data, sharedlib_data_size);
     if (decompressed_shlib.size() == 0)
+        return NULL;
+
+    CachedLibrary entry;
+    entry.path = storeLibrary(decompressed_shlib, key, &entry.fd);
+    if (entry.path.size() == 0)
+        return NULL;
+    entry.blob.assign(sharedlib_data, sharedlib_data_size);
+    entry.shlib = NULL;
+    entry.last_used = ++use_counter;
+    return &(libraries[key] = entry);
+}
+
+std::string CppBackend::storeLibrary(const std::string &shlib, uint64_t key, int *fd)
+{
+    /*
+     * Shared libraries are dlopen()ed straight from memory. The memfd is sealed
+     * so that it cannot be changed under our feet, and it is inherited by the
+     * processes we fork.
+     */
+    *fd = memfd_create("hdf5-udf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd >= 0)
     {
-        fprintf(stderr, "Will not be able to load the UDF function\n");
-        return false;
+        size_t written = 0;
+        while (written < shlib.size())
+        {
+            ssize_t n = write(*fd, &shlib[written], shlib.size() - written);
+            if (n <= 0)
+                break;
+            written += n;
+        }
+        if (written == shlib.size())
+        {
+            fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+            return "/proc/self/fd/" + std::to_string(*fd);
+        }
+        fprintf(stderr, "Failed to write shared library to memfd: %s\n", strerror(errno));
+        close(*fd);
+        *fd = -1;
     }
 
     /*
-     * Unfortunately we have to make a trip to disk so we can dlopen()
-     * and dlsym() the function we are looking for in a portable way.
+     * Unfortunately we have to make a trip to disk so we can dlopen() and
+     * dlsym() the function we are looking for. Libraries are named after
+     * their contents, so other processes of the same user reuse them.
      */
-    auto ext = this->extension();
-    auto so_file = Backend::writeToDisk(decompressed_shlib.data(), decompressed_shlib.size(), ext);
-    if (so_file.size() == 0)
+    char *tmp = getenv("TMPDIR") ? : (char *) "/tmp";
+    auto dir = std::string(tmp) + "/hdf5-udf-" + std::to_string(getuid());
+    struct stat statbuf;
+    if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Failed to create %s: %s\n", dir.c_str(), strerror(errno));
+        return "";
+    }
+    if (lstat(dir.c_str(), &statbuf) < 0 || ! S_ISDIR(statbuf.st_mode) ||
+        statbuf.st_uid != getuid() || (statbuf.st_mode & 0077))
+    {
+        fprintf(stderr, "Refusing to use %s as a cache directory\n", dir.c_str());
+        return "";
+    }
+
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%016lx", (unsigned long) hash64(shlib.data(), shlib.size()));
+    auto path = dir + "/" + hash + ".so";
+    std::ifstream ifs(path, std::ios::binary);
+    std::string existing((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (existing == shlib)
+        return path;
+
+    /* Write to a temporary file first so readers never see partial contents */
+    char tmpfile[PATH_MAX];
+    snprintf(tmpfile, sizeof(tmpfile)-1, "%s/tmp-XXXXXX", dir.c_str());
+    int tmpfd = mkstemp(tmpfile);
+    if (tmpfd < 0)
+    {
+        fprintf(stderr, "Error creating temporary file.\n");
+        return "";
+    }
+    bool ok = write(tmpfd, shlib.data(), shlib.size()) == (ssize_t) shlib.size();
+    ok = fchmod(tmpfd, 0755) == 0 && ok;
+    close(tmpfd);
+    if (! ok || rename(tmpfile, path.c_str()) < 0)
+    {
+        fprintf(stderr, "Failed to store shared library at %s\n", path.c_str());
+        unlink(tmpfile);
+        return "";
+    }
+    return path;
+}
+
+/* Execute the user-defined-function embedded in the given buffer */
+bool CppBackend::run(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *sharedlib_data,
+    size_t sharedlib_data_size)
+{
+    uint64_t load_start = Stats::now();
+    CachedLibrary *library = getLibrary(sharedlib_data, sharedlib_data_size);
+    if (! library)
     {
         fprintf(stderr, "Will not be able to load the UDF function\n");
         return false;
     }
-    chmod(so_file.c_str(), 0755);
+    auto so_file = library->path;
+    Stats::instance()->addTime(STATS_BACKEND_LOAD, Stats::now() - load_start);
 
     /*
      * We want to make the output dataset writeable by the UDF. Because
      * the UDF is run under a separate process we have to use a shared
-     * memory segment which both processes can read and write to.
+     * memory segment which both processes can read and write to, unless
+     * the caller has already allocated the output grid from one.
      */
-    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
+    size_t room_size = output_dataset.getChunkGridSize() * output_dataset.getStorageSize();
     AnonymousMemoryMap mm(room_size);
-    if (! mm.create())
-    {
-        unlink(so_file.c_str());
+    if (! output_dataset.shared_data && ! mm.create())
         return false;
-    }
 
     /*
      * Execute the user-defined-function under a separate process so that
-     * seccomp can kill it (if needed) without crashing the entire program
+     * seccomp can kill it (if needed) without crashing the entire program.
+     * The library is only ever loaded by that process, as its constructors
+     * may run arbitrary code.
      */
-    pid_t pid = fork();
-    if (pid == 0)
+    bool ret = forkUDF([&]()
     {
         SharedLibraryManager shlib;
+        uint64_t open_start = Stats::now();
         if (shlib.open(so_file) == false)
             return false;
-
-        /* Get references to the UDF and the APIs defined in our C++ template file */
-        void (*udf)(void) = (void (*)()) shlib.loadsym("dynamic_dataset");
-        auto hdf5_udf_data =
-            static_cast<std::vector<void *>*>(shlib.loadsym("hdf5_udf_data"));
-        auto hdf5_udf_names =
-            static_cast<std::vector<const char *>*>(shlib.loadsym("hdf5_udf_names"));
-        auto hdf5_udf_types =
-            static_cast<std::vector<const char *>*>(shlib.loadsym("hdf5_udf_types"));
-        auto hdf5_udf_dims =
-            static_cast<std::vector<std::vector<hsize_t>>*>(shlib.loadsym("hdf5_udf_dims"));
-        if (! udf || ! hdf5_udf_data || ! hdf5_udf_names || ! hdf5_udf_types || ! hdf5_udf_dims)
-            return false;
+        Stats::instance()->addTime(STATS_BACKEND_LOAD, Stats::now() - open_start);
 
         /* Let output_dataset.data point to the shared memory segment */
         DatasetInfo output_dataset_copy = output_dataset;
-        output_dataset_copy.data = mm.mm;
-
-        /* Populate vector of dataset names, sizes, and types */
-        std::vector<DatasetInfo> dataset_info;
-        dataset_info.push_back(output_dataset_copy);
-        dataset_info.insert(
-            dataset_info.end(), input_datasets.begin(), input_datasets.end());
-
-        for (size_t i=0; i<dataset_info.size(); ++i)
-        {
-            hdf5_udf_data->push_back(dataset_info[i].data);
-            hdf5_udf_names->push_back(dataset_info[i].name.c_str());
-            hdf5_udf_types->push_back(dataset_info[i].getDatatype());
-            hdf5_udf_dims->push_back(dataset_info[i].dimensions);
-        }
+        if (! output_dataset.shared_data)
+            output_dataset_copy.data = mm.mm;
 
-        /* Prepare the sandbox if needed and run the UDF */
-        bool ready = true;
-#ifdef ENABLE_SANDBOX
-        Sandbox sandbox;
-        ready = sandbox.init(filterpath);
-#endif
-        if (ready)
-            udf();
+        return callUDF(shlib, filterpath, input_datasets, output_dataset_copy, true);
+    });
 
-        /* Exit the process without invoking any callbacks registered with atexit() */
-        _exit(ready ? 0 : 1);
-    }
-    else if (pid > 0)
+    /* Update output HDF5 dataset with data from shared memory segment */
+    if (! output_dataset.shared_data)
     {
-        /* Update output HDF5 dataset with data from shared memory segment */
-        waitpid(pid, NULL, 0);
+        StatsTimer timer(STATS_OUTPUT_COPY);
         memcpy(output_dataset.data, mm.mm, room_size);
     }
 
-    unlink(so_file.c_str());
-    return true;   
+    return ret;
 }
 
-/* Scan the UDF file for references to HDF5 dataset names */
-std::vector<std::string> CppBackend::udfDatasetNames(std::string udf_file)
+bool CppBackend::execute(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *sharedlib_data,
+    size_t sharedlib_data_size)
 {
-    std::vector<std::string> output;
-
-    // We already rely on GCC to build the code, so just invoke its
-    // preprocessor to get rid of comments and identify calls to our API
-    int pipefd[2];
-    if (pipe(pipefd) < 0)
+    uint64_t load_start = Stats::now();
+    CachedLibrary *library = getLibrary(sharedlib_data, sharedlib_data_size);
+    if (! library)
     {
-        fprintf(stderr, "Failed to create pipe\n");
-        return output;
+        fprintf(stderr, "Will not be able to load the UDF function\n");
+        return false;
     }
 
-    pid_t pid = fork();
-    if (pid == 0)
-    {
-        // Child: runs proprocessor, outputs to pipe
-        dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[0]);
-        close(pipefd[1]);
-        char *cmd[] = {
-            (char *) "g++",
-            (char *) "-fpreprocessed",
-            (char *) "-dD",
-            (char *) "-E",
-            (char *) udf_file.c_str(),
-            (char *) NULL
-        };
-        execvp(cmd[0], cmd);
-    }
-    else if (pid > 0)
+    /* We are already isolated, so the library handle can be kept open */
+    if (! library->shlib)
     {
-        // Parent: reads from pipe, concatenating to 'input' string
-        std::string input;
-        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
-        while (true)
+        library->shlib = new SharedLibraryManager();
+        if (! library->shlib->open(library->path))
         {
-            char buf[8192];
-            ssize_t n = read(pipefd[0], buf, sizeof(buf));
-            if (n < 0 && errno == EWOULDBLOCK)
-            {
-                if (waitpid(pid, NULL, WNOHANG) == pid)
-                    break;
-                continue;
-            }
-            else if (n <= 0)
-                break;
-            input.append(buf, n);
+            delete library->shlib;
+            library->shlib = NULL;
+            return false;
         }
+    }
+    Stats::instance()->addTime(STATS_BACKEND_LOAD, Stats::now() - load_start);
 
-        // Go through the output of the preprocessor one line at a time
-        std::string line;
-        std::istringstream iss(input);
-        while (std::getline(iss, line))
-        {
-            size_t n = line.find("lib.getData");
-            if (n != std::string::npos)
-            {
-                auto start = line.substr(n).find_first_of("\"");
-                auto end = line.substr(n+start+1).find_first_of("\"");
-                auto name = line.substr(n).substr(start+1, end);
-                output.push_back(name);
-            }
-        }
+    bool ret = callUDF(*library->shlib, filterpath, input_datasets, output_dataset, false);
+    DatasetInfo::freeSlices();
+    return ret;
+}
 
-        close(pipefd[0]);
-        close(pipefd[1]);
-    }
-    return output;
+/* Scan the UDF file for references to HDF5 dataset names */
+std::vector<std::string> CppBackend::udfDatasetNames(std::string udf_file)
+{
+    return scanCppDatasetNames(udf_file);
+}
+
+/* Scan the UDF file for calls to lib.parallel_for() */
+bool CppBackend::udfCallsParallelFor(std::string udf_file)
+{
+    return stripCppComments(udf_file).find("lib.parallel_for") != std::string::npos;
 }
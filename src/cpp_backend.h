@@ -8,7 +8,9 @@
 #ifndef __cpp_backend_h
 #define __cpp_backend_h
 
+#include <map>
 #include "backend.h"
+#include "sharedlib_manager.h"
 
 class CppBackend : public Backend {
 public:
@@ -21,6 +23,9 @@ public:
     // Compile an input file into executable form
     std::string compile(std::string udf_file, std::string template_file);
 
+    // Compiler and options used by compile()
+    std::string compilerSignature();
+
     // Execute a user-defined-function
     bool run(
         const std::string filterpath,
@@ -30,16 +35,52 @@ public:
         const char *udf_blob,
         size_t udf_blob_size);
 
+    // Execute a user-defined-function in the calling process
+    bool execute(
+        const std::string filterpath,
+        const std::vector<DatasetInfo> input_datasets,
+        const DatasetInfo output_dataset,
+        const char *output_cast_datatype,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
     // Scan the UDF file for references to HDF5 dataset names.
     // We use this to store the UDF dependencies in the JSON payload.
     std::vector<std::string> udfDatasetNames(std::string udf_file);
 
+    // Scan the UDF file for calls to lib.parallel_for()
+    bool udfCallsParallelFor(std::string udf_file);
+
 private:
-    // Compress a data buffer
-    std::string compressBuffer(const char *data, size_t usize);
+    // Populate the dataset vectors of the template library and run the UDF
+    bool callUDF(
+        SharedLibraryManager &shlib,
+        const std::string filterpath,
+        const std::vector<DatasetInfo> &input_datasets,
+        const DatasetInfo &output_dataset,
+        bool use_sandbox);
+
+    // Decompressed shared libraries, indexed by the hash of their compressed form
+    struct CachedLibrary {
+        std::string blob;            /* Compressed shared library */
+        std::string path;            /* Path to dlopen() the decompressed library from */
+        int fd;                      /* memfd holding the library, or -1 if kept on disk */
+        SharedLibraryManager *shlib; /* Handle kept open by pre-forked workers */
+        uint64_t last_used;
+    };
+    std::map<uint64_t, CachedLibrary> libraries;
+    uint64_t use_counter = 0;
+
+    // Decompress the shared library held in a blob. Blobs built for several
+    // ISA levels yield the best build the CPU supports.
+    std::string extractLibrary(const char *blob, size_t blob_size);
+
+    // Get the cache entry of a shared library, decompressing it on first use
+    CachedLibrary *getLibrary(const char *sharedlib_data, size_t sharedlib_data_size);
 
-    // Decompress a data buffer
-    std::string decompressBuffer(const char *data, size_t csize);
+    // Write a decompressed shared library to a sealed memfd or, if that is not
+    // supported, to the per-user on-disk cache. Returns the path to dlopen().
+    std::string storeLibrary(const std::string &shlib, uint64_t key, int *fd);
 };
 
 #endif /* __cpp_backend_h */
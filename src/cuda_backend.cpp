@@ -0,0 +1,494 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: cuda_backend.cpp
+ *
+ * CUDA kernel generation and execution on the GPU.
+ *
+ * UDFs are compiled by nvcc into a fatbin, which holds native code for the
+ * GPU architectures requested at build time along with PTX that the driver
+ * compiles for newer GPUs. On reads, the fatbin is loaded as a module on the
+ * primary context of the device, the input datasets are copied to device
+ * memory, and a kernel is launched with one thread per element of the output
+ * chunk. Only device code comes from the UDF, so it runs in the calling
+ * process: CUDA contexts cannot be used by forked processes, and keeping the
+ * context alive lets modules and uploaded inputs be reused across calls.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "cuda_backend.h"
+#include "dataset.h"
+#include "size_parser.h"
+#include "stats.h"
+
+/* Report a failed driver API call */
+static bool check(CUresult result, const char *what)
+{
+    if (result == CUDA_SUCCESS)
+        return true;
+    const char *message = NULL;
+    cuGetErrorString(result, &message);
+    fprintf(stderr, "%s failed: %s\n", what, message ? message : "unknown error");
+    return false;
+}
+
+/* This backend's name */
+std::string CudaBackend::name()
+{
+    return "CUDA";
+}
+
+/* Extension managed by this backend */
+std::string CudaBackend::extension()
+{
+    return ".cu";
+}
+
+std::string CudaBackend::compilerSignature()
+{
+    /* Extra architectures requested through the environment are part of the output */
+    const char *archs = getenv("HDF5_UDF_CUDA_ARCHS");
+    return std::string("nvcc --fatbin -O3 archs=") + (archs ? archs : "");
+}
+
+/*
+ * Compile the UDF to a fatbin using nvcc. $HDF5_UDF_CUDA_ARCHS may list GPU
+ * architectures (e.g., "sm_70,sm_80") to build native code and PTX for;
+ * nvcc's default architecture is used otherwise. Returns the compressed
+ * fatbin as a string.
+ */
+std::string CudaBackend::compile(std::string udf_file, std::string template_file)
+{
+    std::vector<std::string> gencodes;
+    const char *env = getenv("HDF5_UDF_CUDA_ARCHS");
+    if (env)
+    {
+        std::string arch;
+        std::istringstream iss(env);
+        while (std::getline(iss, arch, ','))
+        {
+            if (arch.empty())
+                continue;
+            if (arch.size() < 4 || arch.compare(0, 3, "sm_") != 0 ||
+                arch.find_first_not_of("0123456789", 3) != std::string::npos)
+            {
+                fprintf(stderr, "Unsupported architecture '%s' given to $HDF5_UDF_CUDA_ARCHS\n", arch.c_str());
+                return "";
+            }
+            auto version = arch.substr(3);
+            gencodes.push_back("-gencode=arch=compute_" + version + ",code=[sm_" + version + ",compute_" + version + "]");
+        }
+    }
+
+    std::string placeholder = "// user_callback_placeholder";
+    auto cu_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
+    if (cu_file.size() == 0)
+    {
+        fprintf(stderr, "Will not be able to compile the UDF code\n");
+        return "";
+    }
+
+    std::string output = udf_file + ".fatbin";
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Child process
+        std::vector<char *> cmd = {
+            (char *) "nvcc",
+            (char *) "--fatbin",
+            (char *) "-O3",
+            (char *) "-o",
+            (char *) output.c_str(),
+        };
+        for (auto &gencode: gencodes)
+            cmd.push_back((char *) gencode.c_str());
+        cmd.push_back((char *) cu_file.c_str());
+        cmd.push_back(NULL);
+        execvp(cmd[0], cmd.data());
+        _exit(1);
+    }
+    else if (pid < 0)
+    {
+        fprintf(stderr, "Failed to execute nvcc\n");
+        unlink(cu_file.c_str());
+        return "";
+    }
+
+    // Parent
+    int exit_status;
+    waitpid(pid, &exit_status, 0);
+    unlink(cu_file.c_str());
+
+    // Read generated fatbin
+    struct stat statbuf;
+    std::string fatbin;
+    if (stat(output.c_str(), &statbuf) == 0)
+    {
+        std::ifstream data(output, std::ifstream::binary);
+        std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(data), {});
+        fatbin.assign(buffer.begin(), buffer.end());
+        unlink(output.c_str());
+    }
+    if (! WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0 || fatbin.size() == 0)
+    {
+        fprintf(stderr, "Failed to compile the UDF with nvcc\n");
+        return "";
+    }
+    return compressBuffer(fatbin.data(), fatbin.size());
+}
+
+bool CudaBackend::enterContext()
+{
+    /* Contexts retained by the parent process are not usable here */
+    if (context && owner != getpid())
+        dropContext(false);
+
+    if (! context)
+    {
+        const char *env = getenv("HDF5_UDF_CUDA_DEVICE");
+        int ordinal = env ? atoi(env) : 0;
+        if (! check(cuInit(0), "cuInit") ||
+            ! check(cuDeviceGet(&device, ordinal), "cuDeviceGet") ||
+            ! check(cuDevicePrimaryCtxRetain(&context, device), "cuDevicePrimaryCtxRetain"))
+        {
+            context = NULL;
+            return false;
+        }
+        owner = getpid();
+
+        /* Uploaded inputs may take a quarter of the device memory unless told otherwise */
+        size_t total_memory = 0;
+        cuDeviceTotalMem(&total_memory, device);
+        env = getenv("HDF5_UDF_CUDA_CACHE");
+        budget = env ? parseSize(env) : total_memory / 4;
+    }
+    return check(cuCtxPushCurrent(context), "cuCtxPushCurrent");
+}
+
+void CudaBackend::dropContext(bool release)
+{
+    if (release)
+    {
+        for (auto &entry: buffers)
+            cuMemFree(entry.second.ptr);
+        for (auto &entry: modules)
+            cuModuleUnload(entry.second.module);
+        cuCtxPopCurrent(NULL);
+        cuDevicePrimaryCtxRelease(device);
+        cuDevicePrimaryCtxReset(device);
+    }
+    buffers.clear();
+    modules.clear();
+    cached_bytes = 0;
+    context = NULL;
+}
+
+/* Maximum number of modules kept loaded between calls */
+#define MAX_CACHED_MODULES 16
+
+CudaBackend::CachedModule *CudaBackend::getModule(const char *blob, size_t blob_size)
+{
+    uint64_t key = blobHash(blob, blob_size);
+    auto it = modules.find(key);
+    if (it != modules.end() &&
+        it->second.blob.size() == blob_size &&
+        memcmp(it->second.blob.data(), blob, blob_size) == 0)
+    {
+        it->second.last_used = ++use_counter;
+        return &it->second;
+    }
+
+    if (it != modules.end())
+    {
+        /* Hash collision: evict the previous entry */
+        cuModuleUnload(it->second.module);
+        modules.erase(it);
+    }
+
+    /* Evict the least recently used module if the cache is full */
+    if (modules.size() >= MAX_CACHED_MODULES)
+    {
+        auto lru = std::min_element(modules.begin(), modules.end(),
+            [](const std::pair<const uint64_t, CachedModule> &a,
+               const std::pair<const uint64_t, CachedModule> &b)
+            { return a.second.last_used < b.second.last_used; });
+        cuModuleUnload(lru->second.module);
+        modules.erase(lru);
+    }
+
+    /* Decompress the fatbin. The driver compiles its PTX if there is no native code for the device. */
+    std::string image = decompressBuffer(blob, blob_size);
+    if (image.size() == 0)
+        return NULL;
+
+    CachedModule entry;
+    if (! check(cuModuleLoadData(&entry.module, image.data()), "cuModuleLoadData"))
+        return NULL;
+    if (! check(cuModuleGetFunction(&entry.kernel, entry.module, "hdf5_udf_kernel"), "cuModuleGetFunction"))
+    {
+        cuModuleUnload(entry.module);
+        return NULL;
+    }
+    entry.blob.assign(blob, blob_size);
+    entry.last_used = ++use_counter;
+    return &(modules[key] = entry);
+}
+
+bool CudaBackend::evict(size_t size)
+{
+    if (size > budget)
+        return false;
+    while (cached_bytes + size > budget)
+    {
+        auto lru = buffers.end();
+        for (auto it = buffers.begin(); it != buffers.end(); ++it)
+            if (it->second.last_used < call_counter &&
+                (lru == buffers.end() || it->second.last_used < lru->second.last_used))
+                lru = it;
+        if (lru == buffers.end())
+            return false;
+        cuMemFree(lru->second.ptr);
+        cached_bytes -= lru->second.size;
+        buffers.erase(lru);
+    }
+    return true;
+}
+
+bool CudaBackend::allocate(CUdeviceptr *ptr, size_t size)
+{
+    CUresult result = cuMemAlloc(ptr, std::max(size, (size_t) 1));
+    if (result == CUDA_ERROR_OUT_OF_MEMORY && cached_bytes > 0)
+    {
+        /* Make room by dropping the inputs that the current call does not use */
+        size_t saved_budget = budget;
+        budget = cached_bytes;
+        evict(cached_bytes);
+        budget = saved_budget;
+        result = cuMemAlloc(ptr, std::max(size, (size_t) 1));
+    }
+    return check(result, "cuMemAlloc");
+}
+
+bool CudaBackend::holdsInput(const DatasetInfo &info)
+{
+    return context && owner == getpid() && info.content_key.size() &&
+        buffers.find(info.content_key) != buffers.end();
+}
+
+bool CudaBackend::launch(
+    const std::vector<DatasetInfo> &input_datasets,
+    const DatasetInfo &output_dataset,
+    const char *udf_blob,
+    size_t udf_blob_size)
+{
+    uint64_t load_start = Stats::now();
+    if (! enterContext())
+        return false;
+    call_counter++;
+
+    std::vector<CUdeviceptr> temporaries;
+    auto leave = [&](bool ret)
+    {
+        for (auto ptr: temporaries)
+            cuMemFree(ptr);
+        cuCtxPopCurrent(NULL);
+        return ret;
+    };
+
+    CachedModule *module = getModule(udf_blob, udf_blob_size);
+    if (! module)
+    {
+        fprintf(stderr, "Will not be able to load the UDF function\n");
+        return leave(false);
+    }
+
+    /* Tables defined by our CUDA template file. Their capacities follow from their sizes. */
+    struct Symbol { const char *name; CUdeviceptr ptr; size_t size; } symbols[] = {
+        { "hdf5_udf_data", 0, 0 },
+        { "hdf5_udf_names", 0, 0 },
+        { "hdf5_udf_types", 0, 0 },
+        { "hdf5_udf_rank", 0, 0 },
+        { "hdf5_udf_dims", 0, 0 },
+        { "hdf5_udf_chunk_offset", 0, 0 },
+        { "hdf5_udf_chunk_dims", 0, 0 },
+        { "hdf5_udf_count", 0, 0 },
+    };
+    for (auto &symbol: symbols)
+        if (! check(cuModuleGetGlobal(&symbol.ptr, &symbol.size, module->module, symbol.name), symbol.name))
+            return leave(false);
+    Stats::instance()->addTime(STATS_BACKEND_LOAD, Stats::now() - load_start);
+
+    size_t max_datasets = symbols[0].size / sizeof(CUdeviceptr);
+    size_t max_rank = symbols[5].size / sizeof(uint64_t);
+    size_t name_size = max_datasets ? symbols[1].size / max_datasets : 0;
+    size_t type_size = max_datasets ? symbols[2].size / max_datasets : 0;
+    if (input_datasets.size() + 1 > max_datasets || output_dataset.dimensions.size() > max_rank ||
+        symbols[4].size < max_datasets * max_rank * sizeof(uint64_t))
+    {
+        fprintf(stderr, "The UDF takes more datasets or dimensions than the CUDA template allows\n");
+        return leave(false);
+    }
+
+    /* Populate dataset pointers, names, types, and dimensions */
+    std::vector<DatasetInfo> datasets;
+    datasets.push_back(output_dataset);
+    datasets.insert(datasets.end(), input_datasets.begin(), input_datasets.end());
+    std::vector<CUdeviceptr> data(max_datasets, 0);
+    std::vector<char> names(symbols[1].size, 0), types(symbols[2].size, 0);
+    std::vector<uint32_t> ranks(max_datasets, 0);
+    std::vector<uint64_t> dims(max_datasets * max_rank, 0);
+    for (size_t i=0; i<datasets.size(); ++i)
+    {
+        auto &info = datasets[i];
+        if (info.name.size() >= name_size || info.dimensions.size() > max_rank)
+        {
+            fprintf(stderr, "Dataset %s does not fit the tables of the CUDA template\n", info.name.c_str());
+            return leave(false);
+        }
+        strncpy(&names[i * name_size], info.name.c_str(), name_size - 1);
+        strncpy(&types[i * type_size], info.getDatatype(), type_size - 1);
+        ranks[i] = info.dimensions.size();
+        std::copy(info.dimensions.begin(), info.dimensions.end(), &dims[i * max_rank]);
+
+        /* Outputs are produced on the device and copied back once the kernel is done */
+        if (info.isOutput())
+        {
+            size_t size = info.getChunkGridSize() * info.getStorageSize();
+            if (! allocate(&data[i], size))
+                return leave(false);
+            temporaries.push_back(data[i]);
+            if (! check(cuMemsetD8(data[i], 0, size), "cuMemsetD8"))
+                return leave(false);
+            continue;
+        }
+
+        /* Inputs are uploaded once for as long as their contents stay the same */
+        size_t size = info.getGridSize() * info.getStorageSize();
+        auto it = info.content_key.size() ? buffers.find(info.content_key) : buffers.end();
+        if (it != buffers.end() && it->second.size == size)
+        {
+            it->second.last_used = call_counter;
+            data[i] = it->second.ptr;
+            Stats::instance()->addInput(info.name, "device");
+            continue;
+        }
+        if (it != buffers.end())
+        {
+            cuMemFree(it->second.ptr);
+            cached_bytes -= it->second.size;
+            buffers.erase(it);
+        }
+        if (! info.data && ! info.load())
+            return leave(false);
+
+        StatsTimer timer(STATS_DEVICE_UPLOAD);
+        if (! allocate(&data[i], size))
+            return leave(false);
+        bool cacheable = info.content_key.size() && evict(size);
+        if (! cacheable)
+            temporaries.push_back(data[i]);
+        if (! check(cuMemcpyHtoD(data[i], info.data, size), "cuMemcpyHtoD"))
+        {
+            if (cacheable)
+                cuMemFree(data[i]);
+            return leave(false);
+        }
+        if (cacheable)
+        {
+            buffers[info.content_key] = DeviceBuffer { data[i], size, call_counter };
+            cached_bytes += size;
+        }
+    }
+
+    uint32_t count = datasets.size();
+    std::vector<uint64_t> chunk_offset(max_rank, 0), chunk_dims(max_rank, 0);
+    std::copy(output_dataset.chunk_offset.begin(), output_dataset.chunk_offset.end(), chunk_offset.begin());
+    std::copy(output_dataset.chunk_dimensions.begin(), output_dataset.chunk_dimensions.end(), chunk_dims.begin());
+    const void *tables[] = {
+        data.data(), names.data(), types.data(), ranks.data(), dims.data(),
+        chunk_offset.data(), chunk_dims.data(), &count };
+    size_t sizes[] = {
+        max_datasets * sizeof(CUdeviceptr), names.size(), types.size(), max_datasets * sizeof(uint32_t),
+        dims.size() * sizeof(uint64_t), max_rank * sizeof(uint64_t), max_rank * sizeof(uint64_t), sizeof(count) };
+    for (size_t i=0; i<sizeof(tables)/sizeof(tables[0]); ++i)
+        if (! check(cuMemcpyHtoD(symbols[i].ptr, tables[i], std::min(sizes[i], symbols[i].size)), "cuMemcpyHtoD"))
+            return leave(false);
+
+    /* Run the kernel over the elements of the output chunk */
+    size_t n = output_dataset.getChunkGridSize();
+    int min_grid_size = 0, block_size = 0;
+    if (! check(cuOccupancyMaxPotentialBlockSize(&min_grid_size, &block_size, module->kernel, NULL, 0, 0),
+        "cuOccupancyMaxPotentialBlockSize"))
+        return leave(false);
+    size_t grid_size = std::max(std::min((n + block_size - 1) / block_size, (size_t) INT_MAX), (size_t) 1);
+    void *args[] = { &n };
+    bool ret;
+    {
+        StatsTimer timer(STATS_UDF);
+        ret = check(cuLaunchKernel(module->kernel, grid_size, 1, 1, block_size, 1, 1, 0, NULL, args, NULL),
+            "cuLaunchKernel") && check(cuCtxSynchronize(), "Execution of the CUDA kernel");
+    }
+    if (! ret)
+    {
+        /* Faults leave the context unusable */
+        for (auto ptr: temporaries)
+            cuMemFree(ptr);
+        dropContext(true);
+        return false;
+    }
+
+    /* Update the output grids with the data produced on the device */
+    {
+        StatsTimer timer(STATS_OUTPUT_COPY);
+        for (size_t i=0; i<datasets.size() && ret; ++i)
+            if (datasets[i].isOutput())
+                ret = check(cuMemcpyDtoH(datasets[i].data, data[i],
+                    datasets[i].getChunkGridSize() * datasets[i].getStorageSize()), "cuMemcpyDtoH");
+    }
+    return leave(ret);
+}
+
+/* Execute the user-defined-function embedded in the given buffer */
+bool CudaBackend::run(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *udf_blob,
+    size_t udf_blob_size)
+{
+    return launch(input_datasets, output_dataset, udf_blob, udf_blob_size);
+}
+
+bool CudaBackend::execute(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *udf_blob,
+    size_t udf_blob_size)
+{
+    return launch(input_datasets, output_dataset, udf_blob, udf_blob_size);
+}
+
+bool CudaBackend::runsInProcess()
+{
+    return true;
+}
+
+/* Scan the UDF file for references to HDF5 dataset names */
+std::vector<std::string> CudaBackend::udfDatasetNames(std::string udf_file)
+{
+    return scanCppDatasetNames(udf_file);
+}
@@ -0,0 +1,112 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: cuda_backend.h
+ *
+ * Interfaces for CUDA kernel generation and execution on the GPU.
+ */
+#ifndef __cuda_backend_h
+#define __cuda_backend_h
+
+#include <cuda.h>
+#include <sys/types.h>
+#include <map>
+#include "backend.h"
+
+class CudaBackend : public Backend {
+public:
+    // Backend name
+    std::string name();
+
+    // Extension managed by this backend
+    std::string extension();
+
+    // Compile an input file into executable form
+    std::string compile(std::string udf_file, std::string template_file);
+
+    // Compiler and options used by compile()
+    std::string compilerSignature();
+
+    // Execute a user-defined-function
+    bool run(
+        const std::string filterpath,
+        const std::vector<DatasetInfo> input_datasets,
+        const DatasetInfo output_dataset,
+        const char *output_cast_datatype,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Execute a user-defined-function in the calling process
+    bool execute(
+        const std::string filterpath,
+        const std::vector<DatasetInfo> input_datasets,
+        const DatasetInfo output_dataset,
+        const char *output_cast_datatype,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // UDFs run on the device context of the calling process
+    bool runsInProcess();
+
+    // Whether an input dataset is still held on the device
+    bool holdsInput(const DatasetInfo &info);
+
+    // Scan the UDF file for references to HDF5 dataset names.
+    // We use this to store the UDF dependencies in the JSON payload.
+    std::vector<std::string> udfDatasetNames(std::string udf_file);
+
+private:
+    // Retain the primary context of the device given by $HDF5_UDF_CUDA_DEVICE
+    // (0 by default) on first use, and make it current
+    bool enterContext();
+
+    // Forget the modules and buffers of a context that can no longer be used
+    // (after a kernel fault, or in a forked process), so that the next call
+    // starts afresh. With 'release', the context is reset as well.
+    void dropContext(bool release);
+
+    // Upload the datasets of a call and launch the kernel over the output chunk
+    bool launch(
+        const std::vector<DatasetInfo> &input_datasets,
+        const DatasetInfo &output_dataset,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Modules loaded on the context, indexed by the hash of their compressed form
+    struct CachedModule {
+        std::string blob;            /* Compressed fatbin */
+        CUmodule module;
+        CUfunction kernel;
+        uint64_t last_used;
+    };
+    std::map<uint64_t, CachedModule> modules;
+
+    // Get the cache entry of a module, loading it on first use
+    CachedModule *getModule(const char *blob, size_t blob_size);
+
+    // Input datasets uploaded by previous calls, indexed by their content key.
+    // Entries used by the current call are never evicted.
+    struct DeviceBuffer {
+        CUdeviceptr ptr;
+        size_t size;
+        uint64_t last_used;
+    };
+    std::map<std::string, DeviceBuffer> buffers;
+    size_t cached_bytes = 0;
+    size_t budget = 0;
+
+    // Allocate device memory, evicting unused cached inputs if the device is full
+    bool allocate(CUdeviceptr *ptr, size_t size);
+
+    // Drop cached inputs not used by the current call, least recently used
+    // first, until 'size' more bytes fit the budget. Returns whether they do.
+    bool evict(size_t size);
+
+    CUdevice device = 0;
+    CUcontext context = NULL;
+    pid_t owner = 0;                 /* Process that retained the context */
+    uint64_t use_counter = 0;
+    uint64_t call_counter = 0;
+};
+
+#endif /* __cuda_backend_h */
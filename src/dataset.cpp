@@ -6,7 +6,29 @@
  * High-level interfaces for information retrieval from HDF5 datasets.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
 #include "dataset.h"
+#include "size_parser.h"
+#include "stats.h"
+
+/* Buffers handed out by getSlice() */
+static std::vector<void *> dataset_slices;
+
+/* Default number of bytes a block of rows may take in streaming mode */
+#define DEFAULT_BLOCK_SIZE (64 * 1024 * 1024)
+
+/* Bytes that load() may still read, see setLoadBudget() */
+static size_t load_budget = SIZE_MAX;
+
+/* Rows of the output chunk being produced, and slices handed out before that block */
+static hsize_t block_first = 0, block_last = 0;
+static size_t block_slices = 0;
 
 static std::vector<DatasetTypeInfo> dataset_type_info = {
     {"int16",  "int16_t*",  H5T_STD_I16LE,  sizeof(int16_t)},
@@ -23,7 +45,14 @@ DatasetInfo::DatasetInfo() :
     name(""),
     datatype(""),
     hdf5_datatype(-1),
-    data(NULL)
+    data(NULL),
+    shared_data(false),
+    shared_fd(-1),
+    shared_offset(0),
+    deferred_file_id(-1),
+    deferred_data(NULL),
+    deferred_status(NULL),
+    prefetch_fd(-1)
 {
 }
 
@@ -32,15 +61,27 @@ DatasetInfo::DatasetInfo(std::string in_name, std::vector<hsize_t> in_dims, std:
     datatype(in_datatype),
     hdf5_datatype(-1),
     dimensions(in_dims),
-    data(NULL)
+    data(NULL),
+    shared_data(false),
+    shared_fd(-1),
+    shared_offset(0),
+    deferred_file_id(-1),
+    deferred_data(NULL),
+    deferred_status(NULL),
+    prefetch_fd(-1)
+{
+    dimensions_str = dimensionsToString(dimensions);
+}
+
+std::string DatasetInfo::dimensionsToString(const std::vector<hsize_t> &dims)
 {
     std::stringstream ss;
-    for (size_t i=0; i<dimensions.size(); ++i) {
-        ss << dimensions[i];
-        if (i < dimensions.size()-1)
+    for (size_t i=0; i<dims.size(); ++i) {
+        ss << dims[i];
+        if (i < dims.size()-1)
             ss << "x";
     }
-    dimensions_str = ss.str();
+    return ss.str();
 }
 
 size_t DatasetInfo::getGridSize() const
@@ -48,7 +89,23 @@ size_t DatasetInfo::getGridSize() const
     return std::accumulate(
         std::begin(dimensions),
         std::end(dimensions),
-        1, std::multiplies<hsize_t>());
+        (hsize_t) 1, std::multiplies<hsize_t>());
+}
+
+/* Number of elements held in 'data'. Datasets that are not split in chunks hold the whole grid. */
+size_t DatasetInfo::getChunkGridSize() const
+{
+    if (chunk_dimensions.size() == 0)
+        return getGridSize();
+    return std::accumulate(
+        std::begin(chunk_dimensions),
+        std::end(chunk_dimensions),
+        (hsize_t) 1, std::multiplies<hsize_t>());
+}
+
+bool DatasetInfo::isOutput() const
+{
+    return chunk_dimensions.size() > 0;
 }
 
 const char *DatasetInfo::getDatatype() const
@@ -94,4 +151,242 @@ void DatasetInfo::printInfo(std::string dataset_type) const
     for (size_t i=1; i<dimensions.size(); ++i)
         printf("x%lld", dimensions[i]);
     printf(", datatype=%s\n", datatype.c_str());
-}
\ No newline at end of file
+}
+
+bool DatasetInfo::prefetched(bool wait)
+{
+    if (data || ! deferred_status)
+        return data != NULL;
+    if (wait && prefetch_fd >= 0 && __atomic_load_n(deferred_status, __ATOMIC_ACQUIRE) != 1)
+    {
+        /* Nobody ever writes to the pipe: reads return once the prefetching process is gone */
+        StatsTimer timer(STATS_PREFETCH_WAIT);
+        char c;
+        while (read(prefetch_fd, &c, 1) < 0 && errno == EINTR)
+            continue;
+    }
+    if (__atomic_load_n(deferred_status, __ATOMIC_ACQUIRE) != 1)
+        return false;
+    data = deferred_data;
+    return true;
+}
+
+void *DatasetInfo::load()
+{
+    if (data || deferred_file_id < 0 || ! deferred_data)
+        return data;
+    if (prefetched(true))
+        return data;
+
+    size_t size = getGridSize() * H5Tget_size(hdf5_datatype);
+    if (size > load_budget)
+    {
+        fprintf(stderr, "Input dataset %s takes %zu bytes, over the %zu bytes left of $HDF5_UDF_MEMORY_LIMIT; "
+            "read it with lib.getBlock() instead\n", name.c_str(), size, load_budget);
+        return NULL;
+    }
+
+    uint64_t start = Stats::now();
+    hid_t dset_id = H5Dopen(deferred_file_id, name.c_str(), H5P_DEFAULT);
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Failed to open dataset %s for reading\n", name.c_str());
+        return NULL;
+    }
+    herr_t ret = H5Dread(dset_id, hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, deferred_data);
+    H5Dclose(dset_id);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read HDF5 dataset %s\n", name.c_str());
+        return NULL;
+    }
+
+    data = deferred_data;
+    if (deferred_status)
+        __atomic_store_n(deferred_status, 1, __ATOMIC_RELEASE);
+    if (load_budget != SIZE_MAX)
+        load_budget -= size;
+    Stats::instance()->addInputRead(name, size, Stats::now() - start);
+    return data;
+}
+
+void DatasetInfo::setLoadBudget(size_t bytes)
+{
+    load_budget = bytes;
+}
+
+void *DatasetInfo::getSlice(const std::vector<hsize_t> &offset, const std::vector<hsize_t> &count)
+{
+    if (offset.size() != dimensions.size() || count.size() != dimensions.size())
+    {
+        fprintf(stderr, "Slice of %s must have %zd dimensions\n", name.c_str(), dimensions.size());
+        return NULL;
+    }
+    for (size_t i=0; i<dimensions.size(); ++i)
+        if (offset[i] + count[i] > dimensions[i])
+        {
+            fprintf(stderr, "Slice exceeds the dimensions of %s\n", name.c_str());
+            return NULL;
+        }
+
+    size_t element_size = H5Tget_size(hdf5_datatype);
+    size_t n_elements = std::accumulate(
+        std::begin(count), std::end(count), (hsize_t) 1, std::multiplies<hsize_t>());
+    char *slice = NULL;
+    if (posix_memalign((void **) &slice, DATA_ALIGNMENT, std::max(n_elements * element_size, (size_t) 1)) != 0)
+    {
+        fprintf(stderr, "Not enough memory while allocating room for slice of %s\n", name.c_str());
+        return NULL;
+    }
+
+    /* Datasets being prefetched are waited for rather than read twice */
+    if (data || prefetched(prefetch_fd >= 0))
+    {
+        /* Copy the rows of the hyperslab that are contiguous in memory */
+        size_t rank = dimensions.size();
+        size_t row_size = (rank ? count[rank-1] : 1) * element_size;
+        std::vector<hsize_t> index(rank, 0);
+        for (size_t n=0; n_elements && n<n_elements/(rank ? count[rank-1] : 1); ++n)
+        {
+            size_t src = 0;
+            for (size_t i=0; i<rank; ++i)
+                src = src * dimensions[i] + offset[i] + (i == rank-1 ? 0 : index[i]);
+            memcpy(&slice[n * row_size], (char *) data + src * element_size, row_size);
+
+            /* Move on to the next row */
+            for (ssize_t i=rank-2; i>=0; --i)
+            {
+                if (++index[i] < count[i])
+                    break;
+                index[i] = 0;
+            }
+        }
+    }
+    else
+    {
+        uint64_t start = Stats::now();
+        hid_t dset_id = deferred_file_id >= 0 ?
+            H5Dopen(deferred_file_id, name.c_str(), H5P_DEFAULT) : -1;
+        if (dset_id < 0)
+        {
+            fprintf(stderr, "Failed to open dataset %s for reading\n", name.c_str());
+            free(slice);
+            return NULL;
+        }
+        hid_t file_space_id = H5Dget_space(dset_id);
+        hid_t mem_space_id = H5Screate_simple(count.size(), count.data(), NULL);
+        herr_t ret = H5Sselect_hyperslab(
+            file_space_id, H5S_SELECT_SET, offset.data(), NULL, count.data(), NULL);
+        if (ret >= 0)
+            ret = H5Dread(dset_id, hdf5_datatype, mem_space_id, file_space_id, H5P_DEFAULT, slice);
+        H5Sclose(mem_space_id);
+        H5Sclose(file_space_id);
+        H5Dclose(dset_id);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to read slice of HDF5 dataset %s\n", name.c_str());
+            free(slice);
+            return NULL;
+        }
+        Stats::instance()->addInputRead(name, n_elements * element_size, Stats::now() - start);
+    }
+
+    dataset_slices.push_back(slice);
+    return slice;
+}
+
+void DatasetInfo::freeSlices()
+{
+    for (auto slice: dataset_slices)
+        free(slice);
+    dataset_slices.clear();
+    block_first = block_last = 0;
+    block_slices = 0;
+}
+
+/* Number of bytes taken by each row (i.e., for each index of the first dimension) */
+static size_t rowSize(const DatasetInfo &info, const std::vector<hsize_t> &dims)
+{
+    size_t element_size = info.hdf5_datatype >= 0 ? H5Tget_size(info.hdf5_datatype) : 0;
+    return std::accumulate(
+        dims.begin() + std::min(dims.size(), (size_t) 1), dims.end(),
+        element_size, std::multiplies<size_t>());
+}
+
+hsize_t DatasetInfo::blockRows(const std::vector<DatasetInfo> &datasets, hsize_t *step)
+{
+    *step = 0;
+    if (datasets.size() == 0 || datasets[0].dimensions.size() == 0)
+        return 0;
+
+    /* Rows of chunks at the edges of the dataset that are out of bounds are not produced */
+    const DatasetInfo &output = datasets[0];
+    auto &dims = output.chunk_dimensions.size() ? output.chunk_dimensions : output.dimensions;
+    hsize_t first_row = output.chunk_offset.size() ? output.chunk_offset[0] : 0;
+    if (first_row >= output.dimensions[0])
+        return 0;
+    hsize_t rows = std::min(dims[0], output.dimensions[0] - first_row);
+
+    size_t row_size = rowSize(output, dims);
+    for (size_t i=1; i<datasets.size(); ++i)
+        row_size += rowSize(datasets[i],
+            datasets[i].isOutput() ? datasets[i].chunk_dimensions : datasets[i].dimensions);
+
+    size_t block_size = DEFAULT_BLOCK_SIZE;
+    const char *env = getenv("HDF5_UDF_BLOCK_SIZE");
+    if (env && parseSize(env) > 0)
+        block_size = parseSize(env);
+    block_size = std::min(block_size, load_budget);
+
+    *step = std::max((hsize_t) 1, std::min(rows, (hsize_t) (block_size / std::max(row_size, (size_t) 1))));
+    return rows;
+}
+
+void DatasetInfo::setBlock(hsize_t first, hsize_t last)
+{
+    if (block_last > block_first)
+    {
+        for (size_t i=block_slices; i<dataset_slices.size(); ++i)
+            free(dataset_slices[i]);
+        dataset_slices.resize(std::min(block_slices, dataset_slices.size()));
+    }
+    block_first = first;
+    block_last = last;
+    block_slices = dataset_slices.size();
+}
+
+void *DatasetInfo::getBlock(const DatasetInfo &output)
+{
+    if (block_last <= block_first)
+    {
+        fprintf(stderr, "Blocks of %s can only be retrieved while streaming\n", name.c_str());
+        return NULL;
+    }
+    if (dimensions.size() == 0)
+        return NULL;
+
+    if (this == &output || name.compare(output.name) == 0 || isOutput())
+    {
+        auto &dims = chunk_dimensions.size() ? chunk_dimensions : dimensions;
+        return (char *) data + block_first * rowSize(*this, dims);
+    }
+
+    /* Inputs are expected to share the first dimension of the output dataset */
+    hsize_t first_row = (output.chunk_offset.size() ? output.chunk_offset[0] : 0) + block_first;
+    hsize_t last_row = std::min(first_row + (block_last - block_first), dimensions[0]);
+    if (first_row >= last_row)
+    {
+        fprintf(stderr, "Dataset %s has no rows matching the current block\n", name.c_str());
+        return NULL;
+    }
+
+    /* Inputs already in memory are used in place */
+    if (data)
+        return (char *) data + first_row * rowSize(*this, dimensions);
+
+    std::vector<hsize_t> offset(dimensions.size(), 0);
+    std::vector<hsize_t> count(dimensions);
+    offset[0] = first_row;
+    count[0] = last_row - first_row;
+    return getSlice(offset, count);
+}
@@ -14,6 +14,12 @@
 #include <numeric>
 #include <sstream>
 
+/*
+ * Alignment of the dataset buffers handed to UDFs. Backends that compile to
+ * native code let the compiler take it for granted to vectorize loops.
+ */
+#define DATA_ALIGNMENT 64
+
 struct DatasetTypeInfo {
     DatasetTypeInfo(std::string dtype, std::string ddeclaration, hid_t did, hid_t dsize) :
         datatype(dtype),
@@ -34,18 +40,73 @@ public:
     DatasetInfo(std::string in_name, std::vector<hsize_t> in_dims, std::string in_datatype);
 
     size_t getGridSize() const;
+    size_t getChunkGridSize() const;
+
+    // Whether this is an output of the UDF. Outputs hold the chunk being
+    // computed (see chunk_dimensions) rather than the whole grid. The first
+    // dataset handed to a UDF is the output being read; UDFs that produce
+    // several datasets get the other outputs among the inputs.
+    bool isOutput() const;
     const char *getDatatype() const;
     size_t getHdf5Datatype() const;
     hid_t getStorageSize() const;
     const char *getCastDatatype() const;
     void printInfo(std::string dataset_type) const;
+    static std::string dimensionsToString(const std::vector<hsize_t> &dims);
+
+    // Read the contents of a dataset whose loading has been deferred to its
+    // first use, unless a process prefetching it (see InputPrefetch) gets
+    // it read first. Returns 'data', or NULL on errors.
+    void *load();
+
+    // Bytes that load() may read into memory from now on, across all
+    // datasets of the calling process. Datasets that do not fit are refused.
+    static void setLoadBudget(size_t bytes);
+
+    // Pick up the contents read by a process prefetching the dataset.
+    // With 'wait', wait for that process to exit first. Returns whether
+    // 'data' is available.
+    bool prefetched(bool wait);
+
+    // Get a hyperslab of the dataset, loading only the requested region when
+    // the dataset contents have not been read yet. The returned buffer is
+    // valid until freeSlices() is called.
+    void *getSlice(const std::vector<hsize_t> &offset, const std::vector<hsize_t> &count);
+    static void freeSlices();
+
+    // Streaming mode. The rows of the output chunk are produced in blocks
+    // small enough for a block of the output and of every input to fit in
+    // $HDF5_UDF_BLOCK_SIZE bytes, and in what is left of the load budget. 'datasets' holds the output dataset first,
+    // followed by the inputs. Returns the number of rows to produce and sets
+    // 'step' to the number of rows per block.
+    static hsize_t blockRows(const std::vector<DatasetInfo> &datasets, hsize_t *step);
+
+    // Start producing the rows [first, last) of the output chunk. Slices
+    // handed out for the previous block are released; first == last ends
+    // the streaming.
+    static void setBlock(hsize_t first, hsize_t last);
+
+    // Get the rows of the current block: a pointer into 'data' for output
+    // datasets, or the matching rows of an input dataset, which are
+    // read from the file if the dataset contents have not been loaded.
+    void *getBlock(const DatasetInfo &output);
 
     std::string name;                /* Dataset name */
     std::string datatype;            /* Datatype, given as string */
     std::string dimensions_str;      /* Dimensions, given as string */
     hid_t hdf5_datatype;             /* Datatype, given as HDF5 type */
     std::vector<hsize_t> dimensions; /* Dataset dimensions */
+    std::vector<hsize_t> chunk_offset;     /* Offset of the chunk held in 'data' */
+    std::vector<hsize_t> chunk_dimensions; /* Dimensions of the chunk held in 'data' */
     void *data;                      /* Allocated buffer to hold dataset data */
+    bool shared_data;                /* Whether 'data' is writeable by forked processes */
+    int shared_fd;                   /* memfd or file holding 'data' at 'shared_offset', or -1 */
+    size_t shared_offset;            /* Offset of 'data' within 'shared_fd' */
+    hid_t deferred_file_id;          /* File to read the dataset from on first use, or -1 */
+    void *deferred_data;             /* Buffer that load() reads the dataset into */
+    int *deferred_status;            /* Set to 1 by load() once 'deferred_data' is filled */
+    int prefetch_fd;                 /* Reaches end-of-file once the process prefetching 'deferred_data' exits */
+    std::string content_key;         /* Identifies the contents across filter calls, empty if they may change */
 };
 
 #endif /* __dataset_h */
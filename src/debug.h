@@ -3,64 +3,13 @@
  *
  * File: debug.h
  *
- * Debugging and benchmarking routines.
+ * Debugging routines.
  */
 #ifndef __debug_h
 #define __debug_h
 
 #include <stdio.h>
 #include <ctype.h>
-#include <sys/time.h>
-
-#ifdef DEBUG
-class Benchmark { 
-    public:
-        Benchmark() { start(); }
-        ~Benchmark() {}
-
-        void start() {
-            tv = 0;
-            gettimeofday(&t1, NULL);
-        }
-
-        void stop() {
-            gettimeofday(&t2, NULL);
-
-            // Adjust tv
-            if (t2.tv_sec == t1.tv_sec)
-                tv += (1e-6 * t2.tv_usec) - (1e-6 * t1.tv_usec);
-            else if (t2.tv_sec > t1.tv_sec) {
-                tv += t2.tv_sec - t1.tv_sec;
-                if (t2.tv_usec >= t1.tv_usec)
-                    tv += (1e-6 * t2.tv_usec - 1e-6 * t1.tv_usec);
-                else {
-                    tv -= 1;
-                    tv += (1 - 1e-6 * t1.tv_usec) + (1e-6 * t2.tv_usec);
-                }
-            }
-        }
-
-        double elapsed() {
-            // Elapsed time (seconds)
-            stop();
-            return tv;
-        }
-
-        void print(std::string msg) {
-            fprintf(stdout, "%s: %.2f seconds\n", msg.c_str(), elapsed());
-        }
-    
-    private:
-        struct timeval t1;
-        struct timeval t2;
-        double tv;
-};
-#else
-class Benchmark {
-    public:
-        void print(std::string msg) {}
-};
-#endif
 
 static inline void asciidump(const char *data, size_t size)
 {
@@ -0,0 +1,47 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: file_stamp.h
+ *
+ * Identity of the HDF5 files that in-memory caches key their entries by.
+ */
+#ifndef __file_stamp_h
+#define __file_stamp_h
+
+#include <hdf5.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string>
+
+/*
+ * Identity of a file and its current modification stamp. Files opened for
+ * writing may hold changes that are not reflected by the modification stamp
+ * yet, so they get an empty stamp: data derived from them must not be reused.
+ * 'filename' gets the name of the file.
+ */
+static inline std::string fileStamp(hid_t file_id, std::string &filename)
+{
+    filename.clear();
+    ssize_t len = H5Fget_name(file_id, NULL, 0);
+    if (len <= 0)
+        return "";
+    filename.resize(len + 1);
+    H5Fget_name(file_id, &filename[0], filename.size());
+    filename.resize(len);
+
+    unsigned intent = 0;
+    struct stat statbuf;
+    if (H5Fget_intent(file_id, &intent) < 0 || (intent & H5F_ACC_RDWR) ||
+        stat(filename.c_str(), &statbuf) != 0)
+        return "";
+
+    char stamp[128];
+    snprintf(stamp, sizeof(stamp), "%lu:%lu:%ld.%09ld:%ld:",
+        (unsigned long) statbuf.st_dev, (unsigned long) statbuf.st_ino,
+        (long) statbuf.st_mtim.tv_sec, (long) statbuf.st_mtim.tv_nsec,
+        (long) statbuf.st_size);
+    return stamp;
+}
+
+#endif /* __file_stamp_h */
@@ -0,0 +1,62 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: hash.h
+ *
+ * Non-cryptographic hash used to identify UDF blobs.
+ */
+#ifndef __hash_h
+#define __hash_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+/* 64-bit FNV-1a hash of a data buffer */
+static inline uint64_t hash64(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i=0; i<size; ++i)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Checksum of large data buffers. Four lanes consume the buffer 64 bits at a
+ * time (with the round function of xxHash64), which is much faster than the
+ * byte-wise hash above; the lanes and the trailing bytes are then hashed with
+ * hash64().
+ */
+static inline uint64_t checksum64(const void *data, size_t size)
+{
+    const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+    const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t lanes[5] = { prime1 + prime2, prime2, 0, (uint64_t) 0 - prime1, size };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+        for (int k=0; k<4; ++k)
+        {
+            uint64_t word;
+            memcpy(&word, p + i + k * 8, sizeof(word));
+            lanes[k] += word * prime2;
+            lanes[k] = ((lanes[k] << 31) | (lanes[k] >> 33)) * prime1;
+        }
+    return hash64(lanes, sizeof(lanes)) ^ hash64(p + i, size - i);
+}
+
+/* Hexadecimal representation of a hash */
+static inline std::string hashToString(uint64_t hash)
+{
+    char out[17];
+    snprintf(out, sizeof(out), "%016llx", (unsigned long long) hash);
+    return std::string(out);
+}
+
+#endif /* __hash_h */
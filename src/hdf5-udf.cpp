@@ -6,6 +6,7 @@
  * HDF5 filter callbacks and main interface with the backends.
  */
 #include <dirent.h>
+#include <limits.h>
 #include <H5PLextern.h>
 #include <hdf5.h>
 #include <stdlib.h>
@@ -17,21 +18,42 @@
 #include <time.h>
 #include <unistd.h>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <numeric>
 
 #include "filter_id.h"
 #include "dataset.h"
 #include "backend.h"
-#include "debug.h"
+#include "anon_mmap.h"
+#include "worker_pool.h"
+#include "input_cache.h"
+#include "result_cache.h"
+#include "sibling_cache.h"
+#include "prefetch.h"
+#include "resource_limits.h"
+#include "stats.h"
+#include "hash.h"
+#include "payload.h"
+#include "mpio.h"
 #include "json.hpp"
+#ifdef ENABLE_SANDBOX
+#include "sandbox.h"
+#endif
 
 using namespace std;
 using json = nlohmann::json;
 
 std::string getFilterPath()
 {
-    std::vector<std::string> paths;
-
+    /* The lookup is repeated only if $HDF5_PLUGIN_PATH changes */
+    static std::string cached_env, cached_path;
     const char *env = getenv("HDF5_PLUGIN_PATH");
+    if (cached_path.size() && cached_env.compare(env ? env : "") == 0)
+        return cached_path;
+
+    std::vector<std::string> paths;
     if (env)
     {
         std::istringstream ss(env);
@@ -47,123 +69,929 @@ std::string getFilterPath()
         struct stat statbuf;
         auto p = path + "/libhdf5-udf.so";
         if (stat(p.c_str(), &statbuf) == 0)
+        {
+            cached_env = env ? env : "";
+            cached_path = p;
             return p;
+        }
     }
     return "";
 }
 
-/* Retrieve the HDF5 file handle associated with a given dataset name */
-hid_t getDatasetHandle(std::string dataset, bool *handle_from_procfs)
+/* HDF5 files opened by the filter itself, along with the identity of the file on disk */
+struct OpenFile {
+    hid_t file_id;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+};
+static std::map<std::string, OpenFile> open_files;
+
+/* Path of the file where each output dataset was last found */
+static std::map<std::string, std::string> dataset_files;
+
+/* Get the name of an HDF5 file */
+static std::string getFileName(hid_t file_id)
+{
+    std::string name;
+    ssize_t len = H5Fget_name(file_id, NULL, 0);
+    if (len > 0)
+    {
+        name.resize(len + 1);
+        H5Fget_name(file_id, &name[0], name.size());
+        name.resize(len);
+    }
+    return name;
+}
+
+/* Check if a file holds the given dataset, silencing errors about missing groups */
+static bool holdsDataset(hid_t file_id, std::string &dataset)
+{
+    htri_t exists = -1;
+    H5E_BEGIN_TRY {
+        exists = H5Lexists(file_id, dataset.c_str(), independentAccess());
+    } H5E_END_TRY;
+    return exists > 0;
+}
+
+/* Open a file in read-only mode, reusing the handle from previous calls if the file is unchanged */
+static hid_t openFile(const std::string &path)
 {
+    struct stat statbuf;
+    if (stat(path.c_str(), &statbuf) != 0 || ! S_ISREG(statbuf.st_mode))
+        return (hid_t) -1;
+
+    auto it = open_files.find(path);
+    if (it != open_files.end())
+    {
+        auto &entry = it->second;
+        if (entry.dev == statbuf.st_dev && entry.ino == statbuf.st_ino &&
+            entry.size == statbuf.st_size &&
+            entry.mtime.tv_sec == statbuf.st_mtim.tv_sec &&
+            entry.mtime.tv_nsec == statbuf.st_mtim.tv_nsec)
+            return entry.file_id;
+        H5Fclose(entry.file_id);
+        open_files.erase(it);
+    }
+
+    hid_t file_id = -1;
+    H5E_BEGIN_TRY {
+        file_id = H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    } H5E_END_TRY;
+    if (file_id >= 0)
+        open_files[path] = OpenFile{
+            file_id, statbuf.st_dev, statbuf.st_ino, statbuf.st_mtim, statbuf.st_size};
+    return file_id;
+}
+
+/*
+ * Retrieve the HDF5 file handle associated with a given dataset name. The
+ * handle is owned by the HDF5 library or by this module; callers must not
+ * close it. 'hint' holds the path of the file written by hdf5-udf, if known.
+ */
+hid_t getDatasetHandle(std::string dataset, std::string hint)
+{
+    /* Files where we are most likely to find the dataset come first */
+    std::vector<std::string> preferred;
+    auto it = dataset_files.find(dataset);
+    if (it != dataset_files.end())
+        preferred.push_back(it->second);
+    if (hint.size())
+        preferred.push_back(hint);
+
     /*
-     * Get a list of open files from /proc. This is a workaround for the
-     * lack of an HDF5 Filter API to access the underlying file descriptor.
+     * The file the application is reading from is usually open in this very
+     * library. Its own handle is preferred, as it sees changes that have not
+     * been flushed to disk yet.
      */
-    auto getProcCandidates = [&]()
+    ssize_t count = H5Fget_obj_count(H5F_OBJ_ALL, H5F_OBJ_FILE);
+    if (count > 0)
     {
-        const char *proc = "/proc/self/fd";
-        std::vector<std::string> out;
-        DIR *d = opendir(proc);
-        if (!d)
-            return out;
+        std::vector<hid_t> ids(count);
+        count = H5Fget_obj_ids(H5F_OBJ_ALL, H5F_OBJ_FILE, ids.size(), ids.data());
+        ids.resize(std::max(count, (ssize_t) 0));
 
+        /* Leave out handles opened by this module */
+        for (auto &entry: open_files)
+            ids.erase(std::remove(ids.begin(), ids.end(), entry.second.file_id), ids.end());
+
+        std::vector<std::string> names;
+        std::vector<std::string> realnames;
+        for (auto id: ids)
+        {
+            char path[PATH_MAX];
+            auto name = getFileName(id);
+            names.push_back(name);
+            realnames.push_back(realpath(name.c_str(), path) ? path : name);
+        }
+        for (auto &candidate: preferred)
+            for (size_t i=0; i<ids.size(); ++i)
+                if ((candidate == names[i] || candidate == realnames[i]) && holdsDataset(ids[i], dataset))
+                    return ids[i];
+        for (size_t i=0; i<ids.size(); ++i)
+            if (holdsDataset(ids[i], dataset))
+            {
+                dataset_files[dataset] = realnames[i];
+                return ids[i];
+            }
+    }
+
+    /*
+     * The application may be using a different instance of the HDF5 library
+     * (for instance, one bundled with a Python module). Open the file on our
+     * own, then, starting with the ones we know about.
+     */
+    for (auto &candidate: preferred)
+    {
+        hid_t file_id = openFile(candidate);
+        if (file_id >= 0 && holdsDataset(file_id, dataset))
+            return file_id;
+    }
+
+    /*
+     * Last resort: get a list of open files from /proc. This is a workaround
+     * for the lack of an HDF5 Filter API to access the underlying file descriptor.
+     */
+    const char *proc = "/proc/self/fd";
+    DIR *d = opendir(proc);
+    if (d)
+    {
         struct dirent *e;
         while ((e = readdir(d)) != NULL)
         {
             struct stat s;
             auto fname = std::string(proc) + "/" + std::string(e->d_name);
-            if (stat(fname.c_str(), &s) == 0 && S_ISREG(s.st_mode))
+            if (stat(fname.c_str(), &s) != 0 || ! S_ISREG(s.st_mode))
+                continue;
+
+            char target[PATH_MAX];
+            memset(target, 0, sizeof(target));
+            if (readlink(fname.c_str(), target, sizeof(target)-1) <= 0)
+                continue;
+
+            bool known = open_files.find(target) != open_files.end();
+            hid_t file_id = openFile(target);
+            if (file_id >= 0 && holdsDataset(file_id, dataset))
             {
-                char target[PATH_MAX];
-                memset(target, 0, sizeof(target));
-                if (readlink(fname.c_str(), target, sizeof(target)-1) > 0)
-                    out.push_back(target);
+                closedir(d);
+                dataset_files[dataset] = target;
+                return file_id;
+            }
+            if (file_id >= 0 && ! known)
+            {
+                /* Do not hold on to files that are of no interest */
+                H5Fclose(file_id);
+                open_files.erase(target);
             }
         }
         closedir(d);
-        return out;
-    };
+    }
+    fprintf(stderr, "Failed to identify underlying HDF5 file\n");
+    return (hid_t) -1;
+}
+
+/* Bytecode read from the hidden datasets of a file, least recently used first out */
+struct CachedBytecode {
+    std::string bytecode;
+    uint64_t last_used;
+};
+static std::map<std::string, CachedBytecode> bytecode_cache;
+#define MAX_CACHED_BYTECODES 16
 
-    for (auto &fname: getProcCandidates())
+/*
+ * Read the bytecode that the payload points to. The path holds the hash
+ * of the bytecode, so entries don't go stale when the file is modified.
+ */
+static const std::string *readBytecode(hid_t file_id, const std::string &path, size_t size)
+{
+    static uint64_t counter = 0;
+    auto key = path + ":" + std::to_string(size);
+    auto it = bytecode_cache.find(key);
+    if (it != bytecode_cache.end())
     {
-        hid_t file_id = H5Fopen(fname.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-        if (file_id >= 0 && H5Lexists(file_id, dataset.c_str(), H5P_DEFAULT ) > 0) {
-            *handle_from_procfs = true;
-            return file_id;
+        it->second.last_used = counter++;
+        return &it->second.bytecode;
+    }
+
+    hid_t dset_id = H5Dopen(file_id, path.c_str(), independentAccess());
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Failed to open bytecode dataset %s\n", path.c_str());
+        return NULL;
+    }
+    hid_t space_id = H5Dget_space(dset_id);
+    hssize_t n_elements = H5Sget_simple_extent_npoints(space_id);
+    H5Sclose(space_id);
+    if (n_elements < 0 || (size_t) n_elements != size)
+    {
+        fprintf(stderr, "Unexpected size of bytecode dataset %s\n", path.c_str());
+        H5Dclose(dset_id);
+        return NULL;
+    }
+
+    std::string bytecode(size, '\0');
+    herr_t status = H5Dread(dset_id, H5T_NATIVE_UINT8, H5S_ALL, H5S_ALL, H5P_DEFAULT, &bytecode[0]);
+    H5Dclose(dset_id);
+    if (status < 0)
+    {
+        fprintf(stderr, "Failed to read bytecode dataset %s\n", path.c_str());
+        return NULL;
+    }
+    auto slash = path.find_last_of('/');
+    if (path.substr(slash + 1) != hashToString(hash64(bytecode.data(), bytecode.size())))
+    {
+        fprintf(stderr, "Bytecode dataset %s is corrupted\n", path.c_str());
+        return NULL;
+    }
+
+    if (bytecode_cache.size() >= MAX_CACHED_BYTECODES)
+    {
+        auto victim = bytecode_cache.begin();
+        for (auto e = bytecode_cache.begin(); e != bytecode_cache.end(); ++e)
+            if (e->second.last_used < victim->second.last_used)
+                victim = e;
+        bytecode_cache.erase(victim);
+    }
+    auto &entry = bytecode_cache[key];
+    entry.bytecode.swap(bytecode);
+    entry.last_used = counter++;
+    return &entry.bytecode;
+}
+
+/* Write out the record of a filter call once it returns */
+struct StatsScope {
+    StatsScope() : success(false) { Stats::instance()->begin(); }
+    ~StatsScope() { Stats::instance()->end(success); }
+    bool success;
+};
+
+/* Metadata stored in the payload of a virtual dataset, shared by all of its chunks */
+struct DatasetPayload {
+    size_t bytecode_size;
+    std::string bytecode_dataset;    /* Hidden dataset that holds the bytecode, or "" if the payload does */
+    size_t bytecode_offset;          /* Start of the bytecode on payloads that hold it */
+    uint64_t bytecode_hash;          /* hash64() of the bytecode, if has_bytecode_hash */
+    bool has_bytecode_hash;
+    std::vector<std::string> names;
+    std::string datatype;
+    std::vector<hsize_t> resolution;
+    std::string output_name;
+    std::string backend_name;
+    std::vector<hsize_t> chunk_resolution;
+    std::string file_hint;
+    int parallel_workers;
+    bool materialize;
+    bool row_local;                  /* Output rows only depend on the same rows of the inputs */
+    bool data_slice;                 /* The UDF may read its inputs with lib.getDataSlice() */
+    int follow_input;                /* Input whose leading extent the dataset follows, or -1 */
+    std::vector<std::pair<std::string, std::string>> siblings; /* Other outputs: name and datatype */
+};
+
+/* Payload of the chunk being computed */
+struct ChunkPayload {
+    std::shared_ptr<const DatasetPayload> dataset;
+    std::vector<hsize_t> chunk_offset;
+    const char *raw;                 /* Payload as stored, which identifies the chunk to the result cache */
+    size_t raw_size;
+};
+
+/*
+ * UDFs that call lib.parallel_for() are run by several processes. Zero
+ * means one per available CPU. $HDF5_UDF_PARALLEL_WORKERS overrides the
+ * value stored in the payload.
+ */
+static int parallelWorkers(bool parallel_for, int stored)
+{
+    if (! parallel_for)
+        return 1;
+    const char *env = getenv("HDF5_UDF_PARALLEL_WORKERS");
+    int num_workers = env ? atoi(env) : stored;
+    return num_workers > 0 ? num_workers : sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/* Payloads written by older versions of hdf5-udf, which are decoded on every call */
+static bool parseJsonPayload(const char *buf, size_t buf_size, ChunkPayload &payload)
+{
+    auto dataset = std::make_shared<DatasetPayload>();
+    try {
+        payload.raw = buf;
+        payload.raw_size = strnlen(buf, buf_size);
+        json jas = json::parse(std::string(buf, payload.raw_size));
+
+        /* Retrieve metadata stored in the JSON payload */
+        dataset->bytecode_size = jas["bytecode_size"].get<size_t>();
+        dataset->names = jas["input_datasets"].get<std::vector<std::string>>();
+        dataset->datatype = jas["output_datatype"].get<std::string>();
+        dataset->resolution = jas["output_resolution"].get<std::vector<hsize_t>>();
+        dataset->output_name = jas["output_dataset"].get<std::string>();
+        dataset->backend_name = jas["backend"].get<std::string>();
+        dataset->materialize = jas.contains("materialize") && jas["materialize"].get<bool>();
+        dataset->row_local = false;
+        dataset->data_slice = true;
+        dataset->follow_input = -1;
+
+        /* The bytecode dataset is named after the hash of the bytecode */
+        dataset->has_bytecode_hash = false;
+        dataset->bytecode_offset = 0;
+        if (jas.contains("bytecode_dataset"))
+        {
+            dataset->bytecode_dataset = jas["bytecode_dataset"].get<std::string>();
+            auto hash = dataset->bytecode_dataset.substr(dataset->bytecode_dataset.find_last_of('/') + 1);
+            char *end = NULL;
+            dataset->bytecode_hash = strtoull(hash.c_str(), &end, 16);
+            dataset->has_bytecode_hash = hash.size() == 16 && *end == '\0';
+        }
+        else if (dataset->bytecode_size <= buf_size)
+            dataset->bytecode_offset = buf_size - dataset->bytecode_size;
+        else
+        {
+            fprintf(stderr, "Failed to parse UDF payload: truncated bytecode\n");
+            return false;
         }
-        H5Fclose(file_id);
+
+        /* Datasets written by older versions of hdf5-udf hold a single chunk */
+        payload.chunk_offset = std::vector<hsize_t>(dataset->resolution.size(), 0);
+        dataset->chunk_resolution = dataset->resolution;
+        if (jas.contains("output_chunk_offset"))
+            payload.chunk_offset = jas["output_chunk_offset"].get<std::vector<hsize_t>>();
+        if (jas.contains("output_chunk_resolution"))
+            dataset->chunk_resolution = jas["output_chunk_resolution"].get<std::vector<hsize_t>>();
+        dataset->file_hint = jas.contains("output_file") ? jas["output_file"].get<std::string>() : "";
+
+        /* Outputs of the same UDF that share the layout of this one are produced along with it */
+        if (jas.contains("sibling_datasets"))
+            for (auto &sibling: jas["sibling_datasets"])
+                dataset->siblings.push_back(std::make_pair(
+                    sibling["name"].get<std::string>(), sibling["datatype"].get<std::string>()));
+
+        dataset->parallel_workers = parallelWorkers(jas.contains("parallel_workers"),
+            jas.contains("parallel_workers") ? jas["parallel_workers"].get<int>() : 1);
+    } catch (json::exception &e) {
+        fprintf(stderr, "Failed to parse UDF payload: %s\n", e.what());
+        return false;
     }
-    fprintf(stderr, "Failed to identify underlying HDF5 file\n");
-    return (hid_t) -1;
+    payload.dataset = dataset;
+    return true;
 }
 
-std::vector<DatasetInfo> readHdf5Datasets(hid_t file_id, std::vector<std::string> &names)
+/* Decoded binary payloads, keyed by the bytes shared by all chunks of their dataset */
+struct CachedPayload {
+    std::string key;
+    std::shared_ptr<const DatasetPayload> dataset;
+    uint64_t last_used;
+};
+static std::map<uint64_t, CachedPayload> payload_cache;
+#define MAX_CACHED_PAYLOADS 64
+
+/*
+ * Payloads laid out as described on payload.h. Only the chunk offset is read
+ * on chunks of datasets seen before; the rest is decoded once per dataset.
+ */
+static bool parseBinaryPayload(const char *buf, size_t buf_size, ChunkPayload &payload)
 {
-    auto readHdf5Dataset = [&](hid_t file_id, std::string dname)
+    static uint64_t counter = 0;
+    PayloadHeader header;
+    if (! readPayloadHeader(buf, buf_size, header))
+    {
+        fprintf(stderr, "Failed to parse UDF payload: malformed header\n");
+        return false;
+    }
+    payload.raw = buf;
+    payload.raw_size = header.header_size;
+    readChunkOffset(buf, header, payload.chunk_offset);
+
+    size_t key_size = payloadDatasetSize(header);
+    uint64_t key = hash64(buf, key_size);
+    auto it = payload_cache.find(key);
+    if (it != payload_cache.end() && it->second.key.size() == key_size &&
+        memcmp(it->second.key.data(), buf, key_size) == 0)
+    {
+        it->second.last_used = counter++;
+        payload.dataset = it->second.dataset;
+        return true;
+    }
+
+    auto dataset = std::make_shared<DatasetPayload>();
+    auto backend_name = payloadName(payload_backends, header.backend_id);
+    auto datatype = payloadName(payload_datatypes, header.datatype_id);
+    if (! backend_name || ! datatype)
     {
-        Benchmark benchmark;
-        DatasetInfo out;
+        fprintf(stderr, "Failed to parse UDF payload: unknown backend or datatype\n");
+        return false;
+    }
+    dataset->backend_name = backend_name;
+    dataset->datatype = datatype;
+    dataset->bytecode_size = header.blob_size;
+    dataset->bytecode_offset = header.blob_offset;
+    dataset->bytecode_hash = header.blob_hash;
+    dataset->has_bytecode_hash = true;
+    if (header.blob_offset == 0)
+        dataset->bytecode_dataset = bytecodeDatasetPath(header.blob_hash);
+    dataset->materialize = header.flags & PAYLOAD_FLAG_MATERIALIZE;
+    dataset->row_local = header.flags & PAYLOAD_FLAG_ROW_LOCAL;
+    dataset->data_slice = header.flags & PAYLOAD_FLAG_DATA_SLICE;
+    dataset->follow_input = (int) header.follow_input - 1;
+    dataset->parallel_workers = parallelWorkers(header.flags & PAYLOAD_FLAG_PARALLEL_FOR, header.parallel_workers);
 
-        /* Open .h5 file in read-only mode */
-        hid_t dset_id = H5Dopen(file_id, dname.data(), H5P_DEFAULT);
-        if (dset_id < 0)
+    PayloadReader reader(buf, header);
+    for (uint32_t i=0; i<header.rank; ++i)
+        dataset->resolution.push_back(reader.u64());
+    for (uint32_t i=0; i<header.rank; ++i)
+        dataset->chunk_resolution.push_back(reader.u64());
+    std::vector<const char *> sibling_datatypes;
+    for (uint32_t i=0; i<header.num_siblings; ++i)
+        sibling_datatypes.push_back(payloadName(payload_datatypes, reader.u32()));
+    dataset->output_name = reader.str();
+    dataset->file_hint = reader.str();
+    for (uint32_t i=0; i<header.num_inputs; ++i)
+        dataset->names.push_back(reader.str());
+    for (uint32_t i=0; i<header.num_siblings && reader.valid(); ++i)
+    {
+        auto name = reader.str();
+        if (! sibling_datatypes[i])
         {
-            fprintf(stderr, "Failed to open dataset for reading\n");
-            return out;
+            fprintf(stderr, "Failed to parse UDF payload: unknown datatype of %s\n", name.c_str());
+            return false;
         }
+        dataset->siblings.push_back(std::make_pair(name, sibling_datatypes[i]));
+    }
+    if (! reader.valid())
+    {
+        fprintf(stderr, "Failed to parse UDF payload: truncated tables\n");
+        return false;
+    }
 
-        /* Retrieve datatype */
-        out.hdf5_datatype = H5Dget_type(dset_id);
-        out.datatype = out.getDatatype();
+    if (it != payload_cache.end())
+        payload_cache.erase(it);
+    else if (payload_cache.size() >= MAX_CACHED_PAYLOADS)
+    {
+        auto victim = payload_cache.begin();
+        for (auto e = payload_cache.begin(); e != payload_cache.end(); ++e)
+            if (e->second.last_used < victim->second.last_used)
+                victim = e;
+        payload_cache.erase(victim);
+    }
+    auto &entry = payload_cache[key];
+    entry.key.assign(buf, key_size);
+    entry.dataset = dataset;
+    entry.last_used = counter++;
+    payload.dataset = dataset;
+    return true;
+}
 
-        /* Retrieve number of dimensions and compute total grid size, in bytes */
-        hid_t space_id = H5Dget_space(dset_id);
-        out.dimensions.resize(H5Sget_simple_extent_ndims(space_id));
-        H5Sget_simple_extent_dims(space_id, out.dimensions.data(), NULL);
-        hsize_t n_elements = std::accumulate(
-            std::begin(out.dimensions), std::end(out.dimensions), 1, std::multiplies<hsize_t>());
+static bool parsePayload(const char *buf, size_t buf_size, ChunkPayload &payload)
+{
+    uint64_t parse_start = Stats::now();
+    bool success = isBinaryPayload(buf, buf_size) ?
+        parseBinaryPayload(buf, buf_size, payload) :
+        parseJsonPayload(buf, buf_size, payload);
+    if (success)
+        Stats::instance()->addTime(STATS_PARSE, Stats::now() - parse_start);
+    return success;
+}
+
+static Backend *payloadBackend(const ChunkPayload &payload)
+{
+    auto backend = getBackendByName(payload.dataset->backend_name);
+    if (! backend)
+        fprintf(stderr, "No backend has been found to execute %s code\n",
+            payload.dataset->backend_name.c_str());
+    return backend;
+}
 
-        /* Allocate enough memory so we can read this dataset */
-        void *rdata = (void *) malloc(n_elements * H5Tget_size(out.hdf5_datatype));
-        if (! rdata)
+/*
+ * The bytecode is kept on a hidden dataset shared by all chunks. Payloads
+ * written by older versions of hdf5-udf hold the bytecode after the JSON.
+ */
+static const char *payloadBytecode(hid_t file_id, const ChunkPayload &payload, const char *buf, size_t buf_size)
+{
+    auto &dataset = *payload.dataset;
+    if (dataset.bytecode_dataset.empty())
+        return buf + dataset.bytecode_offset;
+
+    uint64_t bytecode_start = Stats::now();
+    auto stored = readBytecode(file_id, dataset.bytecode_dataset, dataset.bytecode_size);
+    if (! stored)
+        return NULL;
+    Stats::instance()->addTime(STATS_PARSE, Stats::now() - bytecode_start);
+    return stored->data();
+}
+
+/*
+ * State of a filter call. Virtual datasets may take input from other virtual
+ * datasets. Reading those through HDF5 would run this filter again from within
+ * the UDF process, so the filter evaluates them itself, in dependency order,
+ * before running the UDF that asked for them. Each is evaluated at most once
+ * per filter call, however many UDFs along the way take it as input.
+ */
+struct Evaluation {
+    hid_t file_id;
+    bool mpio;                                         /* File is accessed through MPI-IO (see mpio.h) */
+    std::string filterpath;
+    std::map<std::string, DatasetInfo> virtual_inputs; /* Virtual datasets evaluated so far */
+    std::vector<std::string> pending;                  /* Virtual datasets being evaluated */
+
+    Evaluation() : file_id(-1), mpio(false) {}
+    ~Evaluation()
+    {
+        for (auto &entry: virtual_inputs)
+            InputCache::instance()->release(entry.second);
+    }
+};
+
+static bool computeChunk(Evaluation &eval, const ChunkPayload &payload, Backend *backend,
+    const char *bytecode, DatasetInfo &output_dataset, size_t output_size);
+
+/* Check if a dataset is itself computed by a UDF */
+static bool isVirtualDataset(hid_t file_id, const std::string &name)
+{
+    bool is_virtual = false;
+    H5E_BEGIN_TRY {
+        hid_t dset_id = H5Dopen(file_id, name.c_str(), independentAccess());
+        hid_t dcpl_id = dset_id >= 0 ? H5Dget_create_plist(dset_id) : -1;
+        if (dcpl_id >= 0)
         {
-            fprintf(stderr, "Not enough memory while allocating room for dataset\n");
-            return out;
+            unsigned int flags = 0;
+            size_t cd_nelmts = 0;
+            is_virtual = H5Pget_filter_by_id2(
+                dcpl_id, HDF5_UDF_FILTER_ID, &flags, &cd_nelmts, NULL, 0, NULL, NULL) >= 0;
+            H5Pclose(dcpl_id);
         }
+        if (dset_id >= 0)
+            H5Dclose(dset_id);
+    } H5E_END_TRY;
+    return is_virtual;
+}
+
+/*
+ * Evaluate the chunk of a virtual dataset at the given offset, straight from
+ * the payload stored on the file, and copy it into the dataset grid.
+ */
+static bool evaluateChunk(Evaluation &eval, hid_t dset_id, const std::vector<hsize_t> &offset,
+    const std::vector<hsize_t> &dims, const std::vector<hsize_t> &chunk_dims,
+    size_t element_size, char *grid)
+{
+    /* Chunks that were never written hold the fill value */
+    hsize_t storage_size = 0;
+    if (H5Dget_chunk_storage_size(dset_id, offset.data(), &storage_size) < 0 || storage_size == 0)
+        return true;
+
+    std::vector<char> raw(storage_size + 1, '\0');
+    uint32_t filter_mask = 0;
+    if (H5Dread_chunk(dset_id, H5P_DEFAULT, offset.data(), &filter_mask, raw.data()) < 0 || filter_mask)
+    {
+        fprintf(stderr, "Failed to read UDF payload\n");
+        return false;
+    }
+
+    ChunkPayload payload;
+    if (! parsePayload(raw.data(), storage_size, payload))
+        return false;
+    auto backend = payloadBackend(payload);
+    if (! backend)
+        return false;
+    auto bytecode = payloadBytecode(eval.file_id, payload, raw.data(), storage_size);
+    if (! bytecode)
+        return false;
+
+    DatasetInfo output_dataset(payload.dataset->output_name, payload.dataset->resolution, payload.dataset->datatype);
+    output_dataset.hdf5_datatype = output_dataset.getHdf5Datatype();
+    output_dataset.chunk_offset = payload.chunk_offset;
+    output_dataset.chunk_dimensions = payload.dataset->chunk_resolution;
+
+    /* The leading extent of datasets that follow an input is set by hdf5-udf --refresh */
+    auto expected_dims = payload.dataset->resolution;
+    if (payload.dataset->follow_input >= 0 && expected_dims.size() && expected_dims.size() == dims.size())
+        expected_dims[0] = dims[0];
+    if (expected_dims != dims || payload.dataset->chunk_resolution != chunk_dims ||
+        (size_t) output_dataset.getStorageSize() != element_size)
+    {
+        fprintf(stderr, "UDF payload does not match the layout of dataset %s\n", payload.dataset->output_name.c_str());
+        return false;
+    }
+
+    /* The UDF process writes to the chunk grid directly */
+    size_t output_size = element_size * output_dataset.getChunkGridSize();
+    AnonymousMemoryMap output_mm(output_size);
+    if (! output_mm.createShareable())
+        return false;
+    output_dataset.data = output_mm.mm;
+    output_dataset.shared_data = true;
+    output_dataset.shared_fd = output_mm.fd;
+    if (! computeChunk(eval, payload, backend, bytecode, output_dataset, output_size))
+        return false;
 
-        /* Read the dataset */
-        if (H5Dread(dset_id, out.hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, rdata) < 0)
+    /* Copy the rows of the chunk that lie within the grid, one at a time */
+    size_t rank = dims.size();
+    size_t row = std::min(chunk_dims[rank-1], dims[rank-1] - offset[rank-1]) * element_size;
+    std::vector<hsize_t> pos(rank, 0);
+    while (true)
+    {
+        hsize_t src = 0, dst = 0;
+        for (size_t d = 0; d < rank; ++d)
         {
-            fprintf(stderr, "Failed to read HDF5 dataset\n");
-            free(rdata);
-            rdata = NULL;
+            src = src * chunk_dims[d] + pos[d];
+            dst = dst * dims[d] + offset[d] + pos[d];
         }
-        else
+        memcpy(grid + dst * element_size, (char *) output_dataset.data + src * element_size, row);
+
+        int d = rank - 2;
+        for (; d >= 0; --d)
         {
-            benchmark.print("Time to read dataset from disk");
+            if (++pos[d] < chunk_dims[d] && offset[d] + pos[d] < dims[d])
+                break;
+            pos[d] = 0;
         }
-        H5Sclose(space_id);
-        H5Dclose(dset_id);
+        if (d < 0)
+            break;
+    }
+    return true;
+}
 
-        out.name = dname;
-        out.data = rdata;
-        return out;
-    };
+/*
+ * Evaluate a virtual dataset taken as input by a UDF, chunk by chunk. The
+ * result is handed over to the input cache, so it is reused by the next
+ * filter calls for as long as the cache budget allows.
+ */
+static bool evaluateVirtualDataset(Evaluation &eval, const std::string &name, DatasetInfo &out)
+{
+    auto cache = InputCache::instance();
+    if (cache->lookup(eval.file_id, name, out))
+    {
+        eval.virtual_inputs[name] = out;
+        return true;
+    }
+    if (std::find(eval.pending.begin(), eval.pending.end(), name) != eval.pending.end())
+    {
+        fprintf(stderr, "Virtual dataset %s depends on itself\n", name.c_str());
+        return false;
+    }
 
-    std::vector<DatasetInfo> out;
-    for (auto name: names)
+    hid_t dset_id = H5Dopen(eval.file_id, name.c_str(), independentAccess());
+    if (dset_id < 0)
     {
-        auto info = readHdf5Dataset(file_id, name);
-        if (info.data == NULL) {
+        fprintf(stderr, "Failed to open dataset for reading\n");
+        return false;
+    }
+    hid_t space_id = H5Dget_space(dset_id);
+    int rank = H5Sget_simple_extent_ndims(space_id);
+    std::vector<hsize_t> dims(std::max(rank, 0)), chunk_dims(std::max(rank, 0));
+    H5Sget_simple_extent_dims(space_id, dims.data(), NULL);
+    H5Sclose(space_id);
+    hid_t dcpl_id = H5Dget_create_plist(dset_id);
+    bool chunked = rank > 0 && H5Pget_chunk(dcpl_id, rank, chunk_dims.data()) == rank;
+    H5Pclose(dcpl_id);
+
+    hid_t hdf5_datatype = H5Dget_type(dset_id);
+    size_t element_size = H5Tget_size(hdf5_datatype);
+    hsize_t n_elements = std::accumulate(
+        std::begin(dims), std::end(dims), (hsize_t) 1, std::multiplies<hsize_t>());
+    size_t size = n_elements * element_size;
+    void *data = NULL;
+    bool success = chunked;
+    if (! chunked)
+        fprintf(stderr, "Unexpected storage layout of virtual dataset %s\n", name.c_str());
+    else if (posix_memalign(&data, DATA_ALIGNMENT, std::max(size, (size_t) 1)) != 0)
+    {
+        fprintf(stderr, "Not enough memory while allocating room for dataset\n");
+        data = NULL;
+        success = false;
+    }
+    else
+        memset(data, 0, size);
+
+    /* Chunks are visited in row-major order */
+    eval.pending.push_back(name);
+    std::vector<hsize_t> offset(dims.size(), 0);
+    while (success && n_elements > 0)
+    {
+        success = evaluateChunk(eval, dset_id, offset, dims, chunk_dims, element_size, (char *) data);
+
+        int dim = offset.size() - 1;
+        for (; dim >= 0; --dim)
+        {
+            offset[dim] += chunk_dims[dim];
+            if (offset[dim] < dims[dim])
+                break;
+            offset[dim] = 0;
+        }
+        if (dim < 0)
+            break;
+    }
+    eval.pending.pop_back();
+    H5Dclose(dset_id);
+
+    if (! success)
+    {
+        free(data);
+        H5Tclose(hdf5_datatype);
+        return false;
+    }
+    cache->insert(eval.file_id, name, data, size, hdf5_datatype, dims, out);
+    eval.virtual_inputs[name] = out;
+    return true;
+}
+
+/*
+ * Get the input datasets of a UDF. With 'defer', datasets that cannot be
+ * mapped from the file are only read once the UDF asks for them. Virtual
+ * datasets are evaluated right away.
+ */
+static bool readInputDatasets(Evaluation &eval, const std::vector<std::string> &names, bool defer,
+    std::vector<DatasetInfo> &out)
+{
+    auto cache = InputCache::instance();
+    for (auto &name: names)
+    {
+        DatasetInfo info;
+        bool success = true;
+        auto it = eval.virtual_inputs.find(name);
+        if (it != eval.virtual_inputs.end())
+            info = it->second;
+        else if (isVirtualDataset(eval.file_id, name))
+            success = evaluateVirtualDataset(eval, name, info);
+        else
+            success = cache->acquire(eval.file_id, name, defer, info);
+        if (! success)
+        {
             fprintf(stderr, "Failed to read input dataset %s from HDF5 file\n", name.c_str());
             for (auto &entry: out)
-                free(entry.data);
+                if (eval.virtual_inputs.find(entry.name) == eval.virtual_inputs.end())
+                    cache->release(entry);
             out.clear();
-            break;
+            return false;
         }
         out.push_back(info);
     }
-    return out;
+    return true;
+}
+
+/* Hand back the inputs of a UDF. Virtual datasets are kept until the filter call returns. */
+static void releaseInputDatasets(Evaluation &eval, std::vector<DatasetInfo> &datasets)
+{
+    auto cache = InputCache::instance();
+    for (auto &entry: datasets)
+        if (eval.virtual_inputs.find(entry.name) == eval.virtual_inputs.end())
+            cache->release(entry);
+    datasets.clear();
+}
+
+/*
+ * Run the UDF of a chunk into the output grid allocated by the caller. Input
+ * datasets are read by background processes while the UDF starts up; those
+ * not read yet when the UDF asks for them are waited for. Pre-forked workers
+ * have no access to the HDF5 file, so they get all inputs read beforehand, as
+ * do UDFs of files accessed through MPI-IO, which forked processes cannot use.
+ */
+static bool computeChunk(Evaluation &eval, const ChunkPayload &payload, Backend *backend,
+    const char *bytecode, DatasetInfo &output_dataset, size_t output_size)
+{
+    auto &dataset = *payload.dataset;
+    uint64_t bytecode_hash = dataset.has_bytecode_hash ?
+        dataset.bytecode_hash : hash64(bytecode, dataset.bytecode_size);
+
+    /* The chunk may have been produced already, along with a sibling output */
+    auto sibling_cache = SiblingCache::instance();
+    std::string udf_key;
+    if (dataset.siblings.size())
+    {
+        udf_key = hashToString(bytecode_hash);
+        for (auto &name: dataset.names)
+            udf_key += '\0' + name;
+        udf_key += '\0' + DatasetInfo::dimensionsToString(dataset.chunk_resolution);
+        if (sibling_cache->take(eval.file_id, udf_key, dataset.output_name, payload.chunk_offset,
+            output_dataset.data, output_size))
+            return true;
+    }
+
+    auto pool = WorkerPool::instance();
+    std::vector<DatasetInfo> input_datasets;
+    if (! readInputDatasets(eval, dataset.names, ! eval.mpio, input_datasets))
+        return false;
+
+    /*
+     * Datasets that follow the extent of an input grow along with it. Their
+     * payloads keep the extent they were created with, so the chunks added by
+     * hdf5-udf --refresh share them and their results stay on the cache.
+     */
+    if (dataset.follow_input >= 0 &&
+        input_datasets[dataset.follow_input].dimensions.size() == output_dataset.dimensions.size())
+    {
+        output_dataset.dimensions[0] = input_datasets[dataset.follow_input].dimensions[0];
+        output_dataset.dimensions_str = DatasetInfo::dimensionsToString(output_dataset.dimensions);
+    }
+
+    /*
+     * With $HDF5_UDF_MEMORY_LIMIT set, chunks that do not fit in memory along
+     * with the inputs yet to be read from the file are produced in streaming
+     * mode: inputs are left for the UDF process to read block by block (see
+     * lib.forEachBlock()), and reading whole inputs is refused once that would
+     * go over the limit. Chunks whose outputs alone do not fit are refused.
+     */
+    size_t memory_limit = memoryLimit();
+    size_t output_bytes = output_size, input_bytes = 0;
+    for (auto &sibling: dataset.siblings)
+        output_bytes += output_dataset.getChunkGridSize() *
+            std::max(DatasetInfo(sibling.first, output_dataset.dimensions, sibling.second).getStorageSize(), (hid_t) 0);
+    for (auto &info: input_datasets)
+        if (! info.prefetched(false) && info.deferred_data)
+            input_bytes += info.getGridSize() * H5Tget_size(info.hdf5_datatype);
+    if (memory_limit && output_bytes > memory_limit)
+    {
+        fprintf(stderr, "Chunk of dataset %s takes %zu bytes, over the %zu bytes of $HDF5_UDF_MEMORY_LIMIT; "
+            "declare it with smaller chunks\n", dataset.output_name.c_str(), output_bytes, memory_limit);
+        releaseInputDatasets(eval, input_datasets);
+        return false;
+    }
+    bool streaming = memory_limit && output_bytes + input_bytes > memory_limit;
+    bool use_pool = pool->enabled() && ! streaming && ! backend->runsInProcess();
+    bool row_local = dataset.row_local && output_dataset.dimensions.size() > 0;
+
+    /*
+     * Datasets created with --materialize are served from the result cache
+     * for as long as their inputs are unchanged. Those created with
+     * --row-local only compare the rows of the chunk.
+     */
+    std::unique_ptr<ResultCache> result_cache;
+    bool cached = false;
+    if (dataset.materialize && ! streaming)
+    {
+        StatsTimer timer(STATS_RESULT_CACHE);
+        auto key = std::string(payload.raw, payload.raw_size) + '\0' + hashToString(bytecode_hash);
+        result_cache.reset(new ResultCache(eval.file_id, key));
+        if (row_local)
+            result_cache->setRowRange(payload.chunk_offset[0], dataset.chunk_resolution[0],
+                output_dataset.dimensions[0]);
+        cached = result_cache->lookup(input_datasets, output_dataset.data, output_size);
+    }
+
+    /* Inputs read a slice or a block at a time are left for the UDF to read */
+    std::unique_ptr<InputPrefetch> prefetch;
+    if (! streaming && ! cached && ! dataset.data_slice)
+        prefetch.reset(new InputPrefetch(input_datasets, backend));
+
+    /*
+     * Sibling outputs are handed to the UDF along with its inputs. Their
+     * chunks are written by the UDF process straight into shared memory.
+     */
+    std::vector<DatasetInfo> udf_datasets = input_datasets;
+    std::vector<std::unique_ptr<AnonymousMemoryMap>> sibling_mms;
+    bool ready = true;
+    for (size_t i=0; i<dataset.siblings.size() && ! cached && ready; ++i)
+    {
+        DatasetInfo sibling(dataset.siblings[i].first, output_dataset.dimensions, dataset.siblings[i].second);
+        sibling.hdf5_datatype = sibling.getHdf5Datatype();
+        sibling.chunk_offset = payload.chunk_offset;
+        sibling.chunk_dimensions = dataset.chunk_resolution;
+        if (sibling.getStorageSize() <= 0)
+        {
+            fprintf(stderr, "Unsupported datatype of output dataset %s\n", sibling.name.c_str());
+            ready = false;
+            break;
+        }
+        sibling_mms.emplace_back(new AnonymousMemoryMap(sibling.getChunkGridSize() * sibling.getStorageSize()));
+        ready = sibling_mms.back()->createShareable();
+        sibling.data = sibling_mms.back()->mm;
+        sibling.shared_data = true;
+        sibling.shared_fd = sibling_mms.back()->fd;
+        udf_datasets.push_back(sibling);
+    }
+
+    /* Execute the user-defined function */
+    Backend::setParallelWorkers(dataset.parallel_workers);
+    Backend::setBlobHash(bytecode, dataset.bytecode_size, bytecode_hash);
+    auto dtype = output_dataset.getCastDatatype();
+    bool success = cached;
+    for (size_t i=0; i<input_datasets.size() && ! cached && ready && use_pool; ++i)
+        if (! udf_datasets[i].data && ! udf_datasets[i].load())
+            ready = false;
+    DatasetInfo::setLoadBudget(streaming ? memory_limit - output_bytes : SIZE_MAX);
+    if (! cached && ready && use_pool)
+    {
+        /* Workers are never shared between the UDFs of different datasets */
+        auto worker_key = hashToString(bytecode_hash) + '\0' + getFileName(eval.file_id) + '\0' + dataset.output_name;
+        success = pool->run(
+            backend, eval.filterpath, worker_key, udf_datasets, output_dataset, dtype,
+            bytecode, dataset.bytecode_size);
+    }
+    else if (! cached && ready)
+        success = backend->run(
+            eval.filterpath, udf_datasets, output_dataset, dtype, bytecode, dataset.bytecode_size);
+    DatasetInfo::setLoadBudget(SIZE_MAX);
+    if (success && ! cached && result_cache)
+    {
+        StatsTimer timer(STATS_RESULT_CACHE);
+        result_cache->store(input_datasets, output_dataset.data, output_size);
+    }
+    if (success && ! cached)
+        for (size_t i=input_datasets.size(); i<udf_datasets.size(); ++i)
+            sibling_cache->store(eval.file_id, udf_key, udf_datasets[i].name, payload.chunk_offset,
+                udf_datasets[i].data, udf_datasets[i].getChunkGridSize() * udf_datasets[i].getStorageSize());
+
+    /* Release memory used by auxiliary datasets */
+    releaseInputDatasets(eval, input_datasets);
+    return success;
 }
 
 static size_t
@@ -172,86 +1000,123 @@ const unsigned int *cd_values, size_t nbytes, size_t *buf_size, void **buf)
 {
     if (flags & H5Z_FLAG_REVERSE)
     {
-        std::string json_string((const char *)*buf);
-        json jas = json::parse(json_string);
-
-        /* Retrieve metadata stored in the JSON payload */
-        int bytecode_size = jas["bytecode_size"].get<int>();
-        auto names = jas["input_datasets"].get<std::vector<std::string>>();
-        auto datatype = jas["output_datatype"].get<std::string>();
-        auto resolution = jas["output_resolution"].get<std::vector<hsize_t>>();
-        auto output_name = jas["output_dataset"].get<std::string>();
-        auto backend_name = jas["backend"].get<std::string>();
-
-        auto backend = getBackendByName(backend_name);
+        StatsScope scope;
+        auto stats = Stats::instance();
+        ChunkPayload payload;
+        if (! parsePayload((const char *) *buf, *buf_size, payload))
+            return 0;
+        auto backend = payloadBackend(payload);
         if (! backend)
-        {
-            fprintf(stderr, "No backend has been found to execute %s code\n",
-                backend_name.c_str());
             return 0;
-        }
 
-        auto filterpath = getFilterPath();
-        if (filterpath.size() == 0)
+        Evaluation eval;
+        eval.filterpath = getFilterPath();
+        if (eval.filterpath.size() == 0)
         {
             fprintf(stderr, "Failed to identify path to HDF5-UDF filter\n");
             return 0;
         }
+#ifdef ENABLE_SANDBOX
+        /* Have the processes forked below inherit a ready-to-use sandbox */
+        uint64_t sandbox_start = Stats::now();
+        if (! Sandbox::prepare(eval.filterpath))
+            return 0;
+        stats->addTime(STATS_SANDBOX, Stats::now() - sandbox_start);
+#endif
+
+        /*
+         * Workaround for lack of API to retrieve the HDF5 file handle from the
+         * filter callback. Virtual datasets evaluated along the way live on the
+         * same file, so the lookup is not repeated for them.
+         */
+        uint64_t lookup_start = Stats::now();
+        eval.file_id = getDatasetHandle(payload.dataset->output_name, payload.dataset->file_hint);
+        if (eval.file_id == -1)
+            return 0;
+        eval.mpio = usesMpio(eval.file_id);
+        stats->addTime(STATS_FILE_LOOKUP, Stats::now() - lookup_start);
 
-        /* Workaround for lack of API to retrieve the HDF5 file handle from the filter callback */
-        bool handle_from_procfs = false;
-        hid_t file_id = getDatasetHandle(output_name, &handle_from_procfs);
-        if (file_id == -1)
+        auto bytecode = payloadBytecode(eval.file_id, payload, (const char *) *buf, *buf_size);
+        if (! bytecode)
             return 0;
 
-        /* Allocate input and output grids */
-        auto input_datasets = readHdf5Datasets(file_id, names);
-        DatasetInfo output_dataset(output_name, resolution, datatype);
+        DatasetInfo output_dataset(payload.dataset->output_name, payload.dataset->resolution, payload.dataset->datatype);
         output_dataset.hdf5_datatype = output_dataset.getHdf5Datatype();
-        output_dataset.data = (void *) malloc(
-            output_dataset.getStorageSize() * output_dataset.getGridSize());
-        if (! output_dataset.data)
+        output_dataset.chunk_offset = payload.chunk_offset;
+        output_dataset.chunk_dimensions = payload.dataset->chunk_resolution;
+
+        /*
+         * The sandboxed UDF process writes the output grid to shared memory,
+         * which is moved to the buffer handed over to HDF5 once the UDF
+         * returns, releasing the shared pages as they are copied. Backends
+         * that run the UDF in this process write to the buffer directly.
+         */
+        size_t output_size = output_dataset.getStorageSize() * output_dataset.getChunkGridSize();
+        stats->setOutput(payload.dataset->output_name, backend->name(), output_size);
+        void *output_buf = NULL;
+        if (posix_memalign(&output_buf, DATA_ALIGNMENT, std::max(output_size, (size_t) 1)) != 0)
         {
             fprintf(stderr, "Not enough memory allocating output grid\n");
-            if (handle_from_procfs)
-                H5Fclose(file_id);
             return 0;
         }
+        AnonymousMemoryMap output_mm(output_size);
+        if (! backend->runsInProcess() && output_mm.createShareable())
+        {
+            output_dataset.data = output_mm.mm;
+            output_dataset.shared_data = true;
+            output_dataset.shared_fd = output_mm.fd;
+        }
+        else
+            output_dataset.data = output_buf;
 
-        /* Execute the user-defined function */
-        Benchmark benchmark;
-        auto dtype = output_dataset.getCastDatatype();
-        char *bytecode = (char *)(((char *) *buf) + *buf_size - bytecode_size);
-        if (! backend->run(
-            filterpath, input_datasets, output_dataset, dtype, bytecode, bytecode_size))
+        bool success = computeChunk(eval, payload, backend, bytecode, output_dataset, output_size);
+        if (! success)
         {
             nbytes = 0;
-        } 
-        else 
+            free(output_buf);
+        }
+        else
         {
-            auto n_elements = output_dataset.getGridSize();
+            auto n_elements = output_dataset.getChunkGridSize();
             auto storage_size = output_dataset.getStorageSize();
+            if (output_dataset.shared_data)
+            {
+                StatsTimer timer(STATS_OUTPUT_COPY);
+                output_mm.moveTo(output_buf);
+            }
 
             free(*buf);
-            *buf = (void *) output_dataset.data;
+            *buf = output_buf;
             *buf_size = n_elements * storage_size;
             nbytes = n_elements * storage_size;
-            benchmark.print("Call to user-defined function");
+            scope.success = true;
         }
-
-        /* Release memory used by auxiliary datasets */
-        for (size_t i=0; i<input_datasets.size(); ++i)
-            free(input_datasets[i].data);
-
-        if (handle_from_procfs)
-            H5Fclose(file_id);
     }
     else
     {
-        std::string json_string((const char *) *buf);
-        json jas = json::parse(json_string);
-        int bytecode_size = jas["bytecode_size"].get<int>();
-        nbytes = json_string.length() + bytecode_size + 1;
+        PayloadHeader header;
+        if (isBinaryPayload((const char *) *buf, *buf_size))
+        {
+            nbytes = 0;
+            if (readPayloadHeader((const char *) *buf, *buf_size, header))
+                nbytes = header.blob_offset ? header.blob_offset + header.blob_size : header.header_size;
+        }
+        else
+        {
+            /* Legacy payloads hold the JSON string, its terminator, and the bytecode */
+            nbytes = 0;
+            size_t json_size = strnlen((const char *) *buf, *buf_size);
+            try {
+                json jas = json::parse(std::string((const char *) *buf, json_size));
+                size_t bytecode_size = jas.contains("bytecode_dataset") ? 0 : jas["bytecode_size"].get<size_t>();
+                if (json_size < *buf_size && bytecode_size <= *buf_size - json_size - 1)
+                    nbytes = json_size + bytecode_size + 1;
+                else
+                    fprintf(stderr, "Failed to parse UDF payload: truncated bytecode\n");
+            } catch (json::exception &e) {
+                fprintf(stderr, "Failed to parse UDF payload: %s\n", e.what());
+            }
+        }
         *buf_size = nbytes;
     }
 
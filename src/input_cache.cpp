@@ -0,0 +1,461 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: input_cache.cpp
+ *
+ * Cache of input datasets read by the filter.
+ *
+ * Several virtual datasets often take input from the same datasets, and
+ * applications tend to read the same virtual datasets over and over. Input
+ * datasets are kept around between filter calls for as long as they fit the
+ * budget; entries are keyed by the file identity, its modification stamp, and
+ * the dataset name, so changes made to the file invalidate them.
+ *
+ * Datasets that are stored contiguously and without filters are mapped from
+ * the file rather than read into a new buffer, so the UDF sees the bytes as
+ * they are on the page cache without any copies.
+ *
+ * Other datasets can be read on demand: the entry is then backed by a shared
+ * memfd mapping that the forked UDF process fills the first time the UDF
+ * asks for the dataset. Entries that end up never being read are dropped
+ * without having cost any I/O; the others are kept like any other entry.
+ *
+ * Entries keep the descriptor of the file or memfd they are mapped from, so
+ * that workers of the pool (see WorkerPool) can map the dataset themselves.
+ *
+ * Virtual datasets taken as input are evaluated by the filter itself, which
+ * hands their contents over to the cache so that other virtual datasets
+ * reading from them do not evaluate them again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <numeric>
+#include "input_cache.h"
+#include "worker_pool.h"
+#include "file_stamp.h"
+#include "mpio.h"
+#include "size_parser.h"
+#include "stats.h"
+
+/* Room reserved ahead of deferred entries to hold their status word */
+#define DEFERRED_HEADER_SIZE 64
+
+/* Map 'size' bytes of a new memfd, returning MAP_FAILED on errors */
+static void *mapMemfd(size_t size, int *fd)
+{
+    *fd = memfd_create("hdf5-udf-input", MFD_CLOEXEC);
+    if (*fd < 0)
+        return MAP_FAILED;
+    void *base = MAP_FAILED;
+    if (ftruncate(*fd, size) == 0)
+        base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, *fd, 0);
+    if (base == MAP_FAILED)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+    return base;
+}
+
+#ifdef ENABLE_SANDBOX
+/*
+ * Deferred datasets may be read by the UDF process, under the sandbox. Those
+ * stored with filters that HDF5 may have to load from a plugin, and those of
+ * files opened with a driver other than sec2, are read by the filter instead,
+ * as the library would then make system calls the sandbox does not allow.
+ */
+static bool readableUnderSandbox(hid_t file_id, hid_t dset_id)
+{
+    bool readable = true;
+    hid_t fapl_id = H5Fget_access_plist(file_id);
+    if (fapl_id < 0 || H5Pget_driver(fapl_id) != H5FD_SEC2)
+        readable = false;
+    if (fapl_id >= 0)
+        H5Pclose(fapl_id);
+
+    hid_t dcpl_id = H5Dget_create_plist(dset_id);
+    if (dcpl_id < 0)
+        return false;
+    int nfilters = H5Pget_nfilters(dcpl_id);
+    for (int i=0; i<nfilters && readable; ++i)
+    {
+        unsigned int flags = 0;
+        size_t cd_nelmts = 0;
+        H5Z_filter_t filter = H5Pget_filter2(dcpl_id, i, &flags, &cd_nelmts, NULL, 0, NULL, NULL);
+        readable = filter >= 0 && filter < H5Z_FILTER_RESERVED;
+    }
+    H5Pclose(dcpl_id);
+    return readable;
+}
+#endif
+
+InputCache *InputCache::instance()
+{
+    static InputCache cache;
+    return &cache;
+}
+
+InputCache::InputCache() :
+    budget(0),
+    cached_bytes(0),
+    counter(0)
+{
+    const char *env = getenv("HDF5_UDF_INPUT_CACHE");
+    if (env)
+        budget = parseSize(env);
+}
+
+InputCache::~InputCache()
+{
+    for (auto &it: entries)
+        destroy(it.second);
+}
+
+std::string InputCache::makeKey(hid_t file_id, const std::string &name, std::string &filename)
+{
+    auto stamp = fileStamp(file_id, filename);
+    return stamp.size() ? stamp + name : "";
+}
+
+std::map<std::string, InputCache::Entry>::iterator
+InputCache::add(std::string key, const std::string &name, Entry &entry)
+{
+    entry.key = key;
+    if (key.empty() || entry.status)
+    {
+        /*
+         * Entries that cannot be looked up yet get a key of their own; they
+         * are dropped (or moved under their actual key, once read) when all
+         * users are done with them.
+         */
+        key = "private:" + std::to_string(counter) + ":" + name;
+    }
+    if (! entry.status)
+        cached_bytes += entry.size;
+    return entries.insert(std::make_pair(key, entry)).first;
+}
+
+void InputCache::use(Entry &entry, hid_t file_id, const std::string &name, DatasetInfo &out)
+{
+    entry.refs++;
+    entry.last_used = counter++;
+
+    out = DatasetInfo(name, entry.dimensions, "");
+    out.hdf5_datatype = entry.hdf5_datatype;
+    out.datatype = out.getDatatype();
+    out.content_key = entry.key;
+    out.shared_fd = entry.fd;
+    out.shared_offset = entry.fd_offset;
+    if (entry.status)
+    {
+        out.deferred_file_id = file_id;
+        out.deferred_data = entry.data;
+        out.deferred_status = entry.status;
+    }
+    else
+        out.data = entry.data;
+}
+
+bool InputCache::acquire(hid_t file_id, const std::string &name, bool defer, DatasetInfo &out)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::string filename;
+    auto key = makeKey(file_id, name, filename);
+    auto it = key.size() ? entries.find(key) : entries.end();
+    if (it == entries.end())
+    {
+        Entry entry;
+        uint64_t start = Stats::now();
+        if (! load(file_id, filename, name, defer, entry))
+            return false;
+        uint64_t elapsed = Stats::now() - start;
+        it = add(key, name, entry);
+
+        /* Mapped datasets are only read as the UDF touches them */
+        Stats::instance()->addInput(name, entry.status ? "deferred" : entry.file_mapped ? "mmap" : "read");
+        if (! entry.status)
+            Stats::instance()->addInputRead(name, entry.file_mapped ? 0 : entry.size, elapsed);
+    }
+    else
+        Stats::instance()->addInput(name, it->second.status ? "deferred" : "cache");
+
+    use(it->second, file_id, name, out);
+    return true;
+}
+
+bool InputCache::lookup(hid_t file_id, const std::string &name, DatasetInfo &out)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::string filename;
+    auto key = makeKey(file_id, name, filename);
+    auto it = key.size() ? entries.find(key) : entries.end();
+    if (it == entries.end() || it->second.status)
+        return false;
+    Stats::instance()->addInput(name, "cache");
+    use(it->second, file_id, name, out);
+    return true;
+}
+
+void InputCache::insert(hid_t file_id, const std::string &name, void *data, size_t size,
+    hid_t hdf5_datatype, const std::vector<hsize_t> &dimensions, DatasetInfo &out)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::string filename;
+    auto key = makeKey(file_id, name, filename);
+
+    Entry entry;
+    entry.data = data;
+    entry.size = size;
+    entry.map_base = NULL;
+    entry.map_size = 0;
+    entry.file_mapped = false;
+    entry.fd = -1;
+    entry.fd_offset = 0;
+    entry.hdf5_datatype = hdf5_datatype;
+    entry.dimensions = dimensions;
+    entry.status = NULL;
+    entry.refs = 0;
+    entry.last_used = 0;
+
+    /* Another copy may have been cached under the same key meanwhile */
+    auto it = key.size() ? entries.find(key) : entries.end();
+    if (it != entries.end())
+        key.clear();
+    it = add(key, name, entry);
+    Stats::instance()->addInput(name, "virtual");
+    use(it->second, file_id, name, out);
+}
+
+void InputCache::release(const DatasetInfo &info)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = entries.begin(); it != entries.end(); ++it)
+    {
+        Entry &entry = it->second;
+        void *data = entry.status ? info.deferred_data : info.data;
+        if (entry.data != data || entry.refs == 0)
+            continue;
+        if (--entry.refs > 0)
+            break;
+
+        Entry done = entry;
+        entries.erase(it);
+        if (done.status && *done.status == 1)
+        {
+            /* The dataset has been read by a forked process, so it can be cached now */
+            done.status = NULL;
+            cached_bytes += done.size;
+        }
+        if (done.status || done.key.empty() || entries.find(done.key) != entries.end())
+        {
+            if (! done.status)
+                cached_bytes -= done.size;
+            destroy(done);
+        }
+        else
+            entries.insert(std::make_pair(done.key, done));
+        break;
+    }
+    evict();
+}
+
+void InputCache::evict()
+{
+    while (cached_bytes > budget)
+    {
+        auto victim = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+        {
+            if (it->second.refs > 0)
+                continue;
+            if (victim == entries.end() || it->second.last_used < victim->second.last_used)
+                victim = it;
+        }
+        if (victim == entries.end())
+            break;
+        cached_bytes -= victim->second.size;
+        destroy(victim->second);
+        entries.erase(victim);
+    }
+}
+
+bool InputCache::load(hid_t file_id, const std::string &filename, const std::string &name,
+    bool defer, Entry &entry)
+{
+    entry.data = NULL;
+    entry.size = 0;
+    entry.map_base = NULL;
+    entry.map_size = 0;
+    entry.file_mapped = false;
+    entry.fd = -1;
+    entry.fd_offset = 0;
+    entry.hdf5_datatype = -1;
+    entry.status = NULL;
+    entry.refs = 0;
+    entry.last_used = 0;
+
+    /* Open .h5 file in read-only mode */
+    hid_t dset_id = H5Dopen(file_id, name.c_str(), independentAccess());
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Failed to open dataset for reading\n");
+        return false;
+    }
+
+    /* Retrieve datatype */
+    entry.hdf5_datatype = H5Dget_type(dset_id);
+
+    /* Retrieve number of dimensions and compute total grid size, in bytes */
+    hid_t space_id = H5Dget_space(dset_id);
+    entry.dimensions.resize(H5Sget_simple_extent_ndims(space_id));
+    H5Sget_simple_extent_dims(space_id, entry.dimensions.data(), NULL);
+    H5Sclose(space_id);
+    hsize_t n_elements = std::accumulate(
+        std::begin(entry.dimensions), std::end(entry.dimensions), (hsize_t) 1, std::multiplies<hsize_t>());
+    entry.size = n_elements * H5Tget_size(entry.hdf5_datatype);
+
+    if (filename.size() && map(file_id, dset_id, filename, entry))
+    {
+        H5Dclose(dset_id);
+        return true;
+    }
+
+#ifdef ENABLE_SANDBOX
+    defer = defer && readableUnderSandbox(file_id, dset_id);
+#endif
+    if (defer)
+    {
+        /* Reserve room for the forked process to read the dataset into */
+        size_t map_size = DEFERRED_HEADER_SIZE + entry.size;
+        void *base = mapMemfd(map_size, &entry.fd);
+        if (base == MAP_FAILED)
+            base = mmap(NULL, map_size, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED)
+        {
+            H5Dclose(dset_id);
+            entry.map_base = base;
+            entry.map_size = map_size;
+            entry.fd_offset = DEFERRED_HEADER_SIZE;
+            entry.status = (int *) base;
+            entry.data = (char *) base + DEFERRED_HEADER_SIZE;
+            return true;
+        }
+    }
+
+    /*
+     * Allocate enough memory so we can read this dataset. Workers of the pool
+     * map it from a memfd; other UDF processes are forked and must not see
+     * their changes to the dataset reach the cache, so it is kept private.
+     */
+    entry.data = NULL;
+    void *base = WorkerPool::instance()->enabled() && entry.size ? mapMemfd(entry.size, &entry.fd) : MAP_FAILED;
+    if (base != MAP_FAILED)
+    {
+        entry.map_base = base;
+        entry.map_size = entry.size;
+        entry.data = base;
+    }
+    else if (posix_memalign(&entry.data, DATA_ALIGNMENT, std::max(entry.size, (size_t) 1)) != 0)
+    {
+        entry.data = NULL;
+        fprintf(stderr, "Not enough memory while allocating room for dataset\n");
+        H5Tclose(entry.hdf5_datatype);
+        H5Dclose(dset_id);
+        return false;
+    }
+
+    /* Read the dataset */
+    if (H5Dread(dset_id, entry.hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, entry.data) < 0)
+    {
+        fprintf(stderr, "Failed to read HDF5 dataset\n");
+        H5Dclose(dset_id);
+        destroy(entry);
+        return false;
+    }
+    H5Dclose(dset_id);
+    return true;
+}
+
+bool InputCache::map(hid_t file_id, hid_t dset_id, const std::string &filename, Entry &entry)
+{
+    /* Data written through a read-write handle may not have reached the file yet */
+    unsigned intent = 0;
+    if (H5Fget_intent(file_id, &intent) < 0 || (intent & H5F_ACC_RDWR))
+        return false;
+
+    /* Only contiguous datasets without filters are stored on the file as-is */
+    hid_t dcpl_id = H5Dget_create_plist(dset_id);
+    if (dcpl_id < 0)
+        return false;
+    bool contiguous = H5Pget_layout(dcpl_id) == H5D_CONTIGUOUS && H5Pget_nfilters(dcpl_id) == 0;
+    H5Pclose(dcpl_id);
+    if (! contiguous || entry.size == 0)
+        return false;
+
+    /* Storage may not have been allocated yet, in which case HDF5 returns fill values */
+    H5D_space_status_t status;
+    if (H5Dget_space_status(dset_id, &status) < 0 || status != H5D_SPACE_STATUS_ALLOCATED)
+        return false;
+
+    /* The offset is undefined for datasets kept in external files */
+    haddr_t offset = H5Dget_offset(dset_id);
+    if (offset == HADDR_UNDEF)
+        return false;
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0 || (off_t) (offset + entry.size) > statbuf.st_size)
+    {
+        close(fd);
+        return false;
+    }
+
+    /*
+     * The mapping is private so that changes made by the UDF to its input
+     * never reach the file (nor other users of the cached entry).
+     */
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    off_t map_offset = offset & ~((haddr_t) pagesize - 1);
+    size_t map_size = (offset - map_offset) + entry.size;
+    void *base = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, map_offset);
+    if (base == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    entry.map_base = base;
+    entry.map_size = map_size;
+    entry.file_mapped = true;
+    entry.fd = fd;
+    entry.fd_offset = offset;
+    entry.data = (char *) base + (offset - map_offset);
+    return true;
+}
+
+void InputCache::destroy(Entry &entry)
+{
+    if (entry.map_base)
+        munmap(entry.map_base, entry.map_size);
+    else
+        free(entry.data);
+    if (entry.fd >= 0)
+        close(entry.fd);
+    if (entry.hdf5_datatype >= 0)
+        H5Tclose(entry.hdf5_datatype);
+    entry.data = NULL;
+    entry.map_base = NULL;
+    entry.fd = -1;
+    entry.hdf5_datatype = -1;
+}
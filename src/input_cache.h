@@ -0,0 +1,98 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: input_cache.h
+ *
+ * Cache of input datasets read by the filter.
+ */
+#ifndef __input_cache_h
+#define __input_cache_h
+
+#include <hdf5.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include "dataset.h"
+
+class InputCache {
+public:
+    // Get the process-wide cache. The number of bytes the cache may hold
+    // on to between filter calls is set with $HDF5_UDF_INPUT_CACHE (e.g.,
+    // "512M"). The default budget of zero disables caching.
+    static InputCache *instance();
+
+    // Get the contents of a dataset, reading it from the file unless a
+    // cached copy is still fresh. With 'defer', datasets that cannot be
+    // mapped from the file are not read: 'out' gets a buffer that a forked
+    // process fills on first use through DatasetInfo::load() instead. The
+    // dataset must be handed back with release().
+    bool acquire(hid_t file_id, const std::string &name, bool defer, DatasetInfo &out);
+
+    // Get the contents of a dataset previously handed over with insert(),
+    // if the cached copy is still fresh. The dataset must be handed back
+    // with release().
+    bool lookup(hid_t file_id, const std::string &name, DatasetInfo &out);
+
+    // Hand over the contents of a dataset computed by the caller, such as a
+    // virtual dataset evaluated by the filter. The cache takes ownership of
+    // 'data' (allocated with posix_memalign()) and of 'hdf5_datatype'. 'out'
+    // gets the dataset, which must be handed back with release().
+    void insert(hid_t file_id, const std::string &name, void *data, size_t size,
+        hid_t hdf5_datatype, const std::vector<hsize_t> &dimensions, DatasetInfo &out);
+
+    // Hand back data obtained with acquire(), lookup(), or insert()
+    void release(const DatasetInfo &info);
+
+private:
+    InputCache();
+    ~InputCache();
+
+    struct Entry {
+        void *data;           /* Dataset contents */
+        size_t size;          /* Size of the dataset contents, in bytes */
+        void *map_base;       /* Start of the file mapping, if memory-mapped */
+        size_t map_size;      /* Size of the file mapping */
+        bool file_mapped;     /* Whether 'map_base' maps the file itself */
+        int fd;               /* memfd or file holding 'data' at 'fd_offset', or -1 */
+        size_t fd_offset;
+        hid_t hdf5_datatype;  /* Datatype of the dataset */
+        std::vector<hsize_t> dimensions;
+        int *status;          /* Set by a forked process once it reads a deferred entry */
+        std::string key;      /* Key to cache the entry under, empty if not cacheable */
+        int refs;             /* Active users of this entry */
+        uint64_t last_used;   /* Counter value when the entry was last used */
+    };
+
+    // Key the datasets of a file are cached under, or an empty string if they
+    // cannot be reused. 'filename' gets the name of the file.
+    std::string makeKey(hid_t file_id, const std::string &name, std::string &filename);
+
+    // Cache an entry that has no users yet, returning its position
+    std::map<std::string, Entry>::iterator add(std::string key, const std::string &name, Entry &entry);
+
+    // Register a new user of an entry
+    void use(Entry &entry, hid_t file_id, const std::string &name, DatasetInfo &out);
+
+    // Read a dataset into a new entry, or prepare it to be read later on
+    bool load(hid_t file_id, const std::string &filename, const std::string &name,
+        bool defer, Entry &entry);
+
+    // Map the dataset straight from the file, if it is stored contiguously
+    // without any filters and the file is opened read-only
+    bool map(hid_t file_id, hid_t dset_id, const std::string &filename, Entry &entry);
+
+    // Release the memory held by an entry
+    void destroy(Entry &entry);
+
+    // Drop unused entries, least recently used first, until the cache fits the budget
+    void evict();
+
+    std::map<std::string, Entry> entries;
+    std::mutex lock;
+    size_t budget;
+    size_t cached_bytes;
+    uint64_t counter;
+};
+
+#endif /* __input_cache_h */
@@ -21,87 +21,100 @@
 #include "lua_backend.h"
 #include "anon_mmap.h"
 #include "dataset.h"
+#include "hash.h"
+#include "stats.h"
 #include "lua.hpp"
 #ifdef ENABLE_SANDBOX
 #include "sandbox.h"
 #endif
 
-/* Lua context */
-static lua_State *State;
+/* Datasets made available to the UDF; the output dataset comes first */
+static std::vector<DatasetInfo> dataset_info;
 
-#define DATA_OFFSET(i)        (void *) (((char *) &State) + i)
-#define NAME_OFFSET(i)        (void *) (((char *) &State) + 100 + i)
-#define DIMS_OFFSET(i)        (void *) (((char *) &State) + 200 + i)
-#define TYPE_OFFSET(i)        (void *) (((char *) &State) + 300 + i)
-#define CAST_OFFSET(i)        (void *) (((char *) &State) + 400 + i)
+/*
+ * Description of a dataset handed to the UDF. udf_template.lua declares the
+ * same layout and resolves dataset names to entries of this array once per
+ * run, so that lookups made by the UDF don't need to reach this file.
+ */
+struct LuaDataset {
+    const char *name;
+    const char *type;
+    const char *cast;
+    void *data;              /* NULL until a deferred dataset is loaded */
+    uint64_t ndims;
+    const uint64_t *dims;
+};
+static std::vector<LuaDataset> lua_datasets;
+static_assert(sizeof(hsize_t) == sizeof(uint64_t), "hsize_t must be a 64-bit integer");
+
+/* Maximum number of Lua states kept around between calls to run() */
+#define MAX_CACHED_STATES 16
 
-extern "C" int index_of(const char *element)
+/* Functions exported to the Lua template library (udf_template.lua) */
+extern "C" const LuaDataset *luaGetDatasets(uint64_t *count)
 {
-    for (int index=0; index<100; ++index) {
-        /* Set register key to get datasets name vector */
-        lua_pushlightuserdata(State, NAME_OFFSET(index));
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        const char *name = lua_tostring(State, -1);
-        if (! strcmp(name, element))
-            return index;
-        else if (strlen(name) == 0)
-            break;
-    }
-    fprintf(stderr, "Error: dataset %s not found\n", element);
-    return -1;
+    *count = lua_datasets.size();
+    return lua_datasets.data();
 }
 
-/* Functions exported to the Lua template library (udf_template.lua) */
-extern "C" void *luaGetData(const char *element)
+extern "C" void *luaLoadData(uint64_t index)
 {
-    int index = index_of(element);
-    if (index >= 0)
-    {
-        /* Get datasets contents */
-        lua_pushlightuserdata(State, DATA_OFFSET(index)); 
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        return lua_touserdata(State, -1);
-    }
-    return NULL;
+    if (index >= dataset_info.size())
+        return NULL;
+
+    /* Read the dataset on its first use */
+    void *data = dataset_info[index].load();
+    lua_datasets[index].data = data;
+    return data;
 }
 
-extern "C" const char *luaGetType(const char *element)
+extern "C" void *luaGetDataSlice(uint64_t index, const uint64_t *offset, const uint64_t *count)
 {
-    int index = index_of(element);
-    if (index >= 0)
-    {
-        /* Set register key to get dataset type */
-        lua_pushlightuserdata(State, TYPE_OFFSET(index));
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        return lua_tostring(State, -1);
-    }
-    return NULL;
+    if (index >= dataset_info.size())
+        return NULL;
+    auto &info = dataset_info[index];
+    std::vector<hsize_t> slice_offset(offset, offset + info.dimensions.size());
+    std::vector<hsize_t> slice_count(count, count + info.dimensions.size());
+    return info.getSlice(slice_offset, slice_count);
 }
 
-extern "C" const char *luaGetCast(const char *element)
+extern "C" void luaGetParallelRange(uint64_t n, uint64_t *begin, uint64_t *end)
 {
-    int index = index_of(element);
-    if (index >= 0)
-    {
-        /* Set register key to get dataset type */
-        lua_pushlightuserdata(State, CAST_OFFSET(index));
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        return lua_tostring(State, -1);
-    }
-    return NULL;
+    size_t range_begin, range_end;
+    Backend::parallelRange(n, &range_begin, &range_end);
+    *begin = range_begin;
+    *end = range_end;
 }
 
-extern "C" const char *luaGetDims(const char *element)
+extern "C" void luaGetBlockRange(uint64_t *rows, uint64_t *step)
 {
-    int index = index_of(element);
-    if (index >= 0)
-    {
-        /* Set register key to get dataset size */
-        lua_pushlightuserdata(State, DIMS_OFFSET(index));
-        lua_gettable(State, LUA_REGISTRYINDEX);
-        return lua_tostring(State, -1);
-    }
-    return NULL;
+    hsize_t block_step;
+    *rows = DatasetInfo::blockRows(dataset_info, &block_step);
+    *step = block_step;
+}
+
+extern "C" void luaSetBlock(uint64_t first, uint64_t last)
+{
+    DatasetInfo::setBlock(first, last);
+}
+
+extern "C" void *luaGetBlock(uint64_t index)
+{
+    if (index >= dataset_info.size())
+        return NULL;
+    return dataset_info[index].getBlock(dataset_info[0]);
+}
+
+extern "C" const uint64_t *luaGetChunkOffset(uint64_t *ndims)
+{
+    *ndims = dataset_info.size() ? dataset_info[0].chunk_offset.size() : 0;
+    return *ndims ? (const uint64_t *) dataset_info[0].chunk_offset.data() : NULL;
+}
+
+extern "C" const uint64_t *luaGetChunkDims(uint64_t *ndims)
+{
+    *ndims = dataset_info.size() ? dataset_info[0].chunk_dimensions.size() : 0;
+    return *ndims ? (const uint64_t *) dataset_info[0].chunk_dimensions.data() : NULL;
 }
 
 /* This backend's name */
@@ -116,67 +129,69 @@ std::string LuaBackend::extension()
     return ".lua";
 }
 
+std::string LuaBackend::compilerSignature()
+{
+    /* Bytecode is generated in-process, by the LuaJIT library we are linked to */
+    return LUAJIT_VERSION;
+}
+
 /* Compile Lua to bytecode using LuaJIT. Returns the bytecode as a string. */
 std::string LuaBackend::compile(std::string udf_file, std::string template_file)
 {
     std::string placeholder = "-- user_callback_placeholder";
-    auto lua_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
-    if (lua_file.size() == 0)
+    auto source = Backend::assembleSource(udf_file, template_file, placeholder);
+    if (source.size() == 0)
     {
         fprintf(stderr, "Will not be able to compile the UDF code\n");
         return "";
     }
 
-    std::string output = udf_file + ".bytecode";
-    pid_t pid = fork();
-    if (pid == 0)
+    lua_State *L = luaL_newstate();
+    if (! L)
     {
-        // Child process
-        char *cmd[] = {
-            (char *) "luajit",
-            (char *) "-O3",
-            (char *) "-b",
-            (char *) lua_file.c_str(),
-            (char *) output.c_str(),
-            (char *) NULL
-        };
-        execvp(cmd[0], cmd);
+        fprintf(stderr, "Failed to create Lua state\n");
+        return "";
     }
-    else if (pid > 0)
-    {
-        // Parent
-        int exit_status;
-        wait4(pid, &exit_status, 0, NULL);
-
-        struct stat statbuf;
-        std::string bytecode;
-        if (stat(output.c_str(), &statbuf) == 0) {
-            printf("Bytecode has %ld bytes\n", statbuf.st_size);
-
-            std::ifstream data(output, std::ifstream::binary);
-            std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(data), {});
-            bytecode.assign(buffer.begin(), buffer.end());
+    lua_pushcfunction(L, luaopen_string);
+    lua_call(L,0,0);
 
-            unlink(output.c_str());
+    std::string bytecode;
+    auto chunkname = "@" + udf_file;
+    if (luaL_loadbuffer(L, source.data(), source.size(), chunkname.c_str()) != 0)
+        fprintf(stderr, "Failed to compile %s: %s\n", udf_file.c_str(), lua_tostring(L, -1));
+    else
+    {
+        // string.dump(fn, true) leaves out debug information, as luajit -b does
+        lua_getglobal(L, "string");
+        lua_getfield(L, -1, "dump");
+        lua_pushvalue(L, -3);
+        lua_pushboolean(L, 1);
+        if (lua_pcall(L, 2, 1, 0) != 0)
+            fprintf(stderr, "Failed to dump the bytecode: %s\n", lua_tostring(L, -1));
+        else
+        {
+            size_t size = 0;
+            const char *data = lua_tolstring(L, -1, &size);
+            if (data)
+                bytecode.assign(data, size);
         }
-        unlink(lua_file.c_str());
-        return bytecode;
     }
-    fprintf(stderr, "Failed to execute luajit\n");
-    return "";
+    lua_close(L);
+
+    if (bytecode.size())
+        printf("Bytecode has %ld bytes\n", bytecode.size());
+    return bytecode.size() ? compressPayload(bytecode) : "";
 }
 
-/* Execute the user-defined-function embedded in the given bytecode */
-bool LuaBackend::run(
-    const std::string filterpath,
-    const std::vector<DatasetInfo> input_datasets,
-    const DatasetInfo output_dataset,
-    const char *output_cast_datatype,
-    const char *bytecode,
-    size_t bytecode_size)
+/* Create a new Lua state and load the given bytecode into it */
+lua_State *LuaBackend::newState(const char *bytecode, size_t bytecode_size)
 {
     lua_State *L = luaL_newstate();
-    State = L;
+    if (! L)
+    {
+        fprintf(stderr, "Failed to create Lua state\n");
+        return NULL;
+    }
 
     lua_pushcfunction(L, luaopen_base);
     lua_call(L,0,0);
@@ -193,52 +208,18 @@ bool LuaBackend::run(
     lua_pushcfunction(L, luaopen_table);
     lua_call(L,0,0);
 
-    // We want to make the output dataset writeable by the UDF. Because
-    // the UDF is run under a separate process we have to use a shared
-    // memory segment which both processes can read and write to.
-    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
-    AnonymousMemoryMap mm(room_size);
-    if (! mm.create())
-        return false;
-
-    // Let output_dataset.data point to the shared memory segment
-    DatasetInfo output_dataset_copy = output_dataset;
-    output_dataset_copy.data = mm.mm;
-
-    DatasetInfo empty_entry;
-    std::vector<DatasetInfo> dataset_info;
-    dataset_info.push_back(output_dataset_copy);
-    dataset_info.insert(
-        dataset_info.end(), input_datasets.begin(), input_datasets.end());
-    dataset_info.push_back(empty_entry);
-
-    /* Populate vector of dataset names, sizes, and types */
-    for (size_t i=0; i<dataset_info.size(); ++i)
+    // Bytecode written by recent versions of hdf5-udf is compressed
+    std::string decompressed;
+    if (isCompressedPayload(bytecode, bytecode_size))
     {
-        /* Grid */
-        lua_pushlightuserdata(L, DATA_OFFSET(i));
-        lua_pushlightuserdata(L, (void *) dataset_info[i].data);
-        lua_settable(L, LUA_REGISTRYINDEX);
-
-        /* Name */
-        lua_pushlightuserdata(L, NAME_OFFSET(i));
-        lua_pushstring(L, dataset_info[i].name.c_str());
-        lua_settable(L, LUA_REGISTRYINDEX);
-
-        /* Dimensions */
-        lua_pushlightuserdata(L, DIMS_OFFSET(i));
-        lua_pushstring(L, dataset_info[i].dimensions_str.c_str());
-        lua_settable(L, LUA_REGISTRYINDEX);
-
-        /* Type */
-        lua_pushlightuserdata(L, TYPE_OFFSET(i));
-        lua_pushstring(L, dataset_info[i].getDatatype());
-        lua_settable(L, LUA_REGISTRYINDEX);
-
-        /* Type, used for casting purposes */
-        lua_pushlightuserdata(L, CAST_OFFSET(i));
-        lua_pushstring(L, dataset_info[i].getCastDatatype());
-        lua_settable(L, LUA_REGISTRYINDEX);
+        decompressed = decompressPayload(bytecode, bytecode_size);
+        if (decompressed.size() == 0)
+        {
+            lua_close(L);
+            return NULL;
+        }
+        bytecode = decompressed.data();
+        bytecode_size = decompressed.size();
     }
 
     int retValue = luaL_loadbuffer(L, bytecode, bytecode_size, "hdf5_udf_bytecode");
@@ -246,20 +227,143 @@ bool LuaBackend::run(
     {
         fprintf(stderr, "luaL_loadbuffer failed: %s\n", lua_tostring(L, -1));
         lua_close(L);
-        return false;
+        return NULL;
     }
     if (lua_pcall(L, 0, 0 , 0) != 0)
     {
         fprintf(stderr, "Failed to load the bytecode: %s\n", lua_tostring(L, -1));
         lua_close(L);
+        return NULL;
+    }
+    return L;
+}
+
+/*
+ * Get a Lua state that has the given bytecode loaded into it. Bringing up the
+ * interpreter and running the top-level chunk of the UDF is only done on the
+ * first time a given bytecode is seen; subsequent calls reuse that state.
+ */
+lua_State *LuaBackend::getState(const char *bytecode, size_t bytecode_size)
+{
+    uint64_t key = blobHash(bytecode, bytecode_size);
+    auto it = states.find(key);
+    if (it != states.end() &&
+        it->second.bytecode.size() == bytecode_size &&
+        memcmp(it->second.bytecode.data(), bytecode, bytecode_size) == 0)
+    {
+        it->second.last_used = ++use_counter;
+        return it->second.L;
+    }
+    else if (it != states.end())
+    {
+        /* Hash collision: evict the previous entry */
+        lua_close(it->second.L);
+        states.erase(it);
+    }
+
+    /* Evict the least recently used state if the cache is full */
+    if (states.size() >= MAX_CACHED_STATES)
+    {
+        auto lru = std::min_element(states.begin(), states.end(),
+            [](const std::pair<const uint64_t, CachedState> &a,
+               const std::pair<const uint64_t, CachedState> &b)
+            { return a.second.last_used < b.second.last_used; });
+        lua_close(lru->second.L);
+        states.erase(lru);
+    }
+
+    lua_State *L = newState(bytecode, bytecode_size);
+    if (! L)
+        return NULL;
+
+    CachedState entry;
+    entry.L = L;
+    entry.bytecode.assign(bytecode, bytecode_size);
+    entry.last_used = ++use_counter;
+    states[key] = entry;
+    return L;
+}
+
+/* Describe the datasets that the UDF has access to */
+void LuaBackend::setDatasets(
+    const std::vector<DatasetInfo> &input_datasets,
+    const DatasetInfo &output_dataset)
+{
+    dataset_info.clear();
+    dataset_info.push_back(output_dataset);
+    dataset_info.insert(
+        dataset_info.end(), input_datasets.begin(), input_datasets.end());
+
+    lua_datasets.clear();
+    for (auto &info: dataset_info)
+    {
+        LuaDataset entry;
+        entry.name = info.name.c_str();
+        entry.type = info.getDatatype();
+        entry.cast = info.getCastDatatype();
+        entry.data = info.data;
+        entry.ndims = info.dimensions.size();
+        entry.dims = (const uint64_t *) info.dimensions.data();
+        lua_datasets.push_back(entry);
+    }
+}
+
+/* Initialize the UDF library and call the UDF entry point */
+bool LuaBackend::callUDF(lua_State *L, const std::string filterpath)
+{
+    lua_getglobal(L, "init");
+    lua_pushstring(L, filterpath.c_str());
+    if (lua_pcall(L, 1, 0, 0) != 0)
+    {
+        fprintf(stderr, "Failed to invoke the init callback: %s\n", lua_tostring(L, -1));
         return false;
     }
 
+    StatsTimer timer(STATS_UDF);
+    lua_getglobal(L, "dynamic_dataset");
+    if (lua_pcall(L, 0, 0, 0) != 0)
+    {
+        fprintf(stderr, "Failed to invoke the dynamic_dataset callback: %s\n", lua_tostring(L, -1));
+        return false;
+    }
+    return true;
+}
+
+/* Execute the user-defined-function embedded in the given bytecode */
+bool LuaBackend::run(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *bytecode,
+    size_t bytecode_size)
+{
+    uint64_t load_start = Stats::now();
+    lua_State *L = getState(bytecode, bytecode_size);
+    if (! L)
+        return false;
+    Stats::instance()->addTime(STATS_BACKEND_LOAD, Stats::now() - load_start);
+
+    // We want to make the output dataset writeable by the UDF. Because
+    // the UDF is run under a separate process we have to use a shared
+    // memory segment which both processes can read and write to, unless
+    // the caller has already allocated the output grid from one.
+    size_t room_size = output_dataset.getChunkGridSize() * output_dataset.getStorageSize();
+    AnonymousMemoryMap mm(room_size);
+    DatasetInfo output_dataset_copy = output_dataset;
+    if (! output_dataset.shared_data)
+    {
+        if (! mm.create())
+            return false;
+
+        // Let output_dataset.data point to the shared memory segment
+        output_dataset_copy.data = mm.mm;
+    }
+    setDatasets(input_datasets, output_dataset_copy);
+
     // Execute the user-defined-function under a separate process so that
     // seccomp can kill it (if needed) without crashing the entire program
-    bool ret = false;
-    pid_t pid = fork();
-    if (pid == 0)
+    bool ret = forkUDF([&]()
     {
         bool ready = true;
 #ifdef ENABLE_SANDBOX
@@ -267,42 +371,46 @@ bool LuaBackend::run(
         ready = sandbox.init(filterpath);
 #endif
         if (ready)
-        {
-            // Initialize the UDF library
-            lua_getglobal(L, "init");
-            lua_pushstring(L, filterpath.c_str());
-            if (lua_pcall(L, 1, 0, 0) != 0)
-            {
-                fprintf(stderr, "Failed to invoke the init callback: %s\n", lua_tostring(L, -1));
-                lua_close(L);
-                _exit(1);
-            }
+            ready = callUDF(L, filterpath);
+        return ready;
+    });
 
-            // Call the UDF entry point
-            lua_getglobal(L, "dynamic_dataset");
-            if (lua_pcall(L, 0, 0, 0) != 0)
-            {
-                fprintf(stderr, "Failed to invoke the dynamic_dataset callback: %s\n", lua_tostring(L, -1));
-                lua_close(L);
-                _exit(1);
-            }
-        }
-        _exit(0);
-    }
-    else if (pid > 0)
+    // Update output HDF5 dataset with data from shared memory segment
+    if (! output_dataset.shared_data)
     {
-        int status;
-        waitpid(pid, &status, 0);
-        ret = WIFEXITED(status) ? WEXITSTATUS(status) == 0 : false;
-
-        // Update output HDF5 dataset with data from shared memory segment
+        StatsTimer timer(STATS_OUTPUT_COPY);
         memcpy(output_dataset.data, mm.mm, room_size);
     }
-    lua_close(L);
 
     return ret;
 }
 
+/*
+ * Execute the user-defined-function in the calling process. Each call gets a
+ * fresh state, since the UDF runs in the same address space as the state and
+ * could otherwise leave traces for the next caller.
+ */
+bool LuaBackend::execute(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *bytecode,
+    size_t bytecode_size)
+{
+    uint64_t load_start = Stats::now();
+    lua_State *L = newState(bytecode, bytecode_size);
+    if (! L)
+        return false;
+    Stats::instance()->addTime(STATS_BACKEND_LOAD, Stats::now() - load_start);
+
+    setDatasets(input_datasets, output_dataset);
+    bool ret = callUDF(L, filterpath);
+    DatasetInfo::freeSlices();
+    lua_close(L);
+    return ret;
+}
+
 /* Scan the UDF file for references to HDF5 dataset names */
 std::vector<std::string> LuaBackend::udfDatasetNames(std::string udf_file)
 {
@@ -343,6 +451,8 @@ std::vector<std::string> LuaBackend::udfDatasetNames(std::string udf_file)
         else if (! is_comment)
         {
             auto n = line.find("lib.getData");
+            if (n == std::string::npos)
+                n = line.find("lib.getBlock");
             auto c = line.find("--");
             if (n != std::string::npos && (c == std::string::npos || c > n))
             {
@@ -8,8 +8,12 @@
 #ifndef __lua_backend_h
 #define __lua_backend_h
 
+#include <map>
+#include <stdint.h>
 #include "backend.h"
 
+struct lua_State;
+
 class LuaBackend : public Backend {
 public:
     // Backend name
@@ -21,6 +25,9 @@ public:
     // Compile an input file into executable form
     std::string compile(std::string udf_file, std::string template_file);
 
+    // Compiler and options used by compile()
+    std::string compilerSignature();
+
     // Execute a user-defined-function
     bool run(
         const std::string filterpath,
@@ -30,12 +37,42 @@ public:
         const char *udf_blob,
         size_t udf_blob_size);
 
+    // Execute a user-defined-function in the calling process
+    bool execute(
+        const std::string filterpath,
+        const std::vector<DatasetInfo> input_datasets,
+        const DatasetInfo output_dataset,
+        const char *output_cast_datatype,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
     // Scan the UDF file for references to HDF5 dataset names.
     // We use this to store the UDF dependencies in the JSON payload.
     std::vector<std::string> udfDatasetNames(std::string udf_file);
 
 private:
-    std::string bytecode;
+    // Create a new Lua state and load the given bytecode into it
+    lua_State *newState(const char *bytecode, size_t bytecode_size);
+
+    // Get a Lua state that has the given bytecode loaded into it
+    lua_State *getState(const char *bytecode, size_t bytecode_size);
+
+    // Describe the datasets that the UDF has access to
+    void setDatasets(
+        const std::vector<DatasetInfo> &input_datasets,
+        const DatasetInfo &output_dataset);
+
+    // Initialize the UDF library and call the UDF entry point
+    bool callUDF(lua_State *L, const std::string filterpath);
+
+    // Warm Lua states, indexed by the hash of the bytecode they have loaded
+    struct CachedState {
+        lua_State *L;
+        std::string bytecode;
+        uint64_t last_used;
+    };
+    std::map<uint64_t, CachedState> states;
+    uint64_t use_counter = 0;
 };
 
 #endif /* __lua_backend_h */
\ No newline at end of file
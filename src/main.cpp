@@ -15,21 +15,77 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <limits.h>
 #include <algorithm>
 #include <fstream>
 
 #include "filter_id.h"
 #include "dataset.h"
 #include "backend.h"
+#include "compile_cache.h"
+#include "hash.h"
+#include "payload.h"
 #include "json.hpp"
 
 using json = nlohmann::json;
 using namespace std;
 
+/*
+ * Store the bytecode in a hidden dataset named after its hash, so that all
+ * chunks (and all virtual datasets created from the same UDF) share a single
+ * copy of it. Returns the path to that dataset, or an empty string on error.
+ */
+static std::string storeBytecode(hid_t file_id, const std::string &bytecode)
+{
+    std::string path = bytecodeDatasetPath(hash64(bytecode.data(), bytecode.size()));
+
+    if (H5Lexists(file_id, BYTECODE_GROUP, H5P_DEFAULT) <= 0)
+    {
+        hid_t group_id = H5Gcreate(file_id, BYTECODE_GROUP, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if (group_id < 0)
+        {
+            fprintf(stderr, "Failed to create group %s\n", BYTECODE_GROUP);
+            return "";
+        }
+        H5Gclose(group_id);
+    }
+    else if (H5Lexists(file_id, path.c_str(), H5P_DEFAULT) > 0)
+    {
+        /* Same bytecode already stored by a previous run */
+        return path;
+    }
+
+    hsize_t dims[1] = { bytecode.size() };
+    hid_t space_id = H5Screate_simple(1, dims, NULL);
+    if (space_id < 0)
+    {
+        fprintf(stderr, "Failed to create dataspace\n");
+        return "";
+    }
+    hid_t dset_id = H5Dcreate(file_id, path.c_str(), H5T_STD_U8LE, space_id,
+        H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Failed to create dataset %s\n", path.c_str());
+        H5Sclose(space_id);
+        return "";
+    }
+    herr_t status = H5Dwrite(dset_id, H5T_NATIVE_UINT8, H5S_ALL, H5S_ALL, H5P_DEFAULT, bytecode.data());
+    H5Dclose(dset_id);
+    H5Sclose(space_id);
+    if (status < 0)
+    {
+        fprintf(stderr, "Failed to write bytecode to %s\n", path.c_str());
+        return "";
+    }
+    return path;
+}
+
 /* Virtual dataset parser */
 class DatasetOptionsParser {
 public:
@@ -38,73 +94,87 @@ private:
     bool parseName(std::string text, DatasetInfo &out);
     bool parseDimensions(std::string text, DatasetInfo &out);
     bool parseDataType(std::string text, DatasetInfo &out);
+    bool parseChunkDimensions(std::string text, DatasetInfo &out);
+    bool parseResolution(std::string text, std::vector<hsize_t> &out);
+    std::vector<std::string> split(std::string text);
 };
 
 bool DatasetOptionsParser::parse(std::string text, DatasetInfo &out)
 {
     /* format 1: dataset_name
-     * format 2: dataset_name:dimensions:datatype */
+     * format 2: dataset_name:dimensions:datatype
+     * format 3: dataset_name:dimensions:datatype:chunk_dimensions */
     if (parseName(text, out) == false)
         return false;
     if (parseDimensions(text, out) == false)
         return false;
     if (parseDataType(text, out) == false)
         return false;
+    if (parseChunkDimensions(text, out) == false)
+        return false;
     return true;
 }
 
-bool DatasetOptionsParser::parseName(std::string text, DatasetInfo &out)
+std::vector<std::string> DatasetOptionsParser::split(std::string text)
 {
-    auto sep = text.find_first_of(":");
-    if (sep == string::npos)
-        out.name = text;
-    else
-        out.name = text.substr(0, sep);
-    return true;
+    std::vector<std::string> out;
+    std::string token;
+    std::istringstream iss(text);
+    while (std::getline(iss, token, ':'))
+        out.push_back(token);
+    return out;
 }
 
-bool DatasetOptionsParser::parseDimensions(std::string text, DatasetInfo &out)
+bool DatasetOptionsParser::parseResolution(std::string res, std::vector<hsize_t> &out)
 {
-    auto sep = text.find_first_of(":");
-    if (sep == string::npos)
-    {
-        /* No dimensions declared in the input string (not an error) */
-        return true;
-    }
-
-    std::string res(text.substr(sep+1));
     size_t num_dims = std::count(res.begin(), res.end(), 'x') + 1;
     if (num_dims < 1 || num_dims > 3)
     {
         fprintf(stderr, "Error: unsupported number of dimensions (%jd)\n", num_dims);
         return false;
     }
-    auto x = res.substr(0, res.find_first_of(":"));
-    out.dimensions.push_back(std::stoi(x));
-    if (num_dims == 2)
+    std::string dim;
+    std::istringstream iss(res);
+    while (std::getline(iss, dim, 'x'))
     {
-        auto y = res.substr(res.find_first_of("x")+1, res.find_first_of(":"));
-        out.dimensions.push_back(std::stoi(y));
+        auto value = std::stoll(dim);
+        if (value <= 0)
+        {
+            fprintf(stderr, "Error: invalid dimension '%s'\n", dim.c_str());
+            return false;
+        }
+        out.push_back(value);
     }
-    else if (num_dims == 3)
+    return true;
+}
+
+bool DatasetOptionsParser::parseName(std::string text, DatasetInfo &out)
+{
+    auto tokens = split(text);
+    out.name = tokens.size() ? tokens[0] : text;
+    return true;
+}
+
+bool DatasetOptionsParser::parseDimensions(std::string text, DatasetInfo &out)
+{
+    auto tokens = split(text);
+    if (tokens.size() < 2)
     {
-        auto y = res.substr(res.find_first_of("x")+1, res.find_last_of("x"));
-        auto z = res.substr(res.find_last_of("x")+1, res.find_first_of(":"));
-        out.dimensions.push_back(std::stoi(y));
-        out.dimensions.push_back(std::stoi(z));
+        /* No dimensions declared in the input string (not an error) */
+        return true;
     }
-    return true;
+    return parseResolution(tokens[1], out.dimensions);
 }
 
 bool DatasetOptionsParser::parseDataType(std::string text, DatasetInfo &out)
 {
-    auto sep = text.find_last_of(":");
-    if (sep == string::npos)
+    auto tokens = split(text);
+    if (tokens.size() < 3)
     {
         /* No datatype declared in the input string (not an error) */
         return true;
     }
-    out.datatype = text.substr(sep+1);
+    out.datatype = tokens[2];
     out.hdf5_datatype = out.getHdf5Datatype();
     if (out.hdf5_datatype < 0)
     {
@@ -114,13 +184,34 @@ bool DatasetOptionsParser::parseDataType(std::string text, DatasetInfo &out)
     return true;
 }
 
+bool DatasetOptionsParser::parseChunkDimensions(std::string text, DatasetInfo &out)
+{
+    auto tokens = split(text);
+    if (tokens.size() < 4)
+    {
+        /* No chunk dimensions declared in the input string (not an error) */
+        return true;
+    }
+    if (parseResolution(tokens[3], out.chunk_dimensions) == false)
+        return false;
+    if (out.chunk_dimensions.size() != out.dimensions.size())
+    {
+        fprintf(stderr, "Error: chunk and dataset dimensions have a different rank\n");
+        return false;
+    }
+    for (size_t i=0; i<out.dimensions.size(); ++i)
+        if (out.chunk_dimensions[i] > out.dimensions[i])
+        {
+            fprintf(stderr, "Error: chunk dimensions exceed the dataset dimensions\n");
+            return false;
+        }
+    return true;
+}
+
 /* Check if a dataset exist in a HDF5 file */
-bool dataset_exists(std::string filename, std::string name)
+bool dataset_exists(hid_t file_id, std::string name)
 {
-    hid_t file_id = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-    bool exists = H5Lexists(file_id, name.c_str(), H5P_DEFAULT ) > 0;
-    H5Fclose(file_id);
-    return exists;
+    return H5Lexists(file_id, name.c_str(), H5P_DEFAULT ) > 0;
 }
 
 /* Get the template file, if one exists for the given backend */
@@ -168,221 +259,498 @@ std::string template_path(std::string backend_extension, std::string argv0)
     return "";
 }
 
-int main(int argc, char **argv)
+
+/* A UDF file and the virtual datasets to create from it */
+struct UdfJob {
+    std::string udf_file;
+    std::vector<std::string> dataset_specs;
+    bool overwrite = false;
+    int parallel_workers = 0;
+    bool materialize = false;
+    std::string follow;              /* Input whose leading extent the virtual datasets follow */
+    bool row_local = false;
+
+    /* Filled by prepareJob() and compileJobs() */
+    Backend *backend = NULL;
+    std::string template_file;
+    std::vector<DatasetInfo> virtual_datasets;
+    std::vector<DatasetInfo> input_datasets;
+    std::vector<std::string> delete_list;
+    bool uses_parallel_for = false;
+    bool uses_data_slice = false;
+    std::string bytecode;
+};
+
+/*
+ * Read a batch manifest: a JSON array with one object per UDF file, e.g.
+ * [{"udf": "add.lua", "datasets": ["C:100x50:int32"], "overwrite": true}].
+ * Options left out of an entry take the values given in the command line.
+ * Relative UDF paths are taken from the directory of the manifest.
+ */
+static bool parseManifest(std::string manifest_file, const UdfJob &defaults, std::vector<UdfJob> &jobs)
 {
-    if(argc < 3)
+    std::ifstream stream(manifest_file);
+    if (! stream.is_open())
     {
-        fprintf(stdout,
-            "Syntax: %s <hdf5_file> <udf_file> [--overwrite] [virtual_dataset..]\n\n"
-            "Options:\n"
-            "  hdf5_file                      Input/output HDF5 file\n"
-            "  udf_file                       File implementing the user-defined-function\n"
-            "  virtual_dataset                Virtual dataset(s) to create. See syntax below.\n"
-            "                                 If omitted, dataset names are picked from udf_file\n"
-            "                                 and their resolutions/types are set to match the input\n"
-            "                                 datasets declared in that same file\n"
-            "  --overwrite                    Overwrite existing virtual dataset(s)\n\n"
-            "Formatting options for <virtual_dataset>:\n"
-            "  dataset_name:resolution:type   dataset_name: name of the virtual dataset\n"
-            "                                 resolution: XRES, XRESxYRES, or XRESxYRESxZRES\n"
-            "                                 type: [u]int16, [u]int32, [u]int64, float, or double\n\n"
-            "Examples:\n"
-            "%s sample.h5 simple_vector.lua Simple:500:float\n"
-            "%s sample.h5 sine_wave.lua SineWave:100x10:int32\n",
-            argv[0], argv[0], argv[0]);
-        exit(1);
+        fprintf(stderr, "Error opening manifest %s\n", manifest_file.c_str());
+        return false;
     }
+    auto sep = manifest_file.find_last_of('/');
+    std::string basedir = sep == std::string::npos ? "" : manifest_file.substr(0, sep + 1);
 
-    /* Sanity checks */
-    if (H5Zfilter_avail(HDF5_UDF_FILTER_ID) <= 0)
+    try {
+        json manifest = json::parse(stream);
+        if (! manifest.is_array())
+        {
+            fprintf(stderr, "Manifest %s must hold an array of UDF entries\n", manifest_file.c_str());
+            return false;
+        }
+        for (auto &entry: manifest)
+        {
+            UdfJob job = defaults;
+            job.udf_file = entry.at("udf").get<std::string>();
+            if (job.udf_file.size() && job.udf_file[0] != '/')
+                job.udf_file = basedir + job.udf_file;
+            if (entry.contains("datasets"))
+                job.dataset_specs = entry["datasets"].get<std::vector<std::string>>();
+            job.overwrite = entry.value("overwrite", job.overwrite);
+            job.parallel_workers = entry.value("parallel", job.parallel_workers);
+            job.materialize = entry.value("materialize", job.materialize);
+            job.follow = entry.value("follow", job.follow);
+            job.row_local = entry.value("row_local", job.row_local);
+            if (job.parallel_workers < 0)
+            {
+                fprintf(stderr, "Invalid number of processes given to %s\n", job.udf_file.c_str());
+                return false;
+            }
+            jobs.push_back(job);
+        }
+    } catch (json::exception &e) {
+        fprintf(stderr, "Malformed manifest %s: %s\n", manifest_file.c_str(), e.what());
+        return false;
+    }
+    if (jobs.size() == 0)
     {
-        fprintf(stderr, "Could not locate the HDF5-UDF filter\n");
-        fprintf(stderr, "Make sure to set $HDF5_PLUGIN_PATH prior to running this tool\n");
-        exit(1);
+        fprintf(stderr, "Manifest %s has no UDF entries\n", manifest_file.c_str());
+        return false;
     }
+    return true;
+}
 
-    std::string hdf5_file = argv[1];
-    std::string udf_file = argv[2];
-    const int first_dataset_index = 3;
-    bool overwrite = false;
-
-    Backend *backend = getBackendByFileExtension(udf_file);
-    if (! backend)
+/*
+ * Identify the virtual and input datasets of a job. 'declared' holds the
+ * virtual datasets of the jobs prepared before this one, which may be
+ * read by this UDF as inputs even though they are not on the file yet.
+ */
+static bool prepareJob(hid_t file_id, UdfJob &job, std::map<std::string, DatasetInfo> &declared, std::string argv0)
+{
+    job.backend = getBackendByFileExtension(job.udf_file);
+    if (! job.backend)
     {
-        fprintf(stderr, "Could not identify a parser for %s\n", udf_file.c_str());
-        exit(1);
+        fprintf(stderr, "Could not identify a parser for %s\n", job.udf_file.c_str());
+        return false;
     }
-    printf("Backend: %s\n", backend->name().c_str());
+    printf("Backend: %s\n", job.backend->name().c_str());
+    job.template_file = template_path(job.backend->extension(), argv0);
 
     /* Process virtual (output) datasets given in the command line */
-    std::vector<DatasetInfo> virtual_datasets;
-    std::vector<std::string> delete_list;
-    for (int i=first_dataset_index; i<argc; ++i)
+    for (auto &spec: job.dataset_specs)
     {
         DatasetInfo info;
         DatasetOptionsParser parser;
-        if (strcmp(argv[i], "--overwrite") == 0)
-        {
-            overwrite = true;
-            continue;
-        }
-        if (parser.parse(argv[i], info) == false)
+        if (parser.parse(spec, info) == false)
         {
-            fprintf(stderr, "Failed to parse string '%s'\n", argv[i]);
-            exit(1);
-        }
-        if (dataset_exists(hdf5_file, info.name))
-        {
-            if (overwrite)
-                delete_list.push_back(info.name);
-            else
-            {
-                fprintf(stderr, "Error: dataset %s already exists\n", info.name.c_str());
-                exit(1);
-            }
+            fprintf(stderr, "Failed to parse string '%s'\n", spec.c_str());
+            return false;
         }
-        virtual_datasets.push_back(info);
+        job.virtual_datasets.push_back(info);
     }
 
     /* Identify virtual dataset name(s) and input dataset(s) that the UDF code depends on */
-    std::vector<std::string> dataset_names = backend->udfDatasetNames(udf_file);
-    std::vector<DatasetInfo> input_datasets;
+    std::vector<std::string> dataset_names;
+    CompileCache cache(job.backend, job.udf_file, job.template_file);
+    if (! cache.lookupDatasetNames(dataset_names))
+    {
+        dataset_names = job.backend->udfDatasetNames(job.udf_file);
+        if (dataset_names.size())
+            cache.storeDatasetNames(dataset_names);
+    }
     for (auto &name: dataset_names)
     {
-        DatasetInfo info;
-        info.name = name;
-        if (dataset_exists(hdf5_file, name))
-        {
-            /* Open HDF5 file */
-            hid_t file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-            if (file_id < 0)
+        /* Datasets given as virtual ones are outputs, even if they exist and are to be overwritten */
+        bool is_virtual = false;
+        for (auto &entry: job.virtual_datasets)
+            if (entry.name.compare(name) == 0)
             {
-                fprintf(stderr, "Error opening %s\n", hdf5_file.c_str());
-                exit(1);
+                is_virtual = true;
+                break;
             }
+        if (is_virtual)
+            continue;
 
+        DatasetInfo info;
+        info.name = name;
+        auto earlier = declared.find(name);
+        if (earlier != declared.end())
+        {
+            /* Virtual dataset created by an earlier entry of the manifest */
+            info.dimensions = earlier->second.dimensions;
+            info.hdf5_datatype = earlier->second.hdf5_datatype;
+            info.datatype = earlier->second.datatype;
+            job.input_datasets.push_back(info);
+            info.printInfo("Input");
+        }
+        else if (dataset_exists(file_id, name))
+        {
             /* Retrieve dataset information */
             hid_t dset_id = H5Dopen(file_id, info.name.c_str(), H5P_DEFAULT);
             if (dset_id < 0)
             {
-                fprintf(stderr, "Error opening dataset %s from file %s\n",
-                    info.name.c_str(), hdf5_file.c_str());
-                exit(1);
+                fprintf(stderr, "Error opening dataset %s\n", info.name.c_str());
+                return false;
             }
             hid_t space_id = H5Dget_space(dset_id);
             int ndims = H5Sget_simple_extent_ndims(space_id);
             info.dimensions.resize(ndims);
             info.hdf5_datatype = H5Dget_type(dset_id);
             H5Sget_simple_extent_dims(space_id, info.dimensions.data(), NULL);
+            H5Sclose(space_id);
+            H5Dclose(dset_id);
 
             /* Check that the input dataset's datatype is supported by our implementation */
             auto datatype_ptr = info.getDatatype();
             if (datatype_ptr == NULL) {
                 fprintf(stderr, "Unsupported HDF5 datatype %jd\n", info.hdf5_datatype);
-                exit(1);
+                return false;
             }
             info.datatype = datatype_ptr;
 
-            input_datasets.push_back(info);
-            H5Sclose(space_id);
-            H5Dclose(dset_id);
-            H5Fclose(file_id);
+            job.input_datasets.push_back(info);
             info.printInfo("Input");
         }
         else
         {
             /* This is an output (virtual) dataset */
-            bool already_given_in_cmdline = false;
-            for (auto &entry: virtual_datasets)
-                if (entry.name.compare(name) == 0)
-                {
-                    already_given_in_cmdline = true;
-                    break;
-                }
-            if (! already_given_in_cmdline)
-            {
-                info.name = name;
-                virtual_datasets.push_back(info);
-            }
+            job.virtual_datasets.push_back(info);
         }
     }
 
-    if (virtual_datasets.size() == 0)
+    if (job.virtual_datasets.size() == 0)
     {
         fprintf(stderr,
-            "Error: all datasets given in the UDF file already exist.\n"
-            "Please explicitly specify the virtual dataset(s) in the command line.\n");
-        exit(1);
+            "Error: all datasets given in %s already exist.\n"
+            "Please explicitly specify the virtual dataset(s) in the command line.\n",
+            job.udf_file.c_str());
+        return false;
     }
 
     /*
      * Validate output dimensions and datatypes. If some information is not
      * available, pick it up from the input datasets parsed in the loop above.
      */
-    for (auto &info: virtual_datasets)
+    for (auto &info: job.virtual_datasets)
     {
-        if (info.hdf5_datatype != -1) {
-            info.printInfo("Virtual");
-            continue;
+        if (declared.find(info.name) != declared.end())
+        {
+            fprintf(stderr, "Error: dataset %s is declared more than once\n", info.name.c_str());
+            return false;
         }
-
-        /* Make sure that we have at least one input dataset */
-        if (input_datasets.size() == 0)
+        if (dataset_exists(file_id, info.name))
         {
-            fprintf(stderr, "Cannot determine dimensions and type of virtual dataset %s. Please specify.\n",
-                info.name.c_str());
-            exit(1);
+            if (! job.overwrite)
+            {
+                fprintf(stderr, "Error: dataset %s already exists\n", info.name.c_str());
+                return false;
+            }
+            job.delete_list.push_back(info.name);
         }
 
-        /* Require that all input datasets have the same dimensions and type */
-        for (size_t i=1; i<input_datasets.size(); ++i)
+        if (info.hdf5_datatype == -1)
         {
-            if (! H5Tequal(input_datasets[i].hdf5_datatype, input_datasets[i-1].hdf5_datatype))
+            /* Make sure that we have at least one input dataset */
+            auto &inputs = job.input_datasets;
+            if (inputs.size() == 0)
             {
-                fprintf(stderr, "Cannot determine type of virtual dataset %s. Please specify.\n",
+                fprintf(stderr, "Cannot determine dimensions and type of virtual dataset %s. Please specify.\n",
                     info.name.c_str());
-                exit(1);
+                return false;
             }
-            if (input_datasets[i].dimensions != input_datasets[i-1].dimensions)
+
+            /* Require that all input datasets have the same dimensions and type */
+            for (size_t i=1; i<inputs.size(); ++i)
             {
-                fprintf(stderr, "Cannot determine dimensions of virtual dataset %s. Please specify.\n",
-                    info.name.c_str());
-                exit(1);
+                if (! H5Tequal(inputs[i].hdf5_datatype, inputs[i-1].hdf5_datatype))
+                {
+                    fprintf(stderr, "Cannot determine type of virtual dataset %s. Please specify.\n",
+                        info.name.c_str());
+                    return false;
+                }
+                if (inputs[i].dimensions != inputs[i-1].dimensions)
+                {
+                    fprintf(stderr, "Cannot determine dimensions of virtual dataset %s. Please specify.\n",
+                        info.name.c_str());
+                    return false;
+                }
             }
+
+            /* We're all set: copy attributes from the first input dataset */
+            info.hdf5_datatype = inputs[0].hdf5_datatype;
+            info.datatype = inputs[0].datatype;
+            info.dimensions = inputs[0].dimensions;
         }
 
-        /* We're all set: copy attributes from the first input dataset */
-        info.hdf5_datatype = input_datasets[0].hdf5_datatype;
-        info.datatype = input_datasets[0].datatype;
-        info.dimensions = input_datasets[0].dimensions;
+        /* The leading extent follows the current one of an input (see --refresh) */
+        if (job.follow.size())
+        {
+            auto input = std::find_if(job.input_datasets.begin(), job.input_datasets.end(),
+                [&](const DatasetInfo &entry) { return entry.name == job.follow; });
+            if (input == job.input_datasets.end())
+            {
+                fprintf(stderr, "Error: dataset %s given to --follow is not an input of %s\n",
+                    job.follow.c_str(), job.udf_file.c_str());
+                return false;
+            }
+            if (info.chunk_dimensions.size() == 0)
+            {
+                fprintf(stderr, "Error: dataset %s follows %s, so its chunk dimensions must be given\n",
+                    info.name.c_str(), job.follow.c_str());
+                return false;
+            }
+            if (input->dimensions.size() != info.dimensions.size() || input->dimensions[0] == 0)
+            {
+                fprintf(stderr, "Error: dataset %s cannot follow the extent of %s\n",
+                    info.name.c_str(), job.follow.c_str());
+                return false;
+            }
+            info.dimensions[0] = input->dimensions[0];
+        }
         info.printInfo("Virtual");
+        declared[info.name] = info;
     }
 
-    /* Compile the UDF source file */
-    auto template_file = template_path(backend->extension(), argv[0]);
-    auto bytecode = backend->compile(udf_file, template_file);
-    if (bytecode.size() == 0)
+    /* UDFs that call lib.parallel_for() are executed by several processes */
+    job.uses_parallel_for = job.backend->udfCallsParallelFor(job.udf_file);
+
+    /* Inputs of UDFs that read them a slice at a time are not prefetched */
+    job.uses_data_slice = job.backend->udfCallsDataSlice(job.udf_file);
+    return true;
+}
+
+/* Read the whole contents of a file descriptor */
+static bool readFile(int fd, std::string &out)
+{
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0)
+        return false;
+    out.resize(statbuf.st_size);
+    size_t done = 0;
+    while (done < out.size())
     {
-        fprintf(stderr, "Failed to compile UDF file\n");
-        exit(1);
+        ssize_t n = pread(fd, &out[done], out.size() - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
     }
+    return true;
+}
 
-    /* Create the virtual datasets */
-    for (auto &info: virtual_datasets)
+/*
+ * Compile the UDF files of all jobs. Each distinct file is compiled once, by
+ * a child process that hands the bytecode back through a temporary file; up
+ * to one compilation per CPU runs at a time. Files found on the compilation
+ * cache are not compiled at all.
+ */
+static bool compileJobs(std::vector<UdfJob> &jobs)
+{
+    struct Compilation {
+        UdfJob *job;
+        int fd;
+        pid_t pid;
+    };
+    std::vector<Compilation> pending;
+    std::map<std::string, UdfJob *> unique_files;
+    for (auto &job: jobs)
+        if (unique_files.find(job.udf_file) == unique_files.end())
+        {
+            unique_files[job.udf_file] = &job;
+            CompileCache cache(job.backend, job.udf_file, job.template_file);
+            if (cache.lookupBytecode(job.bytecode))
+                printf("Using cached build of %s\n", job.udf_file.c_str());
+            else
+                pending.push_back({&job, -1, -1});
+        }
+
+    long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_running < 1)
+        max_running = 1;
+    const char *tmp = getenv("TMPDIR") ? : "/tmp";
+
+    bool ret = true;
+    size_t next = 0, running = 0;
+    while (next < pending.size() || running > 0)
     {
-        hid_t file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
-        if (file_id < 0)
+        if (ret && next < pending.size() && running < (size_t) max_running)
         {
-            fprintf(stderr, "Error opening %s\n", hdf5_file.c_str());
-            exit(1);
+            auto &entry = pending[next++];
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path)-1, "%s/hdf5-udf-XXXXXX", tmp);
+            entry.fd = mkstemp(path);
+            if (entry.fd < 0)
+            {
+                fprintf(stderr, "Error creating temporary file: %s\n", strerror(errno));
+                ret = false;
+                continue;
+            }
+            unlink(path);
+
+            /* Don't let the children inherit (and print again) buffered output */
+            fflush(stdout);
+            fflush(stderr);
+            entry.pid = fork();
+            if (entry.pid == 0)
+            {
+                auto bytecode = entry.job->backend->compile(entry.job->udf_file, entry.job->template_file);
+                bool ok = bytecode.size() > 0;
+                for (size_t done = 0; ok && done < bytecode.size(); )
+                {
+                    ssize_t n = write(entry.fd, &bytecode[done], bytecode.size() - done);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    ok = n > 0;
+                    done += ok ? n : 0;
+                }
+                fflush(stdout);
+                fflush(stderr);
+                _exit(ok ? 0 : 1);
+            }
+            else if (entry.pid < 0)
+            {
+                fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+                close(entry.fd);
+                entry.fd = -1;
+                ret = false;
+                continue;
+            }
+            running++;
+            continue;
+        }
+
+        /* Collect the next compilation that finishes */
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (auto &entry: pending)
+        {
+            if (entry.pid != pid)
+                continue;
+            running--;
+            entry.pid = -1;
+            if (! WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+                ! readFile(entry.fd, entry.job->bytecode) || entry.job->bytecode.size() == 0)
+            {
+                fprintf(stderr, "Failed to compile UDF file %s\n", entry.job->udf_file.c_str());
+                ret = false;
+            }
+            else
+            {
+                CompileCache cache(entry.job->backend, entry.job->udf_file, entry.job->template_file);
+                cache.storeBytecode(entry.job->bytecode);
+            }
+            close(entry.fd);
+            break;
+        }
+    }
+
+    /* Jobs that share a UDF file share its bytecode */
+    for (auto &job: jobs)
+        job.bytecode = unique_files[job.udf_file]->bytecode;
+    return ret;
+}
+
+/*
+ * Write one payload per chunk, skipping the chunks that start before
+ * 'first_row'. Each payload tells the filter which part of the grid it has
+ * to produce, so readers only ever run the UDF on the chunks covered by their
+ * selection. The payloads are written straight to storage, bypassing the
+ * filter pipeline, so they only take as much room as needed; the bytecode is
+ * not repeated on them.
+ */
+static bool writePayloads(hid_t dset_id, std::string &payload, const std::vector<hsize_t> &dims,
+    const std::vector<hsize_t> &chunk_dims, hsize_t first_row)
+{
+    std::vector<hsize_t> chunk_offset(dims.size(), 0);
+    if (dims.size())
+        chunk_offset[0] = (first_row + chunk_dims[0] - 1) / chunk_dims[0] * chunk_dims[0];
+    for (size_t dim=0; dim<dims.size(); ++dim)
+        if (chunk_offset[dim] >= dims[dim])
+            return true;
+
+    while (true)
+    {
+        PayloadWriter::setChunkOffset(payload, chunk_offset);
+        herr_t status = H5Dwrite_chunk(
+            dset_id, H5P_DEFAULT, 0, chunk_offset.data(), payload.size(), payload.data());
+        if (status < 0)
+        {
+            fprintf(stderr, "Failed to write to the dataset\n");
+            return false;
         }
 
+        /* Move on to the next chunk, in row-major order */
+        int dim = chunk_offset.size() - 1;
+        for (; dim >= 0; --dim)
+        {
+            chunk_offset[dim] += chunk_dims[dim];
+            if (chunk_offset[dim] < dims[dim])
+                break;
+            chunk_offset[dim] = 0;
+        }
+        if (dim < 0)
+            break;
+    }
+    return true;
+}
+
+/* Create the virtual datasets of a job */
+static bool writeJob(hid_t file_id, std::string hdf5_file, UdfJob &job)
+{
+    /* The bytecode is stored once per file, apart from the chunk payloads */
+    auto bytecode_dataset = storeBytecode(file_id, job.bytecode);
+    if (bytecode_dataset.size() == 0)
+        return false;
+
+    /* Prepare data for JSON payload */
+    std::vector<std::string> input_dataset_names;
+    std::transform(job.input_datasets.begin(), job.input_datasets.end(), std::back_inserter(input_dataset_names),
+        [](DatasetInfo info) -> std::string { return info.name; });
+
+    /* Unless told otherwise, the whole dataset is stored in a single chunk */
+    for (auto &info: job.virtual_datasets)
+        if (info.chunk_dimensions.size() == 0)
+            info.chunk_dimensions = info.dimensions;
+
+    /* Datasets that follow an input can be extended along their leading dimension */
+    auto follow = std::find(input_dataset_names.begin(), input_dataset_names.end(), job.follow);
+    uint32_t follow_input = job.follow.size() ? follow - input_dataset_names.begin() + 1 : 0;
+
+    for (auto &info: job.virtual_datasets)
+    {
         /* Create dataspace */
-        hid_t space_id = H5Screate_simple(info.dimensions.size(), info.dimensions.data(), NULL);
+        std::vector<hsize_t> max_dims = info.dimensions;
+        if (follow_input)
+            max_dims[0] = H5S_UNLIMITED;
+        hid_t space_id = H5Screate_simple(info.dimensions.size(), info.dimensions.data(), max_dims.data());
         if (space_id < 0)
         {
             fprintf(stderr, "Failed to create dataspace\n");
-            exit(1);
+            return false;
         }
 
         /* Create virtual dataset creation property list */
@@ -390,7 +758,7 @@ int main(int argc, char **argv)
         if (dcpl_id < 0)
         {
             fprintf(stderr, "Failed to create dataset property list\n");
-            exit(1);
+            return false;
         }
 
         herr_t status;
@@ -399,24 +767,24 @@ int main(int argc, char **argv)
         {
             fprintf(stderr, "Failed to configure dataset filter\n");
             fprintf(stderr, "Make sure to set $HDF5_PLUGIN_PATH prior to running this tool\n");
-            exit(1);
+            return false;
         }
 
-        status = H5Pset_chunk(dcpl_id, info.dimensions.size(), info.dimensions.data());
+        status = H5Pset_chunk(dcpl_id, info.chunk_dimensions.size(), info.chunk_dimensions.data());
         if (status < 0)
         {
             fprintf(stderr, "Failed to set chunk size\n");
-            exit(1);
+            return false;
         }
 
-        if (std::find(delete_list.begin(), delete_list.end(), info.name) != delete_list.end())
+        if (std::find(job.delete_list.begin(), job.delete_list.end(), info.name) != job.delete_list.end())
         {
             /* Delete existing dataset so its contents can be overwritten */
             status = H5Ldelete(file_id, info.name.c_str(), H5P_DEFAULT);
             if (status < 0)
             {
                 fprintf(stderr, "Failed to delete existing virtual dataset %s\n", info.name.c_str());
-                exit(1);
+                return false;
             }
         }
 
@@ -425,59 +793,413 @@ int main(int argc, char **argv)
         if (dset_id < 0)
         {
             fprintf(stderr, "Failed to create dataset\n");
-            exit(1);
+            return false;
         }
 
-        /* Prepare data for JSON payload */
-        std::vector<std::string> input_dataset_names;
-        std::transform(input_datasets.begin(), input_datasets.end(), std::back_inserter(input_dataset_names),
-            [](DatasetInfo info) -> std::string { return info.name; });
-
-        /* JSON Payload */
+        /* Description of the payload, shown to the user */
         json jas;
         jas["output_dataset"] = info.name;
         jas["output_resolution"] = info.dimensions;
         jas["output_datatype"] = info.datatype;
+        jas["output_chunk_resolution"] = info.chunk_dimensions;
         jas["input_datasets"] = input_dataset_names;
-        jas["bytecode_size"] = bytecode.length();
-        jas["backend"] = backend->name();
+        jas["bytecode_size"] = job.bytecode.length();
+        jas["bytecode_dataset"] = bytecode_dataset;
+        jas["backend"] = job.backend->name();
 
-        std::string jas_str = jas.dump();
-        size_t payload_size = jas_str.length() + bytecode.size() + 1;
-        printf("%s dataset header:\n%s\n", info.name.c_str(), jas.dump(4).c_str());
+        if (job.uses_parallel_for)
+            jas["parallel_workers"] = job.parallel_workers;
+        if (job.materialize)
+            jas["materialize"] = true;
+        if (job.row_local)
+            jas["row_local"] = true;
+        if (follow_input)
+            jas["follow_input"] = job.follow;
 
-        /* Sanity check: the JSON and the bytecode must fit in the dataset */
-        hsize_t grid_size = std::accumulate(std::begin(info.dimensions), std::end(info.dimensions), 1, std::multiplies<hsize_t>());
-        if (payload_size > (grid_size * H5Tget_size(info.hdf5_datatype)))
-        {
-            /* TODO: fallback to saving a regular dataset */
-            fprintf(stderr, "Error: len(JSON+bytecode) > virtual dataset dimensions\n");
-            exit(1);
-        }
+        /*
+         * The UDF writes all of its outputs in a single run. The filter keeps
+         * the chunks of the outputs that share the layout of the one being
+         * read, so reading them next does not run the UDF again.
+         */
+        std::vector<const DatasetInfo *> siblings;
+        for (auto &other: job.virtual_datasets)
+            if (other.name != info.name && other.dimensions == info.dimensions &&
+                other.chunk_dimensions == info.chunk_dimensions)
+            {
+                siblings.push_back(&other);
+                jas["sibling_datasets"].push_back({{"name", other.name}, {"datatype", other.datatype}});
+            }
 
-        /* Prepare payload data */
-        char *payload = (char *) malloc(grid_size * H5Tget_size(info.hdf5_datatype));
-        char *p = payload;
-        memcpy(p, &jas_str[0], jas_str.length());
-        p += jas_str.length();
-        *p = '\0';
-        memcpy(&p[1], &bytecode[0], bytecode.size());
+        /* Help the filter find the file that holds this dataset */
+        char file_path[PATH_MAX];
+        std::string output_file;
+        if (realpath(hdf5_file.c_str(), file_path))
+            jas["output_file"] = output_file = file_path;
 
-        /* Write the data to the dataset */
-        status = H5Dwrite(dset_id, info.hdf5_datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, payload);
-        if (status < 0)
+        printf("%s dataset header:\n%s\n", info.name.c_str(), jas.dump(4).c_str());
+
+        /* Binary payload (see payload.h) */
+        PayloadWriter writer;
+        writer.header.backend_id = payloadId(payload_backends, job.backend->name());
+        writer.header.datatype_id = payloadId(payload_datatypes, info.datatype);
+        writer.header.rank = info.dimensions.size();
+        writer.header.num_inputs = input_dataset_names.size();
+        writer.header.num_siblings = siblings.size();
+        writer.header.flags = (job.uses_parallel_for ? PAYLOAD_FLAG_PARALLEL_FOR : 0) |
+            (job.materialize ? PAYLOAD_FLAG_MATERIALIZE : 0) |
+            (job.row_local ? PAYLOAD_FLAG_ROW_LOCAL : 0) |
+            (job.uses_data_slice ? PAYLOAD_FLAG_DATA_SLICE : 0);
+        writer.header.follow_input = follow_input;
+        writer.header.parallel_workers = job.uses_parallel_for ? job.parallel_workers : 1;
+        writer.header.blob_size = job.bytecode.length();
+        writer.header.blob_hash = hash64(job.bytecode.data(), job.bytecode.size());
+        if (! writer.header.backend_id || ! writer.header.datatype_id)
         {
-            fprintf(stderr, "Failed to write to the dataset\n");
-            exit(1);
+            fprintf(stderr, "Cannot encode the payload of dataset %s\n", info.name.c_str());
+            return false;
         }
+        for (auto dim: info.dimensions)
+            writer.u64(dim);
+        for (auto dim: info.chunk_dimensions)
+            writer.u64(dim);
+        for (auto sibling: siblings)
+            writer.u32(payloadId(payload_datatypes, sibling->datatype));
+        writer.str(info.name);
+        writer.str(output_file);
+        for (auto &name: input_dataset_names)
+            writer.str(name);
+        for (auto sibling: siblings)
+            writer.str(sibling->name);
+        std::string payload = writer.finish();
+        if (! writePayloads(dset_id, payload, info.dimensions, info.chunk_dimensions, 0))
+            return false;
 
         /* Close and release resources */
         status = H5Pclose(dcpl_id);
         status = H5Dclose(dset_id);
         status = H5Sclose(space_id);
-        status = H5Fclose(file_id);
-        free(payload);
     }
-    
+    return true;
+}
+
+/* Collect the paths of the datasets that hold the UDF filter */
+static herr_t collectVirtualDatasets(hid_t group_id, const char *name, const H5L_info_t *info, void *op_data)
+{
+    auto names = static_cast<std::vector<std::string> *>(op_data);
+    if (info->type != H5L_TYPE_HARD)
+        return 0;
+    H5E_BEGIN_TRY {
+        hid_t dset_id = H5Dopen(group_id, name, H5P_DEFAULT);
+        hid_t dcpl_id = dset_id >= 0 ? H5Dget_create_plist(dset_id) : -1;
+        unsigned int flags = 0;
+        size_t cd_nelmts = 0;
+        if (dcpl_id >= 0 && H5Pget_filter_by_id2(
+            dcpl_id, HDF5_UDF_FILTER_ID, &flags, &cd_nelmts, NULL, 0, NULL, NULL) >= 0)
+            names->push_back(std::string("/") + name);
+        if (dcpl_id >= 0)
+            H5Pclose(dcpl_id);
+        if (dset_id >= 0)
+            H5Dclose(dset_id);
+    } H5E_END_TRY;
+    return 0;
+}
+
+/*
+ * Extend a virtual dataset created with --follow to the current leading
+ * extent of the input it follows, and write the payloads of the chunks
+ * added by that. The new payloads are copies of the first one, so the filter keeps
+ * serving the chunks computed before from the result cache. Sets 'changed'
+ * if the dataset has been extended.
+ */
+static bool refreshDataset(hid_t file_id, const std::string &name, bool &changed)
+{
+    hid_t dset_id = H5Dopen(file_id, name.c_str(), H5P_DEFAULT);
+    if (dset_id < 0)
+    {
+        fprintf(stderr, "Error opening dataset %s\n", name.c_str());
+        return false;
+    }
+    hid_t space_id = H5Dget_space(dset_id);
+    int rank = H5Sget_simple_extent_ndims(space_id);
+    std::vector<hsize_t> dims(std::max(rank, 0)), chunk_dims(std::max(rank, 0));
+    H5Sget_simple_extent_dims(space_id, dims.data(), NULL);
+    H5Sclose(space_id);
+    hid_t dcpl_id = H5Dget_create_plist(dset_id);
+    bool chunked = rank > 0 && H5Pget_chunk(dcpl_id, rank, chunk_dims.data()) == rank;
+    H5Pclose(dcpl_id);
+
+    /* Payloads written by older versions of hdf5-udf never follow an input */
+    std::vector<hsize_t> offset(dims.size(), 0);
+    hsize_t storage_size = 0;
+    PayloadHeader header;
+    std::string raw;
+    uint32_t filter_mask = 0;
+    if (chunked && H5Dget_chunk_storage_size(dset_id, offset.data(), &storage_size) >= 0 && storage_size > 0)
+    {
+        raw.resize(storage_size);
+        if (H5Dread_chunk(dset_id, H5P_DEFAULT, offset.data(), &filter_mask, &raw[0]) < 0)
+            raw.clear();
+    }
+    if (! readPayloadHeader(raw.data(), raw.size(), header) || header.follow_input == 0)
+    {
+        H5Dclose(dset_id);
+        return true;
+    }
+    if (header.blob_offset || header.rank != dims.size())
+    {
+        fprintf(stderr, "Unexpected payload of dataset %s\n", name.c_str());
+        H5Dclose(dset_id);
+        return false;
+    }
+
+    /* Name of the input being followed */
+    PayloadReader reader(raw.data(), header);
+    for (uint32_t i=0; i<header.rank * 2; ++i)
+        reader.u64();
+    for (uint32_t i=0; i<header.num_siblings; ++i)
+        reader.u32();
+    reader.str();
+    reader.str();
+    std::string input_name;
+    for (uint32_t i=0; i<header.follow_input; ++i)
+        input_name = reader.str();
+    if (! reader.valid())
+    {
+        fprintf(stderr, "Malformed payload of dataset %s\n", name.c_str());
+        H5Dclose(dset_id);
+        return false;
+    }
+
+    hid_t input_id = H5Dopen(file_id, input_name.c_str(), H5P_DEFAULT);
+    if (input_id < 0)
+    {
+        fprintf(stderr, "Error opening dataset %s, followed by %s\n", input_name.c_str(), name.c_str());
+        H5Dclose(dset_id);
+        return false;
+    }
+    space_id = H5Dget_space(input_id);
+    std::vector<hsize_t> input_dims(std::max(H5Sget_simple_extent_ndims(space_id), 0));
+    H5Sget_simple_extent_dims(space_id, input_dims.data(), NULL);
+    H5Sclose(space_id);
+    H5Dclose(input_id);
+    if (input_dims.size() != dims.size())
+    {
+        fprintf(stderr, "Dataset %s no longer matches the rank of %s\n", name.c_str(), input_name.c_str());
+        H5Dclose(dset_id);
+        return false;
+    }
+
+    /* Shrinking would have HDF5 rewrite the edge chunks through the filter */
+    bool ret = true;
+    if (input_dims[0] < dims[0])
+    {
+        fprintf(stderr, "Dataset %s is shorter than %s; attach the UDF again with --overwrite\n",
+            input_name.c_str(), name.c_str());
+        ret = false;
+    }
+    else if (input_dims[0] > dims[0])
+    {
+        hsize_t old_rows = dims[0];
+        dims[0] = input_dims[0];
+        std::string payload = raw.substr(0, header.header_size);
+        ret = H5Dset_extent(dset_id, dims.data()) >= 0;
+        if (! ret)
+            fprintf(stderr, "Failed to extend dataset %s\n", name.c_str());
+        else
+            ret = writePayloads(dset_id, payload, dims, chunk_dims, old_rows);
+        if (ret)
+            printf("%s: extended from %llu to %llu rows, following %s\n", name.c_str(),
+                (unsigned long long) old_rows, (unsigned long long) dims[0], input_name.c_str());
+        changed = true;
+    }
+    H5Dclose(dset_id);
+    return ret;
+}
+
+/*
+ * Bring all virtual datasets that follow an input up to date. Datasets may
+ * follow other virtual datasets, so passes are made until none changes.
+ */
+static bool refreshDatasets(hid_t file_id)
+{
+    std::vector<std::string> names;
+    if (H5Lvisit(file_id, H5_INDEX_NAME, H5_ITER_NATIVE, collectVirtualDatasets, &names) < 0)
+    {
+        fprintf(stderr, "Failed to list the datasets of the file\n");
+        return false;
+    }
+    for (size_t pass=0; pass<=names.size(); ++pass)
+    {
+        bool changed = false;
+        for (auto &name: names)
+            if (! refreshDataset(file_id, name, changed))
+                return false;
+        if (! changed)
+            break;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 3)
+    {
+        fprintf(stdout,
+            "Syntax: %s <hdf5_file> <udf_file> [options] [virtual_dataset..]\n"
+            "        %s <hdf5_file> --manifest=<manifest_file> [options]\n"
+            "        %s <hdf5_file> --refresh\n\n"
+            "Options:\n"
+            "  hdf5_file                      Input/output HDF5 file\n"
+            "  udf_file                       File implementing the user-defined-function\n"
+            "  virtual_dataset                Virtual dataset(s) to create. See syntax below.\n"
+            "                                 If omitted, dataset names are picked from udf_file\n"
+            "                                 and their resolutions/types are set to match the input\n"
+            "                                 datasets declared in that same file\n"
+            "  --manifest=FILE                Attach all UDFs listed on a JSON manifest in one run.\n"
+            "                                 See the format below.\n"
+            "  --overwrite                    Overwrite existing virtual dataset(s)\n"
+            "  --parallel=N                   Number of processes that share the ranges given to\n"
+            "                                 lib.parallel_for(). Defaults to the number of CPUs\n"
+            "                                 available when the dataset is read.\n"
+            "  --materialize                  Keep the result of each chunk on a cache file once\n"
+            "                                 computed and serve later reads from it for as long\n"
+            "                                 as the input datasets are unchanged\n"
+            "  --row-local                    Declare that each row of the output only depends on\n"
+            "                                 the same row of the inputs (as elementwise UDFs do).\n"
+            "                                 With --materialize, chunks stay on the cache for as\n"
+            "                                 long as their rows of the inputs are unchanged\n"
+            "  --follow=DATASET               Make the leading dimension of the virtual dataset(s)\n"
+            "                                 follow the current one of input DATASET, which may\n"
+            "                                 grow. Requires the chunk resolution to be given.\n"
+            "  --refresh                      Extend the virtual datasets of hdf5_file created with\n"
+            "                                 --follow to the current extent of their inputs\n\n"
+            "Formatting options for <virtual_dataset>:\n"
+            "  dataset_name:resolution:type[:chunks]\n"
+            "                                 dataset_name: name of the virtual dataset\n"
+            "                                 resolution: XRES, XRESxYRES, or XRESxYRESxZRES\n"
+            "                                 type: [u]int16, [u]int32, [u]int64, float, or double\n"
+            "                                 chunks: chunk resolution, given in the same format as\n"
+            "                                 the resolution. Each chunk is computed independently,\n"
+            "                                 so partial reads only run the UDF on the chunks they\n"
+            "                                 select. Defaults to a single chunk.\n\n"
+            "Format of <manifest_file>:\n"
+            "  [{\"udf\": \"udf_file\", \"datasets\": [\"virtual_dataset\", ...],\n"
+            "    \"overwrite\": bool, \"parallel\": N, \"materialize\": bool,\n"
+            "    \"row_local\": bool, \"follow\": \"dataset\"}, ...]\n"
+            "                                 Only \"udf\" is required; the other options default to\n"
+            "                                 the ones given in the command line. UDF files are\n"
+            "                                 compiled concurrently and may read virtual datasets\n"
+            "                                 declared by earlier entries.\n\n"
+            "Examples:\n"
+            "%s sample.h5 simple_vector.lua Simple:500:float\n"
+            "%s sample.h5 sine_wave.lua SineWave:100x10:int32\n"
+            "%s sample.h5 sine_wave.lua SineWave:100x10:int32:25x10\n"
+            "%s sample.h5 --manifest=udfs.json\n"
+            "%s sample.h5 scale.lua Scaled:1000x64:float:100x64 --follow=Samples --row-local --materialize\n"
+            "%s sample.h5 --refresh\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+
+    /* Sanity checks */
+    if (H5Zfilter_avail(HDF5_UDF_FILTER_ID) <= 0)
+    {
+        fprintf(stderr, "Could not locate the HDF5-UDF filter\n");
+        fprintf(stderr, "Make sure to set $HDF5_PLUGIN_PATH prior to running this tool\n");
+        exit(1);
+    }
+
+    std::string hdf5_file = argv[1];
+    std::string manifest_file;
+    const int first_dataset_index = 3;
+    UdfJob defaults;
+
+    if (strcmp(argv[2], "--refresh") == 0)
+    {
+        hid_t file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+        if (file_id < 0)
+        {
+            fprintf(stderr, "Error opening %s\n", hdf5_file.c_str());
+            exit(1);
+        }
+        bool success = refreshDatasets(file_id);
+        H5Fclose(file_id);
+        return success ? 0 : 1;
+    }
+    else if (strncmp(argv[2], "--manifest=", strlen("--manifest=")) == 0)
+        manifest_file = &argv[2][strlen("--manifest=")];
+    else
+        defaults.udf_file = argv[2];
+
+    /* Process options and virtual (output) datasets given in the command line */
+    for (int i=first_dataset_index; i<argc; ++i)
+    {
+        if (strcmp(argv[i], "--overwrite") == 0)
+        {
+            defaults.overwrite = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--materialize") == 0)
+        {
+            defaults.materialize = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--row-local") == 0)
+        {
+            defaults.row_local = true;
+            continue;
+        }
+        if (strncmp(argv[i], "--follow=", strlen("--follow=")) == 0)
+        {
+            defaults.follow = &argv[i][strlen("--follow=")];
+            continue;
+        }
+        if (strncmp(argv[i], "--parallel=", strlen("--parallel=")) == 0)
+        {
+            defaults.parallel_workers = atoi(&argv[i][strlen("--parallel=")]);
+            if (defaults.parallel_workers <= 0)
+            {
+                fprintf(stderr, "Invalid number of processes given to --parallel\n");
+                exit(1);
+            }
+            continue;
+        }
+        if (manifest_file.size())
+        {
+            fprintf(stderr, "Virtual datasets of a batch must be given in the manifest ('%s')\n", argv[i]);
+            exit(1);
+        }
+        defaults.dataset_specs.push_back(argv[i]);
+    }
+
+    std::vector<UdfJob> jobs;
+    if (manifest_file.empty())
+        jobs.push_back(defaults);
+    else if (! parseManifest(manifest_file, defaults, jobs))
+        exit(1);
+
+    /* The file is opened once for all jobs */
+    hid_t file_id = H5Fopen(hdf5_file.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        fprintf(stderr, "Error opening %s\n", hdf5_file.c_str());
+        exit(1);
+    }
+
+    std::map<std::string, DatasetInfo> declared;
+    for (auto &job: jobs)
+        if (! prepareJob(file_id, job, declared, argv[0]))
+            exit(1);
+
+    /* Compile the UDF source files */
+    if (! compileJobs(jobs))
+        exit(1);
+
+    /* Create the virtual datasets */
+    for (auto &job: jobs)
+        if (! writeJob(file_id, hdf5_file, job))
+            exit(1);
+
+    H5Fclose(file_id);
     return 0;
 }
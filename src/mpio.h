@@ -0,0 +1,59 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: mpio.h
+ *
+ * Access to files opened through the MPI-IO driver of parallel HDF5 builds.
+ *
+ * When an MPI job reads a virtual dataset, each rank runs the filter on the
+ * chunks its own selection covers, with no telling which chunks other ranks
+ * are on. Collective operations issued from the filter would then wait on
+ * ranks that never issue them, so the filter only ever reads from those files
+ * with independent transfers and independent metadata operations. It also
+ * reads all inputs itself, as the processes it forks cannot use MPI.
+ */
+#ifndef __mpio_h
+#define __mpio_h
+
+#include <hdf5.h>
+
+/* Whether a file is accessed through the MPI-IO driver */
+static inline bool usesMpio(hid_t file_id)
+{
+#ifdef H5_HAVE_PARALLEL
+    hid_t fapl_id = H5Fget_access_plist(file_id);
+    if (fapl_id < 0)
+        return false;
+    bool mpio = H5Pget_driver(fapl_id) == H5FD_MPIO;
+    H5Pclose(fapl_id);
+    return mpio;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Access property list for the links and datasets opened by the filter. Files
+ * opened with collective metadata reads would otherwise have them done
+ * collectively.
+ */
+static inline hid_t independentAccess()
+{
+#ifdef H5_HAVE_PARALLEL
+    static hid_t dapl_id = -1;
+    if (dapl_id < 0)
+    {
+        dapl_id = H5Pcreate(H5P_DATASET_ACCESS);
+        if (dapl_id >= 0 && H5Pset_all_coll_metadata_ops(dapl_id, false) < 0)
+        {
+            H5Pclose(dapl_id);
+            dapl_id = -1;
+        }
+    }
+    return dapl_id >= 0 ? dapl_id : H5P_DEFAULT;
+#else
+    return H5P_DEFAULT;
+#endif
+}
+
+#endif /* __mpio_h */
@@ -0,0 +1,277 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: ops.cpp
+ *
+ * Vectorized kernels made available to UDFs as lib.ops.
+ *
+ * The kernels are plain loops that the compiler vectorizes. On x86-64 each
+ * entry point is cloned for AVX2 and AVX-512, and the dynamic loader picks
+ * the best clone for the CPU the first time it resolves the symbol, so the
+ * library still runs on machines without those instruction sets.
+ */
+#include <math.h>
+#include <limits>
+#include <type_traits>
+#include "ops.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__ELF__) && ! defined(__clang__)
+#define OPS_DISPATCH __attribute__((target_clones("default", "avx2", "avx512f")))
+#else
+#define OPS_DISPATCH
+#endif
+
+/* Kernels are inlined into each clone, so they are built for its instruction set */
+#define OPS_INLINE inline __attribute__((always_inline))
+
+/*
+ * Integer arithmetic is done on unsigned integers at least 32 bits wide, so
+ * that overflows wrap around (as the dataset types do) instead of being
+ * undefined behavior.
+ */
+template <typename T, bool integral = std::is_integral<T>::value>
+struct OpsWideOf { typedef T type; };
+
+template <typename T>
+struct OpsWideOf<T, true> {
+    typedef typename std::conditional<(sizeof(T) < 4), uint32_t, typename std::make_unsigned<T>::type>::type type;
+};
+
+template <typename T>
+using OpsWide = typename OpsWideOf<T>::type;
+
+/* Convert a value, saturating floating point values that don't fit integer types */
+template <typename To, typename From>
+static OPS_INLINE To convertValue(From v)
+{
+    if (std::is_integral<To>::value && ! std::is_integral<From>::value)
+    {
+        /* The largest 64-bit integers cannot be represented as doubles, the one below can */
+        const double lo = (double) std::numeric_limits<To>::lowest();
+        const double hi = sizeof(To) == 8 ?
+            nextafter((double) std::numeric_limits<To>::max(), 0.0) :
+            (double) std::numeric_limits<To>::max();
+        double d = (double) v;
+        d = d > lo ? d : lo;
+        d = d < hi ? d : hi;
+        return (To) d;
+    }
+    return (To) v;
+}
+
+template <typename T>
+static OPS_INLINE int binary(int op, T *out, const T *a, const T *b, uint64_t n)
+{
+    typedef OpsWide<T> W;
+    switch (op)
+    {
+        case OPS_ADD:
+            for (uint64_t i=0; i<n; ++i)
+                out[i] = (T) ((W) a[i] + (W) b[i]);
+            return 0;
+        case OPS_SUB:
+            for (uint64_t i=0; i<n; ++i)
+                out[i] = (T) ((W) a[i] - (W) b[i]);
+            return 0;
+        case OPS_MUL:
+            for (uint64_t i=0; i<n; ++i)
+                out[i] = (T) ((W) a[i] * (W) b[i]);
+            return 0;
+        case OPS_DIV:
+            /* Dividing the lowest signed value by -1 overflows, so it is negated instead */
+            if (std::is_integral<T>::value)
+                for (uint64_t i=0; i<n; ++i)
+                    out[i] = ! b[i] ? 0 :
+                        std::is_signed<T>::value && b[i] == (T) -1 ? (T) (0 - (W) a[i]) : (T) (a[i] / b[i]);
+            else
+                for (uint64_t i=0; i<n; ++i)
+                    out[i] = a[i] / b[i];
+            return 0;
+        case OPS_MINIMUM:
+            for (uint64_t i=0; i<n; ++i)
+                out[i] = a[i] < b[i] ? a[i] : b[i];
+            return 0;
+        case OPS_MAXIMUM:
+            for (uint64_t i=0; i<n; ++i)
+                out[i] = a[i] > b[i] ? a[i] : b[i];
+            return 0;
+    }
+    return -1;
+}
+
+template <typename T>
+static OPS_INLINE int scale(T *out, const T *in, uint64_t n, double factor, double offset)
+{
+    if (std::is_integral<T>::value)
+        for (uint64_t i=0; i<n; ++i)
+            out[i] = convertValue<T>((double) in[i] * factor + offset);
+    else
+    {
+        /* Single precision data is scaled in single precision, for wider vectors */
+        const T f = (T) factor, o = (T) offset;
+        for (uint64_t i=0; i<n; ++i)
+            out[i] = in[i] * f + o;
+    }
+    return 0;
+}
+
+template <typename T>
+static OPS_INLINE int clamp(T *out, const T *in, uint64_t n, double lo, double hi)
+{
+    const T tlo = convertValue<T>(lo), thi = convertValue<T>(hi);
+    for (uint64_t i=0; i<n; ++i)
+    {
+        T v = in[i] < tlo ? tlo : in[i];
+        out[i] = v > thi ? thi : v;
+    }
+    return 0;
+}
+
+template <typename To, typename From>
+static OPS_INLINE int convert(To *out, const From *in, uint64_t n)
+{
+    for (uint64_t i=0; i<n; ++i)
+        out[i] = convertValue<To>(in[i]);
+    return 0;
+}
+
+/*
+ * Reductions keep several partial results, which breaks the dependency
+ * between consecutive iterations and lets the loop be vectorized without
+ * reassociating floating point operations behind the user's back.
+ */
+#define OPS_LANES 8
+
+template <typename T>
+static OPS_INLINE double reduce(int op, const T *in, uint64_t n)
+{
+    typedef typename std::conditional<std::is_integral<T>::value, OpsWide<T>, double>::type Acc;
+    uint64_t head = n - n % OPS_LANES;
+    if (op == OPS_SUM)
+    {
+        /* 16-bit sums are kept in 64 bits to hold up to 2^48 elements */
+        typedef typename std::conditional<sizeof(Acc) < 8 && std::is_integral<T>::value, uint64_t, Acc>::type Sum;
+        Sum lanes[OPS_LANES] = {0};
+        for (uint64_t i=0; i<head; i+=OPS_LANES)
+            for (int k=0; k<OPS_LANES; ++k)
+                lanes[k] += (Sum) in[i+k];
+        Sum total = 0;
+        for (int k=0; k<OPS_LANES; ++k)
+            total += lanes[k];
+        for (uint64_t i=head; i<n; ++i)
+            total += (Sum) in[i];
+        if (std::is_integral<T>::value && std::is_signed<T>::value)
+            return (double) (int64_t) total;
+        return (double) total;
+    }
+    if ((op != OPS_MIN && op != OPS_MAX) || n == 0)
+        return 0;
+
+    T lanes[OPS_LANES];
+    for (int k=0; k<OPS_LANES; ++k)
+        lanes[k] = in[0];
+    if (op == OPS_MIN)
+        for (uint64_t i=0; i<head; i+=OPS_LANES)
+            for (int k=0; k<OPS_LANES; ++k)
+                lanes[k] = in[i+k] < lanes[k] ? in[i+k] : lanes[k];
+    else
+        for (uint64_t i=0; i<head; i+=OPS_LANES)
+            for (int k=0; k<OPS_LANES; ++k)
+                lanes[k] = in[i+k] > lanes[k] ? in[i+k] : lanes[k];
+    T result = lanes[0];
+    for (int k=1; k<OPS_LANES; ++k)
+        result = op == OPS_MIN ? (lanes[k] < result ? lanes[k] : result) : (lanes[k] > result ? lanes[k] : result);
+    for (uint64_t i=head; i<n; ++i)
+        result = op == OPS_MIN ? (in[i] < result ? in[i] : result) : (in[i] > result ? in[i] : result);
+    return (double) result;
+}
+
+/* Call FN<T>(args) with T set after an OpsType value */
+#define OPS_SWITCH_TYPE(type, FN, ...) \
+    switch (type) { \
+        case OPS_INT16:  return FN<int16_t>(__VA_ARGS__); \
+        case OPS_INT32:  return FN<int32_t>(__VA_ARGS__); \
+        case OPS_INT64:  return FN<int64_t>(__VA_ARGS__); \
+        case OPS_UINT16: return FN<uint16_t>(__VA_ARGS__); \
+        case OPS_UINT32: return FN<uint32_t>(__VA_ARGS__); \
+        case OPS_UINT64: return FN<uint64_t>(__VA_ARGS__); \
+        case OPS_FLOAT:  return FN<float>(__VA_ARGS__); \
+        case OPS_DOUBLE: return FN<double>(__VA_ARGS__); \
+    }
+
+template <typename T>
+static OPS_INLINE int binaryOf(int op, void *out, const void *a, const void *b, uint64_t n)
+{
+    return binary<T>(op, (T *) out, (const T *) a, (const T *) b, n);
+}
+
+template <typename T>
+static OPS_INLINE int scaleOf(void *out, const void *in, uint64_t n, double factor, double offset)
+{
+    return scale<T>((T *) out, (const T *) in, n, factor, offset);
+}
+
+template <typename T>
+static OPS_INLINE int clampOf(void *out, const void *in, uint64_t n, double lo, double hi)
+{
+    return clamp<T>((T *) out, (const T *) in, n, lo, hi);
+}
+
+template <typename T>
+static OPS_INLINE double reduceOf(int op, const void *in, uint64_t n)
+{
+    return reduce<T>(op, (const T *) in, n);
+}
+
+template <typename From>
+static OPS_INLINE int convertFrom(int out_type, void *out, const void *in, uint64_t n)
+{
+    const From *src = (const From *) in;
+    switch (out_type)
+    {
+        case OPS_INT16:  return convert((int16_t *) out, src, n);
+        case OPS_INT32:  return convert((int32_t *) out, src, n);
+        case OPS_INT64:  return convert((int64_t *) out, src, n);
+        case OPS_UINT16: return convert((uint16_t *) out, src, n);
+        case OPS_UINT32: return convert((uint32_t *) out, src, n);
+        case OPS_UINT64: return convert((uint64_t *) out, src, n);
+        case OPS_FLOAT:  return convert((float *) out, src, n);
+        case OPS_DOUBLE: return convert((double *) out, src, n);
+    }
+    return -1;
+}
+
+OPS_DISPATCH
+int udfOpsBinary(int op, int type, void *out, const void *a, const void *b, uint64_t n)
+{
+    OPS_SWITCH_TYPE(type, binaryOf, op, out, a, b, n);
+    return -1;
+}
+
+OPS_DISPATCH
+int udfOpsScale(int type, void *out, const void *in, uint64_t n, double factor, double offset)
+{
+    OPS_SWITCH_TYPE(type, scaleOf, out, in, n, factor, offset);
+    return -1;
+}
+
+OPS_DISPATCH
+int udfOpsClamp(int type, void *out, const void *in, uint64_t n, double lo, double hi)
+{
+    OPS_SWITCH_TYPE(type, clampOf, out, in, n, lo, hi);
+    return -1;
+}
+
+OPS_DISPATCH
+int udfOpsConvert(int out_type, void *out, int in_type, const void *in, uint64_t n)
+{
+    OPS_SWITCH_TYPE(in_type, convertFrom, out_type, out, in, n);
+    return -1;
+}
+
+OPS_DISPATCH
+double udfOpsReduce(int op, int type, const void *in, uint64_t n)
+{
+    OPS_SWITCH_TYPE(type, reduceOf, op, in, n);
+    return 0;
+}
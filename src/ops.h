@@ -0,0 +1,73 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: ops.h
+ *
+ * Vectorized kernels made available to UDFs as lib.ops.
+ */
+#ifndef __ops_h
+#define __ops_h
+
+#include <stdint.h>
+
+/*
+ * Element types, numbered after the order of the types supported by
+ * DatasetInfo. The templates of all backends use the same numbers.
+ */
+enum OpsType {
+    OPS_INT16 = 0,
+    OPS_INT32,
+    OPS_INT64,
+    OPS_UINT16,
+    OPS_UINT32,
+    OPS_UINT64,
+    OPS_FLOAT,
+    OPS_DOUBLE,
+    OPS_TYPE_COUNT
+};
+
+/* Elementwise operations on two arrays */
+enum OpsBinary {
+    OPS_ADD = 0,
+    OPS_SUB,
+    OPS_MUL,
+    OPS_DIV,
+    OPS_MINIMUM,
+    OPS_MAXIMUM
+};
+
+/* Reductions of an array to a single value */
+enum OpsReduce {
+    OPS_SUM = 0,
+    OPS_MIN,
+    OPS_MAX
+};
+
+/*
+ * Kernels exported to the templates. Arrays hold 'n' elements of the given
+ * type and may overlap only if they are the same. The kernels return 0, or
+ * -1 if given an unknown operation or type. Integer division by zero yields
+ * zero, and dividing the lowest value of a signed type by -1 wraps around to
+ * that same value. Floating point values stored on integer types are saturated to the
+ * range of the type (NaN becomes its lowest value); other conversions follow
+ * the rules of C casts.
+ */
+extern "C" {
+// out[i] = a[i] <op> b[i]
+int udfOpsBinary(int op, int type, void *out, const void *a, const void *b, uint64_t n);
+
+// out[i] = in[i] * scale + offset
+int udfOpsScale(int type, void *out, const void *in, uint64_t n, double scale, double offset);
+
+// out[i] = in[i], limited to the range [lo, hi]
+int udfOpsClamp(int type, void *out, const void *in, uint64_t n, double lo, double hi);
+
+// out[i] = (out_type) in[i]
+int udfOpsConvert(int out_type, void *out, int in_type, const void *in, uint64_t n);
+
+// Sum, minimum, or maximum of the elements of 'in'. Returns 0 on errors and
+// for the minimum and maximum of empty arrays.
+double udfOpsReduce(int op, int type, const void *in, uint64_t n);
+}
+
+#endif /* __ops_h */
@@ -0,0 +1,248 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: payload.h
+ *
+ * Binary layout of the chunk payloads of virtual datasets.
+ *
+ * A payload starts with a fixed-size header, followed by the dimensions of the
+ * dataset and of its chunks, the datatypes of the sibling outputs, a table of
+ * strings (output name, output file, input names, and sibling names, each one
+ * prefixed by its length), and finally the offset of the chunk. All integers
+ * are stored in little-endian byte order. Everything but the chunk offset is
+ * the same on all the chunks of a dataset, so the filter only decodes it once
+ * and identifies the dataset by those bytes afterwards. Payloads written by
+ * older versions of hdf5-udf are JSON strings, which start with '{'.
+ */
+#ifndef __payload_h
+#define __payload_h
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+#include <hdf5.h>
+#include <string>
+#include <vector>
+#include "hash.h"
+
+#define PAYLOAD_MAGIC "HUDFPAYL"
+#define PAYLOAD_MAGIC_SIZE 8
+#define PAYLOAD_VERSION 1
+
+#define PAYLOAD_FLAG_MATERIALIZE  0x1 /* Results are kept on the result cache */
+#define PAYLOAD_FLAG_PARALLEL_FOR 0x2 /* The UDF calls lib.parallel_for() */
+#define PAYLOAD_FLAG_ROW_LOCAL    0x4 /* Each output row only depends on the same row of the inputs */
+#define PAYLOAD_FLAG_DATA_SLICE   0x8 /* The UDF calls lib.getDataSlice() */
+
+/* Group that holds the bytecode shared by the virtual datasets of a file */
+#define BYTECODE_GROUP "/.hdf5-udf"
+
+struct PayloadHeader {
+    char magic[PAYLOAD_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t header_size;       /* Whole header, chunk offset included */
+    uint32_t backend_id;        /* Index into payload_backends */
+    uint32_t datatype_id;       /* Index into payload_datatypes */
+    uint32_t rank;
+    uint32_t num_inputs;
+    uint32_t num_siblings;
+    uint32_t flags;             /* PAYLOAD_FLAG_* */
+    int32_t parallel_workers;   /* Processes that share lib.parallel_for(), 0 for one per CPU */
+    uint32_t follow_input;      /* 1 + index of the input whose leading extent the dataset follows, or 0 */
+    uint64_t blob_offset;       /* Start of the bytecode on the payload, or 0 if kept on BYTECODE_GROUP */
+    uint64_t blob_size;
+    uint64_t blob_hash;         /* hash64() of the bytecode, which names its dataset on BYTECODE_GROUP */
+};
+
+/* Identifiers of backends and datatypes. Zero is never assigned. */
+static const char *const payload_backends[] = { "", "LuaJIT", "Python", "C++", "CUDA" };
+static const char *const payload_datatypes[] = {
+    "", "int16", "int32", "int64", "uint16", "uint32", "uint64", "float", "double" };
+
+template <size_t N>
+static inline uint32_t payloadId(const char *const (&table)[N], const std::string &name)
+{
+    for (uint32_t id=1; id<N; ++id)
+        if (name == table[id])
+            return id;
+    return 0;
+}
+
+template <size_t N>
+static inline const char *payloadName(const char *const (&table)[N], uint32_t id)
+{
+    return id > 0 && id < N ? table[id] : NULL;
+}
+
+/* Path to the dataset that holds the bytecode with the given hash */
+static inline std::string bytecodeDatasetPath(uint64_t hash)
+{
+    return std::string(BYTECODE_GROUP) + "/" + hashToString(hash);
+}
+
+static inline bool isBinaryPayload(const char *buf, size_t size)
+{
+    return size >= sizeof(PayloadHeader) && memcmp(buf, PAYLOAD_MAGIC, PAYLOAD_MAGIC_SIZE) == 0;
+}
+
+/*
+ * Read the header of a binary payload in host byte order, checking that the
+ * tables and the bytecode it points to lie within the payload.
+ */
+static inline bool readPayloadHeader(const char *buf, size_t size, PayloadHeader &header)
+{
+    if (! isBinaryPayload(buf, size))
+        return false;
+    memcpy(&header, buf, sizeof(header));
+    uint32_t *words[] = { &header.version, &header.header_size, &header.backend_id,
+        &header.datatype_id, &header.rank, &header.num_inputs, &header.num_siblings, &header.flags,
+        &header.follow_input };
+    for (auto word: words)
+        *word = le32toh(*word);
+    header.parallel_workers = (int32_t) le32toh((uint32_t) header.parallel_workers);
+    header.blob_offset = le64toh(header.blob_offset);
+    header.blob_size = le64toh(header.blob_size);
+    header.blob_hash = le64toh(header.blob_hash);
+
+    uint64_t tables = (uint64_t) header.rank * 3 * sizeof(uint64_t) +
+        (uint64_t) header.num_siblings * sizeof(uint32_t) +
+        (2 + (uint64_t) header.num_inputs + header.num_siblings) * sizeof(uint32_t);
+    if (header.version != PAYLOAD_VERSION || header.header_size > size ||
+        sizeof(header) + tables > header.header_size || header.follow_input > header.num_inputs)
+        return false;
+    if (header.blob_offset && (header.blob_offset < header.header_size ||
+        header.blob_size > size || header.blob_offset > size - header.blob_size))
+        return false;
+    return true;
+}
+
+/* Bytes of a binary payload that are shared by all chunks of the dataset */
+static inline size_t payloadDatasetSize(const PayloadHeader &header)
+{
+    return header.header_size - header.rank * sizeof(uint64_t);
+}
+
+/* Offset of the chunk a binary payload belongs to */
+static inline void readChunkOffset(const char *buf, const PayloadHeader &header, std::vector<hsize_t> &offset)
+{
+    offset.resize(header.rank);
+    const char *p = buf + payloadDatasetSize(header);
+    for (uint32_t i=0; i<header.rank; ++i, p += sizeof(uint64_t))
+    {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        offset[i] = le64toh(value);
+    }
+}
+
+/* Sequential reader of the tables that follow the fixed-size header */
+class PayloadReader {
+public:
+    PayloadReader(const char *in_buf, const PayloadHeader &header) :
+        buf(in_buf), pos(sizeof(PayloadHeader)), end(payloadDatasetSize(header)), ok(true) {}
+
+    uint32_t u32()
+    {
+        uint32_t value = 0;
+        if (check(sizeof(value)))
+            memcpy(&value, &buf[pos], sizeof(value));
+        pos += sizeof(value);
+        return le32toh(value);
+    }
+
+    uint64_t u64()
+    {
+        uint64_t value = 0;
+        if (check(sizeof(value)))
+            memcpy(&value, &buf[pos], sizeof(value));
+        pos += sizeof(value);
+        return le64toh(value);
+    }
+
+    std::string str()
+    {
+        size_t len = u32();
+        std::string value = check(len) ? std::string(&buf[pos], len) : "";
+        pos += len;
+        return value;
+    }
+
+    // Whether all reads so far were within bounds
+    bool valid() const { return ok; }
+
+private:
+    bool check(size_t len)
+    {
+        ok = ok && pos <= end && len <= end - pos;
+        return ok;
+    }
+
+    const char *buf;
+    size_t pos, end;
+    bool ok;
+};
+
+/* Builder of binary payloads, whose chunk offset is filled in by setChunkOffset() */
+class PayloadWriter {
+public:
+    PayloadWriter() : header() {}
+
+    PayloadHeader header;
+
+    void u32(uint32_t value)
+    {
+        value = htole32(value);
+        tables.append((const char *) &value, sizeof(value));
+    }
+
+    void u64(uint64_t value)
+    {
+        value = htole64(value);
+        tables.append((const char *) &value, sizeof(value));
+    }
+
+    void str(const std::string &value)
+    {
+        u32(value.size());
+        tables.append(value);
+    }
+
+    // Header and tables, with room for the chunk offset
+    std::string finish()
+    {
+        PayloadHeader out = header;
+        memcpy(out.magic, PAYLOAD_MAGIC, PAYLOAD_MAGIC_SIZE);
+        out.version = htole32(PAYLOAD_VERSION);
+        out.header_size = htole32(sizeof(out) + tables.size() + header.rank * sizeof(uint64_t));
+        uint32_t *words[] = { &out.backend_id, &out.datatype_id, &out.rank,
+            &out.num_inputs, &out.num_siblings, &out.flags, &out.follow_input };
+        for (auto word: words)
+            *word = htole32(*word);
+        out.parallel_workers = (int32_t) htole32((uint32_t) header.parallel_workers);
+        out.blob_offset = htole64(header.blob_offset);
+        out.blob_size = htole64(header.blob_size);
+        out.blob_hash = htole64(header.blob_hash);
+
+        std::string payload((const char *) &out, sizeof(out));
+        payload.append(tables);
+        payload.append(header.rank * sizeof(uint64_t), '\0');
+        return payload;
+    }
+
+    // Overwrite the chunk offset at the end of a payload returned by finish()
+    static void setChunkOffset(std::string &payload, const std::vector<hsize_t> &offset)
+    {
+        size_t pos = payload.size() - offset.size() * sizeof(uint64_t);
+        for (auto value: offset)
+        {
+            uint64_t le = htole64(value);
+            memcpy(&payload[pos], &le, sizeof(le));
+            pos += sizeof(le);
+        }
+    }
+
+private:
+    std::string tables;
+};
+
+#endif /* __payload_h */
@@ -0,0 +1,107 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: prefetch.cpp
+ *
+ * Concurrent read of input datasets, overlapped with the startup of the UDF.
+ *
+ * Deferred input datasets are only read once the UDF asks for them, after the
+ * backend has loaded the UDF, and one after another. Reading them beforehand
+ * and in parallel cuts the time it takes for the UDF to get going, at least on
+ * storage that serves concurrent streams faster than a single one. The HDF5
+ * library cannot be relied upon to serve concurrent reads from threads, so the
+ * datasets are read by forked processes instead, just like the UDF process
+ * reads deferred datasets itself. Each process holds the write end of a pipe
+ * that nobody writes to: the UDF process waits on the read end, which reaches
+ * end-of-file when the prefetching process exits, however it exits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include "prefetch.h"
+#include "stats.h"
+
+InputPrefetch::InputPrefetch(std::vector<DatasetInfo> &inputs, Backend *backend)
+{
+    const char *env = getenv("HDF5_UDF_PREFETCH");
+    long max_processes = env ? atol(env) : 0;
+    if (max_processes <= 0)
+        return;
+
+    /* Datasets waiting to be read, largest first */
+    std::vector<size_t> pending;
+    for (size_t i=0; i<inputs.size(); ++i)
+        if (! inputs[i].prefetched(false) && inputs[i].deferred_data && inputs[i].deferred_file_id >= 0 &&
+            ! backend->holdsInput(inputs[i]))
+            pending.push_back(i);
+    std::sort(pending.begin(), pending.end(), [&](size_t a, size_t b) {
+        return inputs[a].getGridSize() * H5Tget_size(inputs[a].hdf5_datatype) >
+            inputs[b].getGridSize() * H5Tget_size(inputs[b].hdf5_datatype);
+    });
+
+    size_t num_processes = std::min(pending.size(), (size_t) max_processes);
+    if (num_processes == 0)
+        return;
+
+    /* Spread the datasets over the processes, balancing the bytes each one reads */
+    std::vector<std::vector<size_t>> assigned(num_processes);
+    std::vector<size_t> bytes(num_processes, 0);
+    for (auto i: pending)
+    {
+        size_t p = std::min_element(bytes.begin(), bytes.end()) - bytes.begin();
+        assigned[p].push_back(i);
+        bytes[p] += inputs[i].getGridSize() * H5Tget_size(inputs[i].hdf5_datatype);
+    }
+
+    for (size_t p=0; p<num_processes; ++p)
+    {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) < 0)
+        {
+            fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(pipefd[0]);
+            for (auto i: assigned[p])
+                inputs[i].load();
+
+            // Exit the process without invoking any callbacks registered with atexit()
+            _exit(0);
+        }
+        close(pipefd[1]);
+        if (pid < 0)
+        {
+            fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+            close(pipefd[0]);
+            break;
+        }
+        pids.push_back(pid);
+        fds.push_back(pipefd[0]);
+        for (auto i: assigned[p])
+        {
+            inputs[i].prefetch_fd = pipefd[0];
+            Stats::instance()->addInput(inputs[i].name, "prefetch");
+        }
+    }
+}
+
+InputPrefetch::~InputPrefetch()
+{
+    /* Datasets not read yet are no longer needed */
+    for (auto pid: pids)
+        kill(pid, SIGKILL);
+    for (auto pid: pids)
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+            continue;
+    for (auto fd: fds)
+        close(fd);
+}
@@ -0,0 +1,34 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: prefetch.h
+ *
+ * Concurrent read of input datasets, overlapped with the startup of the UDF.
+ */
+#ifndef __prefetch_h
+#define __prefetch_h
+
+#include <sys/types.h>
+#include <vector>
+#include "dataset.h"
+#include "backend.h"
+
+class InputPrefetch {
+public:
+    // Start reading the deferred datasets among 'inputs' on background
+    // processes, each with its own instance of the HDF5 library so that reads
+    // proceed in parallel. $HDF5_UDF_PREFETCH sets the maximum number of such
+    // processes; prefetching is disabled when it is not set. The datasets are updated so that DatasetInfo::load() waits
+    // for the process in charge instead of reading them again. Datasets the
+    // backend still holds from previous calls are not read.
+    InputPrefetch(std::vector<DatasetInfo> &inputs, Backend *backend);
+
+    // Stop the processes that are still running
+    ~InputPrefetch();
+
+private:
+    std::vector<pid_t> pids;
+    std::vector<int> fds;
+};
+
+#endif /* __prefetch_h */
@@ -15,7 +15,6 @@
 #include <fcntl.h>
 #include <dlfcn.h>
 #include <errno.h>
-#include <glob.h>
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -23,6 +22,8 @@
 #include "python_backend.h"
 #include "anon_mmap.h"
 #include "dataset.h"
+#include "hash.h"
+#include "stats.h"
 #ifdef ENABLE_SANDBOX
 #include "sandbox.h"
 #endif
@@ -30,12 +31,29 @@
 // Dataset names, sizes, and types
 static std::vector<DatasetInfo> dataset_info;
 
+// Region of the output grid that the UDF is expected to produce
+static std::string chunk_offset_str, chunk_dims_str;
+
 /* Functions exported to the Python template library (udf_template.py) */
 extern "C" void *pythonGetData(const char *element)
 {
     for (size_t i=0; i<dataset_info.size(); ++i)
         if (dataset_info[i].name.compare(element) == 0)
-            return dataset_info[i].data;
+            return dataset_info[i].data ? dataset_info[i].data : dataset_info[i].load();
+    fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
+    return NULL;
+}
+
+extern "C" void *pythonGetDataSlice(const char *element, const uint64_t *offset, const uint64_t *count)
+{
+    for (size_t i=0; i<dataset_info.size(); ++i)
+        if (dataset_info[i].name.compare(element) == 0)
+        {
+            auto &info = dataset_info[i];
+            std::vector<hsize_t> slice_offset(offset, offset + info.dimensions.size());
+            std::vector<hsize_t> slice_count(count, count + info.dimensions.size());
+            return info.getSlice(slice_offset, slice_count);
+        }
     fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
     return NULL;
 }
@@ -67,6 +85,59 @@ extern "C" const char *pythonGetDims(const char *element)
     return NULL;
 }
 
+extern "C" void pythonGetParallelRange(uint64_t n, uint64_t *begin, uint64_t *end)
+{
+    size_t range_begin, range_end;
+    Backend::parallelRange(n, &range_begin, &range_end);
+    *begin = range_begin;
+    *end = range_end;
+}
+
+extern "C" void pythonGetBlockRange(uint64_t *rows, uint64_t *step)
+{
+    hsize_t block_step;
+    *rows = DatasetInfo::blockRows(dataset_info, &block_step);
+    *step = block_step;
+}
+
+extern "C" void pythonSetBlock(uint64_t first, uint64_t last)
+{
+    DatasetInfo::setBlock(first, last);
+}
+
+extern "C" void *pythonGetBlock(const char *element)
+{
+    for (size_t i=0; i<dataset_info.size(); ++i)
+        if (dataset_info[i].name.compare(element) == 0)
+            return dataset_info[i].getBlock(dataset_info[0]);
+    fprintf(stderr, "%s: dataset %s not found\n", __func__, element);
+    return NULL;
+}
+
+extern "C" const char *pythonGetChunkOffset()
+{
+    return chunk_offset_str.c_str();
+}
+
+extern "C" const char *pythonGetChunkDims()
+{
+    return chunk_dims_str.c_str();
+}
+
+/* Used by UDFs compiled before they could produce several outputs */
+extern "C" const char *pythonGetOutputName()
+{
+    return dataset_info.size() ? dataset_info[0].name.c_str() : "";
+}
+
+extern "C" int pythonIsOutput(const char *element)
+{
+    for (size_t i=0; i<dataset_info.size(); ++i)
+        if (dataset_info[i].name.compare(element) == 0)
+            return i == 0 || dataset_info[i].isOutput();
+    return 0;
+}
+
 /* This backend's name */
 std::string PythonBackend::name()
 {
@@ -79,135 +150,125 @@ std::string PythonBackend::extension()
     return ".py";
 }
 
+std::string PythonBackend::compilerSignature()
+{
+    /* Bytecode is generated in-process, by the interpreter we are linked to */
+    return "Python " PY_VERSION;
+}
+
 /* Compile Python to a bytecode. Returns the bytecode as a string object. */
 std::string PythonBackend::compile(std::string udf_file, std::string template_file)
 {
     std::string placeholder = "# user_callback_placeholder";
-    auto py_file = Backend::assembleUDF(udf_file, template_file, placeholder, this->extension());
-    if (py_file.size() == 0)
+    auto source = Backend::assembleSource(udf_file, template_file, placeholder);
+    if (source.size() == 0)
     {
         fprintf(stderr, "Will not be able to compile the UDF code\n");
         return "";
     }
+    if (! initInterpreter())
+    {
+        fprintf(stderr, "Failed to initialize the Python interpreter\n");
+        return "";
+    }
 
-    pid_t pid = fork();
-    if (pid == 0)
+    // The bytecode is the marshalled code object, without the header of .pyc files
+    std::string bytecode;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    PyObject *code = Py_CompileString(source.c_str(), udf_file.c_str(), Py_file_input);
+    if (! code)
     {
-        // Child process
-        char *cmd[] = {
-            (char *) "python3",
-            (char *) "-m",
-            (char *) "compileall",
-            (char *) "-l",         // don't recurse into subdirectories
-            (char *) "-f",         // force rebuild even if timestamps are up to date
-            (char *) py_file.c_str(),
-            (char *) NULL
-        };
-        execvp(cmd[0], cmd);
+        fprintf(stderr, "Failed to compile %s\n", udf_file.c_str());
+        PyErr_Print();
     }
-    else if (pid > 0)
+    else
     {
-        // Parent
-        int exit_status;
-        wait4(pid, &exit_status, 0, NULL);
+        PyObject *marshalled = PyMarshal_WriteObjectToString(code, Py_MARSHAL_VERSION);
+        char *data = NULL;
+        Py_ssize_t size = 0;
+        if (marshalled && PyBytes_AsStringAndSize(marshalled, &data, &size) == 0)
+            bytecode.assign(data, size);
+        else
+            PyErr_Print();
+        Py_XDECREF(marshalled);
+        Py_DECREF(code);
+    }
+    PyGILState_Release(gstate);
 
-        // Find the bytecode
-        auto sep = py_file.find_last_of('/');
-        if (sep == std::string::npos)
-        {
-            fprintf(stderr, "Failed to identify directory where assembled file was saved\n");
-            unlink(py_file.c_str());
-            return "";
-        }
-        std::string parentdir = py_file.substr(0, sep);
-        std::string filename = py_file.substr(sep + 1);
-        sep = filename.find_last_of(".");
-        filename = filename.substr(0, sep);
-
-        // Because the Python version is part of the generated file name, we resort to glob()
-        // to identify the actual path to that file.
-        glob_t results;
-        std::stringstream pycache, pattern;
-        pycache << parentdir << "/__pycache__";
-        pattern << pycache.str() << "/" << filename << ".cpython-*.pyc";
-        int ret = glob(pattern.str().c_str(), GLOB_NOSORT, NULL, &results);
-        if (ret != 0 || results.gl_pathc == 0)
-        {
-            fprintf(stderr, "No bytecodes were found under %s\n", pattern.str().c_str());
-            unlink(py_file.c_str());
-            rmdir(pycache.str().c_str());
-            if (ret == 0) { globfree(&results); }
-            return "";
-        }
+    if (bytecode.size())
+        printf("Bytecode has %ld bytes\n", bytecode.size());
+    return bytecode.size() ? compressPayload(bytecode) : "";
+}
 
-        // Assume the very first match is the one we're looking for
-        std::string pyc_file = results.gl_pathv[0];
-        globfree(&results);
-        printf("Bytecode found at %s\n", pyc_file.c_str());
-
-        // Read generated bytecode
-        std::string bytecode;
-        std::ifstream data(pyc_file, std::ifstream::binary);
-        std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(data), {});
-        bytecode.assign(buffer.begin(), buffer.end());
-        
-        unlink(py_file.c_str());
-        unlink(pyc_file.c_str());
-        rmdir(pycache.str().c_str());
-        return bytecode;
+/*
+ * Bring up the interpreter. This is done only once per process: finalizing
+ * and initializing Python again is not supported by many extension modules
+ * (CFFI included) and, if the application embeds Python itself, the interpreter
+ * is not ours to finalize anyway.
+ */
+bool PythonBackend::initInterpreter()
+{
+    if (! libpython)
+    {
+        // Workaround for CFFI import errors due to missing symbols. We force libpython
+        // to be loaded and for all symbols to be resolved by dlopen()
+        libpython = dlopen("libpython3.so", RTLD_NOW | RTLD_GLOBAL);
+    }
+    if (! Py_IsInitialized())
+    {
+        Py_Initialize();
+        // Release the GIL acquired by Py_Initialize(); we take it again with
+        // PyGILState_Ensure() whenever we need to talk to the interpreter.
+        PyEval_SaveThread();
     }
-    fprintf(stderr, "Failed to execute python3\n");
-    return "";
+    return Py_IsInitialized();
 }
 
-/* Execute the user-defined-function embedded in the given buffer */
-bool PythonBackend::run(
-    const std::string filterpath,
-    const std::vector<DatasetInfo> input_datasets,
-    const DatasetInfo output_dataset,
-    const char *output_cast_datatype,
-    const char *bytecode,
-    size_t bytecode_size)
+/*
+ * Get the module that results from executing the given bytecode. Modules are
+ * imported on the first time a bytecode is seen and reused afterwards.
+ * Must be called with the GIL held.
+ */
+PyObject *PythonBackend::getModule(const char *bytecode, size_t bytecode_size)
 {
-    if (bytecode_size < 16)
+    uint64_t key = blobHash(bytecode, bytecode_size);
+    auto it = modules.find(key);
+    if (it != modules.end() &&
+        it->second.bytecode.size() == bytecode_size &&
+        memcmp(it->second.bytecode.data(), bytecode, bytecode_size) == 0)
     {
-        fprintf(stderr, "Error: Python bytecode is too small to be valid\n");
-        return false;
+        return it->second.module;
     }
 
-    /*
-     * We want to make the output dataset writeable by the UDF. Because
-     * the UDF is run under a separate process we have to use a shared
-     * memory segment which both processes can read and write to.
-     */
-    size_t room_size = output_dataset.getGridSize() * output_dataset.getStorageSize();
-    AnonymousMemoryMap mm(room_size);
-    if (! mm.create())
-        return false;
-
-    // Let output_dataset.data point to the shared memory segment
-    DatasetInfo output_dataset_copy = output_dataset;
-    output_dataset_copy.data = mm.mm;
-
-    // Populate global vector of dataset names, sizes, and types
-    dataset_info.push_back(output_dataset_copy);
-    dataset_info.insert(
-        dataset_info.end(), input_datasets.begin(), input_datasets.end());
-
-    // Workaround for CFFI import errors due to missing symbols. We force libpython
-    // to be loaded and for all symbols to be resolved by dlopen()
-    void *libpython = dlopen("libpython3.so", RTLD_NOW | RTLD_GLOBAL);
-
-    // Init Python interpreter
-    Py_Initialize();
+    // Bytecode written by recent versions of hdf5-udf is compressed
+    std::string decompressed;
+    const char *pyc = bytecode;
+    size_t pyc_size = bytecode_size;
+    if (isCompressedPayload(bytecode, bytecode_size))
+    {
+        decompressed = decompressPayload(bytecode, bytecode_size);
+        pyc = decompressed.data();
+        pyc_size = decompressed.size();
+    }
+    if (pyc_size < 16)
+    {
+        fprintf(stderr, "Error: Python bytecode is too small to be valid\n");
+        return NULL;
+    }
 
-    // We have to check whether this offset is fixed at all times or if can
-    // change. Some docs mention an offset of 8 bytes, for instance.
-    bytecode = &bytecode[16];
-    bytecode_size -= 16;
+    // Bytecode written by older versions of hdf5-udf is the contents of a .pyc
+    // file, whose 16-byte header starts with a version tag ending in "\r\n".
+    // Marshalled code objects cannot start that way.
+    const char *code = pyc;
+    size_t code_size = pyc_size;
+    if (pyc[2] == '\r' && pyc[3] == '\n')
+    {
+        code = &pyc[16];
+        code_size = pyc_size - 16;
+    }
 
     // Get a reference to the code object we compiled before
-    PyObject *obj = PyMarshal_ReadObjectFromString(bytecode, bytecode_size);
+    PyObject *obj = PyMarshal_ReadObjectFromString(code, code_size);
     if (! obj)
     {
         PyObject *err = PyErr_Occurred();
@@ -219,50 +280,215 @@ bool PythonBackend::run(
             PyErr_Print();
         }
         PyErr_Clear();
-        Py_Finalize();
-        dlclose(libpython);
-        return false;
+        return NULL;
     }
 
-    PyObject *module = PyImport_ExecCodeModule("udf_module", obj);
+    // Each bytecode gets its own entry in sys.modules
+    auto module_name = "udf_module_" + hashToString(key);
+    PyObject *module = PyImport_ExecCodeModule(module_name.c_str(), obj);
+    Py_DECREF(obj);
     if (! module)
     {
         fprintf(stderr, "Failed to import code object\n");
         PyErr_Print();
-        Py_Finalize();
-        dlclose(libpython);
-        return false;
+        return NULL;
     }
 
-    bool retval = false;
+    if (it != modules.end())
+    {
+        // Hash collision: evict the previous entry
+        Py_DECREF(it->second.module);
+        modules.erase(it);
+    }
+    CachedModule entry;
+    entry.module = module;
+    entry.bytecode.assign(bytecode, bytecode_size);
+    modules[key] = entry;
+    return module;
+}
+
+/* Populate global vector of dataset names, sizes, and types */
+void PythonBackend::setDatasets(
+    const std::vector<DatasetInfo> &input_datasets,
+    const DatasetInfo &output_dataset)
+{
+    // Entries from previous calls are dropped, as this backend outlives a single run
+    dataset_info.clear();
+    dataset_info.push_back(output_dataset);
+    dataset_info.insert(
+        dataset_info.end(), input_datasets.begin(), input_datasets.end());
+    chunk_offset_str = DatasetInfo::dimensionsToString(output_dataset.chunk_offset);
+    chunk_dims_str = DatasetInfo::dimensionsToString(output_dataset.chunk_dimensions);
+}
+
+/*
+ * Retrieve 'lib.load' and 'dynamic_dataset' from the UDF module. The reference
+ * returned in 'loadlib' must be released by the caller. Must be called with the
+ * GIL held.
+ */
+bool PythonBackend::getEntryPoints(PyObject *module, PyObject **loadlib, PyObject **udf)
+{
     PyObject *dict = PyModule_GetDict(module);
     PyObject *lib = dict ? PyDict_GetItemString(dict, "lib") : NULL;
-    PyObject *loadlib = lib ? PyObject_GetAttrString(lib, "load") : NULL;
-    PyObject *udf = dict ? PyDict_GetItemString(dict, "dynamic_dataset") : NULL;
-    if (! lib || ! loadlib || ! udf)
+    *loadlib = lib ? PyObject_GetAttrString(lib, "load") : NULL;
+    *udf = dict ? PyDict_GetItemString(dict, "dynamic_dataset") : NULL;
+    if (! lib || ! *loadlib || ! *udf)
         fprintf(stderr, "Failed to load required symbols from code object\n");
-    else if (! PyCallable_Check(loadlib))
+    else if (! PyCallable_Check(*loadlib))
         fprintf(stderr, "Error: lib.load is not a callable function\n");
-    else if (! PyCallable_Check(udf))
+    else if (! PyCallable_Check(*udf))
         fprintf(stderr, "Error: dynamic_dataset is not a callable function\n");
     else
+        return true;
+    Py_XDECREF(*loadlib);
+    *loadlib = NULL;
+    return false;
+}
+
+/* Execute the user-defined-function embedded in the given buffer */
+bool PythonBackend::run(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *bytecode,
+    size_t bytecode_size)
+{
+    if (bytecode_size < 16)
+    {
+        fprintf(stderr, "Error: Python bytecode is too small to be valid\n");
+        return false;
+    }
+
+    /*
+     * We want to make the output dataset writeable by the UDF. Because
+     * the UDF is run under a separate process we have to use a shared
+     * memory segment which both processes can read and write to, unless
+     * the caller has already allocated the output grid from one.
+     */
+    size_t room_size = output_dataset.getChunkGridSize() * output_dataset.getStorageSize();
+    AnonymousMemoryMap mm(room_size);
+    DatasetInfo output_dataset_copy = output_dataset;
+    if (! output_dataset.shared_data)
     {
+        if (! mm.create())
+            return false;
+
+        // Let output_dataset.data point to the shared memory segment
+        output_dataset_copy.data = mm.mm;
+    }
+    setDatasets(input_datasets, output_dataset_copy);
+
+    // Init Python interpreter
+    uint64_t load_start = Stats::now();
+    if (! initInterpreter())
+    {
+        fprintf(stderr, "Failed to initialize the Python interpreter\n");
+        return false;
+    }
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
+    bool retval = false;
+    PyObject *loadlib = NULL, *udf = NULL;
+    PyObject *module = getModule(bytecode, bytecode_size);
+    if (module && getEntryPoints(module, &loadlib, &udf))
+    {
+        Stats::instance()->addTime(STATS_BACKEND_LOAD, Stats::now() - load_start);
         retval = executeUDF(loadlib, udf, filterpath);
-        if (retval == true)
+        if (retval == true && ! output_dataset.shared_data)
         {
             // Update output HDF5 dataset with data from shared memory segment
+            StatsTimer timer(STATS_OUTPUT_COPY);
             memcpy(output_dataset.data, mm.mm, room_size);
         }
+        Py_DECREF(loadlib);
     }
 
-    Py_DECREF(module);
-    Py_DECREF(dict);
-    Py_Finalize();
-    dlclose(libpython);
+    PyGILState_Release(gstate);
+    return retval;
+}
 
+/* Execute the user-defined-function in the calling process */
+bool PythonBackend::execute(
+    const std::string filterpath,
+    const std::vector<DatasetInfo> input_datasets,
+    const DatasetInfo output_dataset,
+    const char *output_cast_datatype,
+    const char *bytecode,
+    size_t bytecode_size)
+{
+    if (bytecode_size < 16)
+    {
+        fprintf(stderr, "Error: Python bytecode is too small to be valid\n");
+        return false;
+    }
+    setDatasets(input_datasets, output_dataset);
+
+    uint64_t load_start = Stats::now();
+    if (! initInterpreter())
+    {
+        fprintf(stderr, "Failed to initialize the Python interpreter\n");
+        return false;
+    }
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
+    bool retval = false;
+    PyObject *loadlib = NULL, *udf = NULL;
+    PyObject *module = getModule(bytecode, bytecode_size);
+    if (module && getEntryPoints(module, &loadlib, &udf))
+    {
+        Stats::instance()->addTime(STATS_BACKEND_LOAD, Stats::now() - load_start);
+        retval = callUDF(loadlib, udf, filterpath, false);
+        DatasetInfo::freeSlices();
+        Py_DECREF(loadlib);
+    }
+
+    PyGILState_Release(gstate);
     return retval;
 }
 
+/*
+ * Import the modules that the UDF template depends on (including NumPy, if
+ * available) and have CFFI parse its declarations once, as neither can be
+ * done after the sandbox is set up.
+ */
+void PythonBackend::warmup(const std::string filterpath)
+{
+    if (! initInterpreter())
+        return;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    const char *code =
+        "import os\n"
+        "from cffi import FFI\n"
+        "try:\n"
+        "    import numpy\n"
+        "except ImportError:\n"
+        "    pass\n"
+        "ffi = FFI()\n"
+        "ffi.cdef('void *pythonGetData(const char *);')\n"
+        "ffi.dlopen(filterpath)\n";
+
+    /*
+     * Preloading is best effort: modules that are missing (such as cffi on
+     * a system without it) are reported when a UDF actually needs them.
+     */
+    PyObject *module = PyImport_AddModule("__main__");
+    PyObject *globals = module ? PyModule_GetDict(module) : NULL;
+    PyObject *pypath = PyUnicode_FromString(filterpath.c_str());
+    PyObject *ret = NULL;
+    if (globals && pypath && PyDict_SetItemString(globals, "filterpath", pypath) == 0)
+    {
+        ret = PyRun_String(code, Py_file_input, globals, globals);
+        PyDict_DelItemString(globals, "filterpath");
+    }
+    Py_XDECREF(pypath);
+    if (ret)
+        Py_DECREF(ret);
+    else
+        PyErr_Clear();
+    PyGILState_Release(gstate);
+}
+
 /* Coordinate the execution of the UDF under a separate process */
 bool PythonBackend::executeUDF(PyObject *loadlib, PyObject *udf, std::string filterpath)
 {
@@ -270,50 +496,56 @@ bool PythonBackend::executeUDF(PyObject *loadlib, PyObject *udf, std::string fil
      * Execute the user-defined-function under a separate process so that
      * seccomp can kill it (if needed) without crashing the entire program
      */
-    pid_t pid = fork();
-    if (pid == 0)
+    return forkUDF([&]()
     {
-        // Run 'lib.load(filterpath)' from our udf_template.py
-        // TODO: load the template straight from /usr/share, as
-        // the function that comes with the UDF may not be trustable.
-        PyObject *pyargs = PyTuple_New(1);
-        PyObject *pypath = Py_BuildValue("s", filterpath.c_str());
-        PyTuple_SetItem(pyargs, 0, pypath);
-        PyObject *callret = PyObject_CallObject(loadlib, pyargs);
-        if (callret)
-            Py_DECREF(callret);
+        return callUDF(loadlib, udf, filterpath, true);
+    });
+}
+
+/* Run 'lib.load()' and 'dynamic_dataset()', optionally setting up the sandbox in between */
+bool PythonBackend::callUDF(PyObject *loadlib, PyObject *udf, std::string filterpath, bool use_sandbox)
+{
+    // Run 'lib.load(filterpath)' from our udf_template.py
+    // TODO: load the template straight from /usr/share, as
+    // the function that comes with the UDF may not be trustable.
+    PyObject *pyargs = PyTuple_New(1);
+    PyObject *pypath = Py_BuildValue("s", filterpath.c_str());
+    PyTuple_SetItem(pyargs, 0, pypath);
+    PyObject *callret = PyObject_CallObject(loadlib, pyargs);
+    Py_DECREF(pyargs);
+    if (callret)
+        Py_DECREF(callret);
+    else
+    {
+        PyErr_Print();
+        PyErr_Clear();
+        return false;
+    }
 
-        bool ready = true;
+    bool ready = true;
 #ifdef ENABLE_SANDBOX
+    if (use_sandbox)
+    {
         Sandbox sandbox;
         ready = sandbox.init(filterpath);
+    }
 #endif
-        if (ready)
+    if (ready)
+    {
+        // Run 'dynamic_dataset()' defined by the user
+        StatsTimer timer(STATS_UDF);
+        callret = PyObject_CallObject(udf, NULL);
+        if (callret)
+            Py_DECREF(callret);
+        else
         {
-            // Run 'dynamic_dataset()' defined by the user
-            callret = PyObject_CallObject(udf, NULL);
-            if (callret)
-                Py_DECREF(callret);
-            else
-            {
-                // Function call terminated by an exception
-                PyErr_Print();
-                PyErr_Clear();
-                ready = false;
-            }
-            Py_DECREF(pypath);
-            Py_DECREF(pyargs);
+            // Function call terminated by an exception
+            PyErr_Print();
+            PyErr_Clear();
+            ready = false;
         }
-        // Exit the process without invoking any callbacks registered with atexit()
-        _exit(ready ? 0 : 1);
     }
-    else if (pid > 0)
-    {
-        int status;
-        waitpid(pid, &status, 0);
-        return WIFEXITED(status) ? WEXITSTATUS(status) == 0 : false;
-    }
-    return false;
+    return ready;
 }
 
 void PythonBackend::printPyObject(PyObject *obj)
@@ -345,6 +577,10 @@ std::vector<std::string> PythonBackend::udfDatasetNames(std::string udf_file)
     {
         ltrim(line);
         auto n = line.find("lib.getData");
+        if (n == std::string::npos)
+            n = line.find("lib.getBlock");
+        if (n == std::string::npos)
+            n = line.find("lib.getArray");
         auto c = line.find("#");
         if (n != std::string::npos && (c == std::string::npos || c > n))
         {
@@ -10,6 +10,8 @@
 
 #include <Python.h>
 #include <marshal.h>
+#include <map>
+#include <stdint.h>
 #include "backend.h"
 
 class PythonBackend : public Backend {
@@ -23,6 +25,9 @@ public:
     // Compile an input file into executable form
     std::string compile(std::string udf_file, std::string template_file);
 
+    // Compiler and options used by compile()
+    std::string compilerSignature();
+
     // Execute a user-defined-function
     bool run(
         const std::string filterpath,
@@ -32,6 +37,18 @@ public:
         const char *udf_blob,
         size_t udf_blob_size);
 
+    // Execute a user-defined-function in the calling process
+    bool execute(
+        const std::string filterpath,
+        const std::vector<DatasetInfo> input_datasets,
+        const DatasetInfo output_dataset,
+        const char *output_cast_datatype,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+    // Import the modules needed by the UDF template ahead of time
+    void warmup(const std::string filterpath);
+
     // Scan the UDF file for references to HDF5 dataset names.
     // We use this to store the UDF dependencies in the JSON payload.
     std::vector<std::string> udfDatasetNames(std::string udf_file);
@@ -39,6 +56,25 @@ public:
 private:
     void printPyObject(PyObject *obj);
     bool executeUDF(PyObject *loadlib, PyObject *udf, std::string filterpath);
+    bool callUDF(PyObject *loadlib, PyObject *udf, std::string filterpath, bool use_sandbox);
+    bool getEntryPoints(PyObject *module, PyObject **loadlib, PyObject **udf);
+    void setDatasets(
+        const std::vector<DatasetInfo> &input_datasets,
+        const DatasetInfo &output_dataset);
+
+    // Bring up the interpreter, if that has not been done yet
+    bool initInterpreter();
+
+    // Get the module that results from executing the given bytecode
+    PyObject *getModule(const char *bytecode, size_t bytecode_size);
+
+    // Modules already imported, indexed by the hash of their bytecode
+    struct CachedModule {
+        PyObject *module;
+        std::string bytecode;
+    };
+    std::map<uint64_t, CachedModule> modules;
+    void *libpython = NULL;
 };
 
 #endif /* __python_backend_h */
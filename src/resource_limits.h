@@ -0,0 +1,117 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: resource_limits.h
+ *
+ * Memory and CPU time limits of the processes that execute UDFs.
+ */
+#ifndef __resource_limits_h
+#define __resource_limits_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <string>
+#include "size_parser.h"
+
+/* Bytes a filter call may allocate, from $HDF5_UDF_MEMORY_LIMIT. Zero means no limit. */
+static inline size_t memoryLimit()
+{
+    const char *env = getenv("HDF5_UDF_MEMORY_LIMIT");
+    return env ? parseSize(env) : 0;
+}
+
+/* Seconds of CPU time a UDF may take, from $HDF5_UDF_CPU_LIMIT. Zero means no limit. */
+static inline rlim_t cpuLimit()
+{
+    const char *env = getenv("HDF5_UDF_CPU_LIMIT");
+    return env ? (rlim_t) std::max(atol(env), 0L) : 0;
+}
+
+/* Seconds a pre-forked worker may take to reply, from $HDF5_UDF_WORKER_TIMEOUT. Zero means no limit. */
+static inline int workerTimeout()
+{
+    const char *env = getenv("HDF5_UDF_WORKER_TIMEOUT");
+    return env ? std::max(atoi(env), 0) : 600;
+}
+
+/* Address space size and CPU time (in seconds, rounded up) used so far by a process */
+static inline bool resourceUsage(pid_t pid, size_t *vm_bytes, rlim_t *cpu_seconds)
+{
+    auto dir = pid ? "/proc/" + std::to_string(pid) : std::string("/proc/self");
+    unsigned long vm_pages = 0, utime = 0, stime = 0;
+    char line[1024];
+    FILE *fp = fopen((dir + "/statm").c_str(), "r");
+    bool ok = fp && fscanf(fp, "%lu", &vm_pages) == 1;
+    if (fp)
+        fclose(fp);
+
+    /* Fields 14 and 15 count clock ticks; the command name may hold spaces */
+    fp = fopen((dir + "/stat").c_str(), "r");
+    ok = ok && fp && fgets(line, sizeof(line), fp);
+    const char *fields = ok ? strrchr(line, ')') : NULL;
+    ok = fields && sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+        &utime, &stime) == 2;
+    if (fp)
+        fclose(fp);
+    if (! ok)
+        return false;
+
+    long ticks = sysconf(_SC_CLK_TCK);
+    *vm_bytes = vm_pages * sysconf(_SC_PAGESIZE);
+    *cpu_seconds = (utime + stime + ticks - 1) / ticks;
+    return true;
+}
+
+/*
+ * Let the process 'pid' (0 for the calling one) grow its address space by
+ * memoryLimit() bytes, plus 'mapped' bytes it is about to map, and use
+ * cpuLimit() more seconds of CPU time, past which allocations fail and the
+ * process gets SIGXCPU. With 'lock', hard limits are lowered as well (one
+ * second past the soft one for CPU time, after which the kernel sends
+ * SIGKILL), so that the process cannot lift them; that is not done on
+ * long-lived workers, whose limits are moved forward before each request.
+ */
+static inline bool limitResources(pid_t pid, bool lock, size_t mapped)
+{
+    size_t memory_limit = memoryLimit();
+    rlim_t cpu_limit = cpuLimit();
+    if (memory_limit == 0 && cpu_limit == 0)
+        return true;
+
+    size_t vm_bytes = 0;
+    rlim_t cpu_seconds = 0;
+    if (! resourceUsage(pid, &vm_bytes, &cpu_seconds))
+    {
+        fprintf(stderr, "Failed to get the resource usage of the UDF process\n");
+        return false;
+    }
+
+    /* The type prlimit() takes resources as, which is an enum with glibc */
+    struct { decltype(RLIMIT_AS) resource; rlim_t value; } limits[] = {
+        { RLIMIT_AS, memory_limit ? (rlim_t) (vm_bytes + mapped + memory_limit) : 0 },
+        { RLIMIT_CPU, cpu_limit ? cpu_seconds + cpu_limit : 0 },
+    };
+    for (auto &limit: limits)
+    {
+        struct rlimit current, wanted;
+        if (limit.value == 0 || prlimit(pid, limit.resource, NULL, &current) < 0)
+            continue;
+        wanted.rlim_cur = std::min(limit.value, current.rlim_max);
+        wanted.rlim_max = lock ? std::min(limit.value + (limit.resource == RLIMIT_CPU), current.rlim_max) :
+            current.rlim_max;
+        if (prlimit(pid, limit.resource, &wanted, NULL) < 0)
+        {
+            fprintf(stderr, "Failed to set the resource limits of the UDF process: %s\n", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif /* __resource_limits_h */
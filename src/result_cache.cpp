@@ -0,0 +1,255 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: result_cache.cpp
+ *
+ * Persistent cache of UDF results (materialization).
+ *
+ * Virtual datasets created with --materialize have the result of each chunk
+ * stored on a cache file the first time they are evaluated. The entry holds
+ * the modification stamp of the HDF5 file the inputs are read from and a
+ * checksum of each input dataset. Later reads are served from the entry for
+ * as long as the stamp matches. When the file has been modified, the inputs
+ * are read and checksummed: the result is served (and the entry stamped
+ * again) if none of them changed, and recomputed otherwise.
+ *
+ * Datasets created with --row-local only have the rows of the chunk
+ * checksummed on inputs that share the leading extent of the output, so
+ * appending rows to those inputs only invalidates the chunks that cover
+ * the new rows.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include "result_cache.h"
+#include "cache_directory.h"
+#include "hash.h"
+
+#define RESULT_CACHE_MAGIC "HUDFRES1"
+
+/* Read or write exactly 'size' bytes at the given offset */
+static bool preadFull(int fd, void *buf, size_t size, off_t offset)
+{
+    char *ptr = (char *) buf;
+    while (size > 0)
+    {
+        ssize_t n = pread(fd, ptr, size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool pwriteFull(int fd, const void *buf, size_t size, off_t offset)
+{
+    const char *ptr = (const char *) buf;
+    while (size > 0)
+    {
+        ssize_t n = pwrite(fd, ptr, size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+ResultCache::ResultCache(hid_t file_id, const std::string &payload_key) :
+    stamp_valid(false), row_local(false), first_row(0), num_rows(0), row_extent(0)
+{
+    memset(&stamp, 0, sizeof(stamp));
+
+    std::string filename;
+    ssize_t len = H5Fget_name(file_id, NULL, 0);
+    if (len <= 0)
+        return;
+    filename.resize(len + 1);
+    H5Fget_name(file_id, &filename[0], filename.size());
+    filename.resize(len);
+
+    auto dir = cacheDirectory("HDF5_UDF_RESULT_CACHE_DIR", "");
+    if (dir.empty() || ! makeDirectory(dir))
+        return;
+
+    /* Entries are named after the file and the chunk payload */
+    char resolved[PATH_MAX];
+    if (realpath(filename.c_str(), resolved))
+        filename = resolved;
+    key = filename + '\0' + payload_key;
+    path = dir + "/" + hashToString(hash64(key.data(), key.size())) + ".bin";
+
+    /*
+     * Files opened for writing may hold changes that are not reflected by
+     * the modification stamp yet, so their inputs are always checksummed.
+     */
+    unsigned intent = 0;
+    struct stat statbuf;
+    if (H5Fget_intent(file_id, &intent) >= 0 && ! (intent & H5F_ACC_RDWR) &&
+        stat(filename.c_str(), &statbuf) == 0)
+    {
+        stamp.dev = statbuf.st_dev;
+        stamp.ino = statbuf.st_ino;
+        stamp.mtime_sec = statbuf.st_mtim.tv_sec;
+        stamp.mtime_nsec = statbuf.st_mtim.tv_nsec;
+        stamp.size = statbuf.st_size;
+        stamp_valid = true;
+    }
+}
+
+void ResultCache::setRowRange(hsize_t first, hsize_t count, hsize_t extent)
+{
+    row_local = true;
+    first_row = first;
+    num_rows = count;
+    row_extent = extent;
+    checksums.clear();
+}
+
+bool ResultCache::computeChecksums(std::vector<DatasetInfo> &inputs)
+{
+    if (checksums.size() == inputs.size())
+        return true;
+    checksums.clear();
+    for (auto &info: inputs)
+    {
+        if (row_local && info.dimensions.size() && info.dimensions[0] == row_extent)
+        {
+            /* Rows of the chunk alone, read by themselves unless the input is in memory */
+            std::vector<hsize_t> offset(info.dimensions.size(), 0), count = info.dimensions;
+            offset[0] = std::min(first_row, row_extent);
+            count[0] = std::min(first_row + num_rows, row_extent) - offset[0];
+            size_t size = H5Tget_size(info.hdf5_datatype);
+            for (auto dim: count)
+                size *= dim;
+            void *slice = size ? info.getSlice(offset, count) : NULL;
+            if (size && ! slice)
+            {
+                checksums.clear();
+                DatasetInfo::freeSlices();
+                return false;
+            }
+            checksums.push_back(checksum64(slice, size));
+            continue;
+        }
+
+        /* Deferred inputs may have been read by the UDF process already */
+        void *data = info.data;
+        if (! data && info.deferred_status && *info.deferred_status == 1)
+            data = info.deferred_data;
+        if (! data)
+            data = info.load();
+        if (! data)
+        {
+            checksums.clear();
+            DatasetInfo::freeSlices();
+            return false;
+        }
+        size_t size = info.getGridSize() * H5Tget_size(info.hdf5_datatype);
+        checksums.push_back(checksum64(data, size));
+    }
+    DatasetInfo::freeSlices();
+    return true;
+}
+
+bool ResultCache::lookup(std::vector<DatasetInfo> &inputs, void *output, size_t output_size)
+{
+    if (! enabled())
+        return false;
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    Header header;
+    std::string stored_key(key.size(), '\0');
+    std::vector<uint64_t> stored_checksums(inputs.size());
+    off_t offset = sizeof(header);
+    bool valid =
+        preadFull(fd, &header, sizeof(header), 0) &&
+        memcmp(header.magic, RESULT_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.key_size == key.size() &&
+        header.num_inputs == inputs.size() &&
+        header.output_size == output_size &&
+        preadFull(fd, &stored_key[0], key.size(), offset) &&
+        stored_key == key;
+    offset += key.size();
+    valid = valid && preadFull(fd, stored_checksums.data(), inputs.size() * sizeof(uint64_t), offset);
+    offset += inputs.size() * sizeof(uint64_t);
+    if (! valid)
+    {
+        close(fd);
+        return false;
+    }
+
+    bool fresh = stamp_valid && memcmp(&header.stamp, &stamp, sizeof(stamp)) == 0;
+    if (! fresh)
+    {
+        /* The file has changed; the result still holds if the inputs have not */
+        if (! computeChecksums(inputs) || checksums != stored_checksums)
+        {
+            close(fd);
+            return false;
+        }
+        if (stamp_valid)
+        {
+            header.stamp = stamp;
+            pwriteFull(fd, &header, sizeof(header), 0);
+        }
+    }
+
+    bool ret = preadFull(fd, output, output_size, offset);
+    close(fd);
+    return ret;
+}
+
+bool ResultCache::store(std::vector<DatasetInfo> &inputs, const void *output, size_t output_size)
+{
+    if (! enabled() || ! computeChecksums(inputs))
+        return false;
+
+    Header header;
+    memcpy(header.magic, RESULT_CACHE_MAGIC, sizeof(header.magic));
+    header.stamp = stamp;
+    header.key_size = key.size();
+    header.num_inputs = inputs.size();
+    header.output_size = output_size;
+
+    /* The entry is written aside and moved into place, so readers never see partial entries */
+    auto tmp_path = temporaryPath(path);
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create result cache entry %s: %s\n", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    off_t offset = 0;
+    bool ret = pwriteFull(fd, &header, sizeof(header), offset);
+    offset += sizeof(header);
+    ret = ret && pwriteFull(fd, key.data(), key.size(), offset);
+    offset += key.size();
+    ret = ret && pwriteFull(fd, checksums.data(), checksums.size() * sizeof(uint64_t), offset);
+    offset += checksums.size() * sizeof(uint64_t);
+    ret = ret && pwriteFull(fd, output, output_size, offset);
+    close(fd);
+    if (! ret || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to write result cache entry %s\n", path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
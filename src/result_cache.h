@@ -0,0 +1,78 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: result_cache.h
+ *
+ * Persistent cache of UDF results (materialization).
+ */
+#ifndef __result_cache_h
+#define __result_cache_h
+
+#include <hdf5.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "dataset.h"
+
+class ResultCache {
+public:
+    // Prepare the lookup of a chunk of a virtual dataset. 'payload_key' identifies
+    // the payload of the chunk (output, UDF, and inputs) and 'file_id' the
+    // file that holds the input datasets. Results are kept under the
+    // directory given by $HDF5_UDF_RESULT_CACHE_DIR, which defaults to
+    // $XDG_CACHE_HOME/hdf5-udf (or ~/.cache/hdf5-udf).
+    ResultCache(hid_t file_id, const std::string &payload_key);
+
+    // Whether a cache directory is available
+    bool enabled() const { return path.size() > 0; }
+
+    // Fill the output grid with a stored result. The result is served
+    // right away if the file holding the inputs has not been modified
+    // since it was stored; otherwise the inputs are read and their
+    // checksums compared against the stored ones.
+    bool lookup(std::vector<DatasetInfo> &inputs, void *output, size_t output_size);
+
+    // Only checksum the rows [first_row, first_row + num_rows) of the inputs
+    // whose leading extent is 'extent', the one of the output. Meant for UDFs
+    // whose output rows only depend on the same rows of their inputs, so
+    // that rows appended to the inputs leave earlier chunks valid.
+    void setRowRange(hsize_t first_row, hsize_t num_rows, hsize_t extent);
+
+    // Store the result of a successful evaluation
+    bool store(std::vector<DatasetInfo> &inputs, const void *output, size_t output_size);
+
+private:
+    struct FileStamp {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t mtime_sec;
+        uint64_t mtime_nsec;
+        uint64_t size;
+    };
+
+    // Layout of the start of a cache entry. It is followed by the key, by
+    // one checksum per input dataset, and by the output grid.
+    struct Header {
+        char magic[8];
+        FileStamp stamp;
+        uint64_t key_size;
+        uint64_t num_inputs;
+        uint64_t output_size;
+    };
+
+    // Compute the checksums of the input datasets, reading those that
+    // have not been loaded yet
+    bool computeChecksums(std::vector<DatasetInfo> &inputs);
+
+    std::string path;
+    std::string key;
+    FileStamp stamp;
+    bool stamp_valid;
+    std::vector<uint64_t> checksums;
+    bool row_local;
+    hsize_t first_row, num_rows, row_extent;
+};
+
+#endif /* __result_cache_h */
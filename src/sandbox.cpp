@@ -4,6 +4,10 @@
  * File: sandbox.cpp
  *
  * High-level interfaces to seccomp and syscall-intercept.
+ *
+ * The sandbox library is extracted and the seccomp policy compiled into a
+ * BPF program only once per process; the processes forked to run UDFs just
+ * load the library from memory and install the program.
  */
 #include <stdio.h>
 #include <errno.h>
@@ -13,9 +17,16 @@
 #include <dlfcn.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <linux/seccomp.h>
+#include <seccomp.h>
 #include <elf.h>
+#include <mutex>
 #include "sandbox.h"
 #include "backend.h"
+#include "stats.h"
 
 #define SANDBOX_SECTION_NAME ".hdf5-udf-sandbox"
 
@@ -35,35 +46,223 @@ public:
     std::vector<std::string> udfDatasetNames(std::string udf_file) { return std::vector<std::string>(); }
 };
 
-bool Sandbox::init(std::string filterpath)
+/* State prepared once per process and inherited by the processes we fork */
+static std::mutex sandbox_lock;
+static std::string sandbox_filterpath;                  /* Filter the state below comes from */
+static int sandbox_fd = -1;                             /* Memfd holding the sandbox library */
+static std::string sandbox_payload;                     /* Sandbox library, if no memfd could be used */
+static std::vector<struct sock_filter> sandbox_program; /* Compiled syscall filter */
+
+#define ALLOW(syscall, ...) do { \
+    if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(syscall), __VA_ARGS__) < 0) { \
+        fprintf(stderr, "Failed to configure seccomp rule for '" #syscall "' syscall\n"); \
+        seccomp_release(ctx); \
+        return NULL; \
+    } \
+} while (0)
+
+static scmp_filter_ctx createFilter()
+{
+    scmp_filter_ctx ctx = seccomp_init(SCMP_ACT_KILL_PROCESS);
+    if (! ctx)
+    {
+        fprintf(stderr, "Failed to initialize seccomp\n");
+        return NULL;
+    }
+
+    // One particular use case of HDF5-UDF is to retrieve data
+    // from servers exposed on the Internet and to provide that
+    // data to the application using the HDF5 dataset interface.
+    // The syscalls below should be sufficient to allow a program
+    // to connect to an external host and communicate with it.
+    // Any other syscall is denied by seccomp and will cause the
+    // UDF thread to be killed.
+
+    // Fundamental system calls we want to allow
+    ALLOW(brk, 0);
+    ALLOW(exit_group, 0);
+
+    // Sockets-related system calls
+    ALLOW(socket, 0);
+    ALLOW(setsockopt, 0);
+    ALLOW(ioctl, 1, SCMP_A1(SCMP_CMP_EQ, FIONREAD));
+    ALLOW(connect, 0);
+    ALLOW(select, 0);
+    ALLOW(poll, 0);
+    ALLOW(read, 0);
+    ALLOW(recv, 0);
+    ALLOW(recvfrom, 0);
+    ALLOW(recvmsg, 0);
+    ALLOW(write, 0);
+    ALLOW(send, 0);
+    ALLOW(sendto, 0);
+    ALLOW(sendmsg, 0);
+    ALLOW(close, 0);
+
+    // System calls issued by gethostbyname(). Some of these could be potentially
+    // misused by malicious user-defined functions; we rely on the syscall-intercept
+    // routines of the sandbox library to check their string-based arguments to
+    // decide to allow or reject them.
+    ALLOW(stat, 0);
+    ALLOW(lstat, 0);
+    ALLOW(fstat, 0);
+    ALLOW(fstat64, 0);
+    ALLOW(open, 1, SCMP_A1(SCMP_CMP_MASKED_EQ, O_RDONLY, O_RDONLY));
+    ALLOW(openat, 1, SCMP_A2(SCMP_CMP_MASKED_EQ, O_RDONLY, O_RDONLY));
+    ALLOW(mmap, 0);
+    ALLOW(mmap2, 0);
+    ALLOW(munmap, 0);
+    ALLOW(lseek, 0);
+    ALLOW(_llseek, 0);
+    ALLOW(futex, 0);
+    ALLOW(uname, 0);
+    ALLOW(mprotect, 0);
+
+    // System calls needed to load the shared library of C++ UDFs from
+    // memory, as done by pre-forked workers. The intercept routines only
+    // let those libraries be opened through a procfs path if they are memfds.
+    ALLOW(memfd_create, 0);
+    ALLOW(pread64, 0);
+    ALLOW(fcntl, 1, SCMP_A1(SCMP_CMP_EQ, F_GET_SEALS));
+
+    return ctx;
+}
+
+bool Sandbox::compileFilter(std::vector<struct sock_filter> &program)
 {
+    scmp_filter_ctx ctx = createFilter();
+    if (! ctx)
+        return false;
+
+    // libseccomp only exports BPF programs to file descriptors
+    bool ret = false;
+    int fd = memfd_create("hdf5-udf-seccomp", MFD_CLOEXEC);
+    if (fd >= 0 && seccomp_export_bpf(ctx, fd) == 0)
+    {
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size > 0 && size % sizeof(struct sock_filter) == 0)
+        {
+            program.resize(size / sizeof(struct sock_filter));
+            ret = pread(fd, program.data(), size, 0) == size;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    seccomp_release(ctx);
+    return ret;
+}
+
+bool Sandbox::loadFilter(const std::vector<struct sock_filter> &program)
+{
+    // This is what seccomp_load() does with the program it generates
+    struct sock_fprog prog;
+    prog.len = (unsigned short) program.size();
+    prog.filter = (struct sock_filter *) program.data();
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0 ||
+        prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) < 0)
+    {
+        fprintf(stderr, "Failed to load seccomp filter: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool Sandbox::prepare(std::string filterpath)
+{
+    std::lock_guard<std::mutex> guard(sandbox_lock);
+    if (sandbox_filterpath.size() && sandbox_filterpath.compare(filterpath) == 0)
+        return true;
+
     // The sandbox library is stored in a special ELF section of the filter file.
-    // We retrieve it from that section, save it to a temporary file and then
-    // dlopen() that file so we can retrieve its symbols.
-    auto so_file = extractSymbol(filterpath, SANDBOX_SECTION_NAME);
-    if (so_file.size() == 0)
+    // We retrieve it from that section and keep it in a sealed memfd that the
+    // processes we fork can dlopen() through procfs.
+    auto payload = extractSymbol(filterpath, SANDBOX_SECTION_NAME);
+    if (payload.size() == 0)
     {
         fprintf(stderr, "Failed to extract sandbox code from shared library\n");
         return false;
     }
-    if (shlib.open(so_file) == false)
+
+    int fd = memfd_create("hdf5-udf-sandbox", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0)
     {
-        unlink(so_file.c_str());
+        size_t written = 0;
+        while (written < payload.size())
+        {
+            ssize_t n = write(fd, payload.data() + written, payload.size() - written);
+            if (n <= 0)
+                break;
+            written += n;
+        }
+        if (written == payload.size())
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+        else
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // If the filter cannot be compiled in advance, init() builds and loads it
+    std::vector<struct sock_filter> program;
+    if (! compileFilter(program))
+        program.clear();
+
+    if (sandbox_fd >= 0)
+        close(sandbox_fd);
+    sandbox_fd = fd;
+    sandbox_payload = fd >= 0 ? "" : payload;
+    sandbox_program = program;
+    sandbox_filterpath = filterpath;
+    return true;
+}
+
+bool Sandbox::init(std::string filterpath)
+{
+    StatsTimer timer(STATS_SANDBOX);
+    if (! prepare(filterpath))
         return false;
+
+    // Without a memfd, the library is saved to a temporary file
+    std::string so_file;
+    if (sandbox_fd >= 0)
+        so_file = "/proc/self/fd/" + std::to_string(sandbox_fd);
+    else
+    {
+        DummyBackend backend;
+        so_file = backend.writeToDisk(sandbox_payload.data(), sandbox_payload.size(), ".so");
+        if (so_file.size() == 0)
+        {
+            fprintf(stderr, "Failed to write payload to disk\n");
+            return false;
+        }
+        chmod(so_file.c_str(), 0755);
     }
 
     // Note that we delete the temporary file prior to the initialization of
     // the syscall filter, as the filter is unlikely to allow calls to unlink().
-    bool ret = false;
-    bool (*syscall_filter_init)() = (bool(*)()) shlib.loadsym("syscall_filter_init");
-    unlink(so_file.c_str());
+    bool opened = shlib.open(so_file);
+    if (sandbox_fd < 0)
+        unlink(so_file.c_str());
+    if (opened == false)
+        return false;
 
-    if (syscall_filter_init)
+    bool ret = false;
+    if (sandbox_program.size())
+        ret = loadFilter(sandbox_program);
+    else
     {
-        ret = syscall_filter_init();
-        if (ret == false)
-            fprintf(stderr, "Failed to configure sandbox\n");
+        scmp_filter_ctx ctx = createFilter();
+        if (ctx)
+        {
+            ret = seccomp_load(ctx) == 0;
+            if (ret == false)
+                fprintf(stderr, "Failed to load seccomp filter: %s\n", strerror(errno));
+            seccomp_release(ctx);
+        }
     }
+    if (ret == false)
+        fprintf(stderr, "Failed to configure sandbox\n");
     return ret;
 }
 
@@ -116,13 +315,5 @@ std::string Sandbox::extractSymbol(std::string elf, std::string symbol_name)
     free(symbol_table);
     close(fd);
 
-    DummyBackend backend;
-    auto so_file = backend.writeToDisk(payload.data(), payload.size(), ".so");
-    if (so_file.size() == 0)
-    {
-        fprintf(stderr, "Failed to write payload to disk\n");
-        return "";
-    }
-    chmod(so_file.c_str(), 0755);
-    return so_file;
-}
\ No newline at end of file
+    return payload;
+}
@@ -13,16 +13,26 @@
 #include <functional>
 #include <algorithm>
 #include <string>
+#include <vector>
+#include <linux/filter.h>
 #include "sharedlib_manager.h"
 
 class Sandbox {
 public:
     Sandbox() {}
     ~Sandbox() {}
+
+    // Extract the sandbox library and compile the syscall filter once, so
+    // that processes forked afterwards only have to install them. Calling
+    // it is optional: init() prepares whatever is missing by itself.
+    static bool prepare(std::string filterpath);
+
     bool init(std::string filterpath);
 
 private:
-    std::string extractSymbol(std::string elf, std::string symbol_name);
+    static std::string extractSymbol(std::string elf, std::string symbol_name);
+    static bool compileFilter(std::vector<struct sock_filter> &program);
+    static bool loadFilter(const std::vector<struct sock_filter> &program);
     SharedLibraryManager shlib;
 };
 
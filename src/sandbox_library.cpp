@@ -12,6 +12,7 @@
  * system calls can be intercepted and their arguments checked by ourselves.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <unistd.h>
@@ -22,7 +23,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
-#include <seccomp.h>
 #include <syscall.h>
 #include <libsyscall_intercept_hook_point.h>
 #include <algorithm>
@@ -59,12 +59,29 @@ static int syscall_intercept(
     (void) arg4;
     (void) arg5;
  
+    // Shared libraries that the UDF process receives from the filter (and
+    // which it cannot save to disk) are loaded from memfds through procfs.
+    auto is_memfd_path = [&](const char *path)
+    {
+        const char *prefix = "/proc/self/fd/";
+        if (strncmp(path, prefix, strlen(prefix)) != 0)
+            return false;
+        char *end = NULL;
+        long fd = strtol(path + strlen(prefix), &end, 10);
+        if (end == path + strlen(prefix) || *end != '\0')
+            return false;
+        // F_GET_SEALS is only implemented by memfds
+        return syscall_no_intercept(SYS_fcntl, fd, F_GET_SEALS) >= 0;
+    };
+
     auto test_file_ok = [&](long arg)
     {
         char *path = (char *) arg;
         for (auto &p: files_allowed)
             if (p.compare(path) == 0)
                 return 1;
+        if (is_memfd_path(path))
+            return 1;
         *ret = -EPERM;
         return 0;
     };
@@ -113,76 +130,4 @@ static __attribute__((constructor)) void syscall_intercept_init()
     intercept_hook_point = &syscall_intercept;
 }
 
-
-////////////////////////////////////
-// System call filtering interface
-////////////////////////////////////
-
-#define ALLOW(syscall, ...) do { \
-    if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(syscall), __VA_ARGS__) < 0) { \
-        fprintf(stderr, "Failed to configure seccomp rule for '" #syscall "' syscall\n"); \
-        return false; \
-    } \
-} while (0)
-
-bool syscall_filter_init()
-{
-    scmp_filter_ctx ctx = seccomp_init(SCMP_ACT_KILL_PROCESS);
-
-    // One particular use case of HDF5-UDF is to retrieve data
-    // from servers exposed on the Internet and to provide that
-    // data to the application using the HDF5 dataset interface.
-    // The syscalls below should be sufficient to allow a program
-    // to connect to an external host and communicate with it.
-    // Any other syscall is denied by seccomp and will cause the
-    // UDF thread to be killed.
-
-    // Fundamental system calls we want to allow
-    ALLOW(brk, 0);
-    ALLOW(exit_group, 0);
-
-    // Sockets-related system calls
-    ALLOW(socket, 0);
-    ALLOW(setsockopt, 0);
-    ALLOW(ioctl, 1, SCMP_A1(SCMP_CMP_EQ, FIONREAD));
-    ALLOW(connect, 0);
-    ALLOW(select, 0);
-    ALLOW(poll, 0);
-    ALLOW(read, 0);
-    ALLOW(recv, 0);
-    ALLOW(recvfrom, 0);
-    ALLOW(write, 0);
-    ALLOW(send, 0);
-    ALLOW(sendto, 0);
-    ALLOW(sendmsg, 0);
-    ALLOW(close, 0);
-
-    // System calls issued by gethostbyname(). Some of these could be potentially
-    // misused by malicious user-defined functions; we rely on the syscall-intercept
-    // routines above to check their string-based arguments to decide to allow or
-    // reject them.
-    ALLOW(stat, 0);
-    ALLOW(lstat, 0);
-    ALLOW(fstat, 0);
-    ALLOW(fstat64, 0);
-    ALLOW(open, 1, SCMP_A1(SCMP_CMP_MASKED_EQ, O_RDONLY, O_RDONLY));
-    ALLOW(openat, 1, SCMP_A2(SCMP_CMP_MASKED_EQ, O_RDONLY, O_RDONLY));
-    ALLOW(mmap, 0);
-    ALLOW(mmap2, 0);
-    ALLOW(munmap, 0);
-    ALLOW(lseek, 0);
-    ALLOW(_llseek, 0);
-    ALLOW(futex, 0);
-    ALLOW(uname, 0);
-    ALLOW(mprotect, 0);    
-
-    // Load seccomp rules
-    int ret = seccomp_load(ctx);
-    seccomp_release(ctx);
-    if (ret < 0)
-        fprintf(stderr, "Failed to load seccomp filter: %s\n", strerror(errno));
-
-    return ret == 0;
-}
-
 } // extern "C"
\ No newline at end of file
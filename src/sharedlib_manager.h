@@ -33,11 +33,12 @@ public:
         return so_handle != NULL;
     }
 
-    void *loadsym(std::string name)
+    // Resolve a symbol. Missing symbols are only reported if they are required.
+    void *loadsym(std::string name, bool required=true)
     {
         (void) dlerror();
         void *symbol = dlsym(so_handle, name.c_str());
-        if (! symbol)
+        if (! symbol && required)
             fprintf(stderr, "%s\n", dlerror());
         return symbol;
     }
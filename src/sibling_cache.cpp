@@ -0,0 +1,118 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: sibling_cache.cpp
+ *
+ * Cache of the outputs computed along with the virtual dataset being read.
+ *
+ * UDFs may produce several virtual datasets in a single pass (for instance,
+ * the components of a vector field and its magnitude). When one of them is
+ * read, the UDF also writes the matching chunks of the other ones, which are
+ * kept here for a short while: applications usually read the sibling datasets
+ * right after the first one, and those reads are then served without running
+ * the UDF again. Entries are keyed by the file identity and modification
+ * stamp, so changes made to the file invalidate them, and each entry is
+ * served only once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sibling_cache.h"
+#include "file_stamp.h"
+#include "size_parser.h"
+#include "dataset.h"
+
+#define DEFAULT_SIBLING_CACHE_SIZE (64 * 1024 * 1024)
+
+SiblingCache *SiblingCache::instance()
+{
+    static SiblingCache cache;
+    return &cache;
+}
+
+SiblingCache::SiblingCache() :
+    budget(DEFAULT_SIBLING_CACHE_SIZE),
+    cached_bytes(0),
+    counter(0)
+{
+    const char *env = getenv("HDF5_UDF_SIBLING_CACHE");
+    if (env)
+        budget = parseSize(env);
+}
+
+SiblingCache::~SiblingCache()
+{
+    for (auto &it: entries)
+        free(it.second.data);
+}
+
+std::string SiblingCache::makeKey(hid_t file_id, const std::string &udf_key, const std::string &name,
+    const std::vector<hsize_t> &chunk_offset)
+{
+    std::string filename;
+    auto stamp = fileStamp(file_id, filename);
+    if (stamp.empty() || budget == 0)
+        return "";
+    return stamp + udf_key + '\0' + name + '\0' + DatasetInfo::dimensionsToString(chunk_offset);
+}
+
+void SiblingCache::store(hid_t file_id, const std::string &udf_key, const std::string &name,
+    const std::vector<hsize_t> &chunk_offset, const void *data, size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto key = makeKey(file_id, udf_key, name, chunk_offset);
+    if (key.empty() || size > budget)
+        return;
+
+    Entry entry;
+    entry.data = malloc(size);
+    if (! entry.data)
+        return;
+    memcpy(entry.data, data, size);
+    entry.size = size;
+    entry.last_used = counter++;
+
+    auto it = entries.find(key);
+    if (it != entries.end())
+    {
+        cached_bytes -= it->second.size;
+        free(it->second.data);
+        entries.erase(it);
+    }
+    entries.insert(std::make_pair(key, entry));
+    cached_bytes += size;
+    evict();
+}
+
+bool SiblingCache::take(hid_t file_id, const std::string &udf_key, const std::string &name,
+    const std::vector<hsize_t> &chunk_offset, void *data, size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto key = makeKey(file_id, udf_key, name, chunk_offset);
+    auto it = key.size() ? entries.find(key) : entries.end();
+    if (it == entries.end())
+        return false;
+
+    Entry entry = it->second;
+    entries.erase(it);
+    cached_bytes -= entry.size;
+    bool found = entry.size == size;
+    if (found)
+        memcpy(data, entry.data, size);
+    free(entry.data);
+    return found;
+}
+
+void SiblingCache::evict()
+{
+    while (cached_bytes > budget && entries.size())
+    {
+        auto victim = entries.begin();
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+            if (it->second.last_used < victim->second.last_used)
+                victim = it;
+        cached_bytes -= victim->second.size;
+        free(victim->second.data);
+        entries.erase(victim);
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: sibling_cache.h
+ *
+ * Cache of the outputs computed along with the virtual dataset being read.
+ */
+#ifndef __sibling_cache_h
+#define __sibling_cache_h
+
+#include <hdf5.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class SiblingCache {
+public:
+    // Get the process-wide cache. The number of bytes it may hold on to is
+    // set with $HDF5_UDF_SIBLING_CACHE (e.g., "256M"); it defaults to 64M,
+    // and zero disables the cache.
+    static SiblingCache *instance();
+
+    // Keep a chunk of a dataset produced by a UDF that was run to compute
+    // another of its outputs. 'udf_key' identifies the UDF and its inputs.
+    void store(hid_t file_id, const std::string &udf_key, const std::string &name,
+        const std::vector<hsize_t> &chunk_offset, const void *data, size_t size);
+
+    // Copy a stored chunk into 'data'. Chunks are served once: the entry
+    // is dropped as soon as it is taken.
+    bool take(hid_t file_id, const std::string &udf_key, const std::string &name,
+        const std::vector<hsize_t> &chunk_offset, void *data, size_t size);
+
+private:
+    SiblingCache();
+    ~SiblingCache();
+
+    struct Entry {
+        void *data;           /* Chunk contents */
+        size_t size;          /* Size of the chunk, in bytes */
+        uint64_t last_used;   /* Counter value when the entry was stored */
+    };
+
+    // Key of a chunk, or an empty string if it cannot be cached
+    std::string makeKey(hid_t file_id, const std::string &udf_key, const std::string &name,
+        const std::vector<hsize_t> &chunk_offset);
+
+    // Drop the oldest entries until the cache fits the budget
+    void evict();
+
+    std::map<std::string, Entry> entries;
+    std::mutex lock;
+    size_t budget;
+    size_t cached_bytes;
+    uint64_t counter;
+};
+
+#endif /* __sibling_cache_h */
@@ -0,0 +1,34 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: size_parser.h
+ *
+ * Parser of the memory sizes given through environment variables.
+ */
+#ifndef __size_parser_h
+#define __size_parser_h
+
+#include <stdlib.h>
+#include <stddef.h>
+
+/* Parse a size such as "1048576", "1024K", "512M", or "2G" */
+static inline size_t parseSize(const char *str)
+{
+    char *end = NULL;
+    double value = strtod(str, &end);
+    if (end == str || value < 0)
+        return 0;
+    switch (*end)
+    {
+        case 'g': case 'G': value *= 1024;
+        // fall through
+        case 'm': case 'M': value *= 1024;
+        // fall through
+        case 'k': case 'K': value *= 1024;
+        // fall through
+        default: break;
+    }
+    return (size_t) value;
+}
+
+#endif /* __size_parser_h */
@@ -0,0 +1,188 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: stats.cpp
+ *
+ * Per-call metrics of the filter, exported as JSON lines.
+ *
+ * Timings are always taken, as reading the monotonic clock is cheap and does
+ * not involve a system call, but they are only written out if requested. The
+ * record lives in a shared anonymous mapping so that the processes forked to
+ * run UDFs (and the workers of the pool) can fill in their own stages.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "stats.h"
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+static const char *stage_names[STATS_STAGE_COUNT] = {
+    "parse",
+    "file_lookup",
+    "input_read",
+    "backend_load",
+    "sandbox",
+    "fork_wait",
+    "udf",
+    "output_copy",
+    "result_cache",
+    "prefetch_wait",
+    "device_upload",
+};
+
+Stats *Stats::instance()
+{
+    static Stats stats;
+    return &stats;
+}
+
+Stats::Stats() :
+    record(NULL),
+    fd(-1),
+    owns_fd(false),
+    start(0),
+    output_bytes(0)
+{
+    void *mm = mmap(NULL, sizeof(Record), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (mm != MAP_FAILED)
+    {
+        record = (Record *) mm;
+        memset(record, 0, sizeof(Record));
+    }
+
+    /* Either a file descriptor number (e.g., "2" for stderr) or a file name */
+    const char *env = getenv("HDF5_UDF_STATS");
+    if (env && *env)
+    {
+        char *end = NULL;
+        long num = strtol(env, &end, 10);
+        if (*end == '\0' && num >= 0)
+            fd = (int) num;
+        else
+        {
+            fd = open(env, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0)
+                fprintf(stderr, "Failed to open %s: %s\n", env, strerror(errno));
+            owns_fd = fd >= 0;
+        }
+    }
+}
+
+Stats::~Stats()
+{
+    if (owns_fd)
+        close(fd);
+    if (record)
+        munmap(record, sizeof(Record));
+}
+
+void Stats::begin()
+{
+    start = now();
+    dataset.clear();
+    backend.clear();
+    output_bytes = 0;
+    if (record)
+        memset(record, 0, sizeof(Record));
+}
+
+void Stats::setOutput(const std::string &dataset, const std::string &backend, size_t bytes)
+{
+    this->dataset = dataset;
+    this->backend = backend;
+    this->output_bytes = bytes;
+}
+
+void Stats::addTime(StatsStage stage, uint64_t ns)
+{
+    if (record)
+        __atomic_fetch_add(&record->stage_ns[stage], ns, __ATOMIC_RELAXED);
+}
+
+Stats::InputRecord *Stats::findInput(const std::string &name)
+{
+    uint32_t count = record ? __atomic_load_n(&record->num_inputs, __ATOMIC_RELAXED) : 0;
+    for (uint32_t i=0; i<count && i<STATS_MAX_INPUTS; ++i)
+        if (strncmp(record->inputs[i].name, name.c_str(), STATS_NAME_SIZE-1) == 0)
+            return &record->inputs[i];
+    return NULL;
+}
+
+void Stats::addInput(const std::string &name, const char *source)
+{
+    if (! record || record->num_inputs >= STATS_MAX_INPUTS)
+        return;
+    InputRecord *input = findInput(name);
+    if (! input)
+    {
+        input = &record->inputs[record->num_inputs];
+        snprintf(input->name, sizeof(input->name), "%s", name.c_str());
+        __atomic_fetch_add(&record->num_inputs, 1, __ATOMIC_RELEASE);
+    }
+    snprintf(input->source, sizeof(input->source), "%s", source);
+}
+
+void Stats::addInputRead(const std::string &name, size_t bytes, uint64_t ns)
+{
+    addTime(STATS_INPUT_READ, ns);
+    InputRecord *input = findInput(name);
+    if (input)
+    {
+        __atomic_fetch_add(&input->bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&input->ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+void Stats::end(bool success)
+{
+    if (fd < 0 || ! record)
+        return;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    json line;
+    line["time"] = tv.tv_sec + tv.tv_usec / 1e6;
+    line["pid"] = getpid();
+    line["dataset"] = dataset;
+    line["backend"] = backend;
+    line["success"] = success;
+    line["output_bytes"] = output_bytes;
+    line["total"] = (now() - start) / 1e9;
+    for (int i=0; i<STATS_STAGE_COUNT; ++i)
+    {
+        /* Only the CUDA backend copies datasets to a device */
+        if (i == STATS_DEVICE_UPLOAD && backend != "CUDA")
+            continue;
+        line["stages"][stage_names[i]] = record->stage_ns[i] / 1e9;
+    }
+    line["inputs"] = json::array();
+    for (uint32_t i=0; i<record->num_inputs && i<STATS_MAX_INPUTS; ++i)
+    {
+        auto &input = record->inputs[i];
+        line["inputs"].push_back({
+            {"name", input.name},
+            {"source", input.source},
+            {"bytes", input.bytes},
+            {"read_time", input.ns / 1e9}
+        });
+    }
+
+    /* Peak resident set size of the process and of the largest child it has waited for, in KiB */
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        line["peak_rss_kb"] = usage.ru_maxrss;
+    if (getrusage(RUSAGE_CHILDREN, &usage) == 0)
+        line["children_peak_rss_kb"] = usage.ru_maxrss;
+
+    std::string out = line.dump() + "\n";
+    if (write(fd, out.data(), out.size()) < 0)
+        fprintf(stderr, "Failed to write stats: %s\n", strerror(errno));
+}
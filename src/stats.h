@@ -0,0 +1,111 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: stats.h
+ *
+ * Per-call metrics of the filter, exported as JSON lines.
+ */
+#ifndef __stats_h
+#define __stats_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <string>
+
+/* Stages of the evaluation of a UDF whose duration is recorded */
+enum StatsStage {
+    STATS_PARSE = 0,      /* Parse of the JSON payload */
+    STATS_FILE_LOOKUP,    /* Discovery of the HDF5 file that holds the dataset */
+    STATS_INPUT_READ,     /* Read of the input datasets */
+    STATS_BACKEND_LOAD,   /* Load of the UDF into the interpreter or as a shared library */
+    STATS_SANDBOX,        /* Setup of the sandbox */
+    STATS_FORK_WAIT,      /* Creation of the UDF processes and wait for their completion */
+    STATS_UDF,            /* Execution of the UDF */
+    STATS_OUTPUT_COPY,    /* Copy of the output grid to the buffer handed to HDF5 */
+    STATS_RESULT_CACHE,   /* Lookup and store of materialized results */
+    STATS_PREFETCH_WAIT,  /* Wait for input datasets being read by prefetching processes */
+    STATS_DEVICE_UPLOAD,  /* Copy of the input datasets to the GPU */
+    STATS_STAGE_COUNT
+};
+
+/* Input datasets whose reads are recorded */
+#define STATS_MAX_INPUTS 64
+#define STATS_NAME_SIZE  64
+
+class Stats {
+public:
+    // Get the process-wide recorder. Records are written to the file or
+    // file descriptor number given by $HDF5_UDF_STATS, one JSON line per
+    // filter call; nothing is written if the variable is not set.
+    static Stats *instance();
+
+    // Monotonic clock, in nanoseconds
+    static inline uint64_t now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // Start the record of a new filter call
+    void begin();
+
+    // Describe the dataset being produced
+    void setOutput(const std::string &dataset, const std::string &backend, size_t bytes);
+
+    // Add to the time spent on a stage. Stages may be recorded by forked
+    // processes; the time spent by concurrent processes is added up.
+    void addTime(StatsStage stage, uint64_t ns);
+
+    // Register an input dataset and how its contents are obtained
+    // ("cache", "mmap", "read", "deferred", "prefetch", or "virtual")
+    void addInput(const std::string &name, const char *source);
+
+    // Add to the bytes read from an input dataset and the time taken
+    void addInputRead(const std::string &name, size_t bytes, uint64_t ns);
+
+    // Write the record of the current call
+    void end(bool success);
+
+private:
+    Stats();
+    ~Stats();
+
+    struct InputRecord {
+        char name[STATS_NAME_SIZE];
+        char source[16];
+        uint64_t bytes;
+        uint64_t ns;
+    };
+
+    // Kept in memory shared with the processes we fork
+    struct Record {
+        uint64_t stage_ns[STATS_STAGE_COUNT];
+        uint32_t num_inputs;
+        InputRecord inputs[STATS_MAX_INPUTS];
+    };
+
+    InputRecord *findInput(const std::string &name);
+
+    Record *record;
+    int fd;
+    bool owns_fd;
+    uint64_t start;
+    std::string dataset;
+    std::string backend;
+    size_t output_bytes;
+};
+
+/* Record the time spent in a scope */
+class StatsTimer {
+public:
+    StatsTimer(StatsStage stage) : stage(stage), start(Stats::now()) {}
+    ~StatsTimer() { Stats::instance()->addTime(stage, Stats::now() - start); }
+
+private:
+    StatsStage stage;
+    uint64_t start;
+};
+
+#endif /* __stats_h */
@@ -6,6 +6,8 @@
 // HDF5 filter callbacks and main interface with the C++ API.
 //
 #include <sys/types.h>
+#include <stdint.h>
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -14,18 +16,142 @@ std::vector<void *> hdf5_udf_data;
 std::vector<const char *> hdf5_udf_names;
 std::vector<const char *> hdf5_udf_types;
 std::vector<std::vector<size_t>> hdf5_udf_dims;
+std::vector<size_t> hdf5_udf_chunk_offset;
+std::vector<size_t> hdf5_udf_chunk_dims;
+void (*hdf5_udf_parallel_range)(size_t, size_t *, size_t *) = NULL;
+void *(*hdf5_udf_loader)(const char *) = NULL;
+void *(*hdf5_udf_slicer)(const char *, const size_t *, const size_t *) = NULL;
+void (*hdf5_udf_block_range)(size_t *, size_t *) = NULL;
+void (*hdf5_udf_set_block)(size_t, size_t) = NULL;
+void *(*hdf5_udf_block)(const char *) = NULL;
+int (*hdf5_udf_ops_binary)(int, int, void *, const void *, const void *, uint64_t) = NULL;
+int (*hdf5_udf_ops_scale)(int, void *, const void *, uint64_t, double, double) = NULL;
+int (*hdf5_udf_ops_clamp)(int, void *, const void *, uint64_t, double, double) = NULL;
+int (*hdf5_udf_ops_convert)(int, void *, int, const void *, uint64_t) = NULL;
+double (*hdf5_udf_ops_reduce)(int, int, const void *, uint64_t) = NULL;
+
+// Alignment of the grids returned by getData() and getDataSlice(), in bytes
+#define HDF5_UDF_ALIGNMENT 64
+
+// Element type identifiers understood by the vectorized kernels
+template <class T> struct UserDefinedOpsType;
+template <> struct UserDefinedOpsType<int16_t>  { static const int id = 0; };
+template <> struct UserDefinedOpsType<int32_t>  { static const int id = 1; };
+template <> struct UserDefinedOpsType<int64_t>  { static const int id = 2; };
+template <> struct UserDefinedOpsType<uint16_t> { static const int id = 3; };
+template <> struct UserDefinedOpsType<uint32_t> { static const int id = 4; };
+template <> struct UserDefinedOpsType<uint64_t> { static const int id = 5; };
+template <> struct UserDefinedOpsType<float>    { static const int id = 6; };
+template <> struct UserDefinedOpsType<double>   { static const int id = 7; };
+
+// Vectorized kernels that process 'n' elements of the grids returned by
+// getData(), getDataSlice(), and getBlock(). They are compiled into the
+// HDF5-UDF filter for several instruction sets, the best of which is picked
+// at run time. The output grid may be one of the inputs.
+class UserDefinedOps
+{
+public:
+    // out[i] = a[i] <op> b[i]. Integer division by zero yields zero.
+    template <class T> void add(T *out, const T *a, const T *b, size_t n) { binary(0, out, a, b, n); }
+    template <class T> void sub(T *out, const T *a, const T *b, size_t n) { binary(1, out, a, b, n); }
+    template <class T> void mul(T *out, const T *a, const T *b, size_t n) { binary(2, out, a, b, n); }
+    template <class T> void div(T *out, const T *a, const T *b, size_t n) { binary(3, out, a, b, n); }
+    template <class T> void minimum(T *out, const T *a, const T *b, size_t n) { binary(4, out, a, b, n); }
+    template <class T> void maximum(T *out, const T *a, const T *b, size_t n) { binary(5, out, a, b, n); }
+
+    // out[i] = a[i] * scale + offset
+    template <class T>
+    void scale(T *out, const T *a, size_t n, double scale, double offset=0)
+    {
+        if (hdf5_udf_ops_scale)
+            hdf5_udf_ops_scale(UserDefinedOpsType<T>::id, out, a, n, scale, offset);
+    }
+
+    // out[i] = a[i], limited to the range [lo, hi]
+    template <class T>
+    void clamp(T *out, const T *a, size_t n, double lo, double hi)
+    {
+        if (hdf5_udf_ops_clamp)
+            hdf5_udf_ops_clamp(UserDefinedOpsType<T>::id, out, a, n, lo, hi);
+    }
+
+    // out[i] = a[i], converted to the type of 'out'. Floating point values
+    // that do not fit an integer type are saturated.
+    template <class T, class U>
+    void convert(T *out, const U *a, size_t n)
+    {
+        if (hdf5_udf_ops_convert)
+            hdf5_udf_ops_convert(UserDefinedOpsType<T>::id, out, UserDefinedOpsType<U>::id, a, n);
+    }
+
+    // Reductions of a[0 .. n-1] to a single number
+    template <class T> double sum(const T *a, size_t n) { return reduce(0, a, n); }
+    template <class T> double min(const T *a, size_t n) { return reduce(1, a, n); }
+    template <class T> double max(const T *a, size_t n) { return reduce(2, a, n); }
+
+private:
+    template <class T>
+    void binary(int op, T *out, const T *a, const T *b, size_t n)
+    {
+        if (hdf5_udf_ops_binary)
+            hdf5_udf_ops_binary(op, UserDefinedOpsType<T>::id, out, a, b, n);
+    }
+
+    template <class T>
+    double reduce(int op, const T *a, size_t n)
+    {
+        return hdf5_udf_ops_reduce ? hdf5_udf_ops_reduce(op, UserDefinedOpsType<T>::id, a, n) : 0;
+    }
+};
 
 // This is the API that user-defined-functions use to retrieve
 // datasets they depend on.
 class UserDefinedLibrary
 {
 public:
+    UserDefinedOps ops;
+
+    // The grid returned is aligned to HDF5_UDF_ALIGNMENT bytes, which the
+    // compiler is told about so it can emit aligned vector loads and stores.
     template <class T>
     T *getData(std::string name);
+
+    // Retrieve a region of an input dataset, given the offset of its first
+    // element and its dimensions. Only that region is read from the file if
+    // the UDF has not retrieved the whole dataset yet.
+    template <class T>
+    T *getDataSlice(std::string name, std::vector<size_t> offset, std::vector<size_t> count);
     
     const char *getType(std::string name);
     
     std::vector<size_t> getDims(std::string name);
+
+    // Offset of the output chunk being computed, relative to the start of the
+    // output dataset. The buffer returned by getData() for the output dataset
+    // holds that chunk only.
+    std::vector<size_t> getChunkOffset();
+
+    // Dimensions of the output chunk being computed. Chunks at the edges of the
+    // dataset may extend past getDims(); elements out of bounds are discarded.
+    std::vector<size_t> getChunkDims();
+
+    // Call fn(first, last) for the indices of the range [0, n) assigned to
+    // this process, where 'last' is one past the final index. The range is
+    // split among the processes that execute the UDF concurrently, so fn
+    // must not depend on the work done for other indices of the same range.
+    void parallel_for(size_t n, std::function<void(size_t, size_t)> fn);
+
+    // Produce the output chunk block by block: fn(first, last) is called for
+    // consecutive ranges of rows of the chunk, sized so that the rows of the
+    // output and of each input fit in $HDF5_UDF_BLOCK_SIZE bytes. Inside fn,
+    // getBlock() returns those rows; buffers obtained there are released
+    // once fn returns.
+    void forEachBlock(std::function<void(size_t, size_t)> fn);
+
+    // Rows of the current block of a dataset. Input datasets are expected
+    // to share the first dimension of the output dataset.
+    template <class T>
+    T *getBlock(std::string name);
 };
 
 template <class T>
@@ -33,7 +159,26 @@ T *UserDefinedLibrary::getData(std::string name)
 {
     for (size_t i=0; i<hdf5_udf_names.size(); ++i)
         if (name.compare(hdf5_udf_names[i]) == 0)
-            return static_cast<T *>(hdf5_udf_data[i]);
+        {
+            if (hdf5_udf_data[i] == NULL && hdf5_udf_loader)
+                hdf5_udf_data[i] = hdf5_udf_loader(hdf5_udf_names[i]);
+            return static_cast<T *>(__builtin_assume_aligned(hdf5_udf_data[i], HDF5_UDF_ALIGNMENT));
+        }
+    return NULL;
+}
+
+template <class T>
+T *UserDefinedLibrary::getDataSlice(std::string name, std::vector<size_t> offset, std::vector<size_t> count)
+{
+    for (size_t i=0; i<hdf5_udf_names.size(); ++i)
+        if (name.compare(hdf5_udf_names[i]) == 0)
+        {
+            if (offset.size() != hdf5_udf_dims[i].size() || count.size() != hdf5_udf_dims[i].size())
+                return NULL;
+            if (hdf5_udf_slicer)
+                return static_cast<T *>(__builtin_assume_aligned(
+                    hdf5_udf_slicer(hdf5_udf_names[i], offset.data(), count.data()), HDF5_UDF_ALIGNMENT));
+        }
     return NULL;
 }
 
@@ -54,6 +199,48 @@ std::vector<size_t> UserDefinedLibrary::getDims(std::string name)
     return dims;
 }
 
+std::vector<size_t> UserDefinedLibrary::getChunkOffset()
+{
+    return hdf5_udf_chunk_offset;
+}
+
+std::vector<size_t> UserDefinedLibrary::getChunkDims()
+{
+    return hdf5_udf_chunk_dims;
+}
+
+void UserDefinedLibrary::parallel_for(size_t n, std::function<void(size_t, size_t)> fn)
+{
+    size_t begin = 0, end = n;
+    if (hdf5_udf_parallel_range)
+        hdf5_udf_parallel_range(n, &begin, &end);
+    if (begin < end)
+        fn(begin, end);
+}
+
+void UserDefinedLibrary::forEachBlock(std::function<void(size_t, size_t)> fn)
+{
+    size_t rows = 0, step = 0;
+    if (hdf5_udf_block_range)
+        hdf5_udf_block_range(&rows, &step);
+    for (size_t first=0; first<rows; first+=step)
+    {
+        size_t last = first + step < rows ? first + step : rows;
+        hdf5_udf_set_block(first, last);
+        fn(first, last);
+    }
+    if (hdf5_udf_set_block)
+        hdf5_udf_set_block(0, 0);
+}
+
+template <class T>
+T *UserDefinedLibrary::getBlock(std::string name)
+{
+    if (hdf5_udf_block)
+        return static_cast<T *>(hdf5_udf_block(name.c_str()));
+    return NULL;
+}
+
 UserDefinedLibrary lib;
 
 // User-Defined Function
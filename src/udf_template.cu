@@ -0,0 +1,119 @@
+//
+// HDF5-UDF: User-Defined Functions for HDF5
+//
+// File: udf_template.cu
+//
+// Device-side interface of CUDA user-defined functions.
+//
+#include <stdint.h>
+#include <stddef.h>
+
+// Capacity of the tables below. The HDF5 filter reads their sizes from the
+// module, so they can be changed here without touching the filter.
+#define HDF5_UDF_MAX_DATASETS 64
+#define HDF5_UDF_MAX_RANK     32
+#define HDF5_UDF_NAME_SIZE    256
+#define HDF5_UDF_TYPE_SIZE    16
+
+// The following variables are populated by our HDF5 filter before each launch.
+// The output dataset comes first, followed by the inputs.
+__constant__ void *hdf5_udf_data[HDF5_UDF_MAX_DATASETS];
+__constant__ char hdf5_udf_names[HDF5_UDF_MAX_DATASETS][HDF5_UDF_NAME_SIZE];
+__constant__ char hdf5_udf_types[HDF5_UDF_MAX_DATASETS][HDF5_UDF_TYPE_SIZE];
+__constant__ uint32_t hdf5_udf_rank[HDF5_UDF_MAX_DATASETS];
+__constant__ uint64_t hdf5_udf_dims[HDF5_UDF_MAX_DATASETS][HDF5_UDF_MAX_RANK];
+__constant__ uint64_t hdf5_udf_chunk_offset[HDF5_UDF_MAX_RANK];
+__constant__ uint64_t hdf5_udf_chunk_dims[HDF5_UDF_MAX_RANK];
+__constant__ uint32_t hdf5_udf_count;
+
+// This is the API that user-defined-functions use to retrieve the datasets
+// they depend on. It mirrors the C++ API, but dimensions are returned as
+// arrays of getRank() elements, and all datasets live in device memory.
+class UserDefinedLibrary
+{
+public:
+    // Input datasets hold the whole grid; the output dataset holds the
+    // chunk being computed (see getChunkOffset() and getChunkDims()).
+    template <class T>
+    __device__ T *getData(const char *name) const;
+
+    __device__ const char *getType(const char *name) const;
+
+    __device__ const uint64_t *getDims(const char *name) const;
+
+    __device__ uint32_t getRank(const char *name) const;
+
+    // Offset of the output chunk being computed, relative to the start of the
+    // output dataset, and its dimensions. Chunks at the edges of the dataset
+    // may extend past getDims(); elements out of bounds are discarded.
+    __device__ const uint64_t *getChunkOffset() const;
+
+    __device__ const uint64_t *getChunkDims() const;
+
+private:
+    __device__ int find(const char *name) const;
+};
+
+__device__ int UserDefinedLibrary::find(const char *name) const
+{
+    for (uint32_t i=0; i<hdf5_udf_count; ++i)
+    {
+        const char *a = hdf5_udf_names[i], *b = name;
+        while (*a && *a == *b)
+            ++a, ++b;
+        if (*a == *b)
+            return i;
+    }
+    return -1;
+}
+
+template <class T>
+__device__ T *UserDefinedLibrary::getData(const char *name) const
+{
+    int i = find(name);
+    return i >= 0 ? static_cast<T *>(hdf5_udf_data[i]) : NULL;
+}
+
+__device__ const char *UserDefinedLibrary::getType(const char *name) const
+{
+    int i = find(name);
+    return i >= 0 ? hdf5_udf_types[i] : NULL;
+}
+
+__device__ const uint64_t *UserDefinedLibrary::getDims(const char *name) const
+{
+    int i = find(name);
+    return i >= 0 ? hdf5_udf_dims[i] : NULL;
+}
+
+__device__ uint32_t UserDefinedLibrary::getRank(const char *name) const
+{
+    int i = find(name);
+    return i >= 0 ? hdf5_udf_rank[i] : 0;
+}
+
+__device__ const uint64_t *UserDefinedLibrary::getChunkOffset() const
+{
+    return hdf5_udf_chunk_offset;
+}
+
+__device__ const uint64_t *UserDefinedLibrary::getChunkDims() const
+{
+    return hdf5_udf_chunk_dims;
+}
+
+__device__ UserDefinedLibrary lib;
+
+// User-Defined Function. It must be declared as
+// __device__ void dynamic_dataset(size_t i), and is called for each index
+// 'i' of the output chunk, in row-major order.
+
+// user_callback_placeholder
+
+// Entry point launched by the HDF5 filter over the n elements of the output chunk
+extern "C" __global__ void hdf5_udf_kernel(size_t n)
+{
+    size_t stride = (size_t) gridDim.x * blockDim.x;
+    for (size_t i = (size_t) blockIdx.x * blockDim.x + threadIdx.x; i < n; i += stride)
+        dynamic_dataset(i);
+}
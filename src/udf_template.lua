@@ -7,33 +7,231 @@
 --
 
 local lib = {}
+local declared = false
 
 function init(filterpath)
     local ffi = require("ffi")
     local filterlib = ffi.load(filterpath)
-    ffi.cdef[[
-        void       *luaGetData(const char *);
-        const char *luaGetType(const char *);
-        const char *luaGetCast(const char *);
-        const char *luaGetDims(const char *);
-    ]]
+    if not declared then
+        ffi.cdef[[
+            struct hdf5_udf_dataset {
+                const char     *name;
+                const char     *type;
+                const char     *cast;
+                void           *data;
+                uint64_t        ndims;
+                const uint64_t *dims;
+            };
+            const struct hdf5_udf_dataset *luaGetDatasets(uint64_t *);
+            void           *luaLoadData(uint64_t);
+            void           *luaGetDataSlice(uint64_t, const uint64_t *, const uint64_t *);
+            void            luaGetParallelRange(uint64_t, uint64_t *, uint64_t *);
+            void            luaGetBlockRange(uint64_t *, uint64_t *);
+            void            luaSetBlock(uint64_t, uint64_t);
+            void           *luaGetBlock(uint64_t);
+            const uint64_t *luaGetChunkOffset(uint64_t *);
+            const uint64_t *luaGetChunkDims(uint64_t *);
+            int             udfOpsBinary(int, int, void *, const void *, const void *, uint64_t);
+            int             udfOpsScale(int, void *, const void *, uint64_t, double, double);
+            int             udfOpsClamp(int, void *, const void *, uint64_t, double, double);
+            int             udfOpsConvert(int, void *, int, const void *, uint64_t);
+            double          udfOpsReduce(int, int, const void *, uint64_t);
+        ]]
+        declared = true
+    end
+
+    local toTable = function(values, n)
+        local t = {}
+        for i = 0, n - 1 do
+            t[i+1] = tonumber(values[i])
+        end
+        return t
+    end
+
+    -- Dataset names are resolved once per run; lookups made by the UDF are
+    -- plain table accesses
+    local size = ffi.new("uint64_t[1]")
+    local datasets = filterlib.luaGetDatasets(size)
+    local entries = {}
+    for i = 0, tonumber(size[0]) - 1 do
+        local dataset = datasets[i]
+        entries[ffi.string(dataset.name)] = {
+            index = i,
+            type = ffi.string(dataset.type),
+            cast = ffi.typeof(ffi.string(dataset.cast)),
+            dims = toTable(dataset.dims, tonumber(dataset.ndims)),
+        }
+    end
+
+    local lookup = function(name)
+        local entry = entries[name]
+        if entry == nil then
+            error("dataset " .. tostring(name) .. " not found", 3)
+        end
+        return entry
+    end
+
+    local chunk_offset = toTable(filterlib.luaGetChunkOffset(size), tonumber(size[0]))
+    local chunk_dims = toTable(filterlib.luaGetChunkDims(size), tonumber(size[0]))
 
     lib.getData = function(name)
-        return ffi.cast(ffi.string(filterlib.luaGetCast(name)), filterlib.luaGetData(name))
+        local entry = lookup(name)
+        if entry.data == nil then
+            local data = datasets[entry.index].data
+            if data == nil then
+                data = filterlib.luaLoadData(entry.index)
+            end
+            if data ~= nil then
+                entry.data = ffi.cast(entry.cast, data)
+            end
+        end
+        return entry.data
+    end
+
+    -- Retrieve a region of an input dataset, given the offset of its first
+    -- element and its dimensions (as tables). Only that region is read from
+    -- the file if the UDF has not retrieved the whole dataset yet.
+    lib.getDataSlice = function(name, offset, count)
+        local entry = lookup(name)
+        local c_offset = ffi.new("uint64_t[?]", #offset)
+        local c_count = ffi.new("uint64_t[?]", #count)
+        for i = 1, #offset do
+            c_offset[i-1] = offset[i]
+            c_count[i-1] = count[i]
+        end
+        return ffi.cast(entry.cast, filterlib.luaGetDataSlice(entry.index, c_offset, c_count))
     end
 
     lib.getType = function(name)
-        return ffi.string(filterlib.luaGetType(name))
+        return lookup(name).type
     end
 
+    -- The table returned is shared by all calls and must not be modified
     lib.getDims = function(name)
-        local dims = ffi.string(filterlib.luaGetDims(name))
-        local t = {}
-        for dim in string.gmatch(dims, "([^x]+)") do
-            table.insert(t, dim)
+        return lookup(name).dims
+    end
+
+    -- Offset of the output chunk being computed, relative to the start of the
+    -- output dataset. The buffer returned by lib.getData() for the output
+    -- dataset holds that chunk only.
+    lib.getChunkOffset = function()
+        return chunk_offset
+    end
+
+    -- Dimensions of the output chunk being computed. Chunks at the edges of the
+    -- dataset may extend past lib.getDims(); elements out of bounds are discarded.
+    lib.getChunkDims = function()
+        return chunk_dims
+    end
+
+    -- Call fn(first, last) for the indices of the range [0, n) assigned to
+    -- this process, where 'last' is one past the final index. The range is
+    -- split among the processes that execute the UDF concurrently, so fn
+    -- must not depend on the work done for other indices of the same range.
+    lib.parallel_for = function(n, fn)
+        local range = ffi.new("uint64_t[2]")
+        filterlib.luaGetParallelRange(n, range, range + 1)
+        if range[0] < range[1] then
+            fn(tonumber(range[0]), tonumber(range[1]))
         end
-        return t
     end
+
+    -- Produce the output chunk block by block: fn(first, last) is called for
+    -- consecutive ranges of rows of the chunk, sized so that the rows of the
+    -- output and of each input fit in $HDF5_UDF_BLOCK_SIZE bytes. Inside fn,
+    -- lib.getBlock() returns those rows; buffers obtained there are released
+    -- once fn returns.
+    lib.forEachBlock = function(fn)
+        local range = ffi.new("uint64_t[2]")
+        filterlib.luaGetBlockRange(range, range + 1)
+        local rows, step = tonumber(range[0]), tonumber(range[1])
+        for first = 0, rows - 1, step do
+            local last = math.min(first + step, rows)
+            filterlib.luaSetBlock(first, last)
+            fn(first, last)
+        end
+        filterlib.luaSetBlock(0, 0)
+    end
+
+    -- Rows of the current block of a dataset. Input datasets are expected
+    -- to share the first dimension of the output dataset.
+    lib.getBlock = function(name)
+        local entry = lookup(name)
+        return ffi.cast(entry.cast, filterlib.luaGetBlock(entry.index))
+    end
+
+    -- Vectorized kernels that process 'n' elements of the buffers returned
+    -- by lib.getData(), lib.getDataSlice(), and lib.getBlock(). All buffers
+    -- given to a kernel must have the same type, except for convert().
+    -- The output buffer may be one of the inputs.
+    local ops_types = {}
+    for i, cast in ipairs({"int16_t*", "int32_t*", "int64_t*", "uint16_t*",
+                           "uint32_t*", "uint64_t*", "float*", "double*"}) do
+        ops_types[i-1] = ffi.typeof(cast)
+    end
+
+    local opsType = function(ptr)
+        for id = 0, #ops_types do
+            if ffi.istype(ops_types[id], ptr) then
+                return id
+            end
+        end
+        error("unsupported buffer type " .. tostring(ptr), 3)
+    end
+
+    local opsBinary = function(op)
+        return function(out, a, b, n)
+            local t = opsType(out)
+            if opsType(a) ~= t or opsType(b) ~= t then
+                error("buffers have different types", 2)
+            end
+            filterlib.udfOpsBinary(op, t, out, a, b, n)
+        end
+    end
+
+    local opsReduce = function(op)
+        return function(a, n)
+            return filterlib.udfOpsReduce(op, opsType(a), a, n)
+        end
+    end
+
+    lib.ops = {
+        -- out[i] = a[i] <op> b[i]. Integer division by zero yields zero.
+        add = opsBinary(0),
+        sub = opsBinary(1),
+        mul = opsBinary(2),
+        div = opsBinary(3),
+        minimum = opsBinary(4),
+        maximum = opsBinary(5),
+
+        -- out[i] = a[i] * scale + offset
+        scale = function(out, a, n, scale, offset)
+            local t = opsType(out)
+            if opsType(a) ~= t then
+                error("buffers have different types", 2)
+            end
+            filterlib.udfOpsScale(t, out, a, n, scale, offset or 0)
+        end,
+
+        -- out[i] = a[i], limited to the range [lo, hi]
+        clamp = function(out, a, n, lo, hi)
+            local t = opsType(out)
+            if opsType(a) ~= t then
+                error("buffers have different types", 2)
+            end
+            filterlib.udfOpsClamp(t, out, a, n, lo, hi)
+        end,
+
+        -- out[i] = a[i], converted to the type of 'out'
+        convert = function(out, a, n)
+            filterlib.udfOpsConvert(opsType(out), out, opsType(a), a, n)
+        end,
+
+        -- Reductions of a[0 .. n-1] to a single number
+        sum = opsReduce(0),
+        min = opsReduce(1),
+        max = opsReduce(2),
+    }
 end
 
 -- User-Defined Function
@@ -11,19 +11,101 @@ from cffi import FFI
 
 class PythonLib:
     def load(self, filterpath):
+        # Datasets looked up by a previous run refer to buffers of that run
+        self.datasets = {}
+        if getattr(self, "filterpath", None) == filterpath:
+            return
         self.ffi = FFI()
         self.ffi.cdef("""
             void       *pythonGetData(const char *);
+            void       *pythonGetDataSlice(const char *, const uint64_t *, const uint64_t *);
             const char *pythonGetType(const char *);
             const char *pythonGetCast(const char *);
             const char *pythonGetDims(const char *);
+            void        pythonGetParallelRange(uint64_t, uint64_t *, uint64_t *);
+            void        pythonGetBlockRange(uint64_t *, uint64_t *);
+            void        pythonSetBlock(uint64_t, uint64_t);
+            void       *pythonGetBlock(const char *);
+            const char *pythonGetChunkOffset();
+            const char *pythonGetChunkDims();
+            int         pythonIsOutput(const char *);
+            int         udfOpsBinary(int, int, void *, const void *, const void *, uint64_t);
+            int         udfOpsScale(int, void *, const void *, uint64_t, double, double);
+            int         udfOpsClamp(int, void *, const void *, uint64_t, double, double);
+            int         udfOpsConvert(int, void *, int, const void *, uint64_t);
+            double      udfOpsReduce(int, int, const void *, uint64_t);
             """)
         self.filterlib = self.ffi.dlopen(filterpath)
+        self.filterpath = filterpath
+        self.ops = PythonOps(self.ffi, self.filterlib)
+
+        # NumPy is optional, and cannot be imported once the sandbox is set up
+        try:
+            import numpy
+            self.numpy = numpy
+        except ImportError:
+            self.numpy = None
+
+    def lookup(self, name):
+        # Encoded name and cast type of a dataset, retrieved once per run
+        entry = self.datasets.get(name)
+        if entry is None:
+            c_name = self.ffi.new("char[]", name.encode("utf-8"))
+            cast = self.filterlib.pythonGetCast(c_name)
+            if cast == self.ffi.NULL:
+                raise KeyError(name)
+            entry = {
+                "name": c_name,
+                "ctype": self.ffi.string(cast).decode("utf-8"),
+                "data": None,
+                "array": None,
+            }
+            self.datasets[name] = entry
+        return entry
 
     def getData(self, name):
+        entry = self.lookup(name)
+        if entry["data"] is None:
+            data = self.filterlib.pythonGetData(entry["name"])
+            if data == self.ffi.NULL:
+                return self.ffi.cast(entry["ctype"], data)
+            entry["data"] = self.ffi.cast(entry["ctype"], data)
+        return entry["data"]
+
+    def getArray(self, name):
+        # NumPy array that views the dataset buffer, without copies. Arrays of
+        # output datasets have the shape of the chunk being computed and are
+        # writable; arrays of input datasets are read-only.
+        entry = self.lookup(name)
+        if entry["array"] is None:
+            numpy = self.numpy
+            if numpy is None:
+                raise ImportError("lib.getArray() requires NumPy")
+            data = self.getData(name)
+            if data == self.ffi.NULL:
+                raise KeyError(name)
+            is_output = self.filterlib.pythonIsOutput(entry["name"]) != 0
+            dims = self.getChunkDims() if is_output else self.getDims(name)
+            dtype = self.ffi.string(self.filterlib.pythonGetType(entry["name"])).decode("utf-8")
+            dtype = numpy.dtype({"float": "float32", "double": "float64"}.get(dtype, dtype))
+            count = 1
+            for dim in dims:
+                count *= dim
+            buf = self.ffi.buffer(data, count * dtype.itemsize)
+            array = numpy.frombuffer(buf, dtype=dtype).reshape(dims)
+            array.flags.writeable = is_output
+            entry["array"] = array
+        return entry["array"]
+
+    def getDataSlice(self, name, offset, count):
+        # Retrieve a region of an input dataset, given the offset of its first
+        # element and its dimensions. Only that region is read from the file if
+        # the UDF has not retrieved the whole dataset yet.
         name = self.ffi.new("char[]", name.encode("utf-8"))
         cast = self.filterlib.pythonGetCast(name)
-        data = self.filterlib.pythonGetData(name)
+        c_offset = self.ffi.new("uint64_t[]", list(offset))
+        c_count = self.ffi.new("uint64_t[]", list(count))
+        data = self.filterlib.pythonGetDataSlice(name, c_offset, c_count)
         ctype = self.ffi.string(cast).decode("utf-8")
         return self.ffi.cast(ctype, data)
 
@@ -34,9 +116,125 @@ class PythonLib:
     def getDims(self, name):
         name = self.ffi.new("char[]", name.encode("utf-8"))
         dims = self.filterlib.pythonGetDims(name)
+        return self.parseDims(dims)
+
+    def getChunkOffset(self):
+        # Offset of the output chunk being computed, relative to the start of
+        # the output dataset. The buffer returned by getData() for the output
+        # dataset holds that chunk only.
+        return self.parseDims(self.filterlib.pythonGetChunkOffset())
+
+    def getChunkDims(self):
+        # Dimensions of the output chunk being computed. Chunks at the edges of
+        # the dataset may extend past getDims(); elements out of bounds are discarded.
+        return self.parseDims(self.filterlib.pythonGetChunkDims())
+
+    def parallel_for(self, n, fn):
+        # Call fn(first, last) for the indices of the range [0, n) assigned to
+        # this process, where 'last' is one past the final index. The range is
+        # split among the processes that execute the UDF concurrently, so fn
+        # must not depend on the work done for other indices of the same range.
+        begin = self.ffi.new("uint64_t *")
+        end = self.ffi.new("uint64_t *")
+        self.filterlib.pythonGetParallelRange(n, begin, end)
+        if begin[0] < end[0]:
+            fn(begin[0], end[0])
+
+    def forEachBlock(self, fn):
+        # Produce the output chunk block by block: fn(first, last) is called for
+        # consecutive ranges of rows of the chunk, sized so that the rows of the
+        # output and of each input fit in $HDF5_UDF_BLOCK_SIZE bytes. Inside fn,
+        # getBlock() returns those rows; buffers obtained there are released
+        # once fn returns.
+        rows = self.ffi.new("uint64_t *")
+        step = self.ffi.new("uint64_t *")
+        self.filterlib.pythonGetBlockRange(rows, step)
+        try:
+            for first in range(0, rows[0], max(step[0], 1)):
+                last = min(first + step[0], rows[0])
+                self.filterlib.pythonSetBlock(first, last)
+                fn(first, last)
+        finally:
+            self.filterlib.pythonSetBlock(0, 0)
+
+    def getBlock(self, name):
+        # Rows of the current block of a dataset. Input datasets are expected
+        # to share the first dimension of the output dataset.
+        name = self.ffi.new("char[]", name.encode("utf-8"))
+        cast = self.filterlib.pythonGetCast(name)
+        data = self.filterlib.pythonGetBlock(name)
+        ctype = self.ffi.string(cast).decode("utf-8")
+        return self.ffi.cast(ctype, data)
+
+    def parseDims(self, dims):
         dims = self.ffi.string(dims).decode("utf-8")
         return tuple([int(dim) for dim in dims.split("x")])
 
+class PythonOps:
+    # Vectorized kernels that process 'n' elements of the buffers returned by
+    # getData(), getDataSlice(), and getBlock(). All buffers given to a kernel
+    # must have the same type, except for convert(). The output buffer may be
+    # one of the inputs.
+    def __init__(self, ffi, filterlib):
+        self.ffi = ffi
+        self.filterlib = filterlib
+        casts = ["int16_t*", "int32_t*", "int64_t*", "uint16_t*",
+                 "uint32_t*", "uint64_t*", "float*", "double*"]
+        self.types = dict((ffi.typeof(cast), i) for i, cast in enumerate(casts))
+
+    def type(self, ptr):
+        try:
+            return self.types[self.ffi.typeof(ptr)]
+        except (KeyError, TypeError):
+            raise TypeError("unsupported buffer type {}".format(ptr))
+
+    def sameType(self, *ptrs):
+        types = set(self.type(ptr) for ptr in ptrs)
+        if len(types) != 1:
+            raise TypeError("buffers have different types")
+        return types.pop()
+
+    # out[i] = a[i] <op> b[i]. Integer division by zero yields zero.
+    def add(self, out, a, b, n):
+        self.filterlib.udfOpsBinary(0, self.sameType(out, a, b), out, a, b, n)
+
+    def sub(self, out, a, b, n):
+        self.filterlib.udfOpsBinary(1, self.sameType(out, a, b), out, a, b, n)
+
+    def mul(self, out, a, b, n):
+        self.filterlib.udfOpsBinary(2, self.sameType(out, a, b), out, a, b, n)
+
+    def div(self, out, a, b, n):
+        self.filterlib.udfOpsBinary(3, self.sameType(out, a, b), out, a, b, n)
+
+    def minimum(self, out, a, b, n):
+        self.filterlib.udfOpsBinary(4, self.sameType(out, a, b), out, a, b, n)
+
+    def maximum(self, out, a, b, n):
+        self.filterlib.udfOpsBinary(5, self.sameType(out, a, b), out, a, b, n)
+
+    # out[i] = a[i] * scale + offset
+    def scale(self, out, a, n, scale, offset=0):
+        self.filterlib.udfOpsScale(self.sameType(out, a), out, a, n, scale, offset)
+
+    # out[i] = a[i], limited to the range [lo, hi]
+    def clamp(self, out, a, n, lo, hi):
+        self.filterlib.udfOpsClamp(self.sameType(out, a), out, a, n, lo, hi)
+
+    # out[i] = a[i], converted to the type of 'out'
+    def convert(self, out, a, n):
+        self.filterlib.udfOpsConvert(self.type(out), out, self.type(a), a, n)
+
+    # Reductions of a[0 .. n-1] to a single number
+    def sum(self, a, n):
+        return self.filterlib.udfOpsReduce(0, self.type(a), a, n)
+
+    def min(self, a, n):
+        return self.filterlib.udfOpsReduce(1, self.type(a), a, n)
+
+    def max(self, a, n):
+        return self.filterlib.udfOpsReduce(2, self.type(a), a, n)
+
 lib = PythonLib()
 
 # User-Defined Function
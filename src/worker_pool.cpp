@@ -0,0 +1,612 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: worker_pool.cpp
+ *
+ * Pool of pre-forked, sandboxed processes that execute UDFs on behalf
+ * of the filter.
+ *
+ * Forking a new process for every UDF call means copying the page tables
+ * of the application, which can be quite expensive when the application
+ * holds large amounts of memory. Workers are forked once, bring up the
+ * backends, and install the sandbox before serving any request. From then
+ * on each request only costs a round-trip through a UNIX socket. Datasets
+ * are not copied: the descriptors of the memfds or files that back the
+ * inputs and the output grid are passed along with the request, and the
+ * worker maps them. Each worker also shares a memfd with the filter, its
+ * channel, which holds the request metadata and copies of the datasets that
+ * have no descriptor, such as virtual datasets taken as input.
+ *
+ * Each worker is forked for a single UDF, whose blob it inherits, and only
+ * ever serves that UDF: interpreter and library state left behind by a UDF
+ * is never seen by another one. A request for a UDF no worker serves
+ * replaces the least recently used worker.
+ *
+ * A worker killed by seccomp (or that crashes for any other reason) only
+ * takes down the request it was serving, as does a worker that takes more
+ * than $HDF5_UDF_WORKER_TIMEOUT seconds to reply, which is killed; a new
+ * worker is forked to replace it on the next request.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "worker_pool.h"
+#include "json.hpp"
+#include "stats.h"
+#include "resource_limits.h"
+#ifdef ENABLE_SANDBOX
+#include "sandbox.h"
+#endif
+
+using json = nlohmann::json;
+
+/* Alignment of the datasets copied to the channel */
+#define REGION_ALIGNMENT 64
+
+/* Initial size of the channel of a worker, which grows on demand */
+#define CHANNEL_SIZE (64 * 1024)
+
+/* Descriptors passed along with a request; SCM_RIGHTS takes up to 253 of them */
+#define MAX_REQUEST_FDS 250
+
+/* Message sent to a worker along with the descriptors of the datasets */
+struct WorkerRequest {
+    uint64_t metadata_offset;        /* Request metadata, within the channel */
+    uint64_t metadata_size;
+    uint64_t channel_size;           /* Size of the channel, remapped by the worker when it grows */
+};
+
+/* Message sent back by a worker once the UDF returns */
+struct WorkerReply {
+    int32_t status;
+};
+
+static size_t align(size_t offset)
+{
+    return (offset + REGION_ALIGNMENT - 1) & ~((size_t) REGION_ALIGNMENT - 1);
+}
+
+/* Send a message and, optionally, file descriptors through a UNIX socket */
+static bool sendMessage(int sock, const void *msg, size_t size, const std::vector<int> &fds)
+{
+    struct iovec iov = { (void *) msg, size };
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_REQUEST_FDS)];
+    if (fds.size())
+    {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+    return sendmsg(sock, &hdr, MSG_NOSIGNAL) == (ssize_t) size;
+}
+
+/* Receive a message and, optionally, file descriptors from a UNIX socket */
+static bool recvMessage(int sock, void *msg, size_t size, std::vector<int> *fds)
+{
+    struct iovec iov = { msg, size };
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_REQUEST_FDS)];
+    if (fds)
+    {
+        fds->clear();
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+    }
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &hdr, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 || ! fds)
+        return n == (ssize_t) size;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            fds->resize(fds->size() + count);
+            memcpy(&(*fds)[fds->size() - count], CMSG_DATA(cmsg), sizeof(int) * count);
+        }
+    if (n != (ssize_t) size || (hdr.msg_flags & MSG_CTRUNC))
+    {
+        for (auto fd: *fds)
+            close(fd);
+        fds->clear();
+        return false;
+    }
+    return true;
+}
+
+/* Wait up to 'seconds' (forever if zero) for a message to arrive on a socket */
+static bool waitMessage(int sock, int seconds)
+{
+    if (seconds <= 0)
+        return true;
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += seconds;
+    while (true)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long timeout_ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        int n = poll(&pfd, 1, std::max(timeout_ms, 0L));
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n > 0;
+    }
+}
+
+/* Mappings made by a worker to serve a request */
+typedef std::vector<std::pair<void *, size_t>> Mappings;
+
+/*
+ * Rebuild a DatasetInfo object from its description in the request metadata.
+ * Datasets handed over by descriptor are mapped at their offset in the memfd
+ * or file: outputs are shared with the filter, while inputs are mapped
+ * privately so that changes made by the UDF never reach the filter. Other
+ * datasets have been copied to the channel.
+ */
+static bool datasetFromJson(const json &entry, char *channel, size_t channel_size,
+    const std::vector<int> &fds, Mappings &mappings, DatasetInfo &info)
+{
+    info = DatasetInfo(
+        entry["name"].get<std::string>(),
+        entry["dims"].get<std::vector<hsize_t>>(),
+        entry["datatype"].get<std::string>());
+    info.hdf5_datatype = info.getHdf5Datatype();
+    info.chunk_offset = entry["chunk_offset"].get<std::vector<hsize_t>>();
+    info.chunk_dimensions = entry["chunk_dims"].get<std::vector<hsize_t>>();
+
+    auto index = entry["fd"].get<int>();
+    auto offset = entry["offset"].get<size_t>();
+    auto size = entry["size"].get<size_t>();
+    if (index < 0)
+    {
+        if (offset > channel_size || size > channel_size - offset)
+            return false;
+        info.data = channel + offset;
+        return true;
+    }
+    if ((size_t) index >= fds.size())
+        return false;
+
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t map_offset = offset & ~(pagesize - 1);
+    size_t map_size = offset - map_offset + size;
+    void *base = mmap(NULL, map_size, PROT_READ|PROT_WRITE,
+        info.isOutput() ? MAP_SHARED : MAP_PRIVATE, fds[index], map_offset);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "Worker failed to map dataset %s: %s\n", info.name.c_str(), strerror(errno));
+        return false;
+    }
+    mappings.push_back(std::make_pair(base, map_size));
+    info.data = (char *) base + (offset - map_offset);
+    info.shared_data = info.isOutput();
+    return true;
+}
+
+static json datasetToJson(const DatasetInfo &info, int fd_index, size_t offset, size_t size)
+{
+    json entry;
+    entry["name"] = info.name;
+    entry["dims"] = info.dimensions;
+    entry["datatype"] = info.datatype;
+    entry["chunk_offset"] = info.chunk_offset;
+    entry["chunk_dims"] = info.chunk_dimensions;
+    entry["fd"] = fd_index;
+    entry["offset"] = offset;
+    entry["size"] = size;
+    return entry;
+}
+
+/* Serve a single request on behalf of the filter */
+static bool serveRequest(const WorkerRequest &req, char *channel, const std::vector<int> &fds,
+    const std::string &blob, uint64_t blob_hash)
+{
+    if (req.metadata_offset > req.channel_size || req.metadata_size > req.channel_size - req.metadata_offset)
+    {
+        fprintf(stderr, "Worker received a malformed request\n");
+        return false;
+    }
+
+    bool ret = false;
+    Mappings mappings;
+    try {
+        std::string metadata(&channel[req.metadata_offset], req.metadata_size);
+        json jas = json::parse(metadata);
+
+        auto backend_name = jas["backend"].get<std::string>();
+        auto backend = getBackendByName(backend_name);
+        bool ready = true;
+        std::vector<DatasetInfo> input_datasets;
+        DatasetInfo output_dataset;
+        for (auto &entry: jas["inputs"])
+        {
+            input_datasets.emplace_back();
+            ready = ready && datasetFromJson(entry, channel, req.channel_size, fds, mappings, input_datasets.back());
+        }
+        ready = ready && datasetFromJson(jas["output"], channel, req.channel_size, fds, mappings, output_dataset);
+
+        if (! backend)
+            fprintf(stderr, "No backend has been found to execute %s code\n", backend_name.c_str());
+        else if (! ready)
+            fprintf(stderr, "Worker received a malformed request\n");
+        else
+        {
+            auto cast = jas["output_cast_datatype"].get<std::string>();
+            Backend::setBlobHash(blob.data(), blob.size(), blob_hash);
+            ret = backend->execute(
+                jas["filterpath"].get<std::string>(),
+                input_datasets,
+                output_dataset,
+                cast.c_str(),
+                blob.data(),
+                blob.size());
+        }
+    } catch (json::exception &e) {
+        fprintf(stderr, "Worker received a malformed request: %s\n", e.what());
+    }
+
+    for (auto &mapping: mappings)
+        munmap(mapping.first, mapping.second);
+    return ret;
+}
+
+/*
+ * Main loop of a worker process, which serves the UDF given by 'blob'. The
+ * channel is inherited from the filter, already mapped.
+ */
+static void serve(int sock, Backend *backend, const std::string filterpath, const std::string &blob,
+    uint64_t blob_hash, int channel_fd, char *channel, size_t channel_size)
+{
+    /* Workers execute the whole range given to lib.parallel_for() themselves */
+    Backend::setParallelWorkers(1);
+
+    /* Other backends are never brought up, as the worker only serves this UDF */
+    backend->warmup(filterpath);
+
+#ifdef ENABLE_SANDBOX
+    Sandbox sandbox;
+    if (sandbox.init(filterpath) == false)
+        _exit(1);
+#endif
+
+    while (true)
+    {
+        WorkerRequest req;
+        std::vector<int> fds;
+        if (! recvMessage(sock, &req, sizeof(req), &fds))
+        {
+            // The filter has gone away
+            _exit(0);
+        }
+
+        /* The filter grows the channel to fit larger requests */
+        if (req.channel_size != channel_size)
+        {
+            munmap(channel, channel_size);
+            channel = (char *) mmap(NULL, req.channel_size, PROT_READ|PROT_WRITE, MAP_SHARED, channel_fd, 0);
+            if (channel == MAP_FAILED)
+                _exit(1);
+            channel_size = req.channel_size;
+        }
+
+        WorkerReply reply;
+        reply.status = serveRequest(req, channel, fds, blob, blob_hash) ? 0 : 1;
+        for (auto fd: fds)
+            close(fd);
+        if (! sendMessage(sock, &reply, sizeof(reply), {}))
+            _exit(1);
+    }
+}
+
+WorkerPool *WorkerPool::instance()
+{
+    static WorkerPool pool;
+    return &pool;
+}
+
+WorkerPool::WorkerPool() :
+    counter(0),
+    num_workers(0)
+{
+    const char *env = getenv("HDF5_UDF_WORKERS");
+    if (env)
+        num_workers = std::max(atoi(env), 0);
+    workers.resize(num_workers, Worker{-1, -1, "", 0, -1, NULL, 0});
+}
+
+WorkerPool::~WorkerPool()
+{
+    for (auto &worker: workers)
+        reap(worker);
+}
+
+bool WorkerPool::spawn(Worker &worker, Backend *backend, const std::string filterpath, const std::string &udf_key,
+    const char *udf_blob, size_t udf_blob_size)
+{
+    uint64_t blob_hash = Backend::blobHash(udf_blob, udf_blob_size);
+    worker.channel_fd = memfd_create("hdf5-udf-channel", MFD_CLOEXEC);
+    if (worker.channel_fd < 0 || ftruncate(worker.channel_fd, CHANNEL_SIZE) < 0)
+    {
+        fprintf(stderr, "Failed to create the channel of a UDF worker: %s\n", strerror(errno));
+        reap(worker);
+        return false;
+    }
+    void *channel = mmap(NULL, CHANNEL_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, worker.channel_fd, 0);
+    if (channel == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map the channel of a UDF worker: %s\n", strerror(errno));
+        reap(worker);
+        return false;
+    }
+    worker.channel = (char *) channel;
+    worker.channel_size = CHANNEL_SIZE;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        reap(worker);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(sv[0]);
+        for (auto &other: workers)
+            if (&other != &worker)
+            {
+                if (other.sock >= 0)
+                    close(other.sock);
+                if (other.channel)
+                    munmap(other.channel, other.channel_size);
+                if (other.channel_fd >= 0)
+                    close(other.channel_fd);
+            }
+        serve(sv[1], backend, filterpath, std::string(udf_blob, udf_blob_size), blob_hash,
+            worker.channel_fd, worker.channel, worker.channel_size);
+        _exit(0);
+    }
+    else if (pid < 0)
+    {
+        fprintf(stderr, "Failed to fork worker: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        reap(worker);
+        return false;
+    }
+
+    close(sv[1]);
+    worker.pid = pid;
+    worker.sock = sv[0];
+    worker.udf_key = udf_key;
+    return true;
+}
+
+WorkerPool::Worker &WorkerPool::pick(const std::string &udf_key)
+{
+    Worker *victim = &workers[0];
+    for (auto &worker: workers)
+    {
+        if (worker.pid > 0 && worker.udf_key == udf_key)
+            return worker;
+        if (worker.last_used < victim->last_used)
+            victim = &worker;
+    }
+    reap(*victim);
+    return *victim;
+}
+
+void WorkerPool::reap(Worker &worker)
+{
+    if (worker.sock >= 0)
+        close(worker.sock);
+    if (worker.pid > 0)
+    {
+        kill(worker.pid, SIGKILL);
+        waitpid(worker.pid, NULL, 0);
+    }
+    if (worker.channel)
+        munmap(worker.channel, worker.channel_size);
+    if (worker.channel_fd >= 0)
+        close(worker.channel_fd);
+    worker.sock = -1;
+    worker.pid = -1;
+    worker.channel_fd = -1;
+    worker.channel = NULL;
+    worker.channel_size = 0;
+}
+
+bool WorkerPool::reserveChannel(Worker &worker, size_t size)
+{
+    if (size <= worker.channel_size)
+        return true;
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t channel_size = (std::max(size, 2 * worker.channel_size) + pagesize - 1) & ~(pagesize - 1);
+    if (ftruncate(worker.channel_fd, channel_size) < 0)
+    {
+        fprintf(stderr, "Failed to allocate %zu bytes for the UDF worker: %s\n",
+            channel_size, strerror(errno));
+        return false;
+    }
+    void *channel = mmap(NULL, channel_size, PROT_READ|PROT_WRITE, MAP_SHARED, worker.channel_fd, 0);
+    if (channel == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map the channel of a UDF worker: %s\n", strerror(errno));
+        return false;
+    }
+    munmap(worker.channel, worker.channel_size);
+    worker.channel = (char *) channel;
+    worker.channel_size = channel_size;
+    return true;
+}
+
+bool WorkerPool::submit(Worker &worker, const std::vector<int> &fds, size_t metadata_offset,
+    size_t metadata_size, size_t mapped_size, bool *sent)
+{
+    WorkerRequest req;
+    req.metadata_offset = metadata_offset;
+    req.metadata_size = metadata_size;
+    req.channel_size = worker.channel_size;
+
+    /* The channel and datasets are mapped by the worker on top of what the UDF may allocate */
+    *sent = limitResources(worker.pid, false, mapped_size) &&
+        sendMessage(worker.sock, &req, sizeof(req), fds);
+    if (! *sent)
+        return false;
+
+    WorkerReply reply;
+    int timeout = workerTimeout();
+    if (! waitMessage(worker.sock, timeout))
+    {
+        fprintf(stderr, "UDF worker did not reply within %d seconds\n", timeout);
+        reap(worker);
+        return false;
+    }
+    if (! recvMessage(worker.sock, &reply, sizeof(reply), NULL))
+    {
+        int status = 0;
+        if (waitpid(worker.pid, &status, 0) == worker.pid)
+        {
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "UDF worker killed by signal %d (%s)\n", WTERMSIG(status), strsignal(WTERMSIG(status)));
+            worker.pid = -1;
+        }
+        reap(worker);
+        return false;
+    }
+    return reply.status == 0;
+}
+
+bool WorkerPool::run(
+    Backend *backend,
+    const std::string filterpath,
+    const std::string &udf_key,
+    const std::vector<DatasetInfo> &input_datasets,
+    const DatasetInfo &output_dataset,
+    const char *output_cast_datatype,
+    const char *udf_blob,
+    size_t udf_blob_size)
+{
+    // Datasets backed by a memfd or by the file are handed over by descriptor.
+    // The others are copied to the channel, followed by the request metadata.
+    std::vector<const DatasetInfo *> datasets;
+    for (auto &input: input_datasets)
+        datasets.push_back(&input);
+    datasets.push_back(&output_dataset);
+
+    json jas;
+    jas["backend"] = backend->name();
+    jas["filterpath"] = filterpath;
+    jas["output_cast_datatype"] = output_cast_datatype ? output_cast_datatype : "";
+    jas["inputs"] = json::array();
+
+    std::vector<int> fds;
+    std::vector<size_t> copy_offsets(datasets.size(), SIZE_MAX);
+    size_t offset = 0, mapped_size = 0;
+    for (size_t i=0; i<datasets.size(); ++i)
+    {
+        auto &info = *datasets[i];
+        size_t size = info.getChunkGridSize() * info.getStorageSize();
+        json entry;
+        if (info.shared_fd >= 0 && size > 0 && fds.size() < MAX_REQUEST_FDS)
+        {
+            entry = datasetToJson(info, fds.size(), info.shared_offset, size);
+            fds.push_back(info.shared_fd);
+            mapped_size += size;
+        }
+        else
+        {
+            entry = datasetToJson(info, -1, offset, size);
+            copy_offsets[i] = offset;
+            offset = align(offset + size);
+        }
+        if (i < input_datasets.size())
+            jas["inputs"].push_back(entry);
+        else
+            jas["output"] = entry;
+    }
+
+    std::string metadata = jas.dump();
+    size_t metadata_offset = offset;
+    size_t copy_size = metadata_offset + metadata.size();
+
+    // Pick the worker of this UDF, forking it if it's not alive. If the worker died
+    // since its last request was served, we fork a replacement and try again once.
+    bool ret = false;
+    for (int attempt=0; attempt<2; ++attempt)
+    {
+        Worker &worker = pick(udf_key);
+        if (worker.pid > 0 && waitpid(worker.pid, NULL, WNOHANG) == worker.pid)
+        {
+            worker.pid = -1;
+            reap(worker);
+        }
+        if (worker.pid < 0 && ! spawn(worker, backend, filterpath, udf_key, udf_blob, udf_blob_size))
+            break;
+        worker.last_used = ++counter;
+        if (! reserveChannel(worker, copy_size))
+            break;
+
+        for (size_t i=0; i<datasets.size(); ++i)
+            if (copy_offsets[i] != SIZE_MAX)
+                memcpy(&worker.channel[copy_offsets[i]], datasets[i]->data,
+                    datasets[i]->getChunkGridSize() * datasets[i]->getStorageSize());
+        memcpy(&worker.channel[metadata_offset], metadata.data(), metadata.size());
+
+        /* Waiting for the worker is the counterpart of waiting for a forked process */
+        bool sent = false;
+        uint64_t submit_start = Stats::now();
+        ret = submit(worker, fds, metadata_offset, metadata.size(), worker.channel_size + mapped_size, &sent);
+        Stats::instance()->addTime(STATS_FORK_WAIT, Stats::now() - submit_start);
+        if (! sent)
+        {
+            reap(worker);
+            continue;
+        }
+
+        /* Outputs handed over by descriptor have been written in place */
+        if (ret)
+        {
+            StatsTimer timer(STATS_OUTPUT_COPY);
+            for (size_t i=0; i<datasets.size(); ++i)
+                if (copy_offsets[i] != SIZE_MAX && (i == input_datasets.size() || datasets[i]->isOutput()))
+                    memcpy(datasets[i]->data, &worker.channel[copy_offsets[i]],
+                        datasets[i]->getChunkGridSize() * datasets[i]->getStorageSize());
+        }
+
+        /* Pages of large copies are not held on to between requests */
+        if (worker.channel && copy_size > CHANNEL_SIZE)
+            madvise(worker.channel, worker.channel_size, MADV_REMOVE);
+        break;
+    }
+    return ret;
+}
@@ -0,0 +1,82 @@
+/*
+ * HDF5-UDF: User-Defined Functions for HDF5
+ *
+ * File: worker_pool.h
+ *
+ * Pool of pre-forked, sandboxed processes that execute UDFs on behalf
+ * of the filter.
+ */
+#ifndef __worker_pool_h
+#define __worker_pool_h
+
+#include <sys/types.h>
+#include <vector>
+#include <string>
+#include "backend.h"
+#include "dataset.h"
+
+class WorkerPool {
+public:
+    // Get the process-wide pool. The pool is enabled by setting
+    // $HDF5_UDF_WORKERS to the number of workers to keep around.
+    static WorkerPool *instance();
+
+    // Is the pool enabled?
+    bool enabled() const { return num_workers > 0; }
+
+    // Execute a user-defined-function on one of the workers. 'udf_key'
+    // identifies the UDF (its bytecode and the dataset it computes): workers
+    // only serve the UDF they were forked for, so that no state is carried
+    // over from one UDF to another.
+    bool run(
+        Backend *backend,
+        const std::string filterpath,
+        const std::string &udf_key,
+        const std::vector<DatasetInfo> &input_datasets,
+        const DatasetInfo &output_dataset,
+        const char *output_cast_datatype,
+        const char *udf_blob,
+        size_t udf_blob_size);
+
+private:
+    WorkerPool();
+    ~WorkerPool();
+
+    struct Worker {
+        pid_t pid;
+        int sock;
+        std::string udf_key;          /* UDF served by the worker */
+        uint64_t last_used;
+        int channel_fd;               /* memfd shared with the worker for the lifetime of both */
+        char *channel;                /* Mapping of 'channel_fd' */
+        size_t channel_size;
+    };
+
+    // Fork a new worker for the given UDF, which warms up its backend and
+    // sets up the sandbox. The worker keeps its own copy of the UDF blob and
+    // inherits the channel through which requests are described.
+    bool spawn(Worker &worker, Backend *backend, const std::string filterpath, const std::string &udf_key,
+        const char *udf_blob, size_t udf_blob_size);
+
+    // Get the worker that serves a UDF. Other UDFs get the least recently
+    // used worker, which is replaced by a fresh one.
+    Worker &pick(const std::string &udf_key);
+
+    // Terminate a worker and release its resources
+    void reap(Worker &worker);
+
+    // Grow the channel of a worker to hold at least 'size' bytes
+    bool reserveChannel(Worker &worker, size_t size);
+
+    // Send a request to a worker along with the descriptors of the datasets it
+    // maps, and wait for its reply. 'sent' tells whether the request made it to
+    // the worker (if not, the worker died before the call).
+    bool submit(Worker &worker, const std::vector<int> &fds, size_t metadata_offset,
+        size_t metadata_size, size_t mapped_size, bool *sent);
+
+    std::vector<Worker> workers;
+    uint64_t counter;
+    int num_workers;
+};
+
+#endif /* __worker_pool_h */